@@ -164,20 +164,25 @@ LOCAL_SRC_FILES := \
   ../source/types.cpp                                                  \
   ../source/bitboard.cpp                                               \
   ../source/misc.cpp                                                   \
+  ../source/cpu_features.cpp                                           \
   ../source/movegen.cpp                                                \
   ../source/position.cpp                                               \
   ../source/usi.cpp                                                    \
   ../source/usi_option.cpp                                             \
   ../source/thread.cpp                                                 \
   ../source/tt.cpp                                                     \
+  ../source/perf_counter.cpp                                           \
   ../source/movepick.cpp                                               \
   ../source/timeman.cpp                                                \
   ../source/book/apery_book.cpp                                        \
+  ../source/book/binary_book.cpp                                       \
   ../source/book/book.cpp                                              \
   ../source/extra/bitop.cpp                                            \
   ../source/extra/long_effect.cpp                                      \
   ../source/extra/sfen_packer.cpp                                      \
   ../source/extra/super_sort.cpp                                       \
+  ../source/extra/move_sort.cpp                                        \
+  ../source/extra/move_sort_simd.cpp                                   \
   ../source/mate/mate.cpp                                              \
   ../source/mate/mate1ply_without_effect.cpp                           \
   ../source/mate/mate1ply_with_effect.cpp                              \
@@ -190,6 +195,7 @@ LOCAL_SRC_FILES := \
   ../source/testcmd/benchmark.cpp                                      \
   ../source/testcmd/mate_test_cmd.cpp                                  \
   ../source/testcmd/normal_test_cmd.cpp                                \
+  ../source/testcmd/perft.cpp                                          \
   ../source/testcmd/unit_test.cpp
 
 ifeq ($(YANEURAOU_EDITION),YANEURAOU_ENGINE_KPPT)
@@ -217,6 +223,7 @@ endif
 ifeq ($(findstring YANEURAOU_ENGINE_NNUE,$(YANEURAOU_EDITION)),YANEURAOU_ENGINE_NNUE)
 LOCAL_SRC_FILES += \
   ../source/eval/nnue/evaluate_nnue.cpp                                \
+  ../source/eval/nnue/evaluate_nnue_kernel.cpp                         \
   ../source/eval/nnue/evaluate_nnue_learner.cpp                        \
   ../source/eval/nnue/nnue_test_command.cpp                            \
   ../source/eval/nnue/features/k.cpp                                   \
@@ -0,0 +1,439 @@
+﻿#include "../config.h"
+
+#include "binary_book.h"
+#include "../thread.h"
+
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+using namespace std;
+
+namespace Book
+{
+	namespace {
+
+		// ファイル先頭のmagic
+		constexpr char kBinaryBookMagic[8] = { 'Y','A','N','E','B','O','O','K' };
+
+		// フォーマットのversion
+		constexpr u32 kBinaryBookVersion = 1;
+
+		// HASH_KEYをu64の配列に変換する。
+		void key_to_words(const HASH_KEY& key, u64* words)
+		{
+#if HASH_KEY_BITS <= 64
+			words[0] = key;
+#else
+			for (int i = 0; i < BinaryBookIndex::kKeyWords; ++i)
+				words[i] = key.p(i);
+#endif
+		}
+
+		// hash keyの比較。BinaryBookIndexはこの順に並んでいる。
+		bool key_less(const u64* lhs, const u64* rhs)
+		{
+			return std::lexicographical_compare(lhs, lhs + BinaryBookIndex::kKeyWords, rhs, rhs + BinaryBookIndex::kKeyWords);
+		}
+
+		bool key_equal(const u64* lhs, const u64* rhs)
+		{
+			return std::equal(lhs, lhs + BinaryBookIndex::kKeyWords, rhs);
+		}
+
+		// 平手の開始局面のhash key。Zobristの乱数が書き出したときと一致するかの確認に用いる。
+		u64 zobrist_check()
+		{
+			Position pos;
+			StateInfo si;
+			pos.set_hirate(&si, Threads.main());
+			u64 words[BinaryBookIndex::kKeyWords];
+			key_to_words(pos.long_key(), words);
+			return words[0];
+		}
+	}
+
+	// ファイルの先頭にバイナリ定跡のmagicがあるか。
+	bool BinaryBook::is_binary_book(const std::string& filename)
+	{
+		std::ifstream fs(filename, std::ios::binary);
+		char magic[sizeof(kBinaryBookMagic)];
+		if (!fs.read(magic, sizeof(magic)))
+			return false;
+		return std::memcmp(magic, kBinaryBookMagic, sizeof(magic)) == 0;
+	}
+
+	// arenaに展開する前の局面
+	struct BinaryBook::RawEntry
+	{
+		BinaryBookIndex index; // first_move,move_numはraw_movesに対するもの。
+		u64 sfen_offset;       // raw_sfensに対するoffset
+	};
+
+	// バイナリ定跡ファイルをmapする。
+	Tools::Result BinaryBook::open(const std::string& filename)
+	{
+		position_count = 0;
+
+		auto result = file.Open(filename);
+		if (result.is_not_ok())
+			return result;
+
+		auto error = [&](const std::string& message) {
+			sync_cout << "info string Error! : " << message << " : " << filename << sync_endl;
+			file.Close();
+			return Tools::Result(Tools::ResultCode::FileReadError);
+		};
+
+		const char* base = (const char*)file.data();
+		const size_t size = file.size();
+		if (size < sizeof(BinaryBookHeader))
+			return error("binary book is too small");
+
+		auto h = (const BinaryBookHeader*)base;
+		if (std::memcmp(h->magic, kBinaryBookMagic, sizeof(kBinaryBookMagic)) != 0 || h->version != kBinaryBookVersion)
+			return error("unknown binary book format");
+
+		if (h->hash_key_bits != HASH_KEY_BITS)
+			return error("binary book was made with HASH_KEY_BITS = " + std::to_string(h->hash_key_bits));
+
+		if (h->zobrist_check != zobrist_check())
+			return error("binary book was made with different Zobrist keys");
+
+		// 各sectionがファイルに収まっているか。
+		if (   h->index_offset + h->position_count * sizeof(BinaryBookIndex) > size
+			|| h->moves_offset + h->move_count     * sizeof(PackedBookMove ) > size
+			|| h->sfens_offset + h->position_count * sizeof(u64            ) > size)
+			return error("binary book is truncated");
+
+		position_count = size_t(h->position_count);
+		index          = (const BinaryBookIndex*)(base + h->index_offset);
+		moves          = (const PackedBookMove* )(base + h->moves_offset);
+		sfen_offsets   = (const u64*            )(base + h->sfens_offset);
+		sfen_blob      = (const char*)(sfen_offsets + position_count);
+		sfen_blob_size = size_t(base + size - sfen_blob);
+
+		return Tools::Result::Ok();
+	}
+
+	// テキスト形式の定跡ファイルを読み込んでarenaに展開する。
+	Tools::Result BinaryBook::read_text_book(const std::string& filename, bool keep_sfen, bool ignore_ply)
+	{
+		SystemIO::TextReader reader;
+		// ReadLine()の時に行の末尾のスペース、タブを自動トリム。空行は自動スキップ。
+		reader.SetTrim(true);
+		reader.SkipEmptyLine(true);
+
+		auto result = reader.Open(filename);
+		if (result.is_not_ok())
+			return result;
+
+		std::vector<RawEntry> raws;
+		std::vector<PackedBookMove> raw_moves;
+		std::string raw_sfens;
+
+		Tools::ProgressBar progress(reader.GetSize());
+
+		Position pos;
+		StateInfo si;
+		RawEntry* entry = nullptr;
+
+		std::string line;
+		while (reader.ReadLine(line).is_ok())
+		{
+			progress.check(reader.GetFilePos());
+
+			// バージョン識別文字列、コメント行は読み飛ばす。
+			if ((line.length() >= 1 && line[0] == '#') || (line.length() >= 2 && line.substr(0, 2) == "//"))
+				continue;
+
+			// "sfen "で始まる行は局面のデータ。hash keyを得るために局面をsetする。
+			if (line.length() >= 5 && line.substr(0, 5) == "sfen ")
+			{
+				pos.set(line.substr(5), &si, Threads.main());
+
+				raws.emplace_back();
+				entry = &raws.back();
+				key_to_words(pos.long_key(), entry->index.key);
+				entry->index.ply        = u16(std::min(pos.game_ply(), int(UINT16_MAX)));
+				entry->index.first_move = u32(raw_moves.size());
+				entry->index.move_num   = 0;
+				entry->sfen_offset      = raw_sfens.size();
+				if (keep_sfen)
+				{
+					raw_sfens += line.substr(5);
+					raw_sfens += '\0';
+				}
+				continue;
+			}
+
+			// 局面より先に指し手が書かれている。
+			if (entry == nullptr)
+				continue;
+
+			auto bp = BookMove::from_string(line);
+			PackedBookMove m;
+			m.move       = bp.move.to_u16();
+			m.ponder     = bp.ponder.to_u16();
+			m.value      = s32(bp.value);
+			m.depth      = s32(bp.depth);
+			m.move_count = u32(std::min(bp.move_count, u64(UINT32_MAX)));
+			raw_moves.push_back(m);
+			if (entry->index.move_num < UINT16_MAX)
+				entry->index.move_num++;
+		}
+
+		compact(raws, raw_moves, raw_sfens, keep_sfen, !ignore_ply);
+
+		return Tools::Result::Ok();
+	}
+
+	// MemoryBookの内容をarenaに展開する。
+	void BinaryBook::build(MemoryBook& book)
+	{
+		std::vector<RawEntry> raws;
+		std::vector<PackedBookMove> raw_moves;
+		std::string raw_sfens;
+		raws.reserve(book.size());
+
+		// 局面をsetしなおしてhash keyと正規化されたsfen文字列を得る。
+		Position pos;
+		book.foreach([&](std::string sfen, BookMovesPtr ptr) {
+			if (!ptr || ptr->size() == 0)
+				return;
+
+			StateInfo si;
+			pos.set(sfen, &si, Threads.main());
+
+			RawEntry entry;
+			key_to_words(pos.long_key(), entry.index.key);
+			entry.index.ply        = u16(std::min(pos.game_ply(), int(UINT16_MAX)));
+			entry.index.first_move = u32(raw_moves.size());
+			entry.index.move_num   = u16(std::min(ptr->size(), size_t(UINT16_MAX)));
+			entry.sfen_offset      = raw_sfens.size();
+			raw_sfens += pos.sfen();
+			raw_sfens += '\0';
+
+			for (size_t i = 0; i < entry.index.move_num; ++i)
+			{
+				const auto& bp = (*ptr)[i];
+				PackedBookMove m;
+				m.move       = bp.move.to_u16();
+				m.ponder     = bp.ponder.to_u16();
+				m.value      = s32(bp.value);
+				m.depth      = s32(bp.depth);
+				m.move_count = u32(std::min(bp.move_count, u64(UINT32_MAX)));
+				raw_moves.push_back(m);
+			}
+			raws.push_back(entry);
+		});
+
+		compact(raws, raw_moves, raw_sfens, true, false);
+	}
+
+	// RawEntryをhash key順に並べ替えて、重複局面をまとめてarenaに格納する。
+	void BinaryBook::compact(std::vector<RawEntry>& raws, std::vector<PackedBookMove>& raw_moves, std::string& raw_sfens, bool keep_sfen, bool per_ply)
+	{
+		// hash key順、同じ局面なら手数の若い順に並べる。(同じ手数なら出現順)
+		std::stable_sort(raws.begin(), raws.end(), [](const RawEntry& lhs, const RawEntry& rhs) {
+			return key_less(lhs.index.key, rhs.index.key)
+				|| (key_equal(lhs.index.key, rhs.index.key) && lhs.index.ply < rhs.index.ply);
+		});
+
+		index_arena.clear();
+		move_arena.clear();
+		sfen_offset_arena.clear();
+		sfen_arena.clear();
+		index_arena.reserve(raws.size());
+		move_arena.reserve(raw_moves.size());
+
+		std::vector<PackedBookMove> merged;
+		for (size_t i = 0; i < raws.size(); )
+		{
+			// 同じhash keyの局面は、per_plyでなければ手数が最小のものだけを残す。(MemoryBook::write_book()と同じ)
+			// per_plyなら手数ごとに残す。(IgnoreBookPlyがfalseのときにbook_bodyに読み込んだのと同じ)
+			// 手数まで同じものは同一局面の重複登録なので、MemoryBook::insert()と同じく指し手をマージする。
+			// (同じ指し手は後から出てきたもので置き換え、採択回数は合算する)
+			// 指し手のない局面は手数の比較の対象外。(MemoryBook::read_book()では登録されないので)
+			size_t j = i + 1;
+			while (j < raws.size() && key_equal(raws[j].index.key, raws[i].index.key))
+				++j;
+			size_t first = i;
+			while (first + 1 < j && raws[first].index.move_num == 0)
+				++first;
+
+			for (size_t g = first; g < j; )
+			{
+				merged.clear();
+				size_t k = g;
+				for (; k < j && raws[k].index.ply == raws[g].index.ply; ++k)
+					for (size_t n = 0; n < raws[k].index.move_num; ++n)
+					{
+						const auto& m = raw_moves[raws[k].index.first_move + n];
+						auto it = std::find_if(merged.begin(), merged.end(), [&](const PackedBookMove& x) { return x.move == m.move; });
+						if (it == merged.end())
+							merged.push_back(m);
+						else {
+							auto move_count = it->move_count;
+							*it = m;
+							it->move_count = u32(std::min(u64(move_count) + m.move_count, u64(UINT32_MAX)));
+						}
+					}
+
+				// 手数ごとに残すときは、指し手のない手数のものは登録しない。(先頭のものだけは、上で空でないものを選んである)
+				if (g == first || !merged.empty())
+				{
+					// BookMoveのoperator <()と同じ順(採択回数、評価値の降順)に並べておく。
+					std::stable_sort(merged.begin(), merged.end(), [](const PackedBookMove& lhs, const PackedBookMove& rhs) {
+						return (lhs.move_count != rhs.move_count) ? (lhs.move_count > rhs.move_count) : (lhs.value > rhs.value);
+					});
+
+					BinaryBookIndex e = raws[g].index;
+					e.first_move = u32(move_arena.size());
+					e.move_num   = u16(merged.size());
+					move_arena.insert(move_arena.end(), merged.begin(), merged.end());
+					index_arena.push_back(e);
+
+					if (keep_sfen)
+					{
+						sfen_offset_arena.push_back(sfen_arena.size());
+						sfen_arena += raw_sfens.c_str() + raws[g].sfen_offset;
+						sfen_arena += '\0';
+					}
+				}
+
+				if (!per_ply)
+					break;
+				g = k;
+			}
+
+			i = j;
+		}
+
+		// 展開前のものはもう要らない。
+		std::vector<RawEntry>().swap(raws);
+		std::vector<PackedBookMove>().swap(raw_moves);
+		std::string().swap(raw_sfens);
+		index_arena.shrink_to_fit();
+		move_arena.shrink_to_fit();
+
+		file.Close();
+		position_count = index_arena.size();
+		index          = index_arena.data();
+		moves          = move_arena.data();
+		sfen_offsets   = keep_sfen ? sfen_offset_arena.data() : nullptr;
+		sfen_blob      = sfen_arena.data();
+		sfen_blob_size = sfen_arena.size();
+	}
+
+	// find()の結果からBookMovesPtrを構築して返す。
+	BookMovesPtr BinaryBook::to_book_moves(const BinaryBookMoves& moves)
+	{
+		if (!moves)
+			return BookMovesPtr();
+
+		BookMovesPtr ptr(new BookMoves());
+		for (const auto& m : moves)
+			ptr->push_back(BinaryBookMoves::to_book_move(m));
+		ptr->sort_moves();
+		return ptr;
+	}
+
+	// 索引i番目の指し手集合を構築して返す。
+	BookMovesPtr BinaryBook::moves_at(size_t i) const
+	{
+		const auto& e = index[i];
+		return to_book_moves(BinaryBookMoves{ moves + e.first_move, e.move_num, true });
+	}
+
+	// 局面posに対応する指し手集合を返す。
+	BinaryBookMoves BinaryBook::find(const Position& pos, bool ignore_ply) const
+	{
+		if (position_count == 0)
+			return BinaryBookMoves();
+
+		u64 key[BinaryBookIndex::kKeyWords];
+		key_to_words(pos.long_key(), key);
+
+		// indexはhash key順(同じhash keyなら手数順)にsortされているので二分探索できる。
+		auto last = index + position_count;
+		auto it = std::lower_bound(index, last, key,
+			[](const BinaryBookIndex& e, const u64* k) { return key_less(e.key, k); });
+
+		// IgnoreBookPlyがfalseならテキスト形式と同じく手数まで一致しなければならない。
+		// 手数違いの同一局面が手数ごとに登録されていることがあるので、同じhash keyのものを順番に調べる。
+		for (; it != last && key_equal(it->key, key); ++it)
+			if (ignore_ply || it->ply == pos.game_ply())
+				return BinaryBookMoves{ moves + it->first_move, it->move_num, true };
+
+		return BinaryBookMoves();
+	}
+
+	// 登録されている局面を列挙する。
+	void BinaryBook::foreach(const std::function<void(const std::string&, BookMovesPtr)>& f) const
+	{
+		if (!sfen_offsets)
+			return;
+
+		for (size_t i = 0; i < position_count; ++i)
+		{
+			if (sfen_offsets[i] >= sfen_blob_size)
+				break;
+			const char* s = sfen_blob + sfen_offsets[i];
+			f(std::string(s, strnlen(s, sfen_blob_size - size_t(sfen_offsets[i]))), moves_at(i));
+		}
+	}
+
+	// 保持している内容をバイナリ定跡ファイルとして書き出す。
+	Tools::Result BinaryBook::write(const std::string& filename) const
+	{
+		if (!has_sfen())
+			return Tools::Result(Tools::ResultCode::SomeError);
+
+		u64 move_count = 0;
+		for (size_t i = 0; i < position_count; ++i)
+			move_count = std::max(move_count, u64(index[i].first_move) + index[i].move_num);
+
+		BinaryBookHeader header = {};
+		std::memcpy(header.magic, kBinaryBookMagic, sizeof(kBinaryBookMagic));
+		header.version        = kBinaryBookVersion;
+		header.hash_key_bits  = HASH_KEY_BITS;
+		header.position_count = position_count;
+		header.move_count     = move_count;
+		header.zobrist_check  = zobrist_check();
+		header.index_offset   = sizeof(BinaryBookHeader);
+		header.moves_offset   = header.index_offset + position_count * sizeof(BinaryBookIndex);
+		header.sfens_offset   = header.moves_offset + move_count * sizeof(PackedBookMove);
+
+		std::ofstream fs(filename, std::ios::binary);
+		if (fs.fail())
+			return Tools::Result(Tools::ResultCode::FileOpenError);
+
+		fs.write((const char*)&header, sizeof(header));
+		fs.write((const char*)index, position_count * sizeof(BinaryBookIndex));
+		fs.write((const char*)moves, move_count * sizeof(PackedBookMove));
+		fs.write((const char*)sfen_offsets, position_count * sizeof(u64));
+		fs.write(sfen_blob, sfen_blob_size);
+
+		if (fs.fail())
+			return Tools::Result(Tools::ResultCode::FileWriteError);
+
+		fs.close();
+		if (fs.fail())
+			return Tools::Result(Tools::ResultCode::FileCloseError);
+
+		cout << "positions = " << position_count << " , moves = " << move_count << endl;
+
+		return Tools::Result::Ok();
+	}
+
+	// MemoryBookの内容をバイナリ定跡として書き出す。
+	Tools::Result BinaryBook::write_book(const std::string& filename, MemoryBook& book)
+	{
+		cout << endl << "write " + filename << endl;
+
+		BinaryBook binary;
+		binary.build(book);
+		return binary.write(filename);
+	}
+}
@@ -0,0 +1,191 @@
+﻿#ifndef _BINARY_BOOK_H_INCLUDED_
+#define _BINARY_BOOK_H_INCLUDED_
+
+#include "book.h"
+
+// バイナリ形式の定跡ファイル。
+//
+// やねうら王のテキスト形式の定跡ファイル(book.db)は、読み込みのたびにsfen文字列をparseして
+// std::unordered_mapに格納するので、巨大な定跡だと起動に何十秒もかかり、メモリも大量に消費する。
+// (BookOnTheFlyのときは、probeのたびにファイル上でseekg()/getline()による二分探索を行う)
+//
+// そこで、局面のhash key(HASH_KEY)でsortしたindexと、固定長にpackした指し手を持つバイナリ形式を用意する。
+// これはmmapしてそのまま二分探索できるので、読み込みは一瞬で終わり、RSSも実際にアクセスしたページの分しか増えない。
+//
+// ファイルの構造)
+//   BinaryBookHeader                                 : ファイルの先頭。64 bytes。
+//   BinaryBookIndex[position_count]                  : hash key順(同じhash keyなら手数順)にsortされた局面のindex。
+//   PackedBookMove[move_count]                       : 局面ごとの指し手。局面ごとに連続して格納されている。
+//   u64[position_count] + char[]                     : 局面のsfen文字列(末尾に'\0')と、そのoffsetの配列。
+//                                                      探索中には用いない。テキスト形式に戻すときにだけ用いる。
+//
+// hash keyはPosition::long_key()。HASH_KEY_BITSが異なる実行ファイルで作成したものは読み込めない。
+// ファイルのendianはlittle endianを前提とする。
+// 読み込みはMemoryBook::read_book()がファイル先頭のmagicで自動判別する。(ファイル名の拡張子は何でも良い)
+// 作成はmakebook convert_to_bin , convert_apery_to_bin で行う。
+//
+// また、テキスト形式の定跡もread_book()のときに同じレイアウトでメモリ上に展開して用いる。(BinaryBook::read_text_book())
+
+namespace Book
+{
+	// バイナリ定跡ファイルのヘッダー
+	struct BinaryBookHeader
+	{
+		// "YANEBOOK"
+		char magic[8];
+
+		// フォーマットのversion
+		u32 version;
+
+		// このファイルを作成したときのHASH_KEY_BITS
+		u32 hash_key_bits;
+
+		// 局面数
+		u64 position_count;
+
+		// 指し手の総数
+		u64 move_count;
+
+		// 平手の開始局面のlong_key()の下位64bit。Zobristの乱数が一致するかの確認用。
+		u64 zobrist_check;
+
+		// BinaryBookIndex、PackedBookMove、sfen文字列のoffset配列の、ファイル先頭からのoffset
+		u64 index_offset;
+		u64 moves_offset;
+		u64 sfens_offset;
+	};
+	static_assert(sizeof(BinaryBookHeader) == 64, "sizeof(BinaryBookHeader) should be 64");
+
+	// バイナリ定跡の局面のindex。hash keyの昇順に並んでいる。
+	struct BinaryBookIndex
+	{
+		static constexpr int kKeyWords = (HASH_KEY_BITS + 63) / 64;
+
+		// 局面のhash key。long_key()をu64単位で格納したもの。
+		u64 key[kKeyWords];
+
+		// この局面の指し手がPackedBookMoveの配列の何番目から始まるか
+		u32 first_move;
+
+		// この局面の指し手の数
+		u16 move_num;
+
+		// この局面の手数(sfen文字列の末尾の数字)。IgnoreBookPlyがfalseのときの照合に用いる。
+		u16 ply;
+	};
+
+	// 固定長にpackしたBookMove。16 bytes。
+	struct PackedBookMove
+	{
+		u16 move;
+		u16 ponder;
+		s32 value;
+		s32 depth;
+
+		// 採択回数。32bitに収まらないものは飽和させる。
+		u32 move_count;
+	};
+	static_assert(sizeof(PackedBookMove) == 16, "sizeof(PackedBookMove) should be 16");
+
+	// BinaryBook::find()で返す、ある局面の指し手集合への参照。
+	// BinaryBookが保持しているメモリ(mmapしたファイルかarena)を指すので、定跡を読み直したあとに用いてはならない。
+	// 指し手はBookMoveのoperator <()の順(採択回数、評価値の降順)に並んでいる。
+	struct BinaryBookMoves
+	{
+		const PackedBookMove* first = nullptr;
+		size_t size = 0;
+
+		// 局面が見つかったか。(見つかっても指し手が0個のことはある)
+		bool found = false;
+
+		explicit operator bool() const { return found; }
+		const PackedBookMove* begin() const { return first; }
+		const PackedBookMove* end() const { return first + size; }
+
+		// PackedBookMoveをBookMoveに戻す。
+		static BookMove to_book_move(const PackedBookMove& m) {
+			return BookMove(Move16(m.move), Move16(m.ponder), m.value, m.depth, m.move_count);
+		}
+	};
+
+	// hash keyで引く読み込み専用の定跡。
+	// ・バイナリ定跡ファイルをmmapしたもの
+	// ・テキスト形式の定跡ファイルを、バイナリ定跡と同じレイアウトでメモリ上のarenaに展開したもの
+	// のどちらか。
+	// 局面ごとにsfen文字列、shared_ptr、mutexを持つMemoryBook::book_bodyと比べて、1局面あたり
+	// BinaryBookIndex 1つ + 指し手の数 × PackedBookMoveしかメモリを消費しない。
+	// sfen文字列は書き出し(変換・マージ)のときにしか必要ないので、保持するかどうかを選べる。
+	struct BinaryBook
+	{
+		// ファイルの先頭にバイナリ定跡のmagicがあるか。
+		static bool is_binary_book(const std::string& filename);
+
+		// バイナリ定跡ファイルをmapする。ヘッダーが不正であればエラーを返す。
+		Tools::Result open(const std::string& filename);
+
+		// テキスト形式の定跡ファイルを読み込んでarenaに展開する。
+		// keep_sfen  : sfen文字列も保持するか。foreach()を用いるならtrueにしておく必要がある。
+		// ignore_ply : IgnoreBookPlyの値。falseなら、同一局面で手数違いのものは手数ごとに別の局面として保持する。
+		//              (sfen文字列をkeyとするbook_bodyに読み込んだときと同じく、手数まで一致したときだけhitする)
+		//              trueなら手数が最小のものだけを保持する。
+		Tools::Result read_text_book(const std::string& filename, bool keep_sfen, bool ignore_ply);
+
+		// MemoryBookの内容をarenaに展開する。
+		void build(MemoryBook& book);
+
+		// [ASYNC] 局面posに対応する指し手集合を返す。メモリの確保は行わない。
+		// 見つからなければ、operator bool()がfalseになるものが返る。
+		// ignore_ply : trueならば手数が異なっても一致したものとみなす。(手数違いで複数あれば、手数が最小のもの)
+		BinaryBookMoves find(const Position& pos, bool ignore_ply) const;
+
+		// find()の結果からBookMovesPtrを構築して返す。見つかっていなければnullptrが返る。
+		static BookMovesPtr to_book_moves(const BinaryBookMoves& moves);
+
+		// 登録されている局面を、sfen文字列(末尾に手数あり)とともに列挙する。書き出し用。
+		// sfen文字列を保持していないときは何もしない。
+		void foreach(const std::function<void(const std::string& /*sfen*/, BookMovesPtr)>& f) const;
+
+		// 保持している局面数
+		size_t size() const { return position_count; }
+
+		// sfen文字列を保持しているか。
+		bool has_sfen() const { return sfen_offsets != nullptr; }
+
+		// 保持している内容をバイナリ定跡ファイルとして書き出す。(sfen文字列を保持している必要がある)
+		Tools::Result write(const std::string& filename) const;
+
+		// MemoryBookの内容をバイナリ定跡として書き出す。
+		// 同一局面(hash keyが同じ)で手数違いのものは、手数が最小のものだけを書き出す。
+		static Tools::Result write_book(const std::string& filename, MemoryBook& book);
+
+	private:
+		// 索引i番目の指し手集合を構築して返す。
+		BookMovesPtr moves_at(size_t i) const;
+
+		// arenaに展開する前の局面。read_text_book()とbuild()で用いる。
+		struct RawEntry;
+
+		// RawEntryをhash key順に並べ替えて、重複局面をまとめてarenaに格納する。
+		// per_ply : 同一局面で手数違いのものを、手数ごとに別の局面として残すか。(falseなら手数が最小のものだけ)
+		void compact(std::vector<RawEntry>& raws, std::vector<PackedBookMove>& raw_moves, std::string& raw_sfens, bool keep_sfen, bool per_ply);
+
+		// open()したときのファイル
+		SystemIO::MappedFile file;
+
+		// read_text_book()、build()したときのarena
+		std::vector<BinaryBookIndex> index_arena;
+		std::vector<PackedBookMove>  move_arena;
+		std::vector<u64>             sfen_offset_arena;
+		std::string                  sfen_arena;
+
+		// 上のfileかarenaを指している。
+		size_t                 position_count = 0;
+		const BinaryBookIndex* index          = nullptr;
+		const PackedBookMove*  moves          = nullptr;
+		const u64*             sfen_offsets   = nullptr; // sfen文字列を保持していないならnullptr
+		const char*            sfen_blob      = nullptr;
+		size_t                 sfen_blob_size = 0;
+	};
+}
+
+#endif // #ifndef _BINARY_BOOK_H_INCLUDED_
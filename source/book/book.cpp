@@ -6,7 +6,9 @@
 #include "../thread.h"
 #include "../learn/multi_think.h"
 #include "../tt.h"
+#include "../perf_counter.h"
 #include "apery_book.h"
+#include "binary_book.h"
 
 #include <unordered_set>
 #include <iomanip>		// std::setprecision()
@@ -192,6 +194,13 @@ namespace Book
 
 		for(auto& it : book_body)
 			f(it.first,it.second);
+
+		// hash keyで引く表現で読み込んだ局面。(book_bodyのほうにもあるものは除く)
+		if (binary_book)
+			binary_book->foreach([&](const std::string& sfen, BookMovesPtr ptr) {
+				if (book_body.find(sfen) == book_body.end())
+					f(sfen, ptr);
+			});
 	}
 
 	// ----------------------------------
@@ -207,7 +216,7 @@ namespace Book
 	}
 
 	// 定跡ファイルの読み込み(book.db)など。
-	Tools::Result MemoryBook::read_book(const std::string& filename, bool on_the_fly_)
+	Tools::Result MemoryBook::read_book(const std::string& filename, bool on_the_fly_, BookLoadMode mode)
 	{
 		std::lock_guard<std::recursive_mutex> lock(mutex_);
 
@@ -220,7 +229,7 @@ namespace Book
 		// 　今回はtrueになった場合、本来ならメモリにすでに読み込まれているのだから読み直しは必要ないが、
 		//　 何らかの目的で変更したのであろうから、この場合もきちんと反映しないとまずい。)
 		bool ignore_book_ply_ = Options["IgnoreBookPly"];
-		if (this->book_name == filename && this->on_the_fly == on_the_fly_ && this->ignoreBookPly == ignore_book_ply_)
+		if (this->book_name == filename && this->on_the_fly == on_the_fly_ && this->ignoreBookPly == ignore_book_ply_ && this->load_mode == mode)
 			return Tools::Result::Ok();
 
 		// 一度このクラスのメンバーが保持しているファイル名はクリアする。(何も読み込んでいない状態になるので)
@@ -229,8 +238,10 @@ namespace Book
 
 		// 別のファイルを開こうとしているので前回メモリに丸読みした定跡をクリアしておかないといけない。
 		book_body.clear();
+		binary_book.reset();
 		this->on_the_fly = false;
 		this->ignoreBookPly = ignore_book_ply_;
+		this->load_mode = mode;
 
 		// フォルダ名を取り去ったものが"no_book"(定跡なし)もしくは"book.bin"(Aperyの定跡ファイル)であるかを判定する。
 		auto pure_filename = Path::GetFileName(filename);
@@ -243,7 +254,19 @@ namespace Book
 			return Tools::Result::Ok();
 		}
 
-		if (pure_filename == kAperyBookName) {
+		if (BinaryBook::is_binary_book(filename))
+		{
+			// バイナリ定跡はmmapするだけ。on the flyであるかどうかは関係ない。
+			auto book = std::make_shared<BinaryBook>();
+			auto result = book->open(filename);
+			if (result.is_not_ok())
+			{
+				sync_cout << "info string Error! : can't read file : " + filename << sync_endl;
+				return result;
+			}
+			binary_book = book;
+		}
+		else if (pure_filename == kAperyBookName) {
 			// Apery定跡データベースを読み込む
 			//	apery_book = std::make_unique<AperyBook>(kAperyBookName);
 			// これ、C++14の機能。C++11用に以下のように書き直す。
@@ -274,6 +297,25 @@ namespace Book
 
 			sync_cout << "info string read book file : " << filename << sync_endl;
 
+			if (mode != BookLoadMode::Editable)
+			{
+				// hash keyで引くコンパクトな表現に展開する。
+				// sfen文字列、shared_ptr、mutexを局面ごとに持たないので、book_bodyに読み込むより遥かに省メモリ。
+				auto book = std::make_shared<BinaryBook>();
+				auto result = book->read_text_book(filename, mode == BookLoadMode::HashedWithSfen, ignoreBookPly);
+				if (result.is_not_ok())
+				{
+					sync_cout << "info string Error! : can't read file : " + filename << sync_endl;
+					return result;
+				}
+				binary_book = book;
+
+				this->book_name = filename;
+				this->pure_book_name = pure_filename;
+				sync_cout << "info string read book done. number of positions = " << size() << sync_endl;
+				return Tools::Result::Ok();
+			}
+
 			SystemIO::TextReader reader;
 			// ReadLine()の時に行の末尾のスペース、タブを自動トリム。空行は自動スキップ。
 			reader.SetTrim(true);
@@ -379,6 +421,12 @@ namespace Book
 		return Tools::Result::Ok();
 	}
 
+	// 保持している局面数を返す。
+	size_t MemoryBook::size() const
+	{
+		return (binary_book ? binary_book->size() : 0) + book_body.size();
+	}
+
 	// 定跡ファイルの書き出し
 	Tools::Result MemoryBook::write_book(const std::string& filename /*, bool sort*/) const
 	{
@@ -409,13 +457,11 @@ namespace Book
 		// sfenの手数の手前までの文字列とそのときの手数
 		std::unordered_map<string, int> book_ply;
 
-		for (auto& it : book_body)
-		{
-			// 指し手のない空っぽのentryは書き出さないように。
-			if (it.second->size() == 0)
-				continue;
-			vectored_book.push_back(it);
-		}
+		// 指し手のない空っぽのentryは書き出さないように。
+		const_cast<MemoryBook*>(this)->foreach([&](const string& sfen, BookMovesPtr ptr) {
+			if (ptr->size() != 0)
+				vectored_book.emplace_back(sfen, ptr);
+		});
 
 		// sfen文字列は手駒の表記に揺れがある。
 		// (USI原案のほうでは規定されているのだが、将棋所が採用しているUSIプロトコルではこの規定がない。)
@@ -497,7 +543,18 @@ namespace Book
 		std::lock_guard<std::recursive_mutex> lock(const_cast<MemoryBook*>(this)->mutex_);
 
 		auto it = book_body.find(trim(sfen));
-		return it == book_body.end() ? BookMovesPtr() : it->second;
+		if (it != book_body.end())
+			return it->second;
+
+		// hash keyで引く表現で読み込んでいるなら、局面をsetしてそちらを調べる。
+		if (binary_book)
+		{
+			Position pos;
+			StateInfo si;
+			pos.set(sfen, &si, Threads.main());
+			return BinaryBook::to_book_moves(binary_book->find(pos, ignoreBookPly));
+		}
+		return BookMovesPtr();
 	}
 
 	// [ASYNC] メモリに保持している定跡に局面を一つ追加する。
@@ -518,6 +575,19 @@ namespace Book
 		if (pure_book_name == "no_book")
 			return BookMovesPtr();
 
+		// バイナリ定跡、hash keyで引く表現で読み込んだ定跡は二分探索する。sfen()の呼び出しも不要。
+		// (append()などでbook_bodyに追加されたものがあれば、そちらを優先する)
+		if (binary_book)
+		{
+			if (!book_body.empty())
+				if (auto it = book_body.find(trim(pos.sfen())); it != book_body.end())
+				{
+					it->second->sort_moves();
+					return it->second;
+				}
+			return BinaryBook::to_book_moves(binary_book->find(pos, ignoreBookPly));
+		}
+
 		if (pure_book_name == kAperyBookName) {
 
 			BookMovesPtr pml_entry(new BookMoves());
@@ -736,6 +806,31 @@ namespace Book
 		}
 	}
 
+	// 局面posの指し手集合をmovesにコピーする。
+	bool MemoryBook::find(const Position& pos, std::vector<BookMove>& moves)
+	{
+		std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+		moves.clear();
+
+		// hash keyで引く表現なら、arenaから直接コピーする。BookMovesPtrを構築しない。
+		// (arenaの指し手はBookMoveのoperator <()の順に並んでいる)
+		if (binary_book && book_body.empty() && pure_book_name != "no_book")
+		{
+			auto found = binary_book->find(pos, ignoreBookPly);
+			for (const auto& m : found)
+				moves.push_back(BinaryBookMoves::to_book_move(m));
+			return (bool)found;
+		}
+
+		auto ptr = find(pos);
+		if (!ptr)
+			return false;
+
+		moves.assign(ptr->begin(), ptr->end());
+		return true;
+	}
+
 	// Apery用定跡ファイルの読み込み（定跡コンバート用）
 	// ・Aperyの定跡ファイルはAperyBookで別途読み込んでいるため、read_apery_bookは定跡のコンバート専用。
 	// ・unreg_depth は定跡未登録の局面を再探索する深さ。デフォルト値1。
@@ -865,17 +960,14 @@ namespace Book
 
 			Position pos;
 
-			for (auto& it : book_body)
+			foreach([&](const std::string& sfen, BookMovesPtr movesptr)
 			{
-				std::string sfen = it.first;
-				BookMovesPtr movesptr = it.second;
-
 				StateInfo si;
 				pos.set(sfen, &si, Threads.main());
 				Key key = AperyBook::bookKey(pos);
 
 				vectored_book.emplace_back(key, movesptr);
-			}
+			});
 		}
 
 		// key順でsort
@@ -917,6 +1009,34 @@ namespace Book
 		return Tools::Result::Ok();
 	}
 
+	// バイナリ定跡ファイルを読み込んで、book_bodyに展開する。（定跡コンバート用）
+	Tools::Result MemoryBook::read_binary_book(const std::string& filename)
+	{
+		std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+		BinaryBook book;
+		auto result = book.open(filename);
+		if (result.is_not_ok())
+			return result;
+
+		cout << "size of binary book = " << book.size() << endl;
+
+		book.foreach([&](const std::string& sfen, BookMovesPtr ptr) { append(sfen, ptr); });
+
+		return Tools::Result::Ok();
+	}
+
+	// バイナリ定跡ファイルに書き出す（定跡コンバート用）
+	Tools::Result MemoryBook::write_binary_book(const std::string& filename)
+	{
+		std::lock_guard<std::recursive_mutex> lock(mutex_);
+
+		auto result = BinaryBook::write_book(filename, *this);
+		if (result.is_ok())
+			std::cout << "done!" << std::endl;
+		return result;
+	}
+
 	// ----------------------------------
 	//			BookMoveSelector
 	// ----------------------------------
@@ -1035,6 +1155,9 @@ namespace Book
 	// probe()の下請け
 	bool BookMoveSelector::probe_impl(Position& rootPos, bool silent , Move16& bestMove , Move16& ponderMove , bool forceHit)
 	{
+		PERF_COUNT(BOOK_PROBE);
+		PERF_TIMER(BOOK_PROBE_TIME);
+
 		if (!forceHit)
 		{
 			// 一定確率で定跡を無視
@@ -1048,15 +1171,16 @@ namespace Book
 				return false;
 		}
 
-		auto it = memory_book.find(rootPos);
-		if (it == nullptr || it->size()==0)
+		// 見つかった指し手集合をコピーして、不要なものを削除していく。(下のコメントを参照のこと)
+		std::vector<BookMove> move_list;
+		if (!memory_book.find(rootPos, move_list) || move_list.size()==0)
 			return false;
 
 		// 定跡にhitした。逆順で出力しないと将棋所だと逆順にならないという問題があるので逆順で出力する。
 		// →　将棋所、updateでMultiPVに対応して改良された
 		// 　ShogiGUIでの表示も問題ないようなので正順に変更する。
 
-		// また、it->size()!=0をチェックしておかないと指し手のない定跡が登録されていたときに困る。
+		// また、move_list.size()!=0をチェックしておかないと指し手のない定跡が登録されていたときに困る。
 
 		// 1) やねうら標準定跡のように評価値なしの定跡DBにおいては
 		// 出現頻度の高い順で並んでいることが保証されている。
@@ -1068,8 +1192,6 @@ namespace Book
 		// やや、オーバーヘッドはあるがコピーして、不要なものを削除していく。
 		// 定跡にhitしたときに発生するオーバーヘッドなので通常は無視できるはず。
 
-		auto move_list = *it;
-
 		// 非合法手の排除(歩の不成を生成しないモードなら、それも排除)
 		{
 			auto it_end = std::remove_if(move_list.begin(), move_list.end(), [&](Book::BookMove& m) {
@@ -1269,15 +1391,16 @@ namespace Book
 					StateInfo si;
 					rootPos.do_move(best,si);
 
-					auto it = memory_book.find(rootPos);
-					if (it != nullptr && it->size())
+					std::vector<BookMove> ponder_list;
+					if (memory_book.find(rootPos, ponder_list) && ponder_list.size())
 						// 1つ目に登録されている指し手が一番いい指し手であろう。
-						ponderMove = (*it)[0].move;
+						ponderMove = ponder_list[0].move;
 
 					rootPos.undo_move(best);
 				}
 			}
 
+			PERF_COUNT(BOOK_HIT);
 			return true;
 		}
 
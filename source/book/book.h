@@ -133,9 +133,26 @@ namespace Book
 
 	typedef std::shared_ptr<BookMoves> BookMovesPtr;
 
+	// mmapしたバイナリ定跡ファイル。binary_book.hで定義されている。
+	struct BinaryBook;
+
 	// sfen文字列からBookMovesPtrへの写像。(これが定跡データがメモリ上に存在するときの構造)
 	typedef std::unordered_map<std::string /* sfen */, BookMovesPtr > BookType;
 
+	// MemoryBook::read_book()でテキスト形式の定跡ファイルをどういう形でメモリに読み込むか。
+	enum class BookLoadMode
+	{
+		// sfen文字列をkeyとしたbook_bodyに読み込む。定跡を書き換える用途(makebook thinkなど)向け。
+		Editable,
+
+		// hash key(Position::long_key())で引く、読み込み専用のコンパクトな表現(BinaryBook)に読み込む。
+		// sfen文字列は保持しない。探索中のprobe用。
+		Hashed,
+
+		// Hashedに加えてsfen文字列も保持する。foreach()やwrite_book()で書き出す用途(マージ、ソート、変換)向け。
+		HashedWithSfen,
+	};
+
 	// メモリ上にある定跡ファイル
 	// ・sfen文字列をkeyとして、局面の指し手へ変換するのが主な役割。(このとき重複した指し手は除外するものとする)
 	// ・on the flyが指定されているときは実際はメモリ上にはないがこれを透過的に扱う。
@@ -147,6 +164,11 @@ namespace Book
 		// ファイルを調べに行き、BookMovesPtrをメモリ上に作って、それをくるんだBookMovesPtrを返す。
 		BookMovesPtr find(const Position& pos);
 
+		// [ASYNC] 局面posの指し手集合をmovesにコピーして返す。見つからなければfalseが返る。
+		// find(pos)と異なり、バイナリ定跡やhash keyで引く表現のときにBookMovesPtrを構築しないので、
+		// 探索開始時の定跡のprobeではこちらを用いる。
+		bool find(const Position& pos, std::vector<BookMove>& moves);
+
 		// [ASYNC] 定跡を内部に読み込む。
 		// ・Aperyの定跡ファイルは"book/book.bin"だと仮定。(これはon the fly読み込みに非対応なので丸読みする)
 		// ・やねうら王の定跡ファイルは、on_the_flyが指定されているとメモリに丸読みしない。
@@ -154,7 +176,11 @@ namespace Book
 		// 　　定跡作成時などはこれをtrueにしてはいけない。(メモリに読み込まれないため)
 		// ・同じファイルを二度目は読み込み動作をskipする。
 		// ・filenameはpathとして"book/"を補完しないので生のpathを指定する。
-		Tools::Result read_book(const std::string& filename, bool on_the_fly = false);
+		// ・mode : テキスト形式の定跡ファイルをどういう形でメモリに読み込むか。
+		// 　Hashed , HashedWithSfenで読み込んだ局面は書き換えられない。(find()で返るBookMovesPtrはその都度構築したコピー)
+		// 　IgnoreBookPlyがfalseなら、Hashed , HashedWithSfenでも手数違いの同一局面は手数ごとに保持される。
+		// 　append() , insert()で追加した局面はbook_bodyに格納され、find()ではそちらが優先される。
+		Tools::Result read_book(const std::string& filename, bool on_the_fly = false, BookLoadMode mode = BookLoadMode::Editable);
 
 		// [ASYNC] 定跡ファイルの書き出し
 		// ・sort = 書き出すときにsfen文字列で並び替えるのか。(書き出しにかかる時間増)
@@ -171,6 +197,14 @@ namespace Book
 		// [ASYNC] Aperyの定跡ファイルに書き出す（定跡コンバート用）
 		Tools::Result write_apery_book(const std::string& filename);
 
+		// [ASYNC] バイナリ定跡ファイルを読み込んで、book_bodyに展開する。（定跡コンバート用）
+		// ・通常の読み込みはread_book()がファイルの先頭のmagicでバイナリ定跡であることを判別してmmapするので、
+		// 　これはテキスト形式などに変換するときにだけ用いる。
+		Tools::Result read_binary_book(const std::string& filename);
+
+		// [ASYNC] バイナリ定跡ファイルに書き出す（定跡コンバート用）
+		Tools::Result write_binary_book(const std::string& filename);
+
 		// --------------------------------------------------------------------------
 		//   以下のメンバは、普段は外部から普段は直接アクセスすべきではない。
 		//
@@ -195,7 +229,8 @@ namespace Book
 		void foreach(std::function<void(std::string /*sfen*/, BookMovesPtr)> f);
 
 		// 保持している局面数を返す。これは、on the flyではない状態でread_book()した時にのみ有効。
-		size_t size() const { return book_body.size(); }
+		// バイナリ定跡を読み込んでいるときは、その局面数を返す。
+		size_t size() const;
 
 	protected:
 
@@ -223,6 +258,9 @@ namespace Book
 		// これが異なるならファイルの読み直しが必要になる。
 		bool ignoreBookPly = false;
 
+		// 前回読み込み時のBookLoadMode。これが異なるならファイルの読み直しが必要になる。
+		BookLoadMode load_mode = BookLoadMode::Editable;
+
 		// 上のon_the_fly == trueのときに、開いている定跡ファイルのファイルハンドル
 		std::fstream fs;
 
@@ -232,6 +270,11 @@ namespace Book
 		// 判定のためにファイル名を内部的に保持してある。
 		std::string book_name;
 		std::string pure_book_name; // book_nameからフォルダ名を取り除いたもの。
+
+		// read_book()でバイナリ定跡を読み込んだときは、これにmmapされている。
+		// テキスト形式の定跡をBookLoadMode::Hashed , HashedWithSfenで読み込んだときは、これに展開されている。
+		// find()はbook_bodyになければこちらを二分探索する。
+		std::shared_ptr<BinaryBook> binary_book;
 	};
 
 #if defined (ENABLE_MAKEBOOK_CMD)
@@ -251,7 +294,8 @@ namespace Book
 		// ・Search::clear()は、USIのisreadyコマンドのときに呼び出されるので
 		// 　定跡をメモリに丸読みするのであればこのタイミングで行なう。
 		// ・Search::clear()が呼び出されたときのOptions["BookOnTheFly"]の値をcaptureして使う。(ことになる)
-		void read_book() { memory_book.read_book(get_book_name(), (bool)Options["BookOnTheFly"]); }
+		// ・探索中は定跡を書き換えないので、hash keyで引くコンパクトな表現で読み込む。
+		void read_book() { memory_book.read_book(get_book_name(), (bool)Options["BookOnTheFly"], BookLoadMode::Hashed); }
 
 		// --- 定跡の指し手の選択
 
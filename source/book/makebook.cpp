@@ -23,6 +23,9 @@ namespace Book
 	// 定跡生成コマンド2019年度版。makebook2019.cppで定義されている。テラショック定跡手法。
 	int makebook2019(Position& pos, istringstream& is, const string& token);
 
+	// 巨大な定跡ファイルの外部ソートによるsort/merge。makebook_external.cppで定義されている。
+	int makebook_external(Position& pos, istringstream& is, const string& token);
+
 #if defined(YANEURAOU_ENGINE_DEEP)
 	// 定跡生成コマンド2021年度版。makebook2021.cppで定義されている。MCTSによる生成。
 	int makebook2021(Position& pos, istringstream& is, const string& token);
@@ -72,6 +75,10 @@ namespace Book
 		if (makebook2019(pos, is, token))
 			return;
 
+		// メモリに載らない巨大な定跡ファイルのsort/merge
+		if (makebook_external(pos, is, token))
+			return;
+
 #if defined(YANEURAOU_ENGINE_DEEP)
 		// 2021年に作ったmakebook拡張コマンド
 		if (makebook2021(pos, is, token))
@@ -85,7 +92,14 @@ namespace Book
 		cout << "> makebook think book.sfen book.db moves 16 depth 18" << endl;
 		cout << "> makebook merge book_src1.db book_src2.db book_merged.db" << endl;
 		cout << "> makebook sort book_src.db book_sorted.db" << endl;
+		cout << "> makebook external_sort book_src.db book_sorted.db buffer_mb 1024 threads 4 tmp_dir tmp" << endl;
+		cout << "> makebook external_merge book_src1.db book_src2.db book_merged.db buffer_mb 1024 threads 4" << endl;
+		cout << "> makebook external_bench book_src.db buffer_mb 1024 threads 4" << endl;
 		cout << "> makebook convert_from_apery book_src.bin book_converted.db" << endl;
+		cout << "> makebook convert_to_bin book_src.db book_converted.ybk" << endl;
+		cout << "> makebook convert_from_bin book_src.ybk book_converted.db" << endl;
+		cout << "> makebook convert_apery_to_bin book_src.bin book_converted.ybk" << endl;
+		cout << "> makebook convert_bin_to_apery book_src.ybk book_converted.bin" << endl;
 		cout << "> makebook build_tree book2019.db user_book1.db" << endl;
 
 	}
@@ -128,9 +128,15 @@ namespace Book
 		bool convert_from_apery = token == "convert_from_apery";
 		// 定跡の変換
 		bool convert_to_apery = token == "convert_to_apery";
+		// 定跡の変換(バイナリ定跡との相互変換)
+		bool convert_to_bin = token == "convert_to_bin";
+		bool convert_from_bin = token == "convert_from_bin";
+		bool convert_apery_to_bin = token == "convert_apery_to_bin";
+		bool convert_bin_to_apery = token == "convert_bin_to_apery";
 		
 		// いずれのコマンドでもないなら、このtokenのコマンドを自分は処理できない。
-		if (!(from_sfen || from_thinking || book_merge || book_sort || convert_from_apery || convert_to_apery))
+		if (!(from_sfen || from_thinking || book_merge || book_sort || convert_from_apery || convert_to_apery
+			|| convert_to_bin || convert_from_bin || convert_apery_to_bin || convert_bin_to_apery))
 			return 0;
 
 		if (from_sfen || from_thinking)
@@ -564,7 +570,8 @@ namespace Book
 			cout << "book merge from " << book_name[0] << " and " << book_name[1] << " to " << book_name[2] << endl;
 			for (int i = 0; i < 2; ++i)
 			{
-				if (book[i].read_book(book_name[i]).is_not_ok())
+				// マージ元は書き換えないので、hash keyで引くコンパクトな表現で読み込む。
+				if (book[i].read_book(book_name[i], false, BookLoadMode::HashedWithSfen).is_not_ok())
 					return 1;
 			}
 
@@ -635,7 +642,7 @@ namespace Book
 			string book_src, book_dst;
 			is >> book_src >> book_dst;
 			cout << "book sort from " << book_src << " , write to " << book_dst << endl;
-			book.read_book(book_src);
+			book.read_book(book_src, false, BookLoadMode::HashedWithSfen);
 
 			book.write_book(book_dst);
 
@@ -654,10 +661,40 @@ namespace Book
 			string book_src, book_dst;
 			is >> book_src >> book_dst;
 			cout << "convert book from " << book_src << " , write apery book to " << book_dst << endl;
-			book.read_book(book_src);
+			book.read_book(book_src, false, BookLoadMode::HashedWithSfen);
 
 			book.write_apery_book(book_dst);
 		}
+		else if (convert_to_bin || convert_apery_to_bin) {
+			// テキスト形式(もしくはApery形式)の定跡をバイナリ定跡に変換する。
+			MemoryBook book;
+			string book_src, book_dst;
+			is >> book_src >> book_dst;
+			cout << "convert " << (convert_apery_to_bin ? "apery " : "") << "book from " << book_src << " , write binary book to " << book_dst << endl;
+			if (convert_apery_to_bin)
+				book.read_apery_book(book_src);
+			else
+				book.read_book(book_src, false, BookLoadMode::HashedWithSfen);
+
+			book.write_binary_book(book_dst);
+		}
+		else if (convert_from_bin || convert_bin_to_apery) {
+			// バイナリ定跡をテキスト形式(もしくはApery形式)に変換する。
+			MemoryBook book;
+			string book_src, book_dst;
+			is >> book_src >> book_dst;
+			cout << "convert binary book from " << book_src << " , write " << (convert_bin_to_apery ? "apery " : "") << "book to " << book_dst << endl;
+			if (book.read_binary_book(book_src).is_not_ok())
+			{
+				cout << "Error! : can't read binary book " << book_src << endl;
+				return 1;
+			}
+
+			if (convert_bin_to_apery)
+				book.write_apery_book(book_dst);
+			else
+				book.write_book(book_dst);
+		}
 
 		return 1;
 	}
@@ -22,9 +22,13 @@
 			// 初期局面から1手指した局面をこのファイルとして与えたほうがいいかも？
 			// あと駒落ちの定跡を生成するときは同様に駒落ちの初期局面と、そこから1手指した局面ぐらいをこのファイルで指定すると良いかも。
 		kif_sfens_name    : 棋譜のファイル名。この棋譜上の局面かつPVまわりを思考させることもできる。
-		book_save_interval: この局面数だけ思考するごとに定跡ファイルを書き出す。
+		book_save_interval: この局面数だけ思考するごとに定跡ファイルを書き出す。0なら書き出さない。(デフォルトでは0)
 			// "book/read_book.db.000001"のようなファイルに通しナンバー付きで書き出していく。
 			// このコマンドが終了するときにも書き出すので、数時間に1度保存される程度のペースでも良いと思う。
+			// 思考した局面は↓のjournalに逐次追記していくので、途中で落ちてもそこまでの思考結果は失われない。
+		journal           : 思考した局面を1局面ずつ追記していくファイル名。(デフォルトでは write_book + ".journal")
+			// 起動時にこのファイルがあれば、read_bookを読み込んだあとに、このファイルの局面も読み込む。(前回の続きから)
+			// コマンドが終了してwrite_bookを書き出したあと、このファイルは削除される。
 		nodes_limit       : 1局面について思考するnode数。30knps出るPCで30000を指定すると1局面1秒。
 		think_limit       : この局面数思考したらこのコマンドを終了する。
 		search_delta_on_kif : ranged alpha beta searchの時に棋譜上に出現したleaf nodeに加点するスコア。
@@ -54,6 +58,10 @@
 		// 配置するとその続きから掘ってくれる。
 		(初回はこのファイルは不要)
 
+		book/write_book.db.journal
+		前回、途中で終了した時に残っているjournal。read_book.dbはそのままで(renameせずに)再度実行すると
+		このjournalの局面も読み込んで続きから掘ってくれる。
+
 	出力)
 		book/write_book.db
 		→　このあと、このファイルをテラショック化コマンドでテラショック定跡化して使う。
@@ -61,6 +69,14 @@
 		例)
 		> makebook build_tree book/write_book.db book/user_book1.db
 
+	journalのcompaction)
+
+		> makebook stera_compact read_book book/read_book.db journal book/write_book.db.journal write_book book/write_book.db
+
+		read_bookとjournalを合わせた定跡をwrite_bookに書き出す。
+		"makebook stera"を止めずに別プロセスで実行して、その時点の定跡を得ることもできる。
+		remove_journal 1 を指定すると書き出したあとjournalを削除する。("makebook stera"を止めている時のみ指定すること)
+
 	注意点)
 
 		高速化のために、局面をSFEN文字列ではなく、局面のhash値で一致しているかどうかをチェックするので
@@ -78,6 +94,12 @@
 #include <limits>
 #include <cmath>
 
+#if defined(_WIN32)
+#include <io.h>			// _chsize_s()
+#else
+#include <unistd.h>		// ftruncate()
+#endif
+
 #include "../usi.h"
 #include "../misc.h"
 #include "../thread.h"
@@ -204,15 +226,21 @@ namespace MakeBook2021
 	// 局面管理用クラス。
 	// HASH_KEYからそのに対応するNode構造体を取り出す。(あるいは格納する)
 	// Node構造体には、その局面の全合法手とその指し手を指した時の評価値が格納されている。
+	//
+	// ranged alpha-beta探索のスレッドがprobe()しているところに、思考を終えたスレッドがinsert()するので、
+	// HASH_KEYの上位bitでshardに分割して、shardごとにmutexでlockする。
+	// (mutex一つだと、探索スレッドのprobe()が全部そこで詰まる)
 	class PositionManager
 	{
 	public:
 
 		// 定跡ファイルを読み込む
-		void read_book(string filename)
+		Tools::Result read_book(string filename)
 		{
 			MemoryBook book;
-			book.read_book(filename);
+			auto result = book.read_book(filename);
+			if (result.is_not_ok())
+				return result;
 
 			Position pos;
 
@@ -232,6 +260,8 @@ namespace MakeBook2021
 				// 進捗の出力
 				progress.check(++counter);
 				});
+
+			return Tools::Result::Ok();
 		}
 
 		// SFEN文字列とそれに対応する局面の情報(定跡の指し手、evalの値等)を
@@ -239,8 +269,8 @@ namespace MakeBook2021
 		// ただしすべての合法手の評価値がついていない局面は登録しない。
 		void store(string sfen, Position& pos, const BookMovesPtr& ptr)
 		{
-			// Node一つ作る。
-			Node& node = *create_node(pos);
+			// Node一つ作る。(すべての合法手の評価値が揃ってから登録する)
+			Node node;
 
 			node.sfen = sfen;
 
@@ -267,40 +297,55 @@ namespace MakeBook2021
 					// 合法手すべてに評価値がついていないとまずい。
 					// このnodeはなかったことにしてしまう。
 					sync_cout << "remove node , sfen = " << sfen << " , missing move = " << move << sync_endl;
-					remove_node(pos);
 					return;
 				}
 				node.children.emplace_back(Child(move, ValueDepth(eval, 0)));
 			}
-		}
 
-		// Nodeを新規に生成して、そのNode*を返す。
-		Node* create_node(Position& pos)
-		{
-			auto key = pos.long_key();
-			auto r = hashkey_to_node.emplace(key, Node());
-			auto& node = r.first->second;
-			return &node;
+			insert(pos.long_key(), std::move(node));
 		}
 
-		// Nodeを削除する。
-		void remove_node(Position& pos)
+		// [ASYNC] 完成したNodeを登録して、そのNode*を返す。
+		// 登録済みのkeyであれば、登録済みのNode*を返す。
+		// unordered_mapの要素は再ハッシュしても移動しないので、返したNode*はずっと有効。
+		Node* insert(HASH_KEY key, Node&& node)
 		{
-			auto key = pos.long_key();
-			hashkey_to_node.erase(key);
+			auto& shard = shard_of(key);
+			std::unique_lock<std::mutex> lk(shard.mutex);
+			auto r = shard.nodes.emplace(key, std::move(node));
+			return &r.first->second;
 		}
 
-		// probe()とcreate_node()だけmutexを用いたいので、
-		// create_nodeを呼び出す前後でこのmutexをlockすればprobe()から守られる。
-		std::mutex* get_mutex() { return &mutex_; }
-
 		// [ASYNC] 引数で指定されたkeyに対応するNode*を返す。
 		// 見つからなければnullptrが返る。
 		Node* probe(HASH_KEY key)
 		{
-			std::unique_lock<std::mutex> lk(mutex_);
-			auto it = hashkey_to_node.find(key);
-			return it == hashkey_to_node.end() ? nullptr : &it->second;
+			auto& shard = shard_of(key);
+			std::unique_lock<std::mutex> lk(shard.mutex);
+			auto it = shard.nodes.find(key);
+			return it == shard.nodes.end() ? nullptr : &it->second;
+		}
+
+		// [ASYNC] 登録されているNodeの数
+		size_t size()
+		{
+			size_t n = 0;
+			for (auto& shard : shards)
+			{
+				std::unique_lock<std::mutex> lk(shard.mutex);
+				n += shard.nodes.size();
+			}
+			return n;
+		}
+
+		// すべてのNodeに対してfを呼び出す。
+		// Nodeを追加するのは思考を行うスレッドだけなので、そのスレッドから呼び出すならlockは要らない。
+		template <typename F>
+		void foreach(F f)
+		{
+			for (auto& shard : shards)
+				for (auto& it : shard.nodes)
+					f(it.first, it.second);
 		}
 
 		// 指定された局面の情報を表示させてみる。(デバッグ用)
@@ -363,18 +408,17 @@ namespace MakeBook2021
 
 		// 持っているNode情報をすべて定跡DBに保存する。
 		// path : 保存する定跡ファイルのpath
-		void save_book(string path)
+		Tools::Result save_book(string path)
 		{
 			sync_cout << "making save file in memory" << sync_endl;
 
 			// 進捗出力用
-			Tools::ProgressBar progress(hashkey_to_node.size());
+			Tools::ProgressBar progress(size());
 			u64 counter = 0;
 
 			MemoryBook book;
-			for (auto& it : hashkey_to_node)
+			foreach([&](const HASH_KEY& /*key*/, Node& node)
 			{
-				auto& node = it.second;
 				auto sfen = node.sfen;
 
 				BookMovesPtr bms(new BookMoves);
@@ -392,9 +436,9 @@ namespace MakeBook2021
 				book.append(sfen, bms);
 
 				progress.check(++counter);
-			}
+			});
 
-			book.write_book(path);
+			return book.write_book(path);
 		}
 
 		// 持っているNode情報をすべて定跡DBに保存する。
@@ -405,14 +449,13 @@ namespace MakeBook2021
 			sync_cout << "making save file in memory" << sync_endl;
 
 			// 進捗出力用
-			Tools::ProgressBar progress(hashkey_to_node.size());
+			Tools::ProgressBar progress(size());
 			u64 counter = 0;
 
 			Position pos;
 			MemoryBook book;
-			for (auto& it : hashkey_to_node)
+			foreach([&](const HASH_KEY& /*key*/, Node& node)
 			{
-				auto& node = it.second;
 				auto sfen = node.sfen;
 
 				BookMovesPtr bms(new BookMoves);
@@ -431,9 +474,9 @@ namespace MakeBook2021
 					StateInfo si;
 					pos.set(sfen, &si, Threads.main());
 					HASH_KEY next_key = pos.long_key_after(pos.to_move(move));
-					auto it = hashkey_to_node.find(next_key);
-					if (it != hashkey_to_node.end())
-						ponder = it->second.best_move;
+					Node* next_node = probe(next_key);
+					if (next_node != nullptr)
+						ponder = next_node->best_move;
 
 					// depthとしてchild.eval.plyを埋めておく。
 					bms->push_back(BookMove(move, ponder, child.eval.value, /* depth */child.eval.depth,/*move_count*/ 1));
@@ -442,7 +485,7 @@ namespace MakeBook2021
 				book.append(sfen, bms);
 
 				progress.check(++counter);
-			}
+			});
 
 			book.write_book(path);
 		}
@@ -452,20 +495,139 @@ namespace MakeBook2021
 		// → generationで管理することにしたので、実際はこの関数は使わない。
 		void clear_all_search_value()
 		{
-			for (auto& it : hashkey_to_node)
+			foreach([](const HASH_KEY& /*key*/, Node& node)
 			{
-				auto& node = it.second;
-
 				node.search_value = ValueDepth(VALUE_NONE, 0);
 				node.cyclic = 0;
-			}
+			});
 		}
 
 	protected:
-		// その局面のHASH_KEYからNode構造体へのmap。
-		unordered_map<HASH_KEY, Node> hashkey_to_node;
+		// shardの数は2のべき乗。HASH_KEYの上位SHARD_BITS bitでshardを選ぶ。
+		// (下位bitはunordered_mapのbucketを選ぶのにstd::hashが使っているので)
+		static constexpr int SHARD_BITS = 6;
 
-		std::mutex mutex_;
+		struct Shard
+		{
+			// その局面のHASH_KEYからNode構造体へのmap。
+			unordered_map<HASH_KEY, Node> nodes;
+
+			std::mutex mutex;
+		};
+
+		Shard& shard_of(const HASH_KEY& key) { return shards[u64(Key(key)) >> (64 - SHARD_BITS)]; }
+
+		Shard shards[1 << SHARD_BITS];
+	};
+
+	// 思考し終わった局面を1局面ずつ追記していくファイル。
+	// 定跡ファイル全体を書き出すと、定跡が大きくなってきた時に時間がかかりすぎるので、
+	// 思考した局面はここに追記だけしておき、次回起動時や"makebook stera_compact"で定跡ファイルにまとめる。
+	// ファイルの形式は定跡DBと同じ。(そのままMemoryBook::read_book()で読み込める)
+	class BookJournal
+	{
+	public:
+		~BookJournal() { close(); }
+
+		// 追記モードで開く。
+		// 前回書いている途中で落ちて最後の行が改行で終わっていなければ、その行は切り捨ててから開く。
+		// (そのまま追記すると、次の"sfen"の行がその行に繋がってしまう)
+		Tools::Result open(const string& path)
+		{
+			close();
+			auto result = drop_partial_line(path);
+			if (result.is_not_ok())
+				return result;
+
+			fp = fopen(path.c_str(), "ab");
+			return fp == nullptr ? Tools::ResultCode::FileOpenError : Tools::ResultCode::Ok;
+		}
+
+		void close()
+		{
+			if (fp)
+				fclose(fp);
+			fp = nullptr;
+		}
+
+		bool is_open() const { return fp != nullptr; }
+
+		// 1局面追記する。落ちた時に失われないように、書くごとにflushする。
+		// 書いている途中で落ちた局面は、全合法手の評価値が揃っていないので読み込む時に捨てられる。
+		Tools::Result append(const Node& node)
+		{
+			if (fp == nullptr)
+				return Tools::ResultCode::FileWriteError;
+
+			string record = "sfen " + node.sfen + "\r\n";
+			for (auto& child : node.children)
+				if (child.eval.value != VALUE_NONE)
+					record += to_usi_string(child.move) + " none " + to_string(child.eval.value)
+						+ " " + to_string(child.eval.depth) + " 1\r\n";
+
+			if (fwrite(record.data(), 1, record.size(), fp) != record.size() || fflush(fp) != 0)
+				return Tools::ResultCode::FileWriteError;
+
+			return Tools::ResultCode::Ok;
+		}
+
+		// ファイルが存在するか。
+		static bool exists(const string& path)
+		{
+			FILE* f = fopen(path.c_str(), "rb");
+			if (f == nullptr)
+				return false;
+			fclose(f);
+			return true;
+		}
+
+	private:
+		// ファイル末尾の、改行で終わっていない行を切り捨てる。ファイルがなければ何もしない。
+		static Tools::Result drop_partial_line(const string& path)
+		{
+			FILE* f = fopen(path.c_str(), "rb+");
+			if (f == nullptr)
+				return Tools::ResultCode::Ok;
+
+			SystemIO::fseek64(f, 0, SEEK_END);
+			const size_t size = SystemIO::ftell64(f);
+
+			// 末尾から遡って最後の改行を探す。
+			size_t end = size;
+			char buf[4096];
+			while (end > 0)
+			{
+				const size_t n = std::min(end, sizeof(buf));
+				SystemIO::fseek64(f, end - n, SEEK_SET);
+				if (fread(buf, 1, n, f) != n)
+				{
+					fclose(f);
+					return Tools::ResultCode::FileReadError;
+				}
+				size_t i = n;
+				while (i > 0 && buf[i - 1] != '\n')
+					--i;
+				end -= n - i;
+				if (i > 0)
+					break;
+			}
+
+			bool ok = true;
+			if (end != size)
+			{
+				sync_cout << "Warning! : drop the partial last line of the journal , path = " << path
+						  << " , " << size - end << " bytes" << sync_endl;
+#if defined(_WIN32)
+				ok = _chsize_s(_fileno(f), (__int64)end) == 0;
+#else
+				ok = ftruncate(fileno(f), (off_t)end) == 0;
+#endif
+			}
+			fclose(f);
+			return ok ? Tools::ResultCode::Ok : Tools::ResultCode::FileWriteError;
+		}
+
+		FILE* fp = nullptr;
 	};
 
 	// 探索中のnodeを表現する。
@@ -635,9 +797,12 @@ namespace MakeBook2021 {
 			//u64 nodes_limit = 100;
 			
 			// ↓の局面数を思考するごとにsaveする。
-			// 15分に1回ぐらいで良いような？
-			// 定跡ファイルが大きくなってきたら数時間に1回でいいと思う。
-			u64 book_save_interval = 30000/*nps*/ / nodes_limit * 30*60 /* 30分 */;
+			// 思考した局面はjournalに逐次追記されるので、途中経過を定跡ファイルとして残したい時だけ指定すれば良い。
+			// (定跡ファイルが大きくなってくると、1回のsaveに数分かかる)
+			u64 book_save_interval = 0;
+
+			// 思考した局面を追記していくjournalファイル。空ならwrite_book_name + ".journal"
+			string journal_name;
 
 			// 探索局面数
 			u64 think_limit = 10000000;
@@ -663,6 +828,7 @@ namespace MakeBook2021 {
 			parser.add_argument("read_book"           , read_book_name);
 			parser.add_argument("write_book"          , write_book_name);
 			parser.add_argument("book_save_interval"  , book_save_interval);
+			parser.add_argument("journal"             , journal_name);
 			parser.add_argument("nodes_limit"         , nodes_limit);
 			parser.add_argument("think_limit"         , think_limit);
 			parser.add_argument("ranged_alpha_beta_loop", ranged_alpha_beta_loop);
@@ -672,8 +838,12 @@ namespace MakeBook2021 {
 
 			parser.parse_args(is);
 
+			if (journal_name.empty())
+				journal_name = write_book_name + ".journal";
+
 			cout << "ReadBook  DB file      : " << read_book_name         << endl;
 			cout << "WriteBook DB file      : " << write_book_name        << endl;
+			cout << "Journal file           : " << journal_name           << endl;
 			cout << "book_save_interval     : " << book_save_interval     << "[positions]" << endl;
 			cout << "nodes_limit            : " << nodes_limit            << endl;
 			cout << "think_limit            : " << think_limit            << endl;
@@ -686,6 +856,21 @@ namespace MakeBook2021 {
 			// 定跡ファイルの読み込み。
 			pm.read_book(read_book_name);
 
+			// 前回の途中までの思考結果が残っていれば、それも読み込む。
+			if (BookJournal::exists(journal_name))
+			{
+				cout << "replay journal : " << journal_name << endl;
+				pm.read_book(journal_name);
+			}
+
+			// 以降、思考した局面はjournalに追記していく。
+			// journalに書けないと、book_save_intervalを指定していない時に思考結果が何も残らないので中断する。
+			if (journal.open(journal_name).is_not_ok())
+			{
+				cout << "Error! : journal file = " << journal_name << " , can't be opened." << endl;
+				return;
+			}
+
 			// root sfen集合の読み込み
 			// このroot sfenとして棋譜を与えて棋譜の局面も全部掘りたい気はするが、そうしたい時とそうしたくない時があるので
 			// それやるなら棋譜の全部のsfenを列挙するconverterみたいなの作った方がいいと思う。
@@ -750,6 +935,10 @@ namespace MakeBook2021 {
 			// 準備完了したのであとは
 			// think limitに達するまで延々と思考する。
 
+			// 思考速度[positions/hour]の計測用
+			think_timer.reset();
+			think_count_at_start = think_count;
+
 			// rootに対応するNode自体は必要。これは特別扱いする。
 			cout << "[Step 2] root nodes check." << endl;
 			for (auto& root_sfen : root_sfens)
@@ -763,12 +952,52 @@ namespace MakeBook2021 {
 			}
 
 			// 定跡ファイルの書き出し(最終)
-			save_book(write_book_name);
+			// journalの内容はwrite_bookに含まれたので、書き出せたらjournalは要らない。
+			journal.close();
+			if (save_book(write_book_name).is_ok())
+				std::remove(journal_name.c_str());
+
+			cout << "think count = " << think_count << " , positions/hour = " << positions_per_hour() << endl;
 
 			// コマンドが完了したことを出力。
 			cout << "makebook stera command has finished." << endl;
 		}
 
+		// 定跡ファイルとjournalを合わせて、定跡ファイルに書き出す。
+		void stera_compact(Position& pos, istringstream& is)
+		{
+			cout << endl;
+			cout << "makebook stera_compact command : " << endl;
+
+			string read_book_name  = "book/read_book.db";
+			string write_book_name = "book/write_book.db";
+			string journal_name    = "book/write_book.db.journal";
+			bool remove_journal    = false;
+
+			Parser::ArgumentParser parser;
+			parser.add_argument("read_book"           , read_book_name);
+			parser.add_argument("write_book"          , write_book_name);
+			parser.add_argument("journal"             , journal_name);
+			parser.add_argument("remove_journal"      , remove_journal);
+
+			parser.parse_args(is);
+
+			cout << "ReadBook  DB file      : " << read_book_name         << endl;
+			cout << "WriteBook DB file      : " << write_book_name        << endl;
+			cout << "Journal file           : " << journal_name           << endl;
+			cout << "remove_journal         : " << remove_journal         << endl;
+
+			pm.read_book(read_book_name);
+			if (pm.read_book(journal_name).is_not_ok())
+				cout << "Warning , journal file = " << journal_name << " , is not found." << endl;
+
+			if (save_book(write_book_name).is_ok() && remove_journal)
+				std::remove(journal_name.c_str());
+
+			// コマンドが完了したことを出力。
+			cout << "makebook stera_compact command has finished." << endl;
+		}
+
 		// スーパーテラショック定跡手法で生成した定跡を、テラショック化する。
 		// これにより、通常の思考エンジンで使える定跡になる。
 		void stera_convert(Position& pos, istringstream& is)
@@ -959,7 +1188,8 @@ namespace MakeBook2021 {
 						banned_nodes.emplace(s_node);
 
 				} else {
-					sync_cout << "think time = " << time.elapsed() << "[ms] , queue.size() = " << search_nodes.size() << sync_endl;
+					sync_cout << "think time = " << time.elapsed() << "[ms] , queue.size() = " << search_nodes.size()
+							  << " , positions/hour = " << positions_per_hour() << sync_endl;
 				}
 
 				// 探索が終わったので、いま以降、このleaf nodeに来ても大丈夫！
@@ -1390,13 +1620,9 @@ namespace MakeBook2021 {
 
 			// 新規にNodeを作成してそこに書き出す
 			{
-				// nodeを追加するので、create_node()付近でmutexをlockしなければならない。
-				// これはthinkが終わった瞬間に行うだけなので、全体時間からするとlockされている時間は
-				// 極わずかだから、問題ない。
-				std::unique_lock<std::mutex> lk(*pm.get_mutex());
-
-				node_ = pm.create_node(pos);
-				Node& node = *node_;
+				// ranged alpha-beta探索のスレッドから書きかけのNodeが見えないように、
+				// ローカルで完成させてからpmに登録する。(lockされるのは登録先のshardだけ)
+				Node node;
 
 				node.sfen = pos.sfen();
 
@@ -1442,13 +1668,20 @@ namespace MakeBook2021 {
 					// この指し手をchildrentの先頭に持ってきておく。(alpha-beta探索で早い段階で枝刈りさせるため)
 					std::swap(node.children[0], node.children[max_index]);
 				}
+
+				// journalに追記。(定跡ファイル全体を書き出さなくとも、ここまでの思考結果が失われないように)
+				if (journal.is_open() && journal.append(node).is_not_ok())
+					sync_cout << "Error! : failed to write the journal." << sync_endl;
+
+				node_ = pm.insert(pos.long_key(), std::move(node));
 			}
 
 			// ================================
 			//   定跡ファイルの定期的な書き出し
 			// ================================
 
-			if (++think_count % search_option.book_save_interval == 0)
+			++think_count;
+			if (search_option.book_save_interval != 0 && think_count % search_option.book_save_interval == 0)
 			{
 				string path = search_option.write_book_name
 					// ゼロサプライして6桁にする。
@@ -1463,10 +1696,16 @@ namespace MakeBook2021 {
 		}
 
 		// 定跡をファイルに保存する。
-		void save_book(const string& path)
+		Tools::Result save_book(const string& path)
+		{
+			cout << "save book , path = " << path << " , positions/hour = " << positions_per_hour() << endl;
+			return pm.save_book(path);
+		}
+
+		// make_book()を開始してからの、1時間あたりの思考局面数。
+		u64 positions_per_hour() const
 		{
-			cout << "save book , path = " << path << endl;
-			pm.save_book(path);
+			return u64(think_count - think_count_at_start) * 60 * 60 * 1000 / (think_timer.elapsed() + 1);
 		}
 
 		void save_tera_book(const string& path)
@@ -1497,6 +1736,9 @@ namespace MakeBook2021 {
 		// 局面管理クラス
 		PositionManager pm;
 
+		// 思考した局面を追記していくjournal
+		BookJournal journal;
+
 		// 探索時のオプション
 		SearchOption search_option;
 
@@ -1509,6 +1751,10 @@ namespace MakeBook2021 {
 		// (一定間隔ごとに定跡をファイルに保存しないといけないのでそのためのカウンター)
 		size_t think_count = 0;
 
+		// positions/hourの計測用。make_book()の開始時のthink_countと、そこからの経過時間。
+		size_t think_count_at_start = 0;
+		Timer think_timer;
+
 		// 棋譜上に出現した局面のhash key
 		unordered_set<HASH_KEY> kif_hash;
 
@@ -1658,6 +1904,15 @@ namespace Book
 			return 1;
 		}
 
+		// makebook stera_compact
+		// "makebook stera"が書き出したjournalを定跡ファイルにまとめる。
+		if (token == "stera_compact")
+		{
+			MakeBook2021::SuperTeraBook st;
+			st.stera_compact(pos, is);
+			return 1;
+		}
+
 		// makebook stera_convert
 		// スーパーテラショック定跡コマンド("makebook stera")で生成した
 		// 定跡をテラショック化(思考エンジンで使う形の定跡に)変換する。
@@ -0,0 +1,990 @@
+﻿#include "../config.h"
+
+#if defined (ENABLE_MAKEBOOK_CMD) && (defined(EVAL_LEARN) || defined(YANEURAOU_ENGINE_DEEP))
+
+#include "book.h"
+#include "../misc.h"
+
+#include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <string_view>
+
+#if defined(_WIN32)
+#include <stdio.h>	// _getmaxstdio()
+#else
+#include <sys/resource.h>	// getrlimit()
+#endif
+
+using namespace std;
+
+// ----------------------------------
+//  makebook external_sort / external_merge
+// ----------------------------------
+
+// メモリに収まらない巨大な定跡ファイルのsort/mergeを外部ソート(external merge sort)で行う。
+//
+// 1) 定跡ファイルを先頭から読み、バッファがいっぱいになるごとに、その分を局面のsfen文字列順にsortして
+//    一時ファイル(run)に書き出す。sortと書き出しはworker threadで行う。
+// 2) runの数が多すぎる(同時に開くと読み込みバッファがメモリに収まらない)ときは、いくつかずつmergeしてrunの数を減らす。
+// 3) すべてのrunをk-way mergeして出力する。sfen文字列の範囲でthreadごとに分担してmergeし、
+//    threadごとの出力を最後に連結する。
+//
+// メモリ使用量は概ねbuffer_mbで指定した値に収まる。同時に開くファイルの数は、OSの上限(ulimit -n)に収まるようにする。
+// ファイルの読み書きに失敗したら、その時点で中断して一時ファイルを削除し、エラーを返す。
+// 出力は makebook sort / makebook merge と同じ規則で行う。
+// ・同じ局面(sfen文字列と手数が一致するもの)が同じ定跡ファイル内に複数あれば、指し手をマージする。
+// 　(MemoryBook::insert()と同じく、同じ指し手は後から出てきたもので置き換え、採択回数は合算する)
+// ・複数の定跡ファイルに同じ局面があれば、makebook mergeと同じ規則でどちらか一方を採用する。
+// ・手数違いの同一局面は、手数が最小のものだけを書き出す。(MemoryBook::write_book()と同じ)
+// ただし、sfen文字列の正規化はPosition::set()を経由せず、手駒の表記順だけを揃える。
+
+namespace Book
+{
+	namespace {
+
+		// 外部ソートの設定
+		struct ExternalSortOptions
+		{
+			// 使用するメモリの上限[byte]
+			size_t buffer_size = size_t(1024) * 1024 * 1024;
+
+			// 並列に処理するスレッド数
+			size_t threads = 1;
+
+			// 一時ファイルを書き出すフォルダ。空なら出力先と同じフォルダ。
+			string tmp_dir;
+
+			// 出力を書き出さない。(benchmark用)
+			bool discard_output = false;
+		};
+
+		// runを読み込むときの1ファイルあたりのバッファサイズ
+		constexpr size_t kReaderBufferSize = 256 * 1024;
+
+		// 最終mergeでrunの数が多いときに、kReaderBufferSizeから小さくするときの下限
+		constexpr size_t kMinReaderBufferSize = 16 * 1024;
+
+		// runのsparse indexの間隔(局面数)
+		constexpr size_t kSparseIndexInterval = 1024;
+
+		// 同時に開けるファイルの数の上限から、標準入出力や定跡ファイルなどの分として差し引いておく数
+		constexpr size_t kReservedFiles = 32;
+
+		// このプロセスで同時に開けるファイルの数
+		size_t max_open_files()
+		{
+#if defined(_WIN32)
+			// fopen()で同時に開けるファイルの数はCRTの上限で決まる。
+			return size_t(_getmaxstdio());
+#else
+			struct rlimit rl;
+			if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY)
+				return 1024;
+			return size_t(rl.rlim_cur);
+#endif
+		}
+
+		// 複数のthreadで処理したときの最初のエラー
+		struct FirstError
+		{
+			void set(const Tools::Result& r)
+			{
+				if (r.is_ok())
+					return;
+				lock_guard<mutex> lk(m);
+				if (result.is_ok())
+					result = r;
+			}
+
+			bool failed() const { lock_guard<mutex> lk(m); return result.is_not_ok(); }
+			Tools::Result get() const { lock_guard<mutex> lk(m); return result; }
+
+		private:
+			mutable mutex m;
+			Tools::Result result = Tools::Result::Ok();
+		};
+
+		// 定跡の1局面分
+		struct BookRecord
+		{
+			// 手数を除いたsfen文字列(手駒の表記は正規化済み)
+			string sfen;
+
+			// 手数
+			int ply = 0;
+
+			// この局面の指し手
+			vector<BookMove> moves;
+
+			// メモリ使用量の概算
+			size_t memory_size() const { return sizeof(BookRecord) + sfen.capacity() + moves.capacity() * sizeof(BookMove); }
+		};
+
+		// runファイル
+		struct RunFile
+		{
+			string filename;
+
+			// どの定跡ファイル(merge元)から作られたrunか。
+			size_t source;
+
+			// 局面数
+			u64 records = 0;
+
+			// kSparseIndexInterval局面ごとの、局面のsfen文字列とファイル上のoffset。
+			vector<pair<string, u64>> sparse_index;
+		};
+
+		// "sfen "の後ろのsfen文字列を、手数を除いた部分と手数とに分解する。
+		// 手駒の表記はPosition::sfen()と同じ順(先手、後手の順に、飛、角、金、銀、桂、香、歩)に揃える。
+		void normalize_sfen(const string& sfen, string& sfen_left, int& ply)
+		{
+			// 盤面、手番、手駒、手数に分解する。(巨大な定跡を読むのでistringstreamは使わない)
+			string_view fields[4];
+			size_t n_fields = 0;
+			for (size_t i = 0; i < sfen.size() && n_fields < 4; )
+			{
+				while (i < sfen.size() && sfen[i] == ' ')
+					++i;
+				size_t j = i;
+				while (j < sfen.size() && sfen[j] != ' ')
+					++j;
+				if (j > i)
+					fields[n_fields++] = string_view(sfen).substr(i, j - i);
+				i = j;
+			}
+			const string_view board = fields[0], turn = fields[1], hand = fields[2];
+			ply = 0;
+			for (char c : fields[3])
+				if (isdigit((unsigned char)c))
+					ply = ply * 10 + (c - '0');
+
+			// 手駒の枚数を数えなおす。
+			static const string kHandOrder = "RBGSNLPrbgsnlp";
+			int count[14] = {};
+			int n = 0;
+			for (char c : hand)
+			{
+				if (isdigit((unsigned char)c))
+					n = n * 10 + (c - '0');
+				else
+				{
+					auto idx = kHandOrder.find(c);
+					if (idx != string::npos)
+						count[idx] += std::max(n, 1);
+					n = 0;
+				}
+			}
+
+			string normalized_hand;
+			for (size_t i = 0; i < kHandOrder.size(); ++i)
+				if (count[i])
+				{
+					if (count[i] != 1)
+						normalized_hand += to_string(count[i]);
+					normalized_hand += kHandOrder[i];
+				}
+			if (normalized_hand.empty())
+				normalized_hand = "-";
+
+			sfen_left.assign(board.data(), board.size());
+			sfen_left += ' ';
+			sfen_left.append(turn.data(), turn.size());
+			sfen_left += ' ';
+			sfen_left += normalized_hand;
+		}
+
+		// 同じ局面の指し手のマージ。MemoryBook::insert(overwrite = true)と同じ。
+		void merge_moves(vector<BookMove>& to, const vector<BookMove>& from)
+		{
+			for (auto& bp : from)
+			{
+				auto it = std::find(to.begin(), to.end(), bp);
+				if (it == to.end())
+					to.push_back(bp);
+				else {
+					auto move_count = it->move_count;
+					*it = bp;
+					it->move_count += move_count;
+				}
+			}
+		}
+
+		// makebook mergeと同じ規則で、2つの定跡ファイルの同じ局面のどちらを採用するかを決める。
+		// 1) 登録されている候補手の数がゼロならこれは無効なのでもう片方
+		// 2) depthが深いほう
+		// 3) depthが同じならmulti pvが大きいほう(登録されている候補手が多いほう)
+		// lhs,rhsはsort済みであること。
+		bool prefer_lhs(const vector<BookMove>& lhs, const vector<BookMove>& rhs)
+		{
+			if (lhs.size() == 0) return false;
+			if (rhs.size() == 0) return true;
+			if (lhs[0].depth != rhs[0].depth) return lhs[0].depth > rhs[0].depth;
+			return lhs.size() >= rhs.size();
+		}
+
+		// 1局面を書き出す。MemoryBook::write_book()と同じ形式。書き出したbyte数をoffsetに加算する。
+		Tools::Result write_record(SystemIO::TextWriter& writer, const string& sfen, int ply, const vector<BookMove>& moves, u64& offset)
+		{
+			string line = "sfen " + sfen + ' ' + to_string(ply);
+			offset += line.size() + 2;
+			auto result = writer.WriteLine(line);
+			for (auto& bp : moves)
+			{
+				if (result.is_not_ok())
+					return result;
+
+				line = to_usi_string(bp.move) + ' ' + to_usi_string(bp.ponder) + ' '
+					+ std::to_string(bp.value) + " " + std::to_string(bp.depth) + " " + std::to_string(bp.move_count);
+				offset += line.size() + 2;
+				result = writer.WriteLine(line);
+			}
+			return result;
+		}
+
+		// writerをCloseして、書き出しのエラー(result)がなければCloseのエラーを返す。
+		Tools::Result close_writer(SystemIO::TextWriter& writer, const string& filename, Tools::Result result)
+		{
+			auto close_result = writer.Close();
+			if (result.is_ok())
+				result = close_result;
+			if (result.is_not_ok())
+				sync_cout << "Error! : can't write " << filename << " , " << result.to_string() << sync_endl;
+			return result;
+		}
+
+		// 定跡ファイル(run)を1局面ずつ読み込む。任意の位置にseekできる。
+		struct RecordReader
+		{
+			RecordReader(size_t buffer_size = kReaderBufferSize) : buffer(buffer_size) {}
+			~RecordReader() { Close(); }
+
+			Tools::Result Open(const string& filename)
+			{
+				Close();
+				fp = fopen(filename.c_str(), "rb");
+				if (fp == nullptr)
+					return Tools::Result(Tools::ResultCode::FileOpenError);
+				return Tools::Result::Ok();
+			}
+
+			void Close()
+			{
+				if (fp)
+					fclose(fp);
+				fp = nullptr;
+				read_size = cursor = 0;
+				has_pending = false;
+			}
+
+			// ファイルのoffsetの位置から読み込む。offsetは局面の先頭("sfen"の行)でなければならない。
+			void Seek(u64 offset)
+			{
+				SystemIO::fseek64(fp, size_t(offset), SEEK_SET);
+				read_size = cursor = 0;
+				has_pending = false;
+			}
+
+			// 読み込んだbyte数。(進捗表示用)
+			u64 bytes_read() const { return total_read; }
+
+			// 1局面読み込む。もう局面がなければfalseを返す。
+			bool Next(BookRecord& record)
+			{
+				// 局面の先頭の"sfen"の行を探す。
+				while (!has_pending)
+				{
+					if (!read_line(pending))
+						return false;
+					has_pending = pending.compare(0, 5, "sfen ") == 0;
+				}
+
+				normalize_sfen(pending.substr(5), record.sfen, record.ply);
+				record.moves.clear();
+				has_pending = false;
+
+				string line;
+				while (read_line(line))
+				{
+					if (line.compare(0, 5, "sfen ") == 0)
+					{
+						pending.swap(line);
+						has_pending = true;
+						break;
+					}
+
+					// 空行、バージョン識別文字列、コメント行は読み飛ばす。
+					if (line.empty() || line[0] == '#' || line.compare(0, 2, "//") == 0)
+						continue;
+
+					record.moves.push_back(BookMove::from_string(line));
+				}
+				return true;
+			}
+
+		private:
+			// 1行読み込む。改行コードは取り除く。
+			bool read_line(string& line)
+			{
+				line.clear();
+				bool found = false;
+				while (true)
+				{
+					if (cursor == read_size)
+					{
+						read_size = fp ? fread(buffer.data(), 1, buffer.size(), fp) : 0;
+						cursor = 0;
+						total_read += read_size;
+						if (read_size == 0)
+							break;
+					}
+					found = true;
+					const char* p = buffer.data() + cursor;
+					const char* nl = (const char*)memchr(p, '\n', read_size - cursor);
+					if (nl)
+					{
+						line.append(p, nl - p);
+						cursor += size_t(nl - p) + 1;
+						break;
+					}
+					line.append(p, read_size - cursor);
+					cursor = read_size;
+				}
+				while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t'))
+					line.pop_back();
+				return found;
+			}
+
+			FILE* fp = nullptr;
+			vector<char> buffer;
+			size_t read_size = 0, cursor = 0;
+			u64 total_read = 0;
+
+			// 先読みした次の局面の"sfen"の行
+			string pending;
+			bool has_pending = false;
+		};
+
+		// 局面のsort順。sfen文字列、手数の順。
+		bool record_less(const BookRecord& lhs, const BookRecord& rhs)
+		{
+			int c = lhs.sfen.compare(rhs.sfen);
+			return c != 0 ? c < 0 : lhs.ply < rhs.ply;
+		}
+
+		// sort済みの局面をrunファイルに書き出す。同じ局面(sfen文字列と手数が一致するもの)は指し手をマージする。
+		Tools::Result write_run(vector<BookRecord>& records, RunFile& run)
+		{
+			std::stable_sort(records.begin(), records.end(), record_less);
+
+			SystemIO::TextWriter writer;
+			auto result = writer.Open(run.filename);
+			if (result.is_not_ok())
+			{
+				sync_cout << "Error! : can't write " << run.filename << " , " << result.to_string() << sync_endl;
+				return result;
+			}
+
+			u64 offset = 0;
+			for (size_t i = 0; i < records.size() && result.is_ok(); )
+			{
+				size_t j = i + 1;
+				while (j < records.size() && records[j].sfen == records[i].sfen && records[j].ply == records[i].ply)
+					merge_moves(records[i].moves, records[j++].moves);
+
+				if (run.records % kSparseIndexInterval == 0)
+					run.sparse_index.emplace_back(records[i].sfen, offset);
+
+				result = write_record(writer, records[i].sfen, records[i].ply, records[i].moves, offset);
+				run.records++;
+				i = j;
+			}
+			return close_writer(writer, run.filename, result);
+		}
+
+		// runファイルのk-way merge。
+		// [lo,hi)の範囲のsfen文字列の局面を、sfen文字列ごとにまとめてon_groupに渡す。
+		// lo,hiが空文字列なら、それぞれ先頭、末尾まで。
+		// on_groupには、同じsfen文字列の局面が、手数、runの順に並べて渡される。(runの番号も一緒に渡される)
+		// reader_bufferは、runごとの読み込みバッファのサイズ。
+		// runが開けなかったり、on_groupがエラーを返したりしたら、そこで中断してそのエラーを返す。
+		Tools::Result merge_runs(const vector<RunFile>& runs, const vector<size_t>& run_ids, const string& lo, const string& hi,
+			size_t reader_buffer, const function<Tools::Result(vector<pair<size_t, BookRecord>>&)>& on_group)
+		{
+			vector<unique_ptr<RecordReader>> readers;
+			vector<BookRecord> heads(run_ids.size());
+
+			// 先頭の局面の比較。sfen文字列、手数、runの番号の順。priority_queueは大きいものから取り出すので逆にしておく。
+			auto greater = [&](size_t a, size_t b) {
+				int c = heads[a].sfen.compare(heads[b].sfen);
+				if (c != 0) return c > 0;
+				if (heads[a].ply != heads[b].ply) return heads[a].ply > heads[b].ply;
+				return run_ids[a] > run_ids[b];
+			};
+			priority_queue<size_t, vector<size_t>, decltype(greater)> queue(greater);
+
+			auto advance = [&](size_t i) {
+				while (readers[i]->Next(heads[i]))
+				{
+					if (!lo.empty() && heads[i].sfen < lo)
+						continue;
+					if (!hi.empty() && heads[i].sfen >= hi)
+						return;
+					queue.push(i);
+					return;
+				}
+			};
+
+			for (size_t i = 0; i < run_ids.size(); ++i)
+			{
+				auto& run = runs[run_ids[i]];
+				readers.emplace_back(make_unique<RecordReader>(reader_buffer));
+				auto result = readers[i]->Open(run.filename);
+				if (result.is_not_ok())
+				{
+					sync_cout << "Error! : can't read " << run.filename << " , " << result.to_string() << sync_endl;
+					return result;
+				}
+
+				// sparse indexから、lo未満の最後の局面の位置に移動する。
+				if (!lo.empty())
+				{
+					auto it = std::lower_bound(run.sparse_index.begin(), run.sparse_index.end(), lo,
+						[](const pair<string, u64>& e, const string& key) { return e.first < key; });
+					if (it != run.sparse_index.begin())
+						readers[i]->Seek((it - 1)->second);
+				}
+				advance(i);
+			}
+
+			vector<pair<size_t, BookRecord>> group;
+			while (!queue.empty())
+			{
+				// 同じsfen文字列の局面をすべて取り出す。
+				group.clear();
+				const string sfen = heads[queue.top()].sfen;
+				while (!queue.empty() && heads[queue.top()].sfen == sfen)
+				{
+					size_t i = queue.top();
+					queue.pop();
+					group.emplace_back(run_ids[i], std::move(heads[i]));
+					advance(i);
+				}
+				auto result = on_group(group);
+				if (result.is_not_ok())
+					return result;
+			}
+			return Tools::Result::Ok();
+		}
+
+		// ファイルの連結。dstの末尾にsrcの内容を追加する。
+		bool append_file(FILE* dst, const string& src)
+		{
+			FILE* fp = fopen(src.c_str(), "rb");
+			if (fp == nullptr)
+				return false;
+			vector<char> buf(4 * 1024 * 1024);
+			size_t n;
+			while ((n = fread(buf.data(), 1, buf.size(), fp)) != 0)
+				if (fwrite(buf.data(), 1, n, dst) != n)
+				{
+					fclose(fp);
+					return false;
+				}
+			fclose(fp);
+			return true;
+		}
+
+		// 外部ソート本体。
+		// sourcesの定跡ファイルを、sort(sourcesが1つ)もしくはmerge(sourcesが2つ以上)してdstに書き出す。
+		Tools::Result external_sort(const vector<string>& sources, const string& dst, const ExternalSortOptions& opt)
+		{
+			const size_t threads = std::max(opt.threads, size_t(1));
+			// ※　Path::GetDirectoryName()は、フォルダを含まないファイル名を渡すとそのファイル名を返すので、その場合はカレントフォルダにする。
+			const string dst_dir = Path::GetFileName(dst) == dst ? "" : Path::GetDirectoryName(dst);
+			const string tmp_dir = opt.tmp_dir.empty() ? dst_dir : opt.tmp_dir;
+			const string tmp_prefix = Path::Combine(tmp_dir, Path::GetFileName(dst));
+			size_t tmp_count = 0;
+			auto tmp_name = [&](const string& kind) { return tmp_prefix + "." + kind + to_string(tmp_count++) + ".tmp"; };
+
+			// 同時に開けるファイルの数
+			const size_t open_files = max_open_files();
+			const size_t file_budget = open_files > kReservedFiles * 2 ? open_files - kReservedFiles : open_files / 2;
+
+			sync_cout << "external sort : buffer = " << opt.buffer_size / (1024 * 1024) << "[MB] , threads = " << threads
+					  << " , max open files = " << open_files << " , tmp = " << tmp_prefix << ".*.tmp" << sync_endl;
+
+			// 一時ファイルの削除。エラーで中断したときにも呼び出す。
+			auto remove_runs = [](const vector<RunFile>& runs) {
+				for (auto& run : runs)
+					if (!run.filename.empty())
+						std::remove(run.filename.c_str());
+			};
+
+			FirstError error;
+
+			Timer timer;
+			timer.reset();
+
+			// --- 1) runの作成
+
+			vector<RunFile> runs;
+			u64 input_positions = 0;
+			{
+				// 作成中のもの1つと、worker threadが処理中のものthreads個とで、buffer_sizeに収める。
+				const size_t chunk_size = std::max(opt.buffer_size / (threads + 1), size_t(1024 * 1024));
+
+				// 読み込んだchunkをsortしてrunとして書き出すjob。
+				struct RunJob {
+					vector<BookRecord> records;
+					size_t run_id;
+					RunFile run;
+				};
+
+				// threads個のworker threadが、jobsからjobを取り出して処理する。
+				// jobsに積まれているものとworker threadが処理中のものの合計(pending_jobs)がthreads個を超えないようにflush()で待つ。
+				deque<RunJob> jobs;
+				mutex worker_mutex;
+				condition_variable worker_cv;
+				size_t pending_jobs = 0;
+				bool closing = false;
+
+				vector<thread> workers;
+				for (size_t t = 0; t < threads; ++t)
+					workers.emplace_back([&] {
+						unique_lock<mutex> lk(worker_mutex);
+						while (true)
+						{
+							worker_cv.wait(lk, [&] { return !jobs.empty() || closing; });
+							if (jobs.empty())
+								return;
+
+							RunJob job = std::move(jobs.front());
+							jobs.pop_front();
+							lk.unlock();
+
+							error.set(write_run(job.records, job.run));
+							job.records = vector<BookRecord>();
+
+							lk.lock();
+							runs[job.run_id] = std::move(job.run);
+							--pending_jobs;
+							worker_cv.notify_all();
+						}
+					});
+
+				auto flush = [&](vector<BookRecord>& chunk, size_t source) {
+					if (chunk.empty())
+						return;
+
+					unique_lock<mutex> lk(worker_mutex);
+					worker_cv.wait(lk, [&] { return pending_jobs < threads; });
+					++pending_jobs;
+
+					// runの番号は読み込み順に振る。worker threadはsort後に自分の番号のところに結果を書き戻す。
+					RunJob job;
+					job.run_id = runs.size();
+					runs.emplace_back();
+					job.run.filename = tmp_name("run");
+					job.run.source = source;
+					job.records = std::move(chunk);
+					chunk.clear();
+
+					jobs.emplace_back(std::move(job));
+					worker_cv.notify_all();
+				};
+
+				for (size_t source = 0; source < sources.size(); ++source)
+				{
+					RecordReader reader(4 * 1024 * 1024);
+					auto result = reader.Open(sources[source]);
+					if (result.is_not_ok())
+					{
+						sync_cout << "Error! : can't read " << sources[source] << sync_endl;
+						error.set(result);
+						break;
+					}
+					sync_cout << "read " << sources[source] << sync_endl;
+
+					vector<BookRecord> chunk;
+					size_t chunk_bytes = 0;
+					BookRecord record;
+					while (reader.Next(record))
+					{
+						++input_positions;
+						chunk_bytes += record.memory_size();
+						chunk.emplace_back(std::move(record));
+						record = BookRecord();
+						if (chunk_bytes >= chunk_size)
+						{
+							flush(chunk, source);
+							chunk_bytes = 0;
+							if (error.failed())
+								break;
+						}
+					}
+					if (error.failed())
+						break;
+					flush(chunk, source);
+				}
+
+				{
+					lock_guard<mutex> lk(worker_mutex);
+					closing = true;
+				}
+				worker_cv.notify_all();
+				for (auto& w : workers)
+					w.join();
+			}
+
+			if (error.failed())
+			{
+				remove_runs(runs);
+				return error.get();
+			}
+
+			auto elapsed1 = timer.elapsed() + 1;
+			sync_cout << "runs : " << runs.size() << " , positions = " << input_positions
+					  << " , time = " << elapsed1 << "[ms] , " << input_positions * 1000 / elapsed1 << " positions/sec" << sync_endl;
+
+			// --- 2) runの数が多すぎるなら、同じ定跡ファイルのrunどうしをいくつかずつmergeして減らす。
+
+			// 同時に開けるrunの数。すべてのthreadが同時にmergeしても、buffer_sizeと同時に開けるファイルの数に収まるように。
+			// (各threadは、fan_in個のrunと書き出し用のファイルを1つ開く)
+			// 3)の最終mergeも、runの数がfan_in以下になっていればthreads個のthreadで全runを開いてbuffer_sizeに収まる。
+			const size_t fan_in = std::max(std::min(opt.buffer_size / (threads * kReaderBufferSize), std::max(file_budget / threads, size_t(3)) - 1), size_t(2));
+
+			// fan_inが下限の2になったときでも、メモリと同時に開くファイルの数が収まるようにmergeするthreadの数を減らす。
+			const size_t reduce_threads = std::max(std::min({ threads, file_budget / (fan_in + 1), opt.buffer_size / (fan_in * kReaderBufferSize) }), size_t(1));
+
+			while (runs.size() > fan_in)
+			{
+				// 同じ定跡ファイルの、番号が連続するrunをfan_in個ずつまとめる。
+				vector<vector<size_t>> groups;
+				for (size_t i = 0; i < runs.size(); ++i)
+				{
+					if (groups.empty() || groups.back().size() >= fan_in || runs[groups.back().back()].source != runs[i].source)
+						groups.emplace_back();
+					groups.back().push_back(i);
+				}
+				if (groups.size() == runs.size())
+					break; // これ以上減らない
+
+				vector<RunFile> next(groups.size());
+				atomic<size_t> next_group{ 0 };
+				vector<thread> workers;
+				for (size_t t = 0; t < reduce_threads; ++t)
+					workers.emplace_back([&] {
+						for (size_t g; (g = next_group++) < groups.size() && !error.failed(); )
+						{
+							auto& run = next[g];
+							run.source = runs[groups[g][0]].source;
+							if (groups[g].size() == 1)
+							{
+								run = std::move(runs[groups[g][0]]);
+								continue;
+							}
+
+							{
+								static mutex name_mutex;
+								lock_guard<mutex> lk(name_mutex);
+								run.filename = tmp_name("run");
+							}
+
+							SystemIO::TextWriter writer;
+							auto result = writer.Open(run.filename);
+							if (result.is_not_ok())
+							{
+								sync_cout << "Error! : can't write " << run.filename << " , " << result.to_string() << sync_endl;
+								error.set(result);
+								break;
+							}
+
+							u64 offset = 0;
+							result = merge_runs(runs, groups[g], "", "", kReaderBufferSize, [&](vector<pair<size_t, BookRecord>>& group) {
+								// 同じ定跡ファイルのものなので、同じ局面は指し手をマージする。
+								for (size_t i = 0; i < group.size(); )
+								{
+									auto& r = group[i].second;
+									size_t j = i + 1;
+									while (j < group.size() && group[j].second.ply == r.ply)
+										merge_moves(r.moves, group[j++].second.moves);
+
+									if (run.records % kSparseIndexInterval == 0)
+										run.sparse_index.emplace_back(r.sfen, offset);
+									auto result = write_record(writer, r.sfen, r.ply, r.moves, offset);
+									if (result.is_not_ok())
+										return result;
+									run.records++;
+									i = j;
+								}
+								return Tools::Result::Ok();
+							});
+							result = close_writer(writer, run.filename, result);
+							if (result.is_not_ok())
+							{
+								error.set(result);
+								break;
+							}
+
+							// 削除したrunは、中断したときのremove_runs()の対象から外しておく。
+							for (auto id : groups[g])
+							{
+								std::remove(runs[id].filename.c_str());
+								runs[id].filename.clear();
+							}
+						}
+					});
+				for (auto& w : workers)
+					w.join();
+
+				if (error.failed())
+				{
+					remove_runs(runs);
+					remove_runs(next);
+					return error.get();
+				}
+
+				runs.swap(next);
+				sync_cout << "runs : " << runs.size() << sync_endl;
+			}
+
+			// 全runを同時に開くthreadの数。各threadは全runと書き出し用のファイルを1つ開くので、
+			// 全threadの読み込みバッファの合計がbuffer_sizeに、開くファイルの数が同時に開けるファイルの数に収まるように減らす。
+			// runの数を減らしきれなかったとき(定跡ファイルの数がfan_inより多いとき)は、1 threadでも収まらないことがあるので、
+			// そのときはrunごとの読み込みバッファを小さくする。
+			const size_t merge_threads = std::min({ threads, file_budget / (runs.size() + 1),
+				std::max(opt.buffer_size / (runs.size() * kReaderBufferSize), size_t(1)) });
+			if (merge_threads == 0)
+			{
+				sync_cout << "Error! : too many runs to merge at once. runs = " << runs.size() << " , max open files = " << open_files
+						  << " , merge fewer book files at a time or raise the limit (ulimit -n)." << sync_endl;
+				remove_runs(runs);
+				return Tools::Result(Tools::ResultCode::FileOpenError);
+			}
+			const size_t reader_buffer = std::max(std::min(opt.buffer_size / (merge_threads * runs.size()), kReaderBufferSize), kMinReaderBufferSize);
+
+			// --- 3) 全runのk-way merge
+
+			// sparse indexのsfen文字列を集めて、threadごとの担当範囲の境界を決める。
+			vector<string> splitters;
+			{
+				vector<string> keys;
+				for (auto& run : runs)
+					for (auto& e : run.sparse_index)
+						keys.push_back(e.first);
+				std::sort(keys.begin(), keys.end());
+				for (size_t t = 1; t < merge_threads && !keys.empty(); ++t)
+				{
+					auto& key = keys[keys.size() * t / merge_threads];
+					if (!key.empty() && (splitters.empty() || splitters.back() < key))
+						splitters.push_back(key);
+				}
+			}
+			const size_t parts = splitters.size() + 1;
+
+			vector<size_t> all_runs(runs.size());
+			for (size_t i = 0; i < runs.size(); ++i)
+				all_runs[i] = i;
+
+			vector<string> part_names(parts);
+			for (auto& name : part_names)
+				name = tmp_name("part");
+
+			atomic<u64> output_positions{ 0 };
+			vector<thread> workers;
+			for (size_t p = 0; p < parts; ++p)
+				workers.emplace_back([&, p] {
+					const string lo = p == 0 ? "" : splitters[p - 1];
+					const string hi = p == parts - 1 ? "" : splitters[p];
+
+					SystemIO::TextWriter writer;
+					if (!opt.discard_output)
+					{
+						auto result = writer.Open(part_names[p]);
+						if (result.is_not_ok())
+						{
+							sync_cout << "Error! : can't write " << part_names[p] << " , " << result.to_string() << sync_endl;
+							error.set(result);
+							return;
+						}
+					}
+
+					vector<BookMove> best, moves;
+					u64 offset = 0;
+					auto result = merge_runs(runs, all_runs, lo, hi, reader_buffer, [&](vector<pair<size_t, BookRecord>>& group) {
+						// 手数の若い順に、その手数の局面を調べて、指し手があれば書き出して終わり。
+						for (size_t i = 0; i < group.size(); )
+						{
+							const int ply = group[i].second.ply;
+							bool found = false;
+
+							// 定跡ファイルごとに指し手をマージしてから、makebook mergeの規則でどれを採用するか決める。
+							for (size_t j = i; j < group.size() && group[j].second.ply == ply; )
+							{
+								const size_t source = runs[group[j].first].source;
+								moves.clear();
+								for (; j < group.size() && group[j].second.ply == ply && runs[group[j].first].source == source; ++j)
+									merge_moves(moves, group[j].second.moves);
+								std::stable_sort(moves.begin(), moves.end());
+
+								// 先に指定された定跡ファイルのほうが優先。
+								if (!found || !prefer_lhs(best, moves))
+									best.swap(moves);
+								found = true;
+								i = j;
+							}
+
+							if (!best.empty())
+							{
+								if (!opt.discard_output)
+								{
+									auto result = write_record(writer, group[0].second.sfen, ply, best, offset);
+									if (result.is_not_ok())
+										return result;
+								}
+								output_positions++;
+								break;
+							}
+						}
+						return Tools::Result::Ok();
+					});
+					if (!opt.discard_output)
+						result = close_writer(writer, part_names[p], result);
+					error.set(result);
+				});
+			for (auto& w : workers)
+				w.join();
+
+			remove_runs(runs);
+
+			if (error.failed())
+			{
+				for (auto& name : part_names)
+					std::remove(name.c_str());
+				return error.get();
+			}
+
+			// threadごとの出力を連結する。
+			Tools::Result result = Tools::Result::Ok();
+			if (!opt.discard_output)
+			{
+				FILE* fp = fopen(dst.c_str(), "wb");
+				if (fp == nullptr)
+					result = Tools::Result(Tools::ResultCode::FileOpenError);
+				else
+				{
+					// バージョン識別用文字列
+					const char* header = "#YANEURAOU-DB2016 1.00\r\n";
+					fwrite(header, 1, strlen(header), fp);
+					for (auto& name : part_names)
+						if (!append_file(fp, name))
+							result = Tools::Result(Tools::ResultCode::FileWriteError);
+					if (fclose(fp) != 0)
+						result = Tools::Result(Tools::ResultCode::FileCloseError);
+				}
+				for (auto& name : part_names)
+					std::remove(name.c_str());
+			}
+
+			auto elapsed = timer.elapsed() + 1;
+			auto elapsed2 = elapsed - elapsed1 + 1;
+			sync_cout << "merge : positions = " << output_positions
+					  << " , time = " << elapsed2 << "[ms] , " << output_positions * 1000 / elapsed2 << " positions/sec" << endl
+					  << "total : input positions = " << input_positions << " , output positions = " << output_positions
+					  << " , time = " << elapsed << "[ms] , " << input_positions * 1000 / elapsed << " positions/sec" << sync_endl;
+
+			return result;
+		}
+
+		// コマンドの後ろに書かれたオプションの解析
+		// 例) buffer_mb 1024 threads 4 tmp_dir /tmp
+		void parse_options(istringstream& is, const string& first_token, ExternalSortOptions& opt)
+		{
+			string token = first_token;
+			do {
+				if (token == "buffer_mb")
+				{
+					size_t mb;
+					is >> mb;
+					opt.buffer_size = std::max(mb, size_t(1)) * 1024 * 1024;
+				}
+				else if (token == "threads")
+					is >> opt.threads;
+				else if (token == "tmp_dir")
+					is >> opt.tmp_dir;
+				else if (!token.empty())
+					sync_cout << "Warning! : unknown option " << token << sync_endl;
+			} while (is >> token);
+		}
+
+		bool is_option_token(const string& token)
+		{
+			return token == "buffer_mb" || token == "threads" || token == "tmp_dir";
+		}
+	}
+
+	// makebook external_sort / external_merge / external_bench コマンド
+	int makebook_external(Position& /*pos*/, istringstream& is, const string& token)
+	{
+		const bool sort  = token == "external_sort";
+		const bool merge = token == "external_merge";
+		const bool bench = token == "external_bench";
+		if (!(sort || merge || bench))
+			return 0;
+
+		ExternalSortOptions opt;
+		opt.threads = size_t(Options["Threads"]);
+
+		// ファイル名を読み込み、その後ろのオプションを解析する。
+		vector<string> files;
+		string t;
+		while (is >> t && !is_option_token(t))
+			files.push_back(t);
+		if (is_option_token(t))
+			parse_options(is, t, opt);
+
+		// sort : src dst , merge : src1 src2 ... dst , bench : src
+		const size_t min_files = bench ? 1 : merge ? 3 : 2;
+		if (files.size() < min_files || (!merge && files.size() > min_files))
+		{
+			sync_cout << "Error! : wrong number of book files." << sync_endl;
+			return 1;
+		}
+
+		string dst;
+		if (bench)
+		{
+			// benchmark用。出力は書き出さずに各段階の局面数/秒を表示する。
+			opt.discard_output = true;
+			dst = files[0] + ".bench";
+		}
+		else {
+			dst = files.back();
+			files.pop_back();
+		}
+
+		const string command = sort ? "sort" : merge ? "merge" : "bench";
+		string from;
+		for (auto& f : files)
+			from += " " + f;
+		sync_cout << "external " << command << " from" << from << (bench ? "" : " to " + dst) << sync_endl;
+
+		if (external_sort(files, dst, opt).is_not_ok())
+			sync_cout << "Error! : external " << command << " failed." << sync_endl;
+		else
+			sync_cout << "done!" << sync_endl;
+
+		return 1;
+	}
+}
+
+#endif // defined (ENABLE_MAKEBOOK_CMD) && (defined(EVAL_LEARN) || defined(YANEURAOU_ENGINE_DEEP))
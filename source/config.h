@@ -103,6 +103,18 @@
 // →　ConsiderationMode というエンジンオプションを用意したので、この機能は無効化する。
 
 
+// 置換表のClusterをCPUのcache lineと同じ64byteにして、1つのClusterに4つのTTEntryを持たせるか。
+// このとき、各TTEntryは64bitのhash key全体を(keyとデータのxorの形で)保持するので、
+// 16bitのkeyによる偽のhitが起きず、また、他のスレッドの書き込みと混ざったTTEntry(torn write)を検出できる。(lockless hashing)
+// 標準では、10byteのTTEntry×3 = 32byteのClusterで、keyは16bitである。
+// #define USE_TT_LOCKLESS
+
+// 置換表・NNUE・MovePicker・1手詰め・静止探索・定跡の呼び出し回数などをスレッドごとに集計するか。
+// "stats"コマンドで全スレッド合算の値を表示できる。(perf_counter.hを参照のこと)
+// 定義しなければ計測のコードは一切生成されない。
+// #define USE_PERF_COUNTERS
+
+
 // ---------------------
 //  評価関数関連の設定
 // ---------------------
@@ -161,7 +173,7 @@
 //#define USE_EVAL_LIST
 
 
-// 評価関数を計算したときに、それをHashTableに記憶しておく機能。KPPT評価関数においてのみサポート。
+// 評価関数を計算したときに、それをHashTableに記憶しておく機能。KPPT/KPP_KKPT/NNUE評価関数においてサポート。
 // #define USE_EVAL_HASH
 
 
@@ -262,6 +274,12 @@
 // ふかうら王でTensorRTを使う時はこちら。
 //#define TENSOR_RT
 
+// ふかうら王で、外部ライブラリを用いずにCPUだけで推論を行うときはこちら。("eval/deep/nn_native.h")
+//#define NATIVE_NN
+
+// ふかうら王で、推論を行わずに探索部だけの速度を計測するときはこちら。("eval/deep/nn_mock.h")
+//#define MOCK_NN
+
 
 // ---------------------
 // 探索パラメーターの自動調整用
@@ -392,9 +410,14 @@ constexpr int MAX_PLY_NUM = 246;
 	#define USE_EVAL
 	#define USE_ENTERING_KING_WIN
 
-	#if defined(YANEURAOU_ENGINE_KPPT) || defined(YANEURAOU_ENGINE_KPP_KKPT)
-		// EvalHashを用いるのは3駒型のみ。それ以外は差分計算用の状態が大きすぎてhitしたところでどうしようもない。
+	#if defined(YANEURAOU_ENGINE_KPPT) || defined(YANEURAOU_ENGINE_KPP_KKPT) || defined(YANEURAOU_ENGINE_NNUE)
+		// EvalHashを用いるのは3駒型とNNUE。
+		// NNUEではhitしてもaccumulatorの差分計算は行うが、affine層の計算を省略できる。
+		// ただし、NNUEではUSIオプションの"EvalHash"のデフォルトは0(用いない)である。
 		#define USE_EVAL_HASH
+	#endif
+
+	#if defined(YANEURAOU_ENGINE_KPPT) || defined(YANEURAOU_ENGINE_KPP_KKPT)
 
 		// 評価関数を共用して複数プロセス立ち上げたときのメモリを節約。(いまのところWindows限定)
 		#define USE_SHARED_MEMORY_IN_EVAL
@@ -795,6 +818,10 @@ constexpr bool pretty_jp = false;
 	#elif defined(TENSOR_RT)
 		#include "NvInferRuntimeCommon.h"
 		#define EVAL_TYPE_NAME "TensorRT" << std::to_string(getInferLibVersion()) << "-" << EVAL_DEEP
+	#elif defined(NATIVE_NN)
+		#define EVAL_TYPE_NAME "Native-" << EVAL_DEEP
+	#elif defined(MOCK_NN)
+		#define EVAL_TYPE_NAME "Mock-" << EVAL_DEEP
 	#endif
 
 #else
@@ -0,0 +1,258 @@
+﻿#include "cpu_features.h"
+
+// TARGET_CPUと、USE_AVX2などから推定される下位の拡張命令のシンボル(USE_SSE42など)を得るため。
+// ※　types.hなどは、TARGET_CPUの拡張命令を使うinline関数を含むのでincludeしない。
+#include "config.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)) && !defined(__EMSCRIPTEN__)
+#define CPU_FEATURES_X86
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+namespace CpuFeatures {
+
+	// CPUIDで調べた結果
+	struct Flags {
+		bool sse2 = false, ssse3 = false, sse41 = false, sse42 = false, popcnt = false;
+		bool avx2 = false, bmi2 = false, avxvnni = false;
+		bool avx512 = false /* F,BW,DQ,VLのすべて */, avx512vnni = false;
+	};
+
+#if defined(CPU_FEATURES_X86)
+
+	// cpuid命令。regs = {eax, ebx, ecx, edx}
+	static void cpuid(std::uint32_t leaf, std::uint32_t subleaf, std::uint32_t regs[4])
+	{
+#if defined(_MSC_VER)
+		int r[4];
+		__cpuidex(r, (int)leaf, (int)subleaf);
+		for (int i = 0; i < 4; ++i)
+			regs[i] = (std::uint32_t)r[i];
+#else
+		__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+	}
+
+	// OSがYMM/ZMMレジスタの退避に対応しているかを調べるためのxgetbv命令。
+	// (gccでは-mxsaveなしに_xgetbv()が使えないのでインラインアセンブラで書く)
+	static std::uint64_t xgetbv0()
+	{
+#if defined(_MSC_VER)
+		return _xgetbv(0);
+#else
+		std::uint32_t eax, edx;
+		__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+		return ((std::uint64_t)edx << 32) | eax;
+#endif
+	}
+
+	static Flags detect()
+	{
+		Flags f;
+		std::uint32_t r[4];
+
+		cpuid(0, 0, r);
+		const std::uint32_t max_leaf = r[0];
+		if (max_leaf < 1)
+			return f;
+
+		cpuid(1, 0, r);
+		f.sse2   = (r[3] >> 26) & 1;
+		f.ssse3  = (r[2] >>  9) & 1;
+		f.sse41  = (r[2] >> 19) & 1;
+		f.sse42  = (r[2] >> 20) & 1;
+		f.popcnt = (r[2] >> 23) & 1;
+		const bool osxsave = (r[2] >> 27) & 1;
+		const bool avx     = (r[2] >> 28) & 1;
+
+		// AVX系の命令は、OSがそのレジスタの退避に対応していなければ使えない。
+		const std::uint64_t xcr0 = osxsave ? xgetbv0() : 0;
+		const bool os_avx     = avx && (xcr0 & 0x06) == 0x06;
+		const bool os_avx512  = os_avx && (xcr0 & 0xe0) == 0xe0;
+
+		if (max_leaf < 7)
+			return f;
+
+		cpuid(7, 0, r);
+		f.avx2       = os_avx && ((r[1] >> 5) & 1);
+		f.bmi2       = (r[1] >> 8) & 1;
+		f.avx512     = os_avx512
+			&& ((r[1] >> 16) & 1)  // AVX512F
+			&& ((r[1] >> 17) & 1)  // AVX512DQ
+			&& ((r[1] >> 30) & 1)  // AVX512BW
+			&& ((r[1] >> 31) & 1); // AVX512VL
+		f.avx512vnni = f.avx512 && ((r[2] >> 11) & 1);
+
+		cpuid(7, 1, r);
+		f.avxvnni    = f.avx2 && ((r[0] >> 4) & 1);
+
+		return f;
+	}
+
+#else
+	static Flags detect() { return Flags(); }
+#endif
+
+	// 一度だけ調べれば良い。
+	static const Flags& flags()
+	{
+		static const Flags f = detect();
+		return f;
+	}
+
+	std::string detected()
+	{
+		const auto& f = flags();
+		std::string s;
+		auto append = [&](bool b, const char* name) { if (b) s += std::string(s.empty() ? "" : " ") + name; };
+		append(f.avx512vnni, "AVX512VNNI");
+		append(f.avx512    , "AVX512");
+		append(f.avxvnni   , "AVXVNNI");
+		append(f.avx2      , "AVX2");
+		append(f.bmi2      , "BMI2");
+		append(f.sse42     , "SSE4.2");
+		append(f.sse41     , "SSE4.1");
+		append(f.ssse3     , "SSSE3");
+		append(f.sse2      , "SSE2");
+		append(f.popcnt    , "POPCNT");
+		return s.empty() ? "(none)" : s;
+	}
+
+	const char* best_target()
+	{
+#if defined(CPU_FEATURES_X86)
+		const auto& f = flags();
+		return f.avx512vnni        ? "AVX512VNNI"
+			:  f.avx512            ? "AVX512"
+			:  f.avx2 && f.bmi2    ? "AVX2"
+			:  f.sse42             ? "SSE42"
+			:  f.sse41             ? "SSE41"
+			:  f.ssse3             ? "SSSE3"
+			:  f.sse2              ? "SSE2"
+			:                        "NO_SSE";
+#else
+		return "";
+#endif
+	}
+
+#if defined(USE_CPU_DISPATCH)
+
+	Kernel best_kernel()
+	{
+		// AVX512VNNIのKernelは-march=cascadelakeでコンパイルしているので、BMI2なども使われうる。
+		const auto& f = flags();
+		return f.avx512vnni && f.bmi2 ? KERNEL_AVX512VNNI
+			:  f.avx2                 ? KERNEL_AVX2
+			:                           KERNEL_SSE42;
+	}
+
+	const char* kernel_name(Kernel k)
+	{
+		static const char* const names[KERNEL_NB] = { "SSE42", "AVX2", "AVX512VNNI" };
+		return names[k];
+	}
+
+	static Kernel& selected_kernel()
+	{
+		static Kernel k = best_kernel();
+		return k;
+	}
+
+	Kernel kernel() { return selected_kernel(); }
+
+	bool select_kernel(const std::string& name)
+	{
+		Kernel k = best_kernel();
+		if (name != "Auto")
+		{
+			Kernel found = KERNEL_NB;
+			for (int i = 0; i < KERNEL_NB; ++i)
+				if (name == kernel_name(Kernel(i)))
+					found = Kernel(i);
+
+			// このCPUで動作しないものは選べない。
+			if (found > k)
+			{
+				selected_kernel() = k;
+				return false;
+			}
+			k = found;
+		}
+		selected_kernel() = k;
+		return true;
+	}
+
+#endif
+
+	// ビルド時に指定された拡張命令(USE_AVX2など)に実行中のCPUが対応しているかを調べて、
+	// 対応していなければ、不正な命令で落ちる前にその旨を出力して終了する。
+	// ※　他の翻訳単位の静的な変数の初期化よりも先に呼び出される。まだstd::coutなどは使えないので、
+	// 　printf()で出力する。また、他の翻訳単位と共有するinline関数(std::stringなど)も使わないこと。
+	static void check_target()
+	{
+#if defined(CPU_FEATURES_X86)
+		const auto& f = flags();
+		char missing[128] = "";
+		size_t len = 0;
+		auto require = [&](bool b, const char* name) {
+			if (b)
+				return;
+			if (len)
+				missing[len++] = ' ';
+			while (*name)
+				missing[len++] = *name++;
+			missing[len] = '\0';
+		};
+
+#if defined(USE_VNNI) && defined(USE_AVX512)
+		require(f.avx512vnni, "AVX512VNNI");
+#elif defined(USE_VNNI)
+		require(f.avxvnni, "AVXVNNI");
+#endif
+#if defined(USE_AVX512)
+		require(f.avx512, "AVX512");
+#endif
+#if defined(USE_AVX2)
+		require(f.avx2, "AVX2");
+#endif
+#if defined(USE_BMI2)
+		require(f.bmi2, "BMI2");
+#endif
+#if defined(USE_SSE42)
+		require(f.sse42 && f.popcnt, "SSE4.2");
+#elif defined(USE_SSE41)
+		require(f.sse41, "SSE4.1");
+#elif defined(USE_SSSE3)
+		require(f.ssse3, "SSSE3");
+#elif defined(USE_SSE2)
+		require(f.sse2, "SSE2");
+#endif
+
+		if (!len)
+			return;
+
+		printf("info string Error! : this binary was built for TARGET_CPU = " TARGET_CPU
+			" , but this CPU does not support %s , use a binary built with TARGET_CPU = %s\n", missing, best_target());
+		fflush(stdout);
+		exit(EXIT_FAILURE);
+#endif
+	}
+
+	// check_target()を、他の翻訳単位の静的な変数の初期化よりも先に呼び出す。
+#if defined(_MSC_VER)
+#pragma warning(disable : 4073) // initializers put in library initialization area
+#pragma init_seg(lib)
+	static const bool target_checked = (check_target(), true);
+#else
+	__attribute__((constructor(101))) static void check_target_at_startup() { check_target(); }
+#endif
+
+} // namespace CpuFeatures
@@ -0,0 +1,48 @@
+﻿#ifndef CPU_FEATURES_H_INCLUDED
+#define CPU_FEATURES_H_INCLUDED
+
+#include <string>
+
+#include "config.h"
+
+// --------------------
+//  CPU拡張命令の判定
+// --------------------
+
+// 実行中のCPUが対応している拡張命令をCPUIDで調べる。
+// x86/x64以外の環境では何も検出されない。
+//
+// ビルド時に指定した拡張命令(TARGET_CPU)にCPUが対応していない場合、他の翻訳単位の静的な変数の初期化で
+// 不正な命令を実行して落ちることがあるので、cpu_features.cppでは、それらよりも先に判定を行い、
+// 対応していなければその旨を出力して終了する。
+// そのため、cpu_features.cppはTARGET_CPUの拡張命令を使わずにコンパイルする。(Makefile , YaneuraOu.vcxproj)
+
+namespace CpuFeatures {
+	// 実行中のCPUが対応している拡張命令を"AVX512VNNI AVX512 AVX2 BMI2 SSE4.2 …"のように列挙した文字列を返す。
+	std::string detected();
+
+	// 実行中のCPUで動作する最上位のTARGET_CPU(Makefileで指定するもの)の名前を返す。
+	// x86/x64以外の環境では空の文字列を返す。
+	const char* best_target();
+
+#if defined(USE_CPU_DISPATCH)
+	// TARGET_CPU = DISPATCHのときに、命令セットごとにコンパイルしてある計算部分(NNUEの評価関数など)の種類。
+	// 上位の命令セットほど後ろ。
+	enum Kernel { KERNEL_SSE42, KERNEL_AVX2, KERNEL_AVX512VNNI, KERNEL_NB };
+
+	// 実行中のCPUで動作する最上位のKernelを返す。
+	Kernel best_kernel();
+
+	// 使用するKernel。select_kernel()で変更するまではbest_kernel()。
+	Kernel kernel();
+
+	// 使用するKernelを名前("SSE42","AVX2","AVX512VNNI")で指定する。"Auto"ならbest_kernel()。
+	// 実行中のCPUで動作しないものや、該当しない名前が指定されたときはbest_kernel()にしてfalseを返す。
+	bool select_kernel(const std::string& name);
+
+	// Kernelの名前
+	const char* kernel_name(Kernel k);
+#endif
+}
+
+#endif // CPU_FEATURES_H_INCLUDED
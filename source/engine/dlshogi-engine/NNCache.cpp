@@ -0,0 +1,165 @@
+﻿#include "NNCache.h"
+
+#if defined(YANEURAOU_ENGINE_DEEP)
+
+#include <cstring>
+#include <algorithm>
+
+#include "Node.h"
+#include "../../misc.h"
+
+namespace dlshogi
+{
+	namespace {
+
+	// レコードの先頭部分。このあとにchild_num個のu16(量子化したnnrate)が続く。
+	struct RecordHeader
+	{
+		Key          key;
+		float        value;
+		ChildNumType child_num;
+	};
+
+	// child_num個の指し手を持つレコードのサイズ[byte]。8の倍数に切り上げておく。
+	constexpr u64 record_bytes(u64 child_num)
+	{
+		return (sizeof(RecordHeader) + child_num * sizeof(u16) + 7) & ~(u64)7;
+	}
+
+	} // namespace
+
+	// size_mb[MB]のメモリを確保して、中身をクリアする。
+	void NNCache::resize(size_t size_mb_)
+	{
+		static_assert(((u64)1 << (64 - 58)) == SHARD_NUM, "SHARD_NUM must match shard_of()");
+
+		if (size_mb_ != size_mb)
+		{
+			size_mb = size_mb_;
+			shards.reset();
+			shard_bytes = 0;
+
+			if (size_mb == 0)
+				return;
+
+			const u64 bytes_per_shard = (u64)size_mb * 1024 * 1024 / SHARD_NUM;
+
+			// indexは、平均的なレコード(指し手80個程度で176byte)1つあたり1要素あれば十分なので、
+			// 128byteあたり1要素にしておく。(メモリの1/16程度)
+			u64 index_num = 1;
+			while (index_num * 2 <= bytes_per_shard / 128)
+				index_num *= 2;
+
+			index_mask  = index_num - 1;
+			shard_bytes = (bytes_per_shard - index_num * sizeof(u64)) & ~(u64)7;
+
+			shards = std::make_unique<Shard[]>(SHARD_NUM);
+			for (size_t i = 0; i < SHARD_NUM; ++i)
+			{
+				// ring bufferは、書き込む前に読むことはないのでゼロクリア不要。
+				shards[i].buffer = std::unique_ptr<u8[]>(new u8[shard_bytes]);
+				shards[i].index  = std::make_unique<u64[]>(index_num);
+
+				// indexが0を指していても無効になるように、2周分進めておく。
+				shards[i].write_pos = shard_bytes * 2;
+			}
+			return;
+		}
+
+		clear();
+	}
+
+	// 保存されている内容をすべて破棄する。
+	void NNCache::clear()
+	{
+		if (!enabled())
+			return;
+
+		// 書き込み位置をring bufferの次の周の先頭から、さらに1周進める。
+		// こうすれば、これまでに書き込んだレコードはすべて無効になる。
+		for (size_t i = 0; i < SHARD_NUM; ++i)
+		{
+			auto& shard = shards[i];
+			std::lock_guard<std::mutex> lk(shard.mutex);
+			shard.write_pos = (shard.write_pos / shard_bytes + 2) * shard_bytes;
+		}
+	}
+
+	// keyの局面がcacheにあれば、nodeの各ChildNodeのnnrateを設定して、valueにその局面のvalueを代入してtrueを返す。
+	bool NNCache::probe(Key key, Node* node, float& value)
+	{
+		if (!enabled())
+			return false;
+
+		const ChildNumType child_num = node->child_num;
+		u16 rates[MAX_MOVES];
+
+		{
+			auto& shard = shard_of(key);
+			std::lock_guard<std::mutex> lk(shard.mutex);
+
+			// 上書きされたレコードを指しているなら無効。
+			const u64 pos = index_of(shard, key);
+			if (shard.write_pos - pos > shard_bytes)
+				return false;
+
+			const u8* record = &shard.buffer[pos % shard_bytes];
+			RecordHeader header;
+			std::memcpy(&header, record, sizeof(header));
+
+			// 指し手の数も一致しているか確認しておく。(GenerateAllLegalMovesの設定が変わった時など)
+			if (header.key != key || header.child_num != child_num)
+				return false;
+
+			value = header.value;
+			std::memcpy(rates, record + sizeof(RecordHeader), child_num * sizeof(u16));
+		}
+
+		ChildNode* uct_child = node->child.get();
+		for (ChildNumType i = 0; i < child_num; ++i)
+			uct_child[i].nnrate = rates[i] * (1.0f / 65535.0f);
+
+		return true;
+	}
+
+	// keyの局面に対するNNの結果を保存する。
+	void NNCache::store(Key key, const Node* node, float value)
+	{
+		if (!enabled())
+			return;
+
+		const ChildNumType child_num = node->child_num;
+		const u64 bytes = record_bytes(child_num);
+		if (bytes > shard_bytes)
+			return;
+
+		// lockの外で量子化しておく。
+		u16 rates[MAX_MOVES];
+		const ChildNode* uct_child = node->child.get();
+		for (ChildNumType i = 0; i < child_num; ++i)
+			rates[i] = (u16)(std::clamp(uct_child[i].nnrate, 0.0f, 1.0f) * 65535.0f + 0.5f);
+
+		RecordHeader header;
+		header.key       = key;
+		header.value     = value;
+		header.child_num = child_num;
+
+		auto& shard = shard_of(key);
+		std::lock_guard<std::mutex> lk(shard.mutex);
+
+		// ring bufferの末尾をまたぐなら、次の周の先頭から書く。
+		u64 pos = shard.write_pos;
+		if (pos % shard_bytes + bytes > shard_bytes)
+			pos = (pos / shard_bytes + 1) * shard_bytes;
+
+		u8* record = &shard.buffer[pos % shard_bytes];
+		std::memcpy(record, &header, sizeof(header));
+		std::memcpy(record + sizeof(RecordHeader), rates, child_num * sizeof(u16));
+
+		shard.write_pos = pos + bytes;
+		index_of(shard, key) = pos;
+	}
+
+} // namespace dlshogi
+
+#endif // defined(YANEURAOU_ENGINE_DEEP)
@@ -0,0 +1,85 @@
+﻿#ifndef __NNCACHE_H_INCLUDED__
+#define __NNCACHE_H_INCLUDED__
+#include "../../config.h"
+
+#if defined(YANEURAOU_ENGINE_DEEP)
+
+#include <mutex>
+#include <memory>
+#include "../../types.h"
+#include "dlshogi_types.h"
+
+namespace dlshogi
+{
+	struct Node;
+
+	// NNの推論結果(各指し手のnnrateとvalue)を、局面のhash key(Position::key())をkeyとして保存しておくcache。
+	// 探索木の別の経路で出現した局面(transposition)や、前回の探索で評価済みの局面を、
+	// もう一度NNに渡さずに済ませるためのもの。
+	// ※　Position::key()は手駒も含んだhash keyなので、盤面と手駒と手番が同じ局面が同じkeyになる。
+	//
+	// ・メモリ量は固定(エンジンオプションの"NN_CacheSize"[MB])で、古いものから上書きされていく。
+	// ・複数の探索スレッドから同時にアクセスされるので、keyによってSHARD_NUM個のshardに分けて、shardごとにlockする。
+	// ・各shardは、レコード(key , value , 指し手ごとのnnrate)を順番に書き込んでいくring buffer。
+	//   指し手の数によってレコードの長さが異なるのでring bufferにしてある。keyからレコードの位置はdirect mapのindexで引く。
+	// ・nnrateは16bitに量子化して保存する。
+	class NNCache
+	{
+	public:
+		// size_mb[MB]のメモリを確保して、中身をクリアする。0ならメモリを開放して、cacheを使わない。
+		// 以前と同じサイズであれば、確保しなおさずにクリアだけ行う。
+		void resize(size_t size_mb);
+
+		// 保存されている内容をすべて破棄する。
+		// ring bufferの書き込み位置を1周以上進めるだけなので、メモリのクリアはしない。
+		void clear();
+
+		// cacheを使う設定になっているか。
+		bool enabled() const { return shard_bytes != 0; }
+
+		// keyの局面がcacheにあれば、nodeの各ChildNodeのnnrateを設定して、valueにその局面のvalueを代入してtrueを返す。
+		// nodeはExpandNode()済みであること。
+		bool probe(Key key, Node* node, float& value);
+
+		// keyの局面に対するNNの結果を保存する。
+		// nodeの各ChildNodeのnnrateと、その局面のvalueを保存する。
+		void store(Key key, const Node* node, float value);
+
+	private:
+		// shardの数
+		static constexpr size_t SHARD_NUM = 64;
+
+		struct alignas(64) Shard
+		{
+			std::mutex mutex;
+
+			// レコードを書き込むring buffer。
+			std::unique_ptr<u8[]> buffer;
+
+			// keyに対応するレコードの位置(write_posと同じく、ring bufferを周回した分も含めたbyte位置)
+			std::unique_ptr<u64[]> index;
+
+			// 次にレコードを書き込む位置。ring bufferを周回した分も含めたbyte位置。
+			// write_pos - shard_bytes より前の位置のレコードは、上書きされているので無効。
+			u64 write_pos;
+		};
+
+		Shard& shard_of(Key key) { return shards[(u64)key >> 58]; }
+		u64& index_of(Shard& shard, Key key) { return shard.index[(u64)key & index_mask]; }
+
+		std::unique_ptr<Shard[]> shards;
+
+		// 1つのshardのring bufferのサイズ[byte]
+		u64 shard_bytes = 0;
+
+		// Shard::indexの要素数 - 1
+		u64 index_mask = 0;
+
+		// 確保しているメモリ量[MB]
+		size_t size_mb = 0;
+	};
+
+} // namespace dlshogi
+
+#endif // defined(YANEURAOU_ENGINE_DEEP)
+#endif // ndef __NNCACHE_H_INCLUDED__
@@ -1,5 +1,8 @@
 ﻿#include "Node.h"
 #if defined(YANEURAOU_ENGINE_DEEP)
+#include <algorithm>
+#include <chrono>
+#include <vector>
 #include "../../misc.h"
 
 namespace dlshogi
@@ -8,57 +11,109 @@ namespace dlshogi
 
 	// 引数のmoveで指定した子ノード以外の子ノードをすべて開放する。
 	// 前回探索した局面からmoveの指し手を選んだ局面の以外の情報を開放するのに用いる。
-	Node* Node::ReleaseChildrenExceptOne(NodeGarbageCollector* gc, const Move move)
+	// ※　他の子ノードは参照を外すだけ。メモリはNodeArenaに残る。
+	Node* Node::ReleaseChildrenExceptOne(const Move move)
 	{
 		if (child_num > 0 && child_nodes) {
-			bool found = false;
 			for (int i = 0; i < child_num; ++i)
 			{
 				auto& uct_child = child[i];
-				auto& child_node = child_nodes[i];
 				if (uct_child.move == move) {
-					found = true;
 					// 子ノードへのedgeは見つかっているけど実体がまだ。
-					if (!child_node)
-	                    // 新しいノードを作成する
-	                    child_node = std::make_unique<Node>();
+					if (!child_nodes[i])
+						// 新しいノードを作成する
+						if (!CreateChildNode(i))
+							return nullptr;
 
 					// 0番目の要素に移動させる。
 					if (i != 0) {
 						child[0] = std::move(uct_child);
-						child_nodes[0] = std::move(child_node);
+						child_nodes[0] = child_nodes[i];
 					}
-				}
-				else {
-					// 子ノードを削除（ガベージコレクタに追加）
-					if (child_node)
-						gc->AddToGcQueue(std::move(child_node));
+
+					// 子ノードを1つにする。
+					child_num = 1;
+					return child_nodes[0].get();
 				}
 			}
 
-			if (found) {
-				// 子ノードを1つにする。
-				child_num = 1;
-				return child_nodes[0].get();
-			}
-			else {
-				// 子ノードが見つからなかった場合、新しいノードを作成する
-				CreateSingleChildNode(move);
-				InitChildNodes();
-				return (child_nodes[0] = std::make_unique<Node>()).get();
-			}
+			// 子ノードが見つからなかった場合、新しいノードを作成する
+			CreateSingleChildNode(move);
+			InitChildNodes();
+			return child && child_nodes ? CreateChildNode(0) : nullptr;
 		}
 		else {
 			// 子ノード未展開、または子ノードへのポインタ配列が未初期化の場合
 			CreateSingleChildNode(move);
 			// 子ノードへのポインタ配列を初期化する
 			InitChildNodes();
-			return (child_nodes[0] = std::make_unique<Node>()).get();
+			return child && child_nodes ? CreateChildNode(0) : nullptr;
 		}
 	}
 
+	// --- class NodeHashTable
+
+	// posの局面のNodeを返す。なければ作成して、createdをtrueにする。
+	ArenaPtr<Node> NodeHashTable::FindOrCreate(Position& pos, bool& created)
+	{
+		const HASH_KEY key = pos.long_key();
+		PackedSfen sfen;
+		pos.sfen_pack(sfen);
+
+		auto& shard = shards[(u64)(Key)key >> 58];
+		std::lock_guard<std::mutex> lock(shard.mutex);
+
+		auto& entry = shard.nodes[key];
+		if (!entry.node)
+		{
+			entry.sfen = sfen;
+			entry.node = arena_new<Node>();
+			created = true;
+			return entry.node;
+		}
+
+		// hash keyの衝突。この局面のNodeは共有せずに作る。
+		if (entry.sfen != sfen)
+		{
+			created = true;
+			return arena_new<Node>();
+		}
+
+		created = false;
+		return entry.node;
+	}
+
+	// Nodeの数
+	size_t NodeHashTable::size() const
+	{
+		size_t sum = 0;
+		for (auto& shard : shards)
+		{
+			std::lock_guard<std::mutex> lock(shard.mutex);
+			sum += shard.nodes.size();
+		}
+		return sum;
+	}
+
 	// --- class NodeTree
 
+	NodeTree::NodeTree(NodeGarbageCollector* gc) : arena(std::make_unique<NodeArena>()), gc(gc)
+	{
+		node_arena = arena.get();
+	}
+
+	NodeTree::~NodeTree()
+	{
+		// コピー中なら終わるのを待つ。(コピー先は使わずに捨てる)
+		if (compact_thread.joinable())
+			compact_thread.join();
+
+		gc->AddToGcQueue(std::move(hash_table));
+
+		// NodeはすべてNodeArenaにあるので、NodeArenaごと開放する。
+		node_arena = nullptr;
+	}
+
 	// ゲーム開始局面からの手順を渡して、node tree内からこの局面を探す。
 	// もし見つかれば、node treeの再利用を試みる。
 	// 新しい位置が古い位置と同じゲームであるかどうかを返す。
@@ -67,6 +122,11 @@ namespace dlshogi
 	// ※　位置が完全に異なる場合、または以前よりも短い指し手がmovesとして与えられている場合は、falseを返す
 	bool NodeTree::ResetToPosition(const std::string& game_root_sfen , const std::vector<Move>& moves)
 	{
+		// 前回の探索の後に開始したコピーの終了を待つ。コピーしたのは前回の探索開始局面で指した手の先だけなので、
+		// 今回の局面がその手を指した先にある時だけ新しいNodeArenaに切り替える。
+		FinishCompaction(this->game_root_sfen == game_root_sfen
+			&& moves.size() > current_head_ply && moves[current_head_ply] == compacted_move);
+
 		// 前回思考した時とは異なるゲーム開始局面であるなら異なるゲームである。
 		// root nodeがまだ生成されていない
 
@@ -77,6 +137,15 @@ namespace dlshogi
 			this->game_root_sfen = game_root_sfen;
 		}
 
+		// DAGの時は、前回の探索のNodeは再利用しない。
+		// 他の経路から合流しているNodeがあるので、ReleaseChildrenExceptOne()のように一部だけを開放することができない。
+		// (NNの評価結果はNNCacheに残っているので、NNを呼び出しなおさずに済む)
+		if (hash_table)
+		{
+			DeallocateTree();
+			return false;
+		}
+
 		// 前回の探索開始局面
 		Node* old_head = current_head;
 
@@ -94,9 +163,16 @@ namespace dlshogi
 			// 一つ前のnode
 			prev_head = current_head;
 
-			// 現在の局面に到達する経路だけを残して他のノードを開放する。(なければNodeを作るのでnullptrになることはない)
-			current_head = current_head->ReleaseChildrenExceptOne(gc,move);
-			
+			// 現在の局面に到達する経路だけを残して他のノードを開放する。(なければNodeを作る)
+			current_head = current_head->ReleaseChildrenExceptOne(move);
+
+			// 前回の探索でNodeArenaを使い切っていて、Nodeが作れなかった。ゲーム木を作り直してからやりなおす。
+			if (!current_head)
+			{
+				DeallocateTree();
+				return ResetToPosition(game_root_sfen, moves);
+			}
+
 			// 途中でold_headが見つかったならseen_old_headをtrueに。
 			// ここを超えて進んだなら、前回の探索結果が使える。
 			seen_old_head |= old_head == current_head;
@@ -111,10 +187,12 @@ namespace dlshogi
 			if (prev_head)
 			{
 				ASSERT_LV3(prev_head->child_num == 1);
-				auto& prev_uct_child_node = prev_head->child_nodes[0];
-				gc->AddToGcQueue(std::move(prev_uct_child_node));
-				prev_uct_child_node = std::make_unique<Node>();
-				current_head = prev_uct_child_node.get();
+				current_head = prev_head->CreateChildNode(0);
+				if (!current_head)
+				{
+					DeallocateTree();
+					return ResetToPosition(game_root_sfen, moves);
+				}
 			}
 			else {
 				// 1手前の局面が存在しないということは、現在の局面が開始局面なので、
@@ -123,17 +201,190 @@ namespace dlshogi
 			}
 		}
 
+		// 前回指した手とは異なる手順に進んでコピーが使えなかった時や、前回の探索でNodeArenaが一杯になって
+		// コピーを開始しなかった時は、ここで捨てたNodeの分を回収してから探索を開始する。
+		// (一杯になった時は、回収しておかないと今回の探索がすぐに中断してしまう)
+		if (!hash_table && (arena->UsedBytes() > NextCompactBytes() || arena->IsFull()))
+		{
+			CompactArena(MOVE_NONE);
+			FinishCompaction(true);
+		}
+
+		current_head_ply = moves.size();
+
 		return seen_old_head;
 	}
 
+	// UCT_Transposition(DAG)にするかの設定。変更された時はゲーム木を開放する。
+	void NodeTree::SetTransposition(bool flag)
+	{
+		FinishCompaction(false);
+
+		if (flag == (hash_table != nullptr))
+			return;
+
+		DeallocateTree();
+		hash_table = flag ? std::make_unique<NodeHashTable>() : nullptr;
+	}
+
 	void NodeTree::DeallocateTree()
 	{
-		// ゲームツリーを保持しているならそれを開放する。
-		// ※　AddToGcQueue()はnullptrを渡しても良いことになっている。
-		gc->AddToGcQueue(std::move(game_root_node));
+		// DAGの時のhash tableは、要素数が多いとその開放に時間がかかるのでGCで開放する。
+		if (hash_table)
+		{
+			gc->AddToGcQueue(std::move(hash_table));
+			hash_table = std::make_unique<NodeHashTable>();
+		}
+
+		// NodeはすべてNodeArenaにあるので、NodeArenaごと開放する。(O(1))
+		arena->Reset();
+
+		game_root_node = arena_new<Node>();
+
+		// 空のNodeArenaからNode1つが確保できないのは、メモリが足りない。探索できないので終了する。
+		if (!game_root_node)
+			Tools::exit();
 
-		game_root_node = std::make_unique<Node>();
 		current_head = game_root_node.get();
+		compacted_bytes = arena->UsedBytes();
+	}
+
+	// 前回のCompactArena()からNodeArenaの使用量がこれ以上増えたらCompactArena()する。
+	u64 NodeTree::NextCompactBytes() const
+	{
+		// 残したNodeの2倍以上になったらコピーすることにすれば、コピーにかかる時間はならせばO(1)。
+		//
+		// ※　コピーしている間は古いNodeArenaとコピー先のNodeArenaが両方ともメモリ上にあるので、
+		//     メモリ使用量のピークは、探索木が実際に使っている量の2倍を超える。
+		//     (古い方は、この値に1回の探索で増えた分を足した量まで、コピー先は残したNodeの分)
+		//     UCT_NodeLimitはcurrent_headの訪問回数(≒1回の探索で増えるNode数)の上限なので、
+		//     物理メモリは、UCT_NodeLimit個のNodeに必要な量の最大4倍程度を見込んでおくこと。
+		//     NodeArenaのindexの範囲(Nodeは2^32個)は、UCT_NodeLimitの上限(10億)でも、
+		//     この値 + 1回の探索で増える分(最大30億個)が収まるので足りる。
+		return std::max(compacted_bytes * 2, MIN_COMPACT_BYTES);
+	}
+
+	// 探索が終わった時に呼び出す。捨てたNodeが溜まっていれば、別スレッドでコピーし始める。
+	void NodeTree::StartCompaction(Move move)
+	{
+		// DAGの時は、毎回DeallocateTree()するので不要。(複数の親から辿れるNodeがあるのでこのコピーではダメ)
+		if (hash_table || !game_root_node || compact_thread.joinable())
+			return;
+
+		// 一杯になっている時は、次のResetToPosition()で不要なNodeを捨ててからコピーする。
+		if (arena->UsedBytes() <= NextCompactBytes() || arena->IsFull())
+			return;
+
+		compacted_move = move;
+		compact_thread = std::thread([this, move]() { CompactArena(move); });
+	}
+
+	// CompactArena()が終わるのを待って、useなら新しいNodeArenaに切り替える。
+	void NodeTree::FinishCompaction(bool use)
+	{
+		if (compact_thread.joinable())
+			compact_thread.join();
+
+		if (!compacted_arena)
+			return;
+
+		// 使わない方のNodeArenaのメモリの開放は時間がかかることがあるのでGCで行う。
+		if (!use)
+		{
+			gc->AddToGcQueue(std::move(compacted_arena));
+			return;
+		}
+
+		gc->AddToGcQueue(std::move(arena));
+
+		arena = std::move(compacted_arena);
+		node_arena = arena.get();
+		game_root_node.index = compacted_root;
+		current_head = (Node*)arena->NodePtr(compacted_head);
+		compacted_bytes = arena->UsedBytes();
+	}
+
+	// game_root_nodeから辿れるNodeをcompacted_arenaにコピーする。
+	// ※　このスレッドから見たnode_arenaは古いNodeArenaのままなので、コピー先はnew_arenaから直接確保する。
+	void NodeTree::CompactArena(Move move)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		auto new_arena = std::make_unique<NodeArena>();
+
+		// コピー元のNodeのindexと、コピー先のNodeのindexの格納先。
+		// 深い木でもstack overflowしないように、再帰ではなくstackを用いる。
+		struct Item
+		{
+			NodeIndex src;
+			NodeIndex* dst;
+		};
+		std::vector<Item> stack;
+
+		NodeIndex new_root = 0, new_head = 0;
+		stack.push_back({ game_root_node.index, &new_root });
+
+		// コピー先のメモリが確保できなかった。コピーはやめて、古いNodeArenaを使い続ける。(compacted_arenaはnullptrのまま)
+		auto fail = [&]() {
+			sync_cout << "info string Error! : failed to allocate memory for NodeArena compaction." << sync_endl;
+			gc->AddToGcQueue(std::move(new_arena));
+		};
+
+		while (!stack.empty())
+		{
+			const Item item = stack.back();
+			stack.pop_back();
+
+			const Node* src = (const Node*)arena->NodePtr(item.src);
+			const NodeIndex index = new_arena->AllocNode();
+			if (!index)
+				return fail();
+			Node* dst = new (new_arena->NodePtr(index)) Node();
+			dst->CopyStatsFrom(*src);
+			*item.dst = index;
+
+			if (src == current_head)
+				new_head = index;
+
+			ChildNode* dst_child = nullptr;
+			if (src->child)
+			{
+				// ReleaseChildrenExceptOne()でchild_numを減らしていることがあるので、child_numの分だけコピーする。
+				ChildNode* src_child = (ChildNode*)arena->Ptr(src->child.index);
+				dst->child.index = new_arena->Alloc(sizeof(ChildNode) * dst->child_num);
+				if (!dst->child)
+					return fail();
+				dst_child = (ChildNode*)new_arena->Ptr(dst->child.index);
+				for (ChildNumType i = 0; i < dst->child_num; ++i)
+				{
+					new (&dst_child[i]) ChildNode();
+					dst_child[i] = std::move(src_child[i]);
+				}
+			}
+
+			if (src->child_nodes)
+			{
+				const ArenaPtr<Node>* src_child_nodes = (const ArenaPtr<Node>*)arena->Ptr(src->child_nodes.index);
+				dst->child_nodes.index = new_arena->Alloc(sizeof(ArenaPtr<Node>) * dst->child_num);
+				if (!dst->child_nodes)
+					return fail();
+				ArenaPtr<Node>* dst_child_nodes = (ArenaPtr<Node>*)new_arena->Ptr(dst->child_nodes.index);
+				for (ChildNumType i = 0; i < dst->child_num; ++i)
+				{
+					new (&dst_child_nodes[i]) ArenaPtr<Node>();
+					// current_headでは、moveの子以外は次のResetToPosition()で捨てられるのでコピーしない。
+					if (src_child_nodes[i] && (src != current_head || move == MOVE_NONE || dst_child[i].move == move))
+						stack.push_back({ src_child_nodes[i].index, &dst_child_nodes[i].index });
+				}
+			}
+		}
+
+		ASSERT_LV3(new_head != 0);
+		compacted_arena = std::move(new_arena);
+		compacted_root  = new_root;
+		compacted_head  = new_head;
+
+		gc->gc_time_ns += (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
 	}
 
 }
@@ -5,8 +5,12 @@
 #if defined(YANEURAOU_ENGINE_DEEP)
 
 #include <thread>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
 #include "../../position.h"
 #include "dlshogi_types.h"
+#include "NodeArena.h"
 
 namespace dlshogi
 {
@@ -25,10 +29,6 @@ namespace dlshogi
 		ChildNode(Move move)
 			: move(move), move_count(0), win(0.0f), nnrate(0.0f){}
 
-		// ムーブコンストラクタ
-		ChildNode(ChildNode&& o) noexcept
-			: move(o.move), move_count(0), win(0.0f), nnrate(0.0f) {}
-
 		// ムーブ代入演算子
 		ChildNode& operator=(ChildNode&& o) noexcept {
 			move       = o.move;
@@ -72,42 +72,62 @@ namespace dlshogi
 
 	// 局面一つを表現する構造体
 	// dlshogiのuct_node_t
+	// ※　Node , ChildNodeはNodeArenaに確保する。デストラクタは呼び出されない。
 	struct Node
 	{
 		Node()
-			: move_count(NOT_EXPANDED), win(0), visited_nnrate(0.0f) , child_num(0) , select_interval(0){}
+			: move_count(NOT_EXPANDED), win(0), visited_nnrate(0.0f) , child_num(0) , select_interval(0) , value(0.0f){}
 
 		// 子ノード作成
+		// NodeArenaを使い切っていて作れなかった時はnullptrを返す。
 		Node* CreateChildNode(int i) {
-			return (child_nodes[i] = std::make_unique<Node>()).get();
+			return (child_nodes[i] = arena_new<Node>()).get();
 		}
 
 		// 子ノード1つのみで初期化する。
+		// NodeArenaを使い切っていて作れなかった時はchild_num == 0になる。
 		void CreateSingleChildNode(const Move move)
 		{
+			child_num = 0;
+			child = arena_new_array<ChildNode>(1);
+			if (!child)
+				return;
 			child_num = 1;
-			child = std::make_unique<ChildNode[]>(1);
 			child[0].move = move;
 		}
 
 		// 候補手の展開
 		// pos          : thisに対応する展開する局面
 		// generate_all : 歩の不成なども生成する。
-		void ExpandNode(const Position* pos, bool generate_all)
+		// 返し値 : NodeArenaを使い切っていて展開できなかった時はfalse。(その時はchild_num == 0のままになる)
+		bool ExpandNode(const Position* pos, bool generate_all)
 		{
 			// 全合法手を生成する。
 
 			if (generate_all)
 				// 歩の不成などを含めて生成する。
-				expand_node<LEGAL_ALL>(pos);
+				return expand_node<LEGAL_ALL>(pos);
 			else
 				// 歩の不成は生成しない。
-				expand_node<LEGAL>(pos);
+				return expand_node<LEGAL>(pos);
 		}
 
 		// 子ノードへのポインタ配列の初期化
+		// NodeArenaを使い切っていて確保できなかった時はchild_nodesはnullptrのままになる。
 		void InitChildNodes() {
-			child_nodes = std::make_unique<std::unique_ptr<Node>[]>(child_num);
+			child_nodes = arena_new_array<ArenaPtr<Node>>(child_num);
+		}
+
+		// 探索の統計情報(child , child_nodes以外)をoからコピーする。NodeTree::CompactArena()で用いる。
+		void CopyStatsFrom(const Node& o)
+		{
+			move_count      = (NodeCountType)o.move_count;
+			win             = (WinType)o.win;
+			visited_nnrate  = (float)o.visited_nnrate;
+			child_num       = o.child_num;
+			last_best_child = o.last_best_child;
+			select_interval = o.select_interval;
+			value           = o.value;
 		}
 
 		// 引数のmoveで指定した子ノード以外の子ノードをすべて開放する。
@@ -118,9 +138,10 @@ namespace dlshogi
 		// ある局面から2手先の局面が送られてきた時に、2手前から現局面に遷移する以外の指し手を
 		// 削除したいので、そのためにこの関数がある。
 		//
-		// ※　その時のガーベジコレクションは別スレッドで行われる。
+		// ※　開放した子ノードはNodeArenaに残ったままになる。(NodeTree::CompactArena()で回収する)
 		// 子ノードが一つも見つからない時は、新しいノードを作成する。
-		Node* ReleaseChildrenExceptOne(NodeGarbageCollector* gc, Move move);
+		// NodeArenaを使い切っていて作れなかった時はnullptrを返す。
+		Node* ReleaseChildrenExceptOne(Move move);
 
 		// このノードがexpand(展開)されたあと、評価関数を呼び出しをするが、それが完了しているかのフラグ。
 		// ※　実際は、フラグ用の変数がもったいないので、move_countを使いまわしている。
@@ -155,47 +176,98 @@ namespace dlshogi
 		ChildNumType child_num;
 
 		// 子ノード(に至るedge)
-		// child_numの数だけ、ChildNodeをnewして保持している。
-		std::unique_ptr<ChildNode[]> child;
+		// child_numの数だけ、ChildNodeをNodeArenaに確保して保持している。
+		ArenaPtr<ChildNode> child;
 
 		// 子ノードへのポインタ配列
-		// もったいないので必要になってからnewする。
+		// もったいないので必要になってからNodeArenaに確保する。
 		// 展開した子ノード以外はnullptrのまま。
-		std::unique_ptr<std::unique_ptr<Node>[]> child_nodes;
+		// ※　UCT_Transposition(DAG)の時は、同じ局面のNodeを複数の親から指すことがある。
+		ArenaPtr<ArenaPtr<Node>> child_nodes;
 
 		// SelectMaxUcbChild()の高速化のために前回選択した子ノードのindexを記憶しておく。
 		// 調べる間隔は、select_intervalにする。
 		u16 last_best_child;
 		u16 select_interval;
 
+		// この局面のNNのvalue(手番側から見た期待勝率)。EvalNode()で設定される。
+		// 詰んでいる局面なら0.0f、詰みを見つけた局面なら1.0f。
+		// UCT_Transposition(DAG)の時に、他の経路から来た訪問の期待勝率を求めるのに用いる。
+		float value;
+
 	private:
 
 		// ExpandNode()の下請け。生成する指し手の種類を指定できる。
 		template <MOVE_GEN_TYPE T>
-		void expand_node(const Position* pos)
+		bool expand_node(const Position* pos)
 		{
 			MoveList<T> ml(*pos);
+			if (ml.size() == 0)
+				return true;
+
+			child = arena_new_array<ChildNode>(ml.size());
+			if (!child)
+				return false;
 
 			// 子ノードの数 = 生成された指し手の数
 			child_num = (ChildNumType)ml.size();
 
-			child = std::make_unique<ChildNode[]>(child_num);
 			auto* child_node = child.get();
 			for (auto m : ml)
 				(child_node++)->move = m.move;
+			return true;
 		}
 	};
 
+	// NodeはNodeArenaにNodeUnit単位で確保する。
+	static_assert(sizeof(Node) <= sizeof(NodeUnit) && alignof(Node) <= alignof(NodeUnit), "Node must fit in NodeUnit");
+
+	// UCT_Transposition(DAG)の時に、局面のhash key(Position::long_key())からNodeを引くためのhash table。
+	// 手順前後で同じ局面に到達した時に、同じNodeを共有する。(探索木ではなくDAGになる)
+	// ・複数の探索スレッドから同時にアクセスされるので、keyによってSHARD_NUM個のshardに分けて、shardごとにlockする。
+	// ・Nodeを作る時にだけ参照する。探索中に子ノードを辿る時は、Node::child_nodes[]を用いる。
+	// ・hash keyが衝突した別の局面のNodeを共有すると、そのNodeの指し手でdo_move()した時に非合法手になりうるので、
+	// 　局面のPackedSfenも格納しておいて、hitした時に照合する。
+	class NodeHashTable
+	{
+	public:
+		// posの局面のNodeを返す。なければ作成して、createdをtrueにする。
+		// hash keyが同じでも局面が異なる(衝突した)時は、hash tableには登録せずに、共有しないNodeを作成して返す。
+		ArenaPtr<Node> FindOrCreate(Position& pos, bool& created);
+
+		// Nodeの数
+		size_t size() const;
+
+	private:
+		// shardの数
+		static constexpr size_t SHARD_NUM = 64;
+
+		// hash tableのentry。sfenはhitした時の照合用。
+		struct Entry
+		{
+			PackedSfen     sfen;
+			ArenaPtr<Node> node;
+		};
+
+		struct alignas(64) Shard
+		{
+			mutable std::mutex mutex;
+			std::unordered_map<HASH_KEY, Entry> nodes;
+		};
+
+		Shard shards[SHARD_NUM];
+	};
+
 	// 前回探索した局面から2手進んだ局面かを判定するための情報を保持しておくためのNodeTree。
 	// 1つのゲームに対して1つのインスタンス。
 	class NodeTree
 	{
 	public:
 
-		NodeTree(NodeGarbageCollector* gc) : gc(gc){}
+		NodeTree(NodeGarbageCollector* gc);
 
 		// デストラクタではゲーム木を開放する。
-		~NodeTree() { DeallocateTree(); }
+		~NodeTree();
 
 		// ゲーム開始局面からの手順を渡して、node tree内からこの局面を探す。
 		// もし見つかれば、node treeの再利用を試みる。
@@ -208,16 +280,64 @@ namespace dlshogi
 		// 現在の探索開始局面の取得
 		Node* GetCurrentHead() const { return current_head; }
 
+		// UCT_Transposition(DAG)にするかの設定。変更された時はゲーム木を開放する。
+		void SetTransposition(bool flag);
+
+		// DAGの時のNodeのhash table。DAGでなければnullptr。
+		NodeHashTable* GetHashTable() const { return hash_table.get(); }
+
+		// NodeArenaが一杯になりそうで、探索を中断すべきか。
+		bool IsArenaFull() const { return arena->IsFull(); }
+
+		// 探索が終わった時に、探索開始局面で指す手moveを渡して呼び出す。捨てたNodeが溜まっていれば、
+		// 次の探索までの間に、別スレッドでgame_root_nodeから辿れるNode(ただしcurrent_headではmoveの子だけ)を
+		// 新しいNodeArenaにコピーし始める。
+		// 新しいNodeArenaへの切り替えは次のResetToPosition()で行うので、それまでは探索したNodeを参照して良い。
+		void StartCompaction(Move move);
+
 	private:
 		// game_root_nodeをrootとするゲーム木を開放する。
 		void DeallocateTree();
 
+		// CompactArena()が終わるのを待って、useなら新しいNodeArenaに切り替える。使わない方のNodeArenaはGCで開放する。
+		// 相手の手番の間にコピーは終わっているはずなので、普通は待つことはない。
+		void FinishCompaction(bool use);
+
+		// game_root_nodeから辿れるNodeをcompacted_arenaにコピーする。普通はcompact_threadで実行する。
+		// current_headの子はmoveの子だけをコピーする。(MOVE_NONEならすべて)
+		// ReleaseChildrenExceptOne()で捨てたNodeの分のメモリを回収するためのもの。
+		void CompactArena(Move move);
+
+		// 前回のCompactArena()からNodeArenaの使用量がこれ以上増えたらCompactArena()する。
+		// 最低でもMIN_COMPACT_BYTES。
+		u64 NextCompactBytes() const;
+		static constexpr u64 MIN_COMPACT_BYTES = u64(64) * 1024 * 1024;
+
+		// CompactArena()を実行するスレッド
+		std::thread compact_thread;
+
+		// CompactArena()のコピー先のNodeArenaと、そこでのgame_root_node , current_headのNode
+		std::unique_ptr<NodeArena> compacted_arena;
+		NodeIndex compacted_root = 0, compacted_head = 0;
+
+		// StartCompaction()で渡された、current_headで指す手
+		Move compacted_move = MOVE_NONE;
+
+		// current_headの局面の、game_root_nodeからの手数
+		size_t current_head_ply = 0;
+
 		// 探索開始局面(現在のroot局面)
 		Node* current_head = nullptr;
 
 		// ゲーム木のroot node = ゲームの開始局面
 		// ※　dlshogiでは、gamebegin_node_という変数名
-		std::unique_ptr<Node> game_root_node;
+		ArenaPtr<Node> game_root_node;
+
+		// ゲーム木のNodeを確保しているNodeArena。node_arenaはこれを指す。
+		std::unique_ptr<NodeArena> arena;
+
+		// 前回のCompactArena()(またはDeallocateTree())の直後のNodeArenaの使用量[byte]
+		u64 compacted_bytes = 0;
 
 		// ゲーム開始局面
 		// ※　dlshogiではhistory_starting_pos_key_というKey型の変数
@@ -225,6 +345,9 @@ namespace dlshogi
 
 		// dlshogiではGCはglobalになっているが、NodeTreeからも使えるようにしておく。
 		NodeGarbageCollector* gc;
+
+		// DAGの時のNodeのhash table。
+		std::unique_ptr<NodeHashTable> hash_table;
 	};
 
 	// 定期的に走るガーベジコレクタ。
@@ -242,14 +365,22 @@ namespace dlshogi
 		// この間隔ごとにGCを走らせる。
 		const int kGCIntervalMs = 100;
 
-		// GC対象に追加する。ここから辿れるNode,ChildNodeはすべて開放する。
-		// また、Nodeは循環していないものとする。
-		// また、node == nullptrなら何もせずにreturnする。
-		void AddToGcQueue(std::unique_ptr<Node> node) {
-			if (!node) return;
+		// GC対象に追加する。NodeArenaが確保したメモリをすべて開放する。
+		// arena == nullptrなら何もせずにreturnする。
+		void AddToGcQueue(std::unique_ptr<NodeArena> arena) {
+			if (!arena) return;
 
 			std::lock_guard<std::mutex> lock(gc_mutex);
-			subtrees_to_gc.emplace_back(std::move(node));
+			arenas_to_gc.emplace_back(std::move(arena));
+		}
+
+		// DAGの時のhash tableをGC対象に追加する。
+		// table == nullptrなら何もせずにreturnする。
+		void AddToGcQueue(std::unique_ptr<NodeHashTable> table) {
+			if (!table) return;
+
+			std::lock_guard<std::mutex> lock(gc_mutex);
+			tables_to_gc.emplace_back(std::move(table));
 		}
 
 		~NodeGarbageCollector() {
@@ -266,26 +397,41 @@ namespace dlshogi
 		// コンストラクタで起動させ、デストラクタで終了する感じ。
 		void set_thread_id(size_t thread_id) { next_thread_id = (int)thread_id; }
 
+		// 開放したNodeArenaとhash tableの数と、開放にかかった時間[ns]。"bench mcts"で表示する。
+		// ※　NodeTree::CompactArena()の時間も、ここに加算される。
+		std::atomic<u64> gc_subtrees{ 0 };
+		std::atomic<u64> gc_time_ns{ 0 };
+
 	private:
 		// ガーベジ用のスレッドがkGCIntervalMs[ms]ごとに実行するガーベジ本体。
 		void GarbageCollect()
 		{
 			while (!stop.load()) {
 
-				// Node will be released in destructor when mutex is not locked.
-				std::unique_ptr<Node> node_to_gc;
+				// mutexをunlockしてから開放する。
+				std::unique_ptr<NodeArena> arena_to_gc;
+				std::unique_ptr<NodeHashTable> table_to_gc;
 				{
-					// Lock the mutex and move last subtree from subtrees_to_gc_ into
-					// node_to_gc.
 					std::lock_guard<std::mutex> lock(gc_mutex);
-					if (subtrees_to_gc.empty()) return;
-					node_to_gc = std::move(subtrees_to_gc.back());
-					// node_to_gcにmoveしておけば、このスコープを抜けるときにまずgc_mutexがunlockされて、
-					// そのさらに一つ外のスコープでnode_to_gcのデストラクタが呼び出されて、
-					// unique_ptrなどで保持しているノードが数珠つなぎに開放される。LC0の手法。
-
-					subtrees_to_gc.pop_back();
+					if (!tables_to_gc.empty()) {
+						table_to_gc = std::move(tables_to_gc.back());
+						tables_to_gc.pop_back();
+					}
+					else {
+						if (arenas_to_gc.empty()) return;
+						arena_to_gc = std::move(arenas_to_gc.back());
+						arenas_to_gc.pop_back();
+					}
 				}
+
+				// --- やねうら王独自拡張
+
+				// 開放にかかった時間を計測しておく。
+				const auto start = std::chrono::steady_clock::now();
+				arena_to_gc.reset();
+				table_to_gc.reset();
+				gc_time_ns += (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+				++gc_subtrees;
 			}
 		}
 
@@ -307,12 +453,15 @@ namespace dlshogi
 			};
 		}
 
-		// subtrees_to_gc を変更する時のmutex
+		// arenas_to_gc , tables_to_gc を変更する時のmutex
 		mutable std::mutex gc_mutex;
 
-		// GC対象のTree。ここから数珠つなぎに開放していく。
+		// GC対象のNodeArena。(NodeTree::CompactArena()でコピーし終わったもの)
 		// 一度にそんなにたくさん積まれないので、そこまで大きなコンテナにはならない。
-	    std::vector<std::unique_ptr<Node>> subtrees_to_gc;
+		std::vector<std::unique_ptr<NodeArena>> arenas_to_gc;
+
+		// GC対象のhash table。(DAGの時)
+		std::vector<std::unique_ptr<NodeHashTable>> tables_to_gc;
 
 		std::atomic<bool> stop{ false };
 		std::thread gc_thread;
@@ -0,0 +1,135 @@
+﻿#include "NodeArena.h"
+#if defined(YANEURAOU_ENGINE_DEEP)
+#include "../../misc.h"
+
+namespace dlshogi
+{
+	NodeArena* node_arena = nullptr;
+
+	namespace {
+		// epochの発行用。
+		std::atomic<u64> epoch_counter{ 0 };
+
+		// 探索スレッドごとに切り出したblock。Nodeの領域用と配列の領域用。
+		thread_local ArenaCursor node_cursor , array_cursor;
+	}
+
+	// --- ArenaRegion
+
+	template <typename Unit, int CHUNK_BITS, size_t MAX_CHUNKS>
+	ArenaRegion<Unit, CHUNK_BITS, MAX_CHUNKS>::ArenaRegion() : chunks(new std::atomic<Unit*>[MAX_CHUNKS])
+	{
+		for (size_t i = 0; i < MAX_CHUNKS; ++i)
+			chunks[i].store(nullptr, std::memory_order_relaxed);
+		Reset();
+	}
+
+	template <typename Unit, int CHUNK_BITS, size_t MAX_CHUNKS>
+	ArenaRegion<Unit, CHUNK_BITS, MAX_CHUNKS>::~ArenaRegion()
+	{
+		for (size_t i = 0; i < MAX_CHUNKS; ++i)
+			delete[] chunks[i].load(std::memory_order_relaxed);
+	}
+
+	// units個のunitを確保して、先頭のunitのindexを返す。
+	template <typename Unit, int CHUNK_BITS, size_t MAX_CHUNKS>
+	u64 ArenaRegion<Unit, CHUNK_BITS, MAX_CHUNKS>::Alloc(u64 units, ArenaCursor& cursor, u64 epoch)
+	{
+		ASSERT_LV3(units <= BLOCK_UNITS);
+
+		if (cursor.epoch != epoch || cursor.pos + units > cursor.end)
+		{
+			// 新しいblockを切り出す。(前のblockの残りは捨てる)
+			const u64 block = used.fetch_add(BLOCK_UNITS, std::memory_order_relaxed);
+			const size_t chunk = size_t(block >> CHUNK_BITS);
+
+			// chunkの先頭のblockなら、次のchunkを前もって確保しておく。
+			// 確保できなければfull()になるので、探索部はそれを見て探索を中断する。このchunkの残りは、中断するまでの予備。
+			if ((block & (CHUNK_UNITS - 1)) == 0 && (chunk + 1 >= MAX_CHUNKS || !AllocChunk(chunk + 1)))
+			{
+				if (!is_full.exchange(true, std::memory_order_relaxed))
+					sync_cout << "info string NodeArena is full. The search is interrupted." << sync_endl;
+			}
+
+			// 予備まで使い切った。探索の中断が間に合わなかった。
+			// ※　通常は、full()になってから探索が中断するまでに予備のchunkを使い切ることはない。
+			// nullptrを表す0を返す。呼び出し元はその探索経路を破棄して、探索はfull()を見て中断する。
+			if (chunk >= MAX_CHUNKS || !AllocChunk(chunk))
+			{
+				is_full.store(true, std::memory_order_relaxed);
+				if (!is_exhausted.exchange(true, std::memory_order_relaxed))
+					sync_cout << "info string Error! : failed to allocate memory for NodeArena. Reduce UCT_NodeLimit." << sync_endl;
+				return 0;
+			}
+
+			cursor.epoch = epoch;
+			cursor.pos   = block == 0 ? 1 : block; // index 0はnullptrを表すので使わない。
+			cursor.end   = block + BLOCK_UNITS;
+		}
+
+		const u64 index = cursor.pos;
+		cursor.pos += units;
+		return index;
+	}
+
+	// chunk番目のchunkを確保する。確保できなければfalseを返す。
+	// chunkの先頭のblockでなくとも、chunkの確保が終わっていないことがあるので、すでに確保されていればそれを使う。
+	template <typename Unit, int CHUNK_BITS, size_t MAX_CHUNKS>
+	bool ArenaRegion<Unit, CHUNK_BITS, MAX_CHUNKS>::AllocChunk(size_t chunk)
+	{
+		if (chunks[chunk].load(std::memory_order_acquire) != nullptr)
+			return true;
+
+		std::lock_guard<std::mutex> lock(chunk_mutex);
+		if (chunks[chunk].load(std::memory_order_relaxed) != nullptr)
+			return true;
+
+		auto* mem = new (std::nothrow) Unit[CHUNK_UNITS];
+		if (mem == nullptr)
+			return false;
+
+		chunks[chunk].store(mem, std::memory_order_release);
+		return true;
+	}
+
+	// 確保したものをすべて開放する。chunkのメモリは開放せずに次に使う。
+	template <typename Unit, int CHUNK_BITS, size_t MAX_CHUNKS>
+	void ArenaRegion<Unit, CHUNK_BITS, MAX_CHUNKS>::Reset()
+	{
+		used.store(0, std::memory_order_relaxed);
+		is_full.store(false, std::memory_order_relaxed);
+		is_exhausted.store(false, std::memory_order_relaxed);
+	}
+
+	// --- NodeArena
+
+	NodeArena::NodeArena()
+	{
+		Reset();
+	}
+
+	NodeArena::~NodeArena() {}
+
+	// Nodeを1つ確保して、そのindexを返す。
+	NodeIndex NodeArena::AllocNode()
+	{
+		return NodeIndex(nodes.Alloc(1, node_cursor, epoch));
+	}
+
+	// bytes[byte]のメモリを確保して、そのindexを返す。
+	ArenaIndex NodeArena::Alloc(size_t bytes)
+	{
+		const u64 units = (bytes + sizeof(ArenaUnit) - 1) / sizeof(ArenaUnit);
+		return ArenaIndex(arrays.Alloc(units, array_cursor, epoch));
+	}
+
+	// 確保したものをすべて開放する。chunkのメモリは開放せずに次に使う。
+	void NodeArena::Reset()
+	{
+		nodes.Reset();
+		arrays.Reset();
+		epoch = ++epoch_counter;
+	}
+}
+
+#endif // defined(YANEURAOU_ENGINE_DEEP)
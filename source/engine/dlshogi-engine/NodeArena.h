@@ -0,0 +1,202 @@
+﻿#ifndef __NODEARENA_H_INCLUDED__
+#define __NODEARENA_H_INCLUDED__
+#include "../../config.h"
+
+#if defined(YANEURAOU_ENGINE_DEEP)
+
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <new>
+#include "../../types.h"
+
+namespace dlshogi
+{
+	struct Node;
+
+	// NodeArenaに確保したNodeを指すindex。Node単位。0はnullptrの意味。
+	// Node単位なので、32bitでもUCT_NodeLimitの上限(1000000000)より多くのNodeを指せる。
+	typedef u32 NodeIndex;
+
+	// NodeArenaに確保した配列(ChildNodeの配列、子ノードへのindexの配列)を指すindex。ArenaUnit(16byte)単位。0はnullptrの意味。
+	// 配列はNodeより大きいので64bit。(Nodeあたり2つしかないので、子ノードへのindexの配列ほどはメモリに影響しない)
+	typedef u64 ArenaIndex;
+
+	// NodeArenaの確保の単位
+	struct alignas(16) ArenaUnit { u8 data[16]; };
+
+	// NodeArenaのNodeの確保の単位。Node.hでsizeof(Node)がこれに収まることをstatic_assertしている。
+	struct alignas(16) NodeUnit { u8 data[48]; };
+
+	// 探索スレッドごとに切り出したblock。[pos,end)が未使用。
+	// epochが、そのNodeArenaの現在のepochと異なるなら無効。
+	struct ArenaCursor
+	{
+		u64 epoch = 0;
+		u64 pos = 0, end = 0;
+	};
+
+	// NodeArenaのなかの、Unit単位で確保する1つの領域。
+	// ・メモリは(1 << CHUNK_BITS)個のUnitからなるchunk単位で必要になった時に確保する。
+	// ・次のchunkも前もって確保しておく。確保できなかった時(chunkの数の上限に達したか、メモリが足りない時)は
+	//   full()がtrueになるので、探索を中断させる。中断するまでの間は、確保済みのchunkの残りから確保する。
+	// ・中断が間に合わずにその残りも使い切った時は、0(nullptr)を返す。呼び出し元は、その探索経路を破棄すること。
+	template <typename Unit, int CHUNK_BITS, size_t MAX_CHUNKS>
+	class ArenaRegion
+	{
+	public:
+		// 1つのchunkのunit数
+		static constexpr u64 CHUNK_UNITS = u64(1) << CHUNK_BITS;
+
+		// 探索スレッドが一度に切り出すunit数。blockはchunkの境界を跨がない。
+		static constexpr u64 BLOCK_UNITS = 4096;
+
+		ArenaRegion();
+		~ArenaRegion();
+
+		// units個のunitを確保して、先頭のunitのindexを返す。確保できなければ0を返す。
+		u64 Alloc(u64 units, ArenaCursor& cursor, u64 epoch);
+
+		// indexの指すunit
+		Unit* Ptr(u64 index) const {
+			return chunks[index >> CHUNK_BITS].load(std::memory_order_relaxed) + (index & (CHUNK_UNITS - 1));
+		}
+
+		// 確保したものをすべて開放する。chunkのメモリは開放せずに次に使う。
+		void Reset();
+
+		// 確保済みのメモリ量[byte]
+		u64 UsedBytes() const { return used.load(std::memory_order_relaxed) * sizeof(Unit); }
+
+		// 次のchunkが確保できなかった。
+		bool full() const { return is_full.load(std::memory_order_relaxed); }
+
+	private:
+		// chunk番目のchunkを確保する。確保できなければfalseを返す。
+		bool AllocChunk(size_t chunk);
+
+		// 探索スレッドに切り出したunit数。(index 0はnullptrを表すので、最初のunitは使わない)
+		std::atomic<u64> used;
+
+		std::atomic<bool> is_full;
+
+		// 予備のchunkも使い切った。(エラーメッセージを1度だけ出すためのもの)
+		std::atomic<bool> is_exhausted;
+
+		// chunkを確保する時のmutex
+		std::mutex chunk_mutex;
+
+		std::unique_ptr<std::atomic<Unit*>[]> chunks;
+	};
+
+	// Node , ChildNode , 子ノードへのindexの配列を確保するためのメモリ領域。
+	//
+	// ・Nodeとそれ以外(配列)は別の領域に確保する。
+	//   Nodeは、NodeUnit単位の32bitのindex(NodeIndex)で参照する。(最大約43億Node)
+	//   配列は、ArenaUnit単位の64bitのindex(ArenaIndex)で参照する。(最大2TB)
+	//   子ノードへのindexの配列は子の数だけあるので、これがポインターより小さく、mallocのヘッダーもないので、Nodeあたりのメモリが減る。
+	// ・探索スレッドごとに、BLOCK_UNITS単位でまとめて切り出しておいて、そこから確保する。(lock不要)
+	// ・個別の開放はしない。Reset()で、確保したものをすべてO(1)で開放する。
+	//   探索木の一部(前回の探索の、現局面に至る経路以外の部分)を捨てる時は、何もせずに放置する。
+	//   不要な部分が溜まってきたら、NodeTreeが必要な部分だけを別のNodeArenaにコピーする。(NodeTree::CompactArena())
+	// ・メモリが確保できなくなったらIsFull()がtrueになる。探索部はこれを見て探索を中断する。(UCT_NodeLimitのhashfullと同様)
+	class NodeArena
+	{
+	public:
+		NodeArena();
+		~NodeArena();
+
+		NodeArena(const NodeArena&) = delete;
+		NodeArena& operator=(const NodeArena&) = delete;
+
+		// Nodeを1つ確保して、そのindexを返す。中身は初期化されていない。確保できなければ0を返す。
+		// 複数の探索スレッドから同時に呼び出して良い。
+		NodeIndex AllocNode();
+
+		// bytes[byte]のメモリを確保して、そのindexを返す。中身は初期化されていない。確保できなければ0を返す。
+		// 複数の探索スレッドから同時に呼び出して良い。
+		ArenaIndex Alloc(size_t bytes);
+
+		// indexの指すNode
+		void* NodePtr(NodeIndex index) const { return nodes.Ptr(index); }
+
+		// indexの指すメモリ
+		void* Ptr(ArenaIndex index) const { return arrays.Ptr(index); }
+
+		// 確保したものをすべて開放する。chunkのメモリは開放せずに次に使う。
+		// 探索スレッドが停止している時に呼び出すこと。
+		void Reset();
+
+		// 確保済みのメモリ量[byte]
+		u64 UsedBytes() const { return nodes.UsedBytes() + arrays.UsedBytes(); }
+
+		// これ以上確保できなくなりそうなので、探索を中断すべきか。
+		bool IsFull() const { return nodes.full() || arrays.full(); }
+
+	private:
+		// Nodeの領域。(1 << 18)個のNodeUnit(12MB)のchunkが2^14個で、2^32個のNode。
+		ArenaRegion<NodeUnit, 18, size_t(1) << 14> nodes;
+
+		// 配列の領域。(1 << 20)個のArenaUnit(16MB)のchunkが2^17個で、2TB。
+		ArenaRegion<ArenaUnit, 20, size_t(1) << 17> arrays;
+
+		// Reset()するごとに変わる値。(全NodeArenaで重複しない)
+		// 探索スレッドが切り出したblockが、Reset()前のものかを判定するのに用いる。
+		u64 epoch;
+	};
+
+	// 探索木のNodeを確保している現在のNodeArena。NodeTreeが設定する。
+	extern NodeArena* node_arena;
+
+	// node_arenaに確保したT型(の配列)を指す。
+	// Node::child , Node::child_nodesでunique_ptrの代わりに用いる。開放はしない。(NodeArena::Reset()で開放される)
+	template <typename T>
+	struct ArenaPtr
+	{
+		ArenaIndex index = 0;
+
+		T* get() const { return index ? (T*)node_arena->Ptr(index) : nullptr; }
+		T* operator->() const { return get(); }
+		T& operator[](size_t i) const { return get()[i]; }
+		explicit operator bool() const { return index != 0; }
+
+		// T型をn個確保する。
+		static ArenaPtr Alloc(size_t n) { ArenaPtr p; p.index = node_arena->Alloc(sizeof(T) * n); return p; }
+	};
+
+	// Nodeを指すArenaPtr。子ノードへのindexの配列の要素なので32bit。
+	template <>
+	struct ArenaPtr<Node>
+	{
+		NodeIndex index = 0;
+
+		Node* get() const { return index ? (Node*)node_arena->NodePtr(index) : nullptr; }
+		Node* operator->() const { return get(); }
+		explicit operator bool() const { return index != 0; }
+
+		// Nodeは1つずつしか確保しない。
+		static ArenaPtr Alloc(size_t n) { ASSERT_LV3(n == 1); ArenaPtr p; p.index = node_arena->AllocNode(); return p; }
+	};
+
+	// node_arenaにT型をn個確保して、デフォルトコンストラクタで初期化する。
+	// 確保できなかった時は、nullptrを指すArenaPtrを返す。
+	// ※　デストラクタは呼び出されないので、Tはtrivially destructibleであること。
+	template <typename T>
+	ArenaPtr<T> arena_new_array(size_t n)
+	{
+		ArenaPtr<T> p = ArenaPtr<T>::Alloc(n);
+		if (!p)
+			return p;
+		T* t = p.get();
+		for (size_t i = 0; i < n; ++i)
+			new (&t[i]) T();
+		return p;
+	}
+
+	// node_arenaにT型を1つ確保して、デフォルトコンストラクタで初期化する。
+	template <typename T>
+	ArenaPtr<T> arena_new() { return arena_new_array<T>(1); }
+}
+
+#endif // defined(YANEURAOU_ENGINE_DEEP)
+#endif // ndef __NODEARENA_H_INCLUDED__
@@ -124,7 +124,8 @@ namespace dlshogi::UctPrint
 	// あるノード以降のPV(最善応手列)を取得する。
 	void  get_pv(Node* node , std::vector<Move>& moves)
 	{
-		while (node)
+		// UCT_Transposition(DAG)の時は、Nodeを辿るとループしていることがあるので、MAX_PLYで打ち切る。
+		while (node && moves.size() < MAX_PLY)
 		{
 			// NOT_EXPANDED or 0
 			if ((NodeCountType)(node->move_count+1) <= 1)
@@ -12,6 +12,7 @@
 #include "../../mate/mate.h"
 
 #include <limits>           // max<T>()
+#include <algorithm>        // clamp()
 
 // 完全なログ出力をしてdlshogiと比較する時用。
 //#define LOG_PRINT
@@ -89,7 +90,7 @@ MyLogger logger;
 using namespace Eval::dlshogi;
 using namespace std;
 
-#define LOCK_EXPAND grp->get_dlsearcher()->mutex_expand.lock();
+#define LOCK_EXPAND lock_and_count_wait(grp->get_dlsearcher()->mutex_expand, stats.lock_wait_ns);
 #define UNLOCK_EXPAND grp->get_dlsearcher()->mutex_expand.unlock();
 
 namespace dlshogi
@@ -246,7 +247,7 @@ namespace dlshogi
 		make_input_features(*pos, current_policy_value_batch_index, packed_features1, packed_features2);
 
 		// 現在のNodeと手番を保存しておく。
-		policy_value_batch[current_policy_value_batch_index] = { node, pos->side_to_move() /* , pos->key() */ , value_win};
+		policy_value_batch[current_policy_value_batch_index] = { node, pos->side_to_move() , pos->key() , value_win};
 
 	#ifdef MAKE_BOOK
 		policy_value_book_key[current_policy_value_batch_index] = Book::bookKey(*pos);
@@ -256,6 +257,21 @@ namespace dlshogi
 		// これが、policy_value_batch_maxsize分だけ溜まったら、nn->forward()を呼び出す。
 	}
 
+	// posの局面がNNCacheにあれば、nodeの各ChildNodeのnnrateを設定して、valueにNNのvalueを代入してtrueを返す。
+	bool UctSearcher::probe_nn_cache(const Position* pos, Node* node, float& value)
+	{
+		auto& nn_cache = grp->get_dlsearcher()->nn_cache;
+		if (!nn_cache.enabled())
+			return false;
+
+		++stats.cache_probes;
+		if (!nn_cache.probe(pos->key(), node, value))
+			return false;
+
+		++stats.cache_hits;
+		return true;
+	}
+
 	// leaf node用の詰め将棋ルーチンの初期化(alloc)を行う。
 	// ※　SetLimits()が"go"に対してしか呼び出されていないからmax_moves_to_drawは未確定なので
 	//     ここでそれを用いた設定をするわけにはいかない。
@@ -399,7 +415,8 @@ namespace dlshogi
 	{
 		DlshogiSearcher* ds = grp->get_dlsearcher();
 		auto& search_limits = ds->search_limits;
-		auto stop = [&]() { return Threads.stop || search_limits.interruption; };
+		// NodeArenaが一杯になった時は、中断のチェックを待たずにただちに止める。(予備のchunkを使い切らないように)
+		auto stop = [&]() { return Threads.stop || search_limits.interruption || get_node_tree()->IsArenaFull(); };
 
 		// ↓ dlshogiのコードここから ↓
 
@@ -408,10 +425,16 @@ namespace dlshogi
 		// ルートノードを評価。これは最初にevaledでないことを見つけたスレッドが行えば良い。
 		LOCK_EXPAND;
 		if (!current_root->IsEvaled()) {
-			current_policy_value_batch_index = 0;
 			float value_win; // EvalNode()した時に、ここにvalueが書き戻される。ダミーの変数。
-			QueuingNode(&rootPos, current_root, &value_win);
-			EvalNode();
+			if (probe_nn_cache(&rootPos, current_root, value_win)) {
+				current_root->value = value_win;
+				current_root->SetEvaled();
+			}
+			else {
+				current_policy_value_batch_index = 0;
+				QueuingNode(&rootPos, current_root, &value_win);
+				EvalNode();
+			}
 		}
 		UNLOCK_EXPAND;
 
@@ -450,10 +473,12 @@ namespace dlshogi
 					atomic_fetch_add(&search_limits.nodes_searched, (NodeCountType)1);
 					//  →　ここで加算するとnpsの計算でまだEvalNodeしてないものまで加算されて
 					// 大きく見えてしまうのでもう少しあとで加算したいところだが…。
+					++stats.playouts;
 				}
 				else {
 					// 破棄した探索経路を保存
 					trajectories_batch_discarded.emplace_back(std::move(visitor_batch.back().trajectories));
+					++stats.discarded;
 				}
 
 				// 評価中の末端ノードに達した、もしくはバックアップ済みため破棄する
@@ -536,11 +561,18 @@ namespace dlshogi
 		// 現在見ているノードをロック
 		// これは、このNode(current)の展開(child[i].node = new Node(); ... )を行う時にLockすることになっている。
 		auto& mutex = ds->get_node_mutex(pos);
-		mutex.lock();
+		lock_and_count_wait(mutex, stats.lock_wait_ns);
 
 		// 子ノードへのポインタ配列が初期化されていない場合、初期化する
 		if (!current->child_nodes) current->InitChildNodes();
 
+		// NodeArenaを使い切っていて確保できなかった。この探索経路は破棄する。
+		if (!current->child_nodes)
+		{
+			mutex.unlock();
+			return DISCARDED;
+		}
+
 		// 子ノードのなかからUCB値最大の手を求める
 		const ChildNumType next_index = SelectMaxUcbChild(parent, current);
 
@@ -557,13 +589,25 @@ namespace dlshogi
 		// 　　この時点では勝率は加算していないのでこの指し手の勝率が相対的に低く見えるようになる。
 		AddVirtualLoss(&uct_child[next_index], current);
 
+		// UCT_Transposition(DAG)の時は、同じ局面のNodeを共有するので、子ノードの展開と辿り方が異なる。
+		if (options.transposition) {
+			result = UctSearchDag(pos, current, next_index, mutex, visitor);
+		}
 		// ノードの展開の確認
 		// この子ノードがまだ展開されていないなら、この子ノードを展開する。
-		if (!current->child_nodes[next_index]) {
+		else if (!current->child_nodes[next_index]) {
 			// ノードの作成
 			Node* child_node = current->CreateChildNode(next_index);
 			//cerr << "value evaluated " << result << " " << v << " " << *value_result << endl;
 
+			// NodeArenaを使い切っていて作れなかった。この探索経路は破棄する。(Virtual Lossは破棄した経路として戻される)
+			if (!child_node)
+			{
+				mutex.unlock();
+				trajectories.emplace_back(current, next_index);
+				return DISCARDED;
+			}
+
 			// ノードを展開したので、もうcurrentは書き換えないからunlockして良い。
 
 			// 現在見ているノードのロックを解除
@@ -620,54 +664,25 @@ namespace dlshogi
 					break;
 
 				case REPETITION_NONE    : // 繰り返しはない
-				{
-					// 詰みチェック
-
-#if !defined(LOG_PRINT)
-
-					bool isMate =
-						// Mate::mate_odd_ply()は自分に王手がかかっていても詰みを読めるはず…。
-
-						// df-pn mate solverをleaf nodeで使う。
-						(options.leaf_dfpn_nodes_limit // 0なら詰み探索無効
-							&& is_ok(mate_solver.mate_dfpn(*pos, options.leaf_dfpn_nodes_limit)))
-							// MOVE_NONE(詰み不明) , MOVE_NULL(不詰)ではない 。これらはis_ok(m) == false
-						|| (pos->DeclarationWin() != MOVE_NONE)            // 宣言勝ち
-						;
-#else
-					// mateが絡むとdlshogiと異なるノードを探索してしまうのでログ調査する時はオフにする。
-					bool isMate = (pos->DeclarationWin() != MOVE_NONE);            // 宣言勝ち
-#endif
-
-					// 詰みの場合、ValueNetの値を上書き
-					if (isMate) {
-						// 親nodeでnext_indexの子を選択した時に即詰みがあったので、この子ノードを勝ち扱いにして、
-						// 今回の期待勝率は0%に設定する。
-						uct_child[next_index].SetWin();
-						result = 0.0f;
-					}
-					else {
-						// 候補手を展開する（千日手や詰みの場合は候補手の展開が不要なため、タイミングを遅らせる）
-						child_node->ExpandNode(pos,options.generate_all_legal_moves);
-						if (child_node->child_num == 0) {
-							// 詰み
-							uct_child[next_index].SetLose();
-							result = 1.0f;
-						}
-						else
-						{
-							// ノードをキューに追加
-							QueuingNode(pos, child_node , &visitor.value_win);
-
-							// このとき、まだEvalNodeが完了していないのでchild_node->evaledはまだfalseのまま
-							// にしておく必要がある。
-
-							return QUEUING;
-						}
+					// 詰みチェックと候補手の展開をして、NNの評価待ちのキューに追加する。
+					result = EvalNewNode(pos, &uct_child[next_index], child_node, visitor);
+
+					// このとき、まだEvalNodeが完了していないのでchild_node->evaledはまだfalseのまま
+					// にしておく必要がある。
+					if (result == QUEUING)
+						return QUEUING;
+
+					// NodeArenaを使い切っていて候補手を展開できなかった。
+					// child_nodeは作らなかったことにして(次に訪問した時に作り直す)、この探索経路は破棄する。
+					if (result == DISCARDED)
+					{
+						mutex.lock();
+						current->child_nodes[next_index] = ArenaPtr<Node>();
+						mutex.unlock();
+						return DISCARDED;
 					}
 
 					break;
-				}
 
 				default: UNREACHABLE;
 			}
@@ -677,14 +692,15 @@ namespace dlshogi
 
 		}
 		else {
+			// child_nodes[next_index]は、候補手を展開できなかった時に他のスレッドがnullptrに戻すことがあるので、ロック中に取り出しておく。
+			Node* next_node = current->child_nodes[next_index].get();
+
 			// 現在見ているノードのロックを解除
 			mutex.unlock();
 
 			// 経路を記録
 			trajectories.emplace_back(current, next_index);
 
-			Node* next_node = current->child_nodes[next_index].get();
-
 			// policy計算中のため破棄する(他のスレッドが同じノードを先に展開した場合)
 			if (!next_node->IsEvaled())
 				return DISCARDED;
@@ -728,6 +744,191 @@ namespace dlshogi
 		return 1.0f - result;
 	}
 
+	// 新しく作成したNode(child_node)の詰みチェックをして、候補手を展開し、NNの評価待ちのキューに追加する。
+	// UctSearch()から呼び出される。posはchild_nodeの局面で、千日手ではないこと。
+	//   edge : 親局面からchild_nodeに至るedge
+	// 返し値 : 親局面の手番側から見た期待勝率。キューに追加した時はQUEUING。
+	//          NodeArenaを使い切っていて候補手を展開できなかった時はDISCARDED。
+	// ※　詰みの時は、edgeにSetWin()/SetLose()する。
+	float UctSearcher::EvalNewNode(Position* pos, ChildNode* edge, Node* child_node, NodeVisitor& visitor)
+	{
+		auto& options = grp->get_dlsearcher()->search_options;
+
+		// 詰みチェック
+
+#if !defined(LOG_PRINT)
+
+		bool isMate =
+			// Mate::mate_odd_ply()は自分に王手がかかっていても詰みを読めるはず…。
+
+			// df-pn mate solverをleaf nodeで使う。
+			(options.leaf_dfpn_nodes_limit // 0なら詰み探索無効
+				&& is_ok(mate_solver.mate_dfpn(*pos, options.leaf_dfpn_nodes_limit)))
+				// MOVE_NONE(詰み不明) , MOVE_NULL(不詰)ではない 。これらはis_ok(m) == false
+			|| (pos->DeclarationWin() != MOVE_NONE)            // 宣言勝ち
+			;
+#else
+		// mateが絡むとdlshogiと異なるノードを探索してしまうのでログ調査する時はオフにする。
+		bool isMate = (pos->DeclarationWin() != MOVE_NONE);            // 宣言勝ち
+#endif
+
+		// 詰みの場合、ValueNetの値を上書き
+		if (isMate) {
+			// 親nodeでnext_indexの子を選択した時に即詰みがあったので、この子ノードを勝ち扱いにして、
+			// 今回の期待勝率は0%に設定する。
+			edge->SetWin();
+			child_node->value = 1.0f;
+			return 0.0f;
+		}
+
+		// 候補手を展開する（千日手や詰みの場合は候補手の展開が不要なため、タイミングを遅らせる）
+		// NodeArenaを使い切っていて展開できなかった時は、呼び出し元でこの探索経路を破棄する。
+		if (!child_node->ExpandNode(pos,options.generate_all_legal_moves))
+			return DISCARDED;
+		if (child_node->child_num == 0) {
+			// 詰み
+			edge->SetLose();
+			child_node->value = 0.0f;
+			return 1.0f;
+		}
+
+		float value;
+		if (probe_nn_cache(pos, child_node, value))
+		{
+			// NNCacheにあったので、NNを呼び出さずに済んだ。
+			// 得られたのはchild_nodeの手番側から見たvalueなので、反転させて返す。
+			child_node->value = value;
+			return 1.0f - value;
+		}
+
+		// ノードをキューに追加
+		QueuingNode(pos, child_node , &visitor.value_win);
+		return QUEUING;
+	}
+
+	// UCT_Transposition(DAG)の時に、UctSearch()から呼び出される。
+	// currentのnext_index番目の子ノードを(なければ作成して)辿る。
+	//   pos   : next_indexの指し手で進めたあとの局面
+	//   mutex : currentのmutex。lockした状態で呼び出すこと。この関数のなかでunlockする。
+	// 返し値 : UctSearch()と同じく、currentの手番側から見た期待勝率。QUEUING , DISCARDEDもありうる。
+	//
+	// 同じ局面のNodeはNodeHashTableで1つにまとめて、手順前後で合流した時は、それを複数の親で共有する。
+	// ・千日手と最大手数による引き分けは、そこまでの経路によって結果が異なるのでNodeやedgeには記録せずに、辿るごとに判定する。
+	// 　(rootからの経路でループになっている時も、千日手として扱われるので、ここで止まる)
+	// ・詰みは経路によらないので、edgeにSetWin()/SetLose()して良い。
+	// ・他の経路からの訪問によって、子ノードの訪問回数がedgeの訪問回数より多くなっている時は、子ノードは辿らずに、
+	// 　edgeの期待勝率が子ノードの期待勝率に一致するような値を返す。(Monte-Carlo Graph Search , Czech et al. 2020)
+	// 　これにより、合流した局面ではNNを呼び出さずに、他の経路で得た探索結果が使える。
+	float UctSearcher::UctSearchDag(Position* pos, Node* current, ChildNumType next_index, std::mutex& mutex, NodeVisitor& visitor)
+	{
+		auto ds = grp->get_dlsearcher();
+		auto& options = ds->search_options;
+		auto& trajectories = visitor.trajectories;
+		ChildNode* edge = &current->child[next_index];
+
+		// 千日手チェック
+		// 合流したNodeを辿ってループしていることがあるので、rootまでの手数分は遡って調べる。
+		RepetitionState rep;
+		if (options.max_moves_to_draw < pos->game_ply())
+			rep = pos->is_mated() ? REPETITION_LOSE : REPETITION_DRAW;
+		else
+			rep = pos->is_repetition(16 + (int)trajectories.size());
+
+		// 子ノードがまだなければ、hash tableから同じ局面のNodeを探して(なければ作成して)、子ノードにする。
+		Node* child_node = current->child_nodes[next_index].get();
+		bool created = false;
+		if (!child_node && rep == REPETITION_NONE)
+		{
+			const ArenaPtr<Node> node = get_node_tree()->GetHashTable()->FindOrCreate(*pos, created);
+			current->child_nodes[next_index] = node;
+			child_node = node.get();
+
+			// NodeArenaを使い切っていて作れなかった。この探索経路は破棄する。
+			if (!child_node)
+			{
+				mutex.unlock();
+				trajectories.emplace_back(current, next_index);
+				return DISCARDED;
+			}
+		}
+
+		// 現在見ているノードのロックを解除
+		mutex.unlock();
+
+		// 経路を記録
+		trajectories.emplace_back(current, next_index);
+
+		switch (rep)
+		{
+		case REPETITION_WIN     : // 連続王手の千日手で反則勝ち
+		case REPETITION_SUPERIOR: // 優等局面は勝ち扱い
+			return 0.0f;
+
+		case REPETITION_LOSE    : // 連続王手の千日手で反則負け
+		case REPETITION_INFERIOR: // 劣等局面は負け扱い
+			return 1.0f;
+
+		case REPETITION_DRAW    : // 引き分け
+			return 1 - ds->draw_value(pos->side_to_move());
+
+		case REPETITION_NONE    : // 繰り返しはない
+			break;
+
+		default: UNREACHABLE;
+		}
+
+		if (created)
+		{
+			// 新しく作ったNodeなので、詰みチェックをしてNNの評価待ちのキューに追加する。
+			// NodeArenaを使い切っていて候補手を展開できなかった時(DISCARDED)は、evaledにしない。
+			// (DAGのNodeは次の探索では作り直すので、この探索の間だけ辿れないNodeになる)
+			const float result = EvalNewNode(pos, edge, child_node, visitor);
+			if (result != QUEUING && result != DISCARDED)
+				child_node->SetEvaled();
+			return result;
+		}
+
+		// policy計算中のため破棄する(他のスレッドか、他の経路から同じノードを先に展開した場合)
+		if (!child_node->IsEvaled())
+			return DISCARDED;
+
+		if (edge->IsWin())
+			return 0.0f; // 反転して値を返すため0を返す
+
+		if (edge->IsLose())
+			return 1.0f; // 反転して値を返すため1を返す
+
+		// 他の経路で詰みとわかっている局面に合流した。
+		if (child_node->child_num == 0)
+		{
+			if (child_node->value > 0.5f) {
+				edge->SetWin();
+				return 0.0f;
+			}
+			edge->SetLose();
+			return 1.0f;
+		}
+
+		// edgeの訪問回数(今回のVirtual Lossの分は除く)と、child_nodeの訪問回数(NNの評価の分を含む)
+		const NodeCountType edge_count = edge->move_count - VIRTUAL_LOSS;
+		const NodeCountType node_count = child_node->move_count + 1;
+
+		if (edge_count < node_count)
+		{
+			// child_nodeの期待勝率(currentの手番側から見たもの)と、edgeの期待勝率
+			const float node_q = 1.0f - (float)((child_node->win + child_node->value) / node_count);
+			const float edge_q = edge_count ? (float)(edge->win / edge_count) : node_q;
+
+			++stats.transpositions;
+
+			// これをedgeに加算すると、edgeの期待勝率がnode_qになる。
+			return std::clamp(node_q + edge_count * (node_q - edge_q), 0.0f, 1.0f);
+		}
+
+		// 手番を入れ替えて1手深く読む
+		return UctSearch(pos, edge, child_node, visitor);
+	}
+
 	//  UCBが最大となる子ノードのインデックスを返す関数
 	//    parent  : 調べたい局面の親局面のcurrentに至るedge。(current == rootであるなら、nullptrを設定しておく)
 	//    current : 調べたい局面
@@ -911,7 +1112,11 @@ namespace dlshogi
 
 		// predict
 		// policy_value_batch_sizeの数だけまとめて局面を評価する
-		grp->nn_forward(policy_value_batch_size, packed_features1, packed_features2, features1, features2, y1, y2);
+		grp->nn_forward(policy_value_batch_size, packed_features1, packed_features2, features1, features2, y1, y2, &stats);
+
+		++stats.batches;
+		stats.batch_positions += policy_value_batch_size;
+		stats.batch_capacity  += policy_value_batch_maxsize;
 
 		//cout << *y2 << endl;
 
@@ -967,6 +1172,7 @@ namespace dlshogi
 
 			// valueの値はここに返すことになっている。
 			*policy_value_batch[i].value_win = *value;
+			node->value = *value;
 
 #if defined(LOG_PRINT)
 			std::vector<MoveIntFloat> m;
@@ -1004,6 +1210,10 @@ namespace dlshogi
 				}
 			}
 	#endif
+
+			// 定跡の遷移確率を反映させたあとのnnrateを保存しておく。
+			ds->nn_cache.store(policy_value_batch[i].key, node, *value);
+
 			node->SetEvaled();
 		}
 	}
@@ -7,6 +7,9 @@
 #include "../../mate/mate.h"
 
 #include "Node.h"
+#include "dlshogi_min.h"
+
+#include <chrono>
 
 // この探索部は、NN専用なので直接読み込む。
 
@@ -21,6 +24,18 @@ namespace dlshogi
 	class DlshogiSearcher;
 	struct SearchOptions;
 
+	// mutexをlockする。すぐに獲得できなかった時だけ、獲得までに待った時間[ns]をwait_nsに加算する。
+	// 競合していない時は、時刻の取得のコストがかからない。
+	inline void lock_and_count_wait(std::mutex& mutex, u64& wait_ns)
+	{
+		if (mutex.try_lock())
+			return;
+
+		const auto start = std::chrono::steady_clock::now();
+		mutex.lock();
+		wait_ns += (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+
 	// UctSearcher(探索用スレッド)をGPU一つ利用する分ずつひとまとめにしたもの。
 	// 一つのGPUにつき、UctSearchThreadGroupひとつが対応する。
 	class UctSearcherGroup
@@ -38,14 +53,25 @@ namespace dlshogi
 		void Initialize(const std::string& model_path , const int new_thread, const int gpu_id, const int policy_value_batch_maxsize);
 
 		// ニューラルネットのforward() (順方向の伝播 = 推論)を呼び出す。
-		void nn_forward(const int batch_size, PType* p1, PType* p2, NN_Input1* x1, NN_Input2* x2, NN_Output_Policy* y1, NN_Output_Value* y2)
+		// statsを渡した時は、mutex_gpuの獲得待ちの時間とforward()の時間をそこに加算する。
+		void nn_forward(const int batch_size, PType* p1, PType* p2, NN_Input1* x1, NN_Input2* x2, NN_Output_Policy* y1, NN_Output_Value* y2, SearchStats* stats = nullptr)
 		{
 #if !defined(UNPACK_NVRTC)
 			// 入力特徴量を展開する。GPU側で展開する場合は不要。
 			extract_input_features(batch_size, p1, p2, x1, x2);
 #endif
-			mutex_gpu.lock();
+			if (!stats)
+			{
+				mutex_gpu.lock();
+				nn->forward(batch_size, p1, p2, x1, x2, y1, y2);
+				mutex_gpu.unlock();
+				return;
+			}
+
+			lock_and_count_wait(mutex_gpu, stats->gpu_wait_ns);
+			const auto start = std::chrono::steady_clock::now();
 			nn->forward(batch_size, p1, p2, x1, x2, y1, y2);
+			stats->forward_ns += (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
 			mutex_gpu.unlock();
 		}
 
@@ -151,6 +177,7 @@ namespace dlshogi
 	struct BatchElement {
 		Node*	node;     // どのNodeに対するEvalNode()なのか。
 		Color	color;    // その時の手番
+		Key		key;      // その局面のhash key。NNCacheに保存する時に用いる。
 
 		// 通常の探索では、このポインターはNodeVisitor::value_win を指している。
 		float* value_win; // leaf nodeでのvalue_winの値(これを辿ってきたNodeに対して符号を反転させながら伝播させていく)
@@ -245,6 +272,10 @@ namespace dlshogi
 		// policy_value_batch_maxsize と同数のダミーデータを作成し、推論を行う。
 		void DummyForward();
 
+		// このスレッドの計測用のカウンター
+		// 書き換えるのはこのスレッドだけなので、探索中でなければ他のスレッドから読み書きして良い。
+		SearchStats& get_stats() { return stats; }
+
 	private:
 		//  並列処理で呼び出す関数
 		//  UCTアルゴリズムを反復する
@@ -263,6 +294,16 @@ namespace dlshogi
 		//
 		float UctSearch(Position* pos, ChildNode* parent, Node* current, NodeVisitor& visitor);
 
+		// UCT_Transposition(DAG)の時に、UctSearch()から呼び出される。
+		// currentのnext_index番目の子ノードを(なければhash tableから探して)辿る。
+		// posはnext_indexの指し手で進めたあとの局面。mutexはcurrentのmutexで、lockされた状態で渡す。
+		// 返し値はUctSearch()と同じ。
+		float UctSearchDag(Position* pos, Node* current, ChildNumType next_index, std::mutex& mutex, NodeVisitor& visitor);
+
+		// 新しく作成したNodeの詰みチェックをして、候補手を展開し、NNの評価待ちのキューに追加する。
+		// 返し値 : 親局面の手番側から見た期待勝率。キューに追加した時はQUEUING。
+		float EvalNewNode(Position* pos, ChildNode* edge, Node* child_node, NodeVisitor& visitor);
+
 		//  UCBが最大となる子ノードのインデックスを返す関数
 		//    pos     : 調べたい局面
 		//    current : 調べたい局面
@@ -272,6 +313,10 @@ namespace dlshogi
 		// Evaluateを呼び出すリスト(queue)に追加する。
 		void QueuingNode(const Position* pos, Node* node, float* value_win);
 
+		// posの局面がNNCacheにあれば、nodeの各ChildNodeのnnrateを設定して、valueにNNのvalueを代入してtrueを返す。
+		// nodeはExpandNode()済みであること。
+		bool probe_nn_cache(const Position* pos, Node* node, float& value);
+
 		// ノードを評価
 		void EvalNode();
 
@@ -327,6 +372,9 @@ namespace dlshogi
 
 		// leaf node用のdf-pn solver
 		Mate::Dfpn::MateDfpnSolver mate_solver;
+
+		// 計測用のカウンター。"bench mcts"で表示する。
+		SearchStats stats;
 	};
 }
 
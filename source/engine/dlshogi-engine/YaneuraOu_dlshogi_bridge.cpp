@@ -12,6 +12,9 @@
 #include "dlshogi_searcher.h"
 
 #include "../../eval/deep/nn_types.h"
+#if defined(MOCK_NN)
+#include "../../eval/deep/nn_mock.h"
+#endif
 
 // やねうら王フレームワークと、dlshogiの橋渡しを行うコード
 
@@ -58,6 +61,11 @@ void USI::extra_option(USI::OptionsMap& o)
 	// ノードを再利用するか。
     o["ReuseSubtree"]                << USI::Option(true);
 
+	// 手順前後で同じ局面に合流した時に、Nodeを共有するか。(探索木ではなくDAGにする)
+	// 合流した局面ではNNを呼び出さずに他の経路の探索結果を使えるので、長い持ち時間で効果がある。
+	// ただし、前回の探索のNodeは再利用しなくなるので、NN_CacheSizeを大きめにしておくこと。
+	o["UCT_Transposition"]           << USI::Option(false);
+
 	// 勝率を評価値に変換する時の定数。
 	o["Eval_Coef"]                   << USI::Option(756, 1, 10000);
 
@@ -126,10 +134,11 @@ void USI::extra_option(USI::OptionsMap& o)
     o["DNN_Model15"]                  << USI::Option("");
     o["DNN_Model16"]                  << USI::Option("");
 
-#if defined(TENSOR_RT) || defined(ORT_TRT)
+#if defined(TENSOR_RT) || defined(ORT_TRT) || defined(MOCK_NN)
 	// 通常時の推奨128 , 検討の時は推奨256。
+	// MOCK_NNは探索部の計測用なので、GPUを使う時と同じ値にしておく。
 	o["DNN_Batch_Size1"]             << USI::Option(128, 1, 1024);
-#elif defined(ONNXRUNTIME)
+#elif defined(ONNXRUNTIME) || defined(NATIVE_NN)
 	// CPUを使っていることがあるので、default値、ちょっと少なめにしておく。
 	o["DNN_Batch_Size1"]             << USI::Option(32, 1, 1024);
 #endif
@@ -149,6 +158,10 @@ void USI::extra_option(USI::OptionsMap& o)
 	o["DNN_Batch_Size15"]             << USI::Option(0, 0, 1024);
 	o["DNN_Batch_Size16"]             << USI::Option(0, 0, 1024);
 
+	// NNの推論結果のcacheのサイズ[MB]。0ならcacheを用いない。
+	// 同一局面(手順前後による合流や、前回の探索で評価済みの局面)をNNで評価しなおさずに済む。
+	o["NN_CacheSize"]                << USI::Option(256, 0, 1048576);
+
 #if defined(ORT_MKL)
 	// nn_onnx_runtime.cpp の NNOnnxRuntime::load() で使用するオプション。
 	// グラフ全体のスレッド数?（default値1）ORT_MKLでは効果が無いかもしれない。
@@ -157,6 +170,22 @@ void USI::extra_option(USI::OptionsMap& o)
 	o["IntraOpNumThreads"]           << USI::Option(4, 1, 65536);
 #endif
 
+#if defined(NATIVE_NN)
+	// nn_native.cpp の NNNative::load() で使用するオプション。モデルを読み込み直した時に反映される。
+	// 推論に使うスレッド数。batchを分割して並列に計算する。UCT_Threads1～の0でないグループの合計。
+	o["NN_Threads"]                  << USI::Option(4, 1, 1024);
+	// Convをint8に量子化して計算する。速くなるが、精度は少し落ちる。
+	o["NN_Int8"]                     << USI::Option(false);
+#endif
+
+#if defined(MOCK_NN)
+	// nn_mock.cpp の NNMock::forward() で待つ時間[us]。GPUでの推論時間の代わり。
+	// forward()1回あたりに待つ時間
+	o["NN_MockLatency"]              << USI::Option(0, 0, 10000000);
+	// 1局面あたりに追加で待つ時間
+	o["NN_MockLatencyPerPosition"]   << USI::Option(0, 0, 1000000);
+#endif
+
     //(*this)["Const_Playout"]               = USIOption(0, 0, INT_MAX);
 	// →　Playout数固定。これはNodeLimitでできるので不要。
 
@@ -196,6 +225,9 @@ void Search::clear()
 	// ノードを再利用するかの設定。
 	searcher.SetReuseSubtree(Options["ReuseSubtree"]);
 
+	// 同じ局面のNodeを共有する(DAGにする)かの設定。
+	searcher.SetTransposition(Options["UCT_Transposition"]);
+
 	// 勝率を評価値に変換する時の定数を設定。
 	searcher.SetEvalCoef((int)Options["Eval_Coef"]);
 
@@ -257,6 +289,14 @@ void Search::clear()
 
 	Eval::dlshogi::set_softmax_temperature(Options["Softmax_Temperature"] / 1000.0f);
 
+	// NNの推論結果のcache。softmaxの温度やモデルが変わっているかも知れないので、毎回クリアする。
+	searcher.SetNNCacheSize((size_t)Options["NN_CacheSize"]);
+
+#if defined(MOCK_NN)
+	// 計測用のNNで推論の時間として待つ時間[us]
+	NNMock::set_latency((s64)Options["NN_MockLatency"], (s64)Options["NN_MockLatencyPerPosition"]);
+#endif
+
 	searcher.SetDrawValue(
 		(int)Options["DrawValueBlack"],
 		(int)Options["DrawValueWhite"]);
@@ -392,6 +432,18 @@ namespace dlshogi
 		return (u64)searcher.search_limits.nodes_searched;
 	}
 
+	// 全探索スレッドとGCの計測値を合算したものを返す。
+	SearchStats get_search_stats()
+	{
+		return searcher.GetSearchStats();
+	}
+
+	// 計測値をすべて0にする。
+	void clear_search_stats()
+	{
+		searcher.ClearSearchStats();
+	}
+
 }
 
 #endif // defined(YANEURAOU_ENGINE_DEEP)
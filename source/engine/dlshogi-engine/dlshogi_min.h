@@ -24,6 +24,45 @@ namespace dlshogi {
 	//  →　そちらは、Position::do_move()した回数。
 	// こちらは、GPUでevaluate()を呼び出した回数。俗に言うnodes visited。
 	extern u64 nodes_visited();
+
+	// 探索部の計測用のカウンター。"bench mcts"で表示する。
+	// 探索スレッド(UctSearcher)ごとに持っていて、get_search_stats()で全スレッド分を合算したものが得られる。
+	struct SearchStats
+	{
+		// UctSearch()でleaf nodeまで辿った回数と、そのうち他のスレッドが評価中などのため破棄した(DISCARDED)回数
+		u64 playouts = 0, discarded = 0;
+
+		// NNのforward()を呼び出した回数と、渡した局面数の合計、batch sizeの上限(DNN_Batch_Size)の合計。
+		// batch_positions / batch_capacity がbatchの充填率。
+		u64 batches = 0, batch_positions = 0, batch_capacity = 0;
+
+		// nodeのmutex(とroot展開用のmutex)の獲得を待った時間[ns]。(すぐに獲得できた時は計測しない)
+		u64 lock_wait_ns = 0;
+
+		// 同じGPUを使う他のスレッドのforward()が終わるのを待った時間[ns]
+		u64 gpu_wait_ns = 0;
+
+		// forward()にかかった時間[ns]
+		u64 forward_ns = 0;
+
+		// NNCacheを調べた回数と、そのうちcacheにあった回数
+		u64 cache_probes = 0, cache_hits = 0;
+
+		// UCT_Transposition(DAG)の時に、他の経路から合流した局面の探索結果を使って、
+		// 子ノードを辿らずに(NNを呼び出さずに)終えたプレイアウトの回数
+		u64 transpositions = 0;
+
+		// GCで開放したNodeArenaとhash tableの数と、開放(とNodeArenaのコンパクション)にかかった時間[ns]。
+		u64 gc_subtrees = 0, gc_ns = 0;
+
+		SearchStats& operator+=(const SearchStats& s);
+	};
+
+	// 全探索スレッドとGCの計測値を合算したものを返す。
+	extern SearchStats get_search_stats();
+
+	// 計測値をすべて0にする。
+	extern void clear_search_stats();
 }
 
 namespace Eval::dlshogi {
@@ -225,6 +225,12 @@ namespace dlshogi
 		search_options.reuse_subtree = flag;
 	}
 
+	//  同じ局面のNodeを共有する(DAGにする)かの設定
+	void DlshogiSearcher::SetTransposition(bool flag)
+	{
+		search_options.transposition = flag;
+	}
+
 	// 勝率から評価値に変換する際の係数を設定する。
 	// ここで設定した値は、そのままsearch_options.eval_cosefに反映する。
 	// 変換部の内部的には、ここで設定した値が1/1000倍されて計算時に使用される。
@@ -254,6 +260,9 @@ namespace dlshogi
 		search_options.uct_node_limit = uct_node_limit;
 
 		if (!tree) tree = std::make_unique<NodeTree>(gc.get());
+
+		// 設定が変更されていればゲーム木は作り直しになる。
+		tree->SetTransposition(search_options.transposition);
 		//search_groups = std::make_unique<UctSearcherGroup[]>(max_gpu);
 		// →　これもっと早い段階で行わないと間に合わない。コンストラクタに移動させる。
 
@@ -492,6 +501,10 @@ namespace dlshogi
 			UctPrint::PrintPlayoutInformation(current_root, &search_limits, finish_time, pre_simulated);
 		}
 
+		// 捨てたNodeが溜まっていれば、次の探索までの間にNodeArenaのコピーを始めておく。
+		// (探索開始時に行うと、その時間が持ち時間から引かれてしまうので)
+		tree->StartCompaction(root_dfpn_searcher->mate_move ? root_dfpn_searcher->mate_move.load() : best.move);
+
 		// ---------------------
 		//     root nodeでのdf-pn
 		// ---------------------
@@ -594,6 +607,14 @@ namespace dlshogi
 			s.interruption = true;
 		};
 
+		// NodeArenaが一杯になりそう。hashfullと同じく時間制御の対象外で、
+		// ノード数固定の時も、ただちに中断すべき。(これ以上Nodeを確保できないので)
+		if (tree->IsArenaFull())
+		{
+			interrupt();
+			return;
+		}
+
 		// 探索depth固定
 		// →　PV掘らないとわからないので実装しない。
 
@@ -832,6 +853,52 @@ namespace dlshogi
 			ASSERT_LV3(false);
 	}
 
+	// 全探索スレッドとGCの計測用のカウンターを合算したものを返す。
+	SearchStats DlshogiSearcher::GetSearchStats() const
+	{
+		SearchStats stats;
+		for (auto uct_searcher : thread_id_to_uct_searcher)
+			stats += uct_searcher->get_stats();
+
+		if (gc)
+		{
+			stats.gc_subtrees = gc->gc_subtrees;
+			stats.gc_ns       = gc->gc_time_ns;
+		}
+		return stats;
+	}
+
+	// 計測用のカウンターをすべて0にする。
+	void DlshogiSearcher::ClearSearchStats()
+	{
+		for (auto uct_searcher : thread_id_to_uct_searcher)
+			uct_searcher->get_stats() = SearchStats();
+
+		if (gc)
+		{
+			gc->gc_subtrees = 0;
+			gc->gc_time_ns  = 0;
+		}
+	}
+
+	SearchStats& SearchStats::operator+=(const SearchStats& s)
+	{
+		playouts        += s.playouts;
+		discarded       += s.discarded;
+		batches         += s.batches;
+		batch_positions += s.batch_positions;
+		batch_capacity  += s.batch_capacity;
+		lock_wait_ns    += s.lock_wait_ns;
+		gpu_wait_ns     += s.gpu_wait_ns;
+		forward_ns      += s.forward_ns;
+		cache_probes    += s.cache_probes;
+		cache_hits      += s.cache_hits;
+		transpositions  += s.transpositions;
+		gc_subtrees     += s.gc_subtrees;
+		gc_ns           += s.gc_ns;
+		return *this;
+	}
+
 	// --------------------------------------------------------------------
 	//  SearchInterruptionChecker : 探索停止チェックを行うスレッド
 	// --------------------------------------------------------------------
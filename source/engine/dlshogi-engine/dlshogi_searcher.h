@@ -8,6 +8,8 @@
 #include "../../book/book.h"
 #include "../../mate/mate.h"
 #include "dlshogi_types.h"
+#include "dlshogi_min.h"
+#include "NNCache.h"
 
 // dlshogiの探索部で構造体化・クラス化されていないものを集めたもの。
 
@@ -133,6 +135,10 @@ namespace dlshogi
 		// エンジンオプションの"ReuseSubtree"の値。
 		bool reuse_subtree = true;
 
+		// 同じ局面のNodeを共有して、探索木ではなくDAGにするかの設定。
+		// エンジンオプションの"UCT_Transposition"の値。
+		bool transposition = false;
+
 		// PVの出力間隔
 		// エンジンオプションの"PV_Interval"の値。
 		TimePoint pv_interval = 0;
@@ -312,6 +318,10 @@ namespace dlshogi
 		//    flag : 探索したノードの再利用をするのか
 		void SetReuseSubtree(bool flag);
 
+		//  同じ局面のNodeを共有する(DAGにする)かの設定
+		//  InitializeUctSearch()で反映される。
+		void SetTransposition(bool flag);
+
 		// 勝率から評価値に変換する際の係数を設定する。
 		// ここで設定した値は、そのままsearch_options.eval_coefに反映する。
 		// 変換部の内部的には、ここで設定した値が1/1000倍されて計算時に使用される。
@@ -407,6 +417,21 @@ namespace dlshogi
 		std::mutex& get_node_mutex(const Position* pos) { return node_mutexes.get_mutex(pos); }
 		//std::mutex& get_child_node_mutex(const HASH_KEY posKey) { return child_node_mutexes.get_mutex(posKey); }
 
+		// 全探索スレッドとGCの計測用のカウンターを合算したものを返す。
+		// 探索中に呼び出してはならない。
+		SearchStats GetSearchStats() const;
+
+		// 計測用のカウンターをすべて0にする。
+		void ClearSearchStats();
+
+		// NNの推論結果のcache。サイズはSetNNCacheSize()で設定する。
+		// 各探索スレッドから参照する。
+		NNCache nn_cache;
+
+		// NNCacheのサイズを[MB]で設定する。0ならcacheを用いない。
+		// 以前の内容はクリアされる。
+		void SetNNCacheSize(size_t size_mb) { nn_cache.resize(size_mb); }
+
 	private:
 
 		// Root Node(探索開始局面)を展開する。
@@ -23,6 +23,7 @@
 #include "../../thread.h"
 #include "../../misc.h"
 #include "../../tt.h"
+#include "../../perf_counter.h"
 #include "../../book/book.h"
 #include "../../movepick.h"
 #include "../../usi.h"
@@ -91,6 +92,12 @@ void USI::extra_option(USI::OptionsMap & o)
 	//  PVの出力の抑制のために前回出力時間からの間隔を指定できる。
 	o["PvInterval"]     << Option(300, 0, 100000);
 
+	// Lazy SMPでのhelper threadの探索深さの分散方法。
+	// None       : 分散させない。
+	// SkipBlocks : Stockfish9のskip blockの表に従って、helper threadごとに一部の深さを飛ばす。
+	//              スレッド数が多いときに、同じ深さを探索するスレッドが偏らないようにする。
+	o["SMP_Diversification"] << Option(std::vector<std::string>{ "None", "SkipBlocks" }, "None");
+
 	// 投了スコア
 	o["ResignValue"]    << Option(99999, 0, 99999);
 
@@ -342,7 +349,7 @@ namespace {
 			else
 			{
 				pos.do_move(m, st);
-				cnt = leaf ? MoveList<LEGAL_ALL>(pos).size() : perft<false>(pos, depth - 1);
+				cnt = leaf ? countMoves<LEGAL_ALL>(pos) : perft<false>(pos, depth - 1);
 				nodes += cnt;
 				pos.undo_move(m);
 			}
@@ -478,6 +485,9 @@ void MainThread::search()
 	// この場合は、PVを毎回出力しないと読み筋が出力されないことがある。
 	Limits.pv_interval = (Limits.infinite || Limits.consideration_mode) ? 0 : (int)Options["PvInterval"];
 
+	// Lazy SMPでのhelper threadの探索深さの分散方法
+	Limits.smp_diversification = std::string(Options["SMP_Diversification"]) == "SkipBlocks" ? 1 : 0;
+
 	// ---------------------
 	// perft(performance test)
 	// ---------------------
@@ -591,6 +601,8 @@ void MainThread::search()
 	// 各スレッドがsearch()を実行する
 	// ---------------------
 
+	Threads.rootVotes.clear(); // 前回の探索の投票を消しておく。
+
 	Threads.start_searching(); // main以外のthreadを開始する
 	Thread::search();          // main thread(このスレッド)も探索に参加する。
 
@@ -893,6 +905,20 @@ void Thread::search()
 		// 折衷案として、rootDepthが低い時にhelper threadをmain threadより先行させる(高いdepthにする)
 		// コード自体は入れたほうがいいかも知れない。
 
+		// → エンジンオプションのSMP_Diversificationで"SkipBlocks"を指定したときは、Stockfish9のコードで
+		//    helper threadごとに一部の深さを飛ばす。
+		if (!mainThread && Limits.smp_diversification == 1)
+		{
+			// Sizes and phases of the skip-blocks, used for distributing search depths across the threads
+			static constexpr int SkipSize [] = { 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+			static constexpr int SkipPhase[] = { 0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7 };
+
+			// Distribute search depths across the helper threads
+			int i = int(thread_id() - 1) % 20;
+			if (((rootDepth + SkipPhase[i]) / SkipSize[i]) % 2)
+				continue;  // Retry with an incremented rootDepth
+		}
+
 		// ------------------------
 		// Lazy SMPのための初期化
 		// ------------------------
@@ -1103,8 +1129,13 @@ void Thread::search()
 
 		  // ここでこの反復深化の1回分は終了したのでcompletedDepthに反映させておく。
 		if (!Threads.stop)
+		{
 			completedDepth = rootDepth;
 
+			// get_best_thread()での投票のために、このiterationの結果を書き込んでおく。
+			Threads.rootVotes.publish(thread_id(), rootMoves[0].pv[0], rootMoves[0].score, completedDepth);
+		}
+
 		if (rootMoves[0].pv[0] != lastBestMove) {
 			lastBestMove = rootMoves[0].pv[0];
 			lastBestMoveDepth = rootDepth;
@@ -1282,6 +1313,8 @@ namespace {
 		if (depth <= 0)
 			return qsearch<PvNode ? PV : NonPV>(pos, ss, alpha, beta);
 
+		PERF_COUNT(SEARCH_NODES);
+
 		ASSERT_LV3(-VALUE_INFINITE <= alpha && alpha < beta && beta <= VALUE_INFINITE);
 		ASSERT_LV3(PvNode || (alpha == beta - 1));
 		ASSERT_LV3(0 < depth && depth < MAX_PLY);
@@ -1301,8 +1334,9 @@ namespace {
 		// do_move()するときに必要
 		StateInfo st;
 
-		// TTのprobe()の返し値
-		TTEntry* tte;
+		// TTのprobe()の返し値。置換表のentryの内容はttDataから読み、書き戻すときはttWriterを用いる。
+		TTData ttData;
+		TTWriter ttWriter;
 
 		// このnodeのhash key
 		Key posKey;
@@ -1501,7 +1535,7 @@ namespace {
 		// excludedMoveがMOVE_NONEの時はkeyを変更してはならない。
 		posKey = excludedMove == MOVE_NONE ? pos.key() : pos.key() ^ make_key(excludedMove);
 
-		tte = TT.probe(posKey, ss->ttHit);
+		ttWriter = TT.probe(posKey, thisThread->numa_node, ss->ttHit, ttData);
 
 		// 置換表上のスコア
 		// 置換表にhitしなければVALUE_NONE
@@ -1509,18 +1543,18 @@ namespace {
 		// singular searchとIIDとのスレッド競合を考慮して、ttValue , ttMoveの順で取り出さないといけないらしい。
 		// cf. More robust interaction of singular search and iid : https://github.com/official-stockfish/Stockfish/commit/16b31bb249ccb9f4f625001f9772799d286e2f04
 
-		ttValue = ss->ttHit ? value_from_tt(tte->value(), ss->ply) : VALUE_NONE;
+		ttValue = ss->ttHit ? value_from_tt(ttData.value, ss->ply) : VALUE_NONE;
 
 		// 置換表の指し手
 		// 置換表にhitしなければMOVE_NONE
 		// RootNodeであるなら、(MultiPVなどでも)現在注目している1手だけがベストの指し手と仮定できるから、
 		// それが置換表にあったものとして指し手を進める。
 		// 注意)
-		// tte->move()にはMOVE_WINも含まれている可能性がある。
+		// ttData.moveにはMOVE_WINも含まれている可能性がある。
 		// この時、pos.to_move(MOVE_WIN) == MOVE_WINなので、ttMove == MOVE_WINとなる。
 
 		ttMove = rootNode ? thisThread->rootMoves[thisThread->pvIdx].pv[0]
-			  : ss->ttHit ? pos.to_move(tte->move()) : MOVE_NONE;
+			  : ss->ttHit ? pos.to_move(ttData.move) : MOVE_NONE;
 		ASSERT_LV3(pos.super_legal(ttMove));
 
 		// 置換表の指し手がcaptureOrPromotionであるか。
@@ -1537,7 +1571,7 @@ namespace {
 		// そのときにss->ttPvが破壊される。なので、破壊しそうなときは直前にローカル変数に保存するコードが書いてある。
 
 		if (!excludedMove)
-			ss->ttPv = PvNode || (ss->ttHit && tte->is_pv());
+			ss->ttPv = PvNode || (ss->ttHit && ttData.is_pv);
 
 	    // Update low ply history for previous move if we are near root and position is or has been in PV
 		// もし、root付近で局面がPVである場合、直前の指し手に対するlow ply historyを更新する
@@ -1556,13 +1590,13 @@ namespace {
 
 		if (  !PvNode                  // PV nodeでは置換表の指し手では枝刈りしない(PV nodeはごくわずかしかないので..)
 			&& ss->ttHit               // 置換表の指し手がhitして
-			&& tte->depth() > depth - (thisThread->id() % 2 == 1)   // 置換表に登録されている探索深さのほうが深くて
+			&& ttData.depth > depth - (thisThread->id() % 2 == 1)   // 置換表に登録されている探索深さのほうが深くて
 									   // ↑ スレッドごとに探索がばらけるように。
 			&& ttValue != VALUE_NONE   // (VALUE_NONEだとすると他スレッドからTTEntryが読みだす直前に破壊された可能性がある)
-			&& (ttValue >= beta ? (tte->bound() & BOUND_LOWER)
-				                : (tte->bound() & BOUND_UPPER))
+			&& (ttValue >= beta ? (ttData.bound & BOUND_LOWER)
+				                : (ttData.bound & BOUND_UPPER))
 			// ttValueが下界(真の評価値はこれより大きい)もしくはジャストな値で、かつttValue >= beta超えならbeta cutされる
-			// ttValueが上界(真の評価値はこれより小さい)だが、tte->depth()のほうがdepthより深いということは、
+			// ttValueが上界(真の評価値はこれより小さい)だが、ttData.depthのほうがdepthより深いということは、
 			// 今回の探索よりたくさん探索した結果のはずなので、今回よりは枝刈りが甘いはずだから、その値を信頼して
 			// このままこの値でreturnして良い。
 			)
@@ -1654,7 +1688,7 @@ namespace {
 					bestValue = mate_in(ss->ply + 1); // 1手詰めなのでこの次のnodeで(指し手がなくなって)詰むという解釈
 
 					ASSERT_LV3(pos.super_legal(m));
-					tte->save(posKey, value_to_tt(bestValue, ss->ply), ss->ttPv, BOUND_EXACT,
+					ttWriter.write(posKey, value_to_tt(bestValue, ss->ply), ss->ttPv, BOUND_EXACT,
 						MAX_PLY, m, ss->staticEval);
 
 					// 読み筋にMOVE_WINも出力するためには、このときpv配列を更新したほうが良いが
@@ -1690,7 +1724,7 @@ namespace {
 
 						// staticEvalの代わりに詰みのスコア書いてもいいのでは..
 						ASSERT_LV3(pos.super_legal(move));
-						tte->save(posKey, value_to_tt(bestValue, ss->ply), ss->ttPv, BOUND_EXACT,
+						ttWriter.write(posKey, value_to_tt(bestValue, ss->ply), ss->ttPv, BOUND_EXACT,
 							MAX_PLY, move, /* ss->staticEval */ bestValue);
 
 						// ■　【計測資料 39.】 mate1plyの指し手を見つけた時に置換表の指し手でbeta cutする時と同じ処理をする。
@@ -1711,7 +1745,7 @@ namespace {
 						bestValue = mate_in(ss->ply + PARAM_WEAK_MATE_PLY);
 
 						ASSERT_LV3(pos.super_legal(move));
-						tte->save(posKey, value_to_tt(bestValue, ss->ply), ss->ttPv, BOUND_EXACT,
+						ttWriter.write(posKey, value_to_tt(bestValue, ss->ply), ss->ttPv, BOUND_EXACT,
 							MAX_PLY, move, /* ss->staticEval */ bestValue);
 
 						return bestValue;
@@ -1745,7 +1779,7 @@ namespace {
 			// Never assume anything about values stored in TT
 			// TTに格納されている値に関して何も仮定はしない
 
-			ss->staticEval = eval = tte->eval();
+			ss->staticEval = eval = ttData.eval;
 
 			// 置換表にhitしたなら、評価値が記録されているはずだから、それを取り出しておく。
 			// あとで置換表に書き込むときにこの値を使えるし、各種枝刈りはこの評価値をベースに行なうから。
@@ -1772,7 +1806,7 @@ namespace {
 			//   evalとしてttValueを採用したほうがこの局面に対する評価値の見積りとして適切である。
 
 			if (    ttValue != VALUE_NONE
-				&& (tte->bound() & (ttValue > eval ? BOUND_LOWER : BOUND_UPPER)))
+				&& (ttData.bound & (ttValue > eval ? BOUND_LOWER : BOUND_UPPER)))
 				eval = ttValue;
 
 		}
@@ -1788,7 +1822,7 @@ namespace {
 			// cf . Add / remove leaves from search tree ttPv : https://github.com/official-stockfish/Stockfish/commit/c02b3a4c7a339d212d5c6f75b3b89c926d33a800
 
 			if (!excludedMove)
-				tte->save(posKey, VALUE_NONE, ss->ttPv, BOUND_NONE, DEPTH_NONE, MOVE_NONE, eval);
+				ttWriter.write(posKey, VALUE_NONE, ss->ttPv, BOUND_NONE, DEPTH_NONE, MOVE_NONE, eval);
 
 			// どうせ毎node評価関数を呼び出すので、evalの値にそんなに価値はないのだが、mate1ply()を
 			// 実行したという証にはなるので意味がある。
@@ -1962,14 +1996,14 @@ namespace {
 			// 実効的な深さはdepth - 3と同じになるからです。
 
 			&& !(  ss->ttHit
-				&& tte->depth() >= depth - (PARAM_PROBCUT_DEPTH-1)
+				&& ttData.depth >= depth - (PARAM_PROBCUT_DEPTH-1)
 				&& ttValue != VALUE_NONE
 				&& ttValue < probCutBeta))
 		{
 			ASSERT_LV3(probCutBeta < VALUE_INFINITE);
 
 			MovePicker mp(pos, ttMove, probCutBeta - ss->staticEval, &captureHistory);
-			bool ttPv = ss->ttPv;  // このあとの探索でss->ttPvを潰してしまうのでtte->save()のときはこっちを用いる。
+			bool ttPv = ss->ttPv;  // このあとの探索でss->ttPvを潰してしまうのでttWriter.write()のときはこっちを用いる。
 			ss->ttPv = false;
 
 			// 試行回数は2回(cutNodeなら4回)までとする。(よさげな指し手を3つ試して駄目なら駄目という扱い)
@@ -2016,11 +2050,11 @@ namespace {
 						// もし置換表が、等しいかより深く探索した情報ではないなら、probCutの情報をそこに書く
 
 						if (! (ss->ttHit
-							&& tte->depth() >= depth - (PARAM_PROBCUT_DEPTH - 1)
+							&& ttData.depth >= depth - (PARAM_PROBCUT_DEPTH - 1)
 							&& ttValue != VALUE_NONE))
 						{
 							ASSERT_LV3(pos.super_legal(move));
-							tte->save(posKey, value_to_tt(value, ss->ply), ttPv,
+							ttWriter.write(posKey, value_to_tt(value, ss->ply), ttPv,
 								BOUND_LOWER,
 								depth - (PARAM_PROBCUT_DEPTH - 1), move, ss->staticEval);
 						}
@@ -2076,8 +2110,8 @@ namespace {
 			&& !PvNode
 			&& depth >= 4
 			&& ttCapture
-			&& (tte->bound() & BOUND_LOWER)
-			&& tte->depth() >= depth - 3
+			&& (ttData.bound & BOUND_LOWER)
+			&& ttData.depth >= depth - 3
 			&& ttValue >= probCutBeta
 			&& abs(ttValue) <= VALUE_KNOWN_WIN
 			&& abs(beta) <= VALUE_KNOWN_WIN
@@ -2120,8 +2154,8 @@ namespace {
 		// ノードが現在のdepth以上で探索され、fail lowである時に、PvNodeがfail lowしそうであるかを示すフラグ。
 		bool likelyFailLow =   PvNode
 							&& ttMove
-							&& (tte->bound() & BOUND_UPPER)
-							&& tte->depth() >= depth;
+							&& (ttData.bound & BOUND_UPPER)
+							&& ttData.depth >= depth;
 
 
 		// -----------------------
@@ -2315,8 +2349,8 @@ namespace {
 				&& !excludedMove // 再帰的なsingular延長を除外する。
 			/*  &&  ttValue != VALUE_NONE Already implicit in the next condition */
 				&&  abs(ttValue) < VALUE_KNOWN_WIN // 詰み絡みのスコアはsingular extensionはしない。(Stockfish 10～)
-				&& (tte->bound() & BOUND_LOWER)
-				&&  tte->depth() >= depth - 3)
+				&& (ttData.bound & BOUND_LOWER)
+				&&  ttData.depth >= depth - 3)
 				// このnodeについてある程度調べたことが置換表によって証明されている。(ttMove == moveなのでttMove != MOVE_NONE)
 				// (そうでないとsingularの指し手以外に他の有望な指し手がないかどうかを調べるために
 				// null window searchするときに大きなコストを伴いかねないから。)
@@ -2433,7 +2467,7 @@ namespace {
 			// Speculative prefetch as early as possible
 			// 投機的なprefetch
 			//const Key nextKey = pos.key_after(move);
-			//prefetch(TT.first_entry(nextKey));
+			//prefetch(TT.first_entry(nextKey, thisThread->numa_node));
 			//Eval::prefetch_evalhash(nextKey);
 
 			// Update the current move (this must be done after singular extension search)
@@ -2869,7 +2903,7 @@ namespace {
 		if (!excludedMove && !(rootNode && thisThread->pvIdx))
 		{
 			ASSERT_LV3(pos.super_legal(bestMove));
-			tte->save(posKey, value_to_tt(bestValue, ss->ply), ss->ttPv,
+			ttWriter.write(posKey, value_to_tt(bestValue, ss->ply), ss->ttPv,
 				bestValue >= beta ? BOUND_LOWER :
 				PvNode && bestMove ? BOUND_EXACT : BOUND_UPPER,
 				depth, bestMove, ss->staticEval);
@@ -2904,6 +2938,8 @@ namespace {
 		ASSERT_LV3(PvNode || alpha == beta - 1);
 		ASSERT_LV3(depth <= 0);
 
+		PERF_COUNT(QSEARCH_NODES);
+
 		// PV求める用のbuffer
 		// (これnonPVでは不要なので、nonPVでは参照していないの削除される。)
 		Move pv[MAX_PLY + 1];
@@ -2912,7 +2948,8 @@ namespace {
 		StateInfo st;
 
 		// 置換表にhitしたときの置換表のエントリーへのポインタ
-		TTEntry* tte;
+		TTData ttData;
+		TTWriter ttWriter;
 
 		// この局面のhash key
 		Key posKey;
@@ -2994,10 +3031,10 @@ namespace {
 		// 置換表のlookup
 
 		posKey = pos.key();
-		tte = TT.probe(posKey, ss->ttHit);
-		ttValue = ss->ttHit ? value_from_tt(tte->value(), ss->ply) : VALUE_NONE;
-		ttMove  = ss->ttHit ? pos.to_move(tte->move()) : MOVE_NONE;
-		pvHit   = ss->ttHit && tte->is_pv();
+		ttWriter = TT.probe(posKey, thisThread->numa_node, ss->ttHit, ttData);
+		ttValue = ss->ttHit ? value_from_tt(ttData.value, ss->ply) : VALUE_NONE;
+		ttMove  = ss->ttHit ? pos.to_move(ttData.move) : MOVE_NONE;
+		pvHit   = ss->ttHit && ttData.is_pv;
 
 		ASSERT_LV3(pos.super_legal(ttMove));
 
@@ -3005,13 +3042,13 @@ namespace {
 		// PVでは置換表の指し手では枝刈りしない(前回evaluateした値は使える)
 		if (  !PvNode
 			&& ss->ttHit
-			&& tte->depth() >= ttDepth
+			&& ttData.depth >= ttDepth
 			&& ttValue != VALUE_NONE // Only in case of TT access race
 									 // ↑置換表から取り出したときに他スレッドが値を潰している可能性があるのでこのチェックが必要
-			&& (ttValue >= beta ? (tte->bound() & BOUND_LOWER)
-								: (tte->bound() & BOUND_UPPER)))
+			&& (ttValue >= beta ? (ttData.bound & BOUND_LOWER)
+								: (ttData.bound & BOUND_UPPER)))
 			// ttValueが下界(真の評価値はこれより大きい)もしくはジャストな値で、かつttValue >= beta超えならbeta cutされる
-			// ttValueが上界(真の評価値はこれより小さい)だが、tte->depth()のほうがdepthより深いということは、
+			// ttValueが上界(真の評価値はこれより小さい)だが、ttData.depthのほうがdepthより深いということは、
 			// 今回の探索よりたくさん探索した結果のはずなので、今回よりは枝刈りが甘いはずだから、その値を信頼して
 			// このままこの値でreturnして良い。
 		{
@@ -3073,12 +3110,12 @@ namespace {
 				// 置換表に評価値が格納されているとは限らないのでその場合は評価関数の呼び出しが必要
 				// bestValueの初期値としてこの局面のevaluate()の値を使う。これを上回る指し手があるはずなのだが..
 
-				if ((ss->staticEval = bestValue = tte->eval()) == VALUE_NONE)
+				if ((ss->staticEval = bestValue = ttData.eval) == VALUE_NONE)
 					ss->staticEval = bestValue = evaluate(pos);
 
-				// 毎回evaluate()を呼ぶならtte->eval()自体不要なのだが、
+				// 毎回evaluate()を呼ぶならttData.eval自体不要なのだが、
 				// 置換表の指し手でこのまま枝刈りできるケースがあるから難しい。
-				// 評価関数がKPPTより軽ければ、tte->eval()をなくしても良いぐらいなのだが…。
+				// 評価関数がKPPTより軽ければ、ttData.evalをなくしても良いぐらいなのだが…。
 
 				// Can ttValue be used as a better position evaluation?
 
@@ -3086,7 +3123,7 @@ namespace {
 				// 精度で探索されたものであるなら、それをbestValueの初期値として使う。
 
 				if (	ttValue != VALUE_NONE
-					&& (tte->bound() & (ttValue > bestValue ? BOUND_LOWER : BOUND_UPPER)))
+					&& (ttData.bound & (ttValue > bestValue ? BOUND_LOWER : BOUND_UPPER)))
 					bestValue = ttValue;
 
 			} else {
@@ -3122,7 +3159,7 @@ namespace {
 			{
 	            // Save gathered info in transposition table
 				if (!ss->ttHit)
-					tte->save(posKey, value_to_tt(bestValue, ss->ply), false /* ss->ttHit == false */, BOUND_LOWER,
+					ttWriter.write(posKey, value_to_tt(bestValue, ss->ply), false /* ss->ttHit == false */, BOUND_LOWER,
 								DEPTH_NONE, MOVE_NONE, ss->staticEval);
 
 				return bestValue;
@@ -3253,7 +3290,7 @@ namespace {
 
 			// TODO : prefetchは、入れると遅くなりそうだが、many coreだと違うかも。
 			// Speculative prefetch as early as possible
-			//prefetch(TT.first_entry(pos.key_after(move)));
+			//prefetch(TT.first_entry(pos.key_after(move), thisThread->numa_node));
 
 			// -----------------------
 			//     局面を1手進める
@@ -3360,7 +3397,7 @@ namespace {
 		// 詰みではなかったのでこれを書き出す。
 		// ※　qsearch()の結果は信用ならないのでBOUND_EXACTで書き出すことはない。
 		ASSERT_LV3(pos.super_legal(bestMove));
-		tte->save(posKey, value_to_tt(bestValue, ss->ply), pvHit,
+		ttWriter.write(posKey, value_to_tt(bestValue, ss->ply), pvHit,
 				  bestValue >= beta ? BOUND_LOWER : BOUND_UPPER,
 				  ttDepth, bestMove, ss->staticEval);
 
@@ -7,6 +7,10 @@
 #elif defined (TENSOR_RT)
 	#include <cuda_runtime.h> // cudaHostAlloc()
 	#include "nn_tensorrt.h"
+#elif defined (NATIVE_NN)
+	#include "nn_native.h"
+#elif defined (MOCK_NN)
+	#include "nn_mock.h"
 #endif
 
 #include "../../misc.h"
@@ -20,7 +24,7 @@ namespace Eval::dlshogi
 	void* NN::alloc(size_t size)
 	{
 		void* ptr;
-#if defined (ONNXRUNTIME)
+#if defined (ONNXRUNTIME) || defined (NATIVE_NN) || defined (MOCK_NN)
 		ptr = (void*)new u8[size];
 #elif defined (TENSOR_RT)
 		checkCudaErrors(cudaHostAlloc(&ptr, size, cudaHostAllocPortable));
@@ -32,7 +36,7 @@ namespace Eval::dlshogi
 	void NN::free(void*ptr)
 	{
 
-#if defined (ONNXRUNTIME)
+#if defined (ONNXRUNTIME) || defined (NATIVE_NN) || defined (MOCK_NN)
 		delete[] (u8*)ptr;
 #elif defined (TENSOR_RT)
 		checkCudaErrors(cudaFreeHost(ptr));
@@ -45,6 +49,10 @@ namespace Eval::dlshogi
 		return NNOnnxRuntime::get_device_count();
 #elif defined(TENSOR_RT)
 		return NNTensorRT::get_device_count();
+#elif defined(NATIVE_NN)
+		return NNNative::get_device_count();
+#elif defined(MOCK_NN)
+		return NNMock::get_device_count();
 #endif
 	}
 
@@ -64,6 +72,15 @@ namespace Eval::dlshogi
 		// ファイル名に応じて、他のフォーマットに対応させるはずだったが、
 		// TensorRTの場合、モデルファイル側にその情報があるので
 		// ここで振り分ける必要はなさげ。
+
+#elif defined (NATIVE_NN)
+
+		nn = std::make_unique<NNNative>();
+
+#elif defined (MOCK_NN)
+
+		nn = std::make_unique<NNMock>();
+
 #endif
 
 		sync_cout << "info string Start loading the model file, path = " << model_path << ", gpu_id = " << gpu_id << ", batch_size = " << batch_size << sync_endl;
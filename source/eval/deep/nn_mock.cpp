@@ -0,0 +1,109 @@
+﻿#include "nn_mock.h"
+
+#if defined(YANEURAOU_ENGINE_DEEP) && defined(MOCK_NN)
+
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#include "../../misc.h"
+
+using namespace std;
+using namespace Tools;
+
+namespace Eval::dlshogi
+{
+	std::atomic<s64> NNMock::latency_us{ 0 };
+	std::atomic<s64> NNMock::latency_per_position_us{ 0 };
+
+	namespace {
+
+	// packed_features(bit単位で詰められている)の[begin, begin + bits)のbit列でhash値hを更新して返す。
+	// 1局面分の特徴量はbyte境界に揃っていないので、8bitずつ切り出す。
+	u64 hash_bits(const PType* p, u64 begin, u64 bits, u64 h)
+	{
+		const u64 end = begin + bits;
+		for (u64 i = begin; i < end; i += 8)
+		{
+			const u64 n     = std::min<u64>(end - i, 8);
+			const u64 index = i >> 3;
+			const u64 shift = i & 7;
+
+			u64 v = p[index] >> shift;
+			if (shift + n > 8)
+				v |= (u64)p[index + 1] << (8 - shift);
+			v &= (1ULL << n) - 1;
+
+			// FNV-1a
+			h = (h ^ v) * 0x100000001b3ULL;
+		}
+		return h;
+	}
+
+	// xorshift64*
+	inline u64 next_random(u64& s)
+	{
+		s ^= s >> 12;
+		s ^= s << 25;
+		s ^= s >> 27;
+		return s * 0x2545F4914F6CDD1DULL;
+	}
+
+	// [0,1)の乱数
+	inline float to_unit(u64 r) { return float(r >> 40) * (1.0f / float(1 << 24)); }
+
+	} // namespace
+
+	// 推論の時間として待つ時間[us]を設定する。
+	void NNMock::set_latency(s64 latency, s64 latency_per_position)
+	{
+		latency_us              = std::max(latency, (s64)0);
+		latency_per_position_us = std::max(latency_per_position, (s64)0);
+	}
+
+	// モデルファイルの読み込み。(何も読み込まない)
+	Result NNMock::load(const std::string& model_path, int gpu_id, int batch_size)
+	{
+		sync_cout << "info string NNMock : model file is not used"
+			<< ", latency = " << latency_us << "us + " << latency_per_position_us << "us/position" << sync_endl;
+
+		return ResultCode::Ok;
+	}
+
+	// 入力特徴量のhash値からpolicyとvalueを生成する。
+	void NNMock::forward(const int batch_size, PType* p1, PType* p2, NN_Input1* x1, NN_Input2* x2, NN_Output_Policy* y1, NN_Output_Value* y2)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		constexpr u64 features1_bits = (u64)COLOR_NB * MAX_FEATURES1_NUM * (u64)SQ_NB;
+		constexpr u64 features2_bits = MAX_FEATURES2_NUM;
+		constexpr int policy_num     = MAX_MOVE_LABEL_NUM * (int)SQ_NB;
+
+		for (int b = 0; b < batch_size; ++b)
+		{
+			u64 h = 0xcbf29ce484222325ULL;
+			h = hash_bits(p1, b * features1_bits, features1_bits, h);
+			h = hash_bits(p2, b * features2_bits, features2_bits, h);
+
+			// xorshiftのseedは0であってはならない。
+			u64 s = h | 1;
+
+			// valueは、極端な値にならないように[0.05,0.95)にしておく。
+			y2[b] = to_dtype(0.05f + 0.9f * to_unit(next_random(s)));
+
+			// policyのlogitは[-3,3)。
+			DType* logits = y1[b];
+			for (int i = 0; i < policy_num; ++i)
+				logits[i] = to_dtype(6.0f * to_unit(next_random(s)) - 3.0f);
+		}
+
+		// GPUでの推論時間の代わりに待つ。
+		// 他の探索スレッドにCPUを譲れるように、busy waitではなくsleepする。
+		const s64 wait_us = latency_us + latency_per_position_us * batch_size;
+		if (wait_us > 0)
+			std::this_thread::sleep_until(start + std::chrono::microseconds(wait_us));
+	}
+
+} // namespace Eval::dlshogi
+
+#endif // defined(YANEURAOU_ENGINE_DEEP) && defined(MOCK_NN)
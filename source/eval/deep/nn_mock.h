@@ -0,0 +1,52 @@
+﻿#ifndef __NN_MOCK_H_INCLUDED__
+#define __NN_MOCK_H_INCLUDED__
+#include "../../config.h"
+
+#if defined(YANEURAOU_ENGINE_DEEP) && defined(MOCK_NN)
+
+// 推論を行わない、探索部の計測用のNN。
+// 入力特徴量のhash値から、決定的(同じ局面なら毎回同じ)なpolicyとvalueを生成して返す。
+// GPUもモデルファイルもない環境(CIなど)で、UCT探索側の速度を計測したりprofileしたりするためのもの。
+//
+// 推論にかかる時間は、エンジンオプションで指定した分だけ待つことで模擬する。
+//   NN_MockLatency            : forward()1回あたりに待つ時間[us]
+//   NN_MockLatencyPerPosition : 1局面あたりに追加で待つ時間[us]
+// forward()の時間 = NN_MockLatency + batch_size * NN_MockLatencyPerPosition となる。
+//
+// モデルファイルは読み込まない。(DNN_Model1などの設定は無視する)
+
+#include <atomic>
+
+#include "nn.h"
+#include "nn_types.h"
+
+namespace Eval::dlshogi
+{
+	// 探索部の計測用のNN
+	class NNMock : public NN
+	{
+	public:
+		// モデルファイルの読み込み。(何も読み込まない)
+		virtual Tools::Result load(const std::string& model_path, int gpu_id, int batch_size);
+
+		// 入力特徴量のhash値からpolicyとvalueを生成する。
+		virtual void forward(const int batch_size, PType* p1, PType* p2, NN_Input1* x1, NN_Input2* x2, NN_Output_Policy* y1, NN_Output_Value* y2);
+
+		// 使用可能なデバイス数を取得する。
+		// 複数GPUの時の探索部の挙動も調べられるように、最大数まで使えることにしておく。
+		static int get_device_count() { return max_gpu; }
+
+		// 推論の時間として待つ時間[us]を設定する。"isready"に対して呼び出される。
+		//   latency              : forward()1回あたりに待つ時間
+		//   latency_per_position : 1局面あたりに追加で待つ時間
+		static void set_latency(s64 latency, s64 latency_per_position);
+
+	private:
+		static std::atomic<s64> latency_us;
+		static std::atomic<s64> latency_per_position_us;
+	};
+
+} // namespace Eval::dlshogi
+
+#endif // defined(YANEURAOU_ENGINE_DEEP) && defined(MOCK_NN)
+#endif // ndef __NN_MOCK_H_INCLUDED__
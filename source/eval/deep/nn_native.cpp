@@ -0,0 +1,1784 @@
+﻿#include "nn_native.h"
+
+#if defined(YANEURAOU_ENGINE_DEEP) && defined(NATIVE_NN)
+
+#include <fstream>
+#include <sstream>
+#include <cmath>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <unordered_map>
+
+#if defined(USE_AVX2)
+#include <immintrin.h>
+#endif
+
+#include "../../usi.h"
+#include "../../misc.h"
+
+using namespace std;
+using namespace Tools;
+
+namespace Eval::dlshogi
+{
+	// ---------------------------------------------
+	//   ONNXファイルの読み込み
+	// ---------------------------------------------
+
+	// ONNXはprotobufで書かれているが、protobufのライブラリに依存したくないので
+	// 必要なfieldだけを自前で読み込む。
+	// cf. https://github.com/onnx/onnx/blob/main/onnx/onnx.proto
+
+	namespace {
+
+	// protobufのwire formatを読み込むためのclass
+	struct PbReader
+	{
+		PbReader(const u8* p_, const u8* end_) : p(p_), end(end_) {}
+
+		bool eof() const { return p >= end || error; }
+
+		u64 varint()
+		{
+			u64 r = 0;
+			for (int shift = 0; shift < 64; shift += 7)
+			{
+				if (p >= end)
+					break;
+				const u8 b = *p++;
+				r |= u64(b & 0x7f) << shift;
+				if (!(b & 0x80))
+					return r;
+			}
+			error = true;
+			return 0;
+		}
+
+		u32 fixed32()
+		{
+			u32 v = 0;
+			if (end - p < 4) { error = true; return 0; }
+			memcpy(&v, p, 4);
+			p += 4;
+			return v;
+		}
+
+		// 次のfieldのkeyを読み込む。
+		bool next(int& field, int& wire)
+		{
+			if (eof())
+				return false;
+			const u64 key = varint();
+			field = int(key >> 3);
+			wire  = int(key & 7);
+			return !error;
+		}
+
+		// length-delimitedなfieldの中身
+		PbReader bytes()
+		{
+			const u64 len = varint();
+			if (error || len > u64(end - p))
+			{
+				error = true;
+				return PbReader(end, end);
+			}
+			PbReader r(p, p + len);
+			p += len;
+			return r;
+		}
+
+		std::string str() { auto r = bytes(); return std::string((const char*)r.p, r.end - r.p); }
+
+		// 読み飛ばす。
+		void skip(int wire)
+		{
+			switch (wire)
+			{
+			case 0: varint(); break;
+			case 1: if (end - p < 8) error = true; else p += 8; break;
+			case 2: bytes(); break;
+			case 5: fixed32(); break;
+			default: error = true; break;
+			}
+		}
+
+		// repeated int64(packedとそうでないものの両方がありうる)
+		void ints(int wire, std::vector<s64>& v)
+		{
+			if (wire == 2)
+			{
+				auto r = bytes();
+				while (!r.eof())
+					v.push_back((s64)r.varint());
+				error |= r.error;
+			}
+			else
+				v.push_back((s64)varint());
+		}
+
+		// repeated float
+		void floats(int wire, std::vector<float>& v)
+		{
+			auto to_float = [](u32 u) { float f; memcpy(&f, &u, 4); return f; };
+			if (wire == 2)
+			{
+				auto r = bytes();
+				while (r.end - r.p >= 4)
+					v.push_back(to_float(r.fixed32()));
+			}
+			else
+				v.push_back(to_float(fixed32()));
+		}
+
+		const u8* p;
+		const u8* end;
+		bool error = false;
+	};
+
+	// IEEE754 half → float
+	float half_to_float(u16 h)
+	{
+		u32 sign = u32(h & 0x8000) << 16, exp = (h >> 10) & 0x1f, man = h & 0x3ff, f;
+		if (exp == 0)
+		{
+			if (man == 0)
+				f = sign;
+			else
+			{
+				// 非正規化数
+				exp = 127 - 15 + 1;
+				while (!(man & 0x400)) { man <<= 1; --exp; }
+				f = sign | (exp << 23) | ((man & 0x3ff) << 13);
+			}
+		}
+		else if (exp == 31)
+			f = sign | 0x7f800000 | (man << 13);
+		else
+			f = sign | ((exp + 127 - 15) << 23) | (man << 13);
+
+		float r;
+		memcpy(&r, &f, 4);
+		return r;
+	}
+
+	// ONNXのTensorProto
+	// 実数の型はすべてfloatに、整数の型はすべてs64に変換して保持する。
+	struct OnnxTensor
+	{
+		std::string name;
+		std::vector<s64> dims;
+		std::vector<float> data;
+		std::vector<s64> ints;
+
+		size_t size() const { size_t n = 1; for (auto d : dims) n *= size_t(d); return n; }
+	};
+
+	// ONNXのAttributeProto
+	struct OnnxAttribute
+	{
+		std::string name;
+		float f = 0;
+		s64 i = 0;
+		std::vector<float> floats;
+		std::vector<s64> ints;
+		OnnxTensor t;
+	};
+
+	// ONNXのNodeProto
+	struct OnnxNode
+	{
+		std::string op_type;
+		std::vector<std::string> inputs, outputs;
+		std::vector<OnnxAttribute> attributes;
+
+		const OnnxAttribute* attribute(const std::string& name) const
+		{
+			for (auto& a : attributes)
+				if (a.name == name)
+					return &a;
+			return nullptr;
+		}
+		s64   get_int  (const std::string& name, s64   def) const { auto a = attribute(name); return a ? a->i : def; }
+		float get_float(const std::string& name, float def) const { auto a = attribute(name); return a ? a->f : def; }
+		std::vector<s64> get_ints(const std::string& name) const { auto a = attribute(name); return a ? a->ints : std::vector<s64>(); }
+	};
+
+	// ONNXのGraphProto
+	struct OnnxGraph
+	{
+		std::vector<OnnxNode> nodes;
+		std::unordered_map<std::string, OnnxTensor> initializers;
+
+		// graphの入力(initializerでないもの)と出力の名前、入力のshape(不明な次元は-1)
+		std::vector<std::string> inputs, outputs;
+		std::vector<std::vector<s64>> input_dims;
+	};
+
+	// ONNXのdata_type
+	enum OnnxDataType { ONNX_FLOAT = 1, ONNX_INT32 = 6, ONNX_INT64 = 7, ONNX_FLOAT16 = 10, ONNX_DOUBLE = 11 };
+
+	bool parse_tensor(PbReader r, OnnxTensor& t)
+	{
+		int data_type = 0, field, wire;
+		std::vector<float> float_data;
+		std::vector<s64> int32_data, int64_data;
+		PbReader raw(nullptr, nullptr);
+		bool external = false;
+
+		while (r.next(field, wire))
+		{
+			switch (field)
+			{
+			case 1:  r.ints(wire, t.dims); break;
+			case 2:  data_type = (int)r.varint(); break;
+			case 4:  r.floats(wire, float_data); break;
+			case 5:  r.ints(wire, int32_data); break;
+			case 7:  r.ints(wire, int64_data); break;
+			case 8:  t.name = r.str(); break;
+			case 9:  raw = r.bytes(); break;
+			case 14: external = r.varint() == 1; break;
+			default: r.skip(wire); break;
+			}
+		}
+		if (r.error || external)
+			return false;
+
+		const size_t n = t.size();
+		const size_t raw_size = raw.end - raw.p;
+		switch (data_type)
+		{
+		case ONNX_FLOAT:
+			if (raw_size)
+			{
+				if (raw_size != n * 4) return false;
+				t.data.resize(n);
+				memcpy(t.data.data(), raw.p, raw_size);
+			}
+			else
+				t.data = std::move(float_data);
+			break;
+
+		case ONNX_FLOAT16:
+			if (raw_size && raw_size != n * 2) return false;
+			t.data.resize(n);
+			for (size_t i = 0; i < n; ++i)
+			{
+				u16 h;
+				if (raw_size)
+					memcpy(&h, raw.p + i * 2, 2);
+				else
+					h = i < int32_data.size() ? u16(int32_data[i]) : 0;
+				t.data[i] = half_to_float(h);
+			}
+			break;
+
+		case ONNX_DOUBLE:
+			if (raw_size != n * 8) return false;
+			t.data.resize(n);
+			for (size_t i = 0; i < n; ++i)
+			{
+				double d;
+				memcpy(&d, raw.p + i * 8, 8);
+				t.data[i] = float(d);
+			}
+			break;
+
+		case ONNX_INT64:
+		case ONNX_INT32:
+			if (raw_size)
+			{
+				const size_t w = data_type == ONNX_INT64 ? 8 : 4;
+				if (raw_size != n * w) return false;
+				t.ints.resize(n);
+				for (size_t i = 0; i < n; ++i)
+				{
+					if (w == 8) { s64 v; memcpy(&v, raw.p + i * 8, 8); t.ints[i] = v; }
+					else        { s32 v; memcpy(&v, raw.p + i * 4, 4); t.ints[i] = v; }
+				}
+			}
+			else
+				t.ints = data_type == ONNX_INT64 ? std::move(int64_data) : std::move(int32_data);
+			break;
+
+		default:
+			return false;
+		}
+
+		if (t.data.size() != n && t.ints.size() != n)
+			return false;
+
+		// 実数としても参照できるようにしておく。
+		if (t.data.empty())
+			for (auto v : t.ints)
+				t.data.push_back(float(v));
+
+		return true;
+	}
+
+	bool parse_attribute(PbReader r, OnnxAttribute& a)
+	{
+		int field, wire;
+		while (r.next(field, wire))
+		{
+			switch (field)
+			{
+			case 1: a.name = r.str(); break;
+			case 2: { u32 u = r.fixed32(); memcpy(&a.f, &u, 4); break; }
+			case 3: a.i = (s64)r.varint(); break;
+			case 5: if (!parse_tensor(r.bytes(), a.t)) return false; break;
+			case 7: r.floats(wire, a.floats); break;
+			case 8: r.ints(wire, a.ints); break;
+			default: r.skip(wire); break;
+			}
+		}
+		return !r.error;
+	}
+
+	bool parse_node(PbReader r, OnnxNode& node)
+	{
+		int field, wire;
+		while (r.next(field, wire))
+		{
+			switch (field)
+			{
+			case 1: node.inputs.push_back(r.str()); break;
+			case 2: node.outputs.push_back(r.str()); break;
+			case 4: node.op_type = r.str(); break;
+			case 5: node.attributes.emplace_back(); if (!parse_attribute(r.bytes(), node.attributes.back())) return false; break;
+			default: r.skip(wire); break;
+			}
+		}
+		return !r.error;
+	}
+
+	// ValueInfoProtoから名前とshapeを取り出す。
+	bool parse_value_info(PbReader r, std::string& name, std::vector<s64>& dims)
+	{
+		int field, wire;
+		while (r.next(field, wire))
+		{
+			if (field == 1)
+				name = r.str();
+			else if (field == 2)
+			{
+				// TypeProto.tensor_type(1).shape(2).dim(1).dim_value(1)
+				auto type = r.bytes();
+				while (type.next(field, wire))
+				{
+					if (field != 1) { type.skip(wire); continue; }
+					auto tensor = type.bytes();
+					while (tensor.next(field, wire))
+					{
+						if (field != 2) { tensor.skip(wire); continue; }
+						auto shape = tensor.bytes();
+						while (shape.next(field, wire))
+						{
+							if (field != 1) { shape.skip(wire); continue; }
+							auto dim = shape.bytes();
+							s64 v = -1;
+							while (dim.next(field, wire))
+								if (field == 1) v = (s64)dim.varint(); else dim.skip(wire);
+							dims.push_back(v);
+						}
+					}
+				}
+			}
+			else
+				r.skip(wire);
+		}
+		return !r.error;
+	}
+
+	Result parse_onnx(const std::string& filename, OnnxGraph& g)
+	{
+		std::ifstream ifs(filename, std::ios::binary);
+		if (!ifs)
+			return ResultCode::FileOpenError;
+		const std::string buf((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+		PbReader model((const u8*)buf.data(), (const u8*)buf.data() + buf.size());
+		int field, wire;
+		bool has_graph = false;
+		while (model.next(field, wire))
+		{
+			// ModelProto.graph = 7
+			if (field != 7) { model.skip(wire); continue; }
+			has_graph = true;
+
+			auto graph = model.bytes();
+			while (graph.next(field, wire))
+			{
+				switch (field)
+				{
+				case 1:
+					g.nodes.emplace_back();
+					if (!parse_node(graph.bytes(), g.nodes.back()))
+						return ResultCode::FileReadError;
+					break;
+
+				case 5: {
+					OnnxTensor t;
+					if (!parse_tensor(graph.bytes(), t))
+						return ResultCode::FileReadError;
+					auto name = t.name;
+					g.initializers[name] = std::move(t);
+					break;
+				}
+
+				case 11: case 12: {
+					std::string name;
+					std::vector<s64> dims;
+					if (!parse_value_info(graph.bytes(), name, dims))
+						return ResultCode::FileReadError;
+					if (field == 12)
+						g.outputs.push_back(name);
+					else
+					{
+						g.inputs.push_back(name);
+						g.input_dims.push_back(dims);
+					}
+					break;
+				}
+
+				default: graph.skip(wire); break;
+				}
+			}
+			if (graph.error)
+				return ResultCode::FileReadError;
+		}
+		if (model.error || !has_graph)
+			return ResultCode::FileReadError;
+
+		// 古いONNXではinitializerもgraphの入力に含まれているので取り除く。
+		for (size_t i = 0; i < g.inputs.size(); )
+			if (g.initializers.count(g.inputs[i]))
+			{
+				g.inputs.erase(g.inputs.begin() + i);
+				g.input_dims.erase(g.input_dims.begin() + i);
+			}
+			else
+				++i;
+
+		return ResultCode::Ok;
+	}
+
+	// ---------------------------------------------
+	//   SIMD
+	// ---------------------------------------------
+
+	// GEMMは、C[M][N] = A[M][K] * B[K][N]をMR×NRのタイル単位で計算する。
+	//   A : 重み。     [M/MR][K][MR]の順にpackしておく。
+	//   B : im2colした入力。[N/NR][K][NR]の順にpackする。
+	// int8の時はKを4つずつまとめて、A : [M/MR][K/4][MR][4] , B : [N/NR][K/4][NR][4]の順。
+	// (u8×s8の4要素の積和を1命令(VNNIのdpbusd)で計算するため)
+
+#if defined(USE_AVX512)
+
+	constexpr int W    = 16; // 1ベクトルに入るfloat(int32)の数
+	constexpr int NR   = 32;
+	constexpr int MR_F = 8;  // fp32
+	constexpr int MR_I = 8;  // int8
+
+	typedef __m512  vf;
+	typedef __m512i vi;
+
+	inline vf   vf_zero()                      { return _mm512_setzero_ps(); }
+	inline vf   vf_load(const float* p)        { return _mm512_loadu_ps(p); }
+	inline void vf_store(float* p, vf v)       { _mm512_storeu_ps(p, v); }
+	inline vf   vf_set1(float x)               { return _mm512_set1_ps(x); }
+	inline vf   vf_add(vf a, vf b)             { return _mm512_add_ps(a, b); }
+	inline vf   vf_mul(vf a, vf b)             { return _mm512_mul_ps(a, b); }
+	inline vf   vf_max(vf a, vf b)             { return _mm512_max_ps(a, b); }
+	inline vf   vf_fmadd(vf a, vf b, vf c)     { return _mm512_fmadd_ps(a, b, c); }
+	inline vf   vf_and(vf a, const u32* m)     { return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_loadu_si512(m))); }
+
+	inline vi   vi_zero()                      { return _mm512_setzero_si512(); }
+	inline vi   vi_load(const void* p)         { return _mm512_loadu_si512(p); }
+	inline void vi_store(void* p, vi v)        { _mm512_storeu_si512(p, v); }
+	inline vi   vi_set1(s32 x)                 { return _mm512_set1_epi32(x); }
+	inline vi   vi_sub(vi a, vi b)             { return _mm512_sub_epi32(a, b); }
+	inline vf   vi_to_vf(vi a)                 { return _mm512_cvtepi32_ps(a); }
+
+	// acc += (u8 × s8)の隣接4要素の和
+	inline vi vi_dot(vi acc, vi u, vi s)
+	{
+#if defined(USE_VNNI)
+		return _mm512_dpbusd_epi32(acc, u, s);
+#else
+		return _mm512_add_epi32(acc, _mm512_madd_epi16(_mm512_maddubs_epi16(u, s), _mm512_set1_epi16(1)));
+#endif
+	}
+
+#elif defined(USE_AVX2)
+
+	constexpr int W    = 8;
+	constexpr int NR   = 16;
+	constexpr int MR_F = 6;
+#if defined(USE_VNNI)
+	constexpr int MR_I = 6;
+#else
+	// maddubs + maddで一時レジスタが要るので少なめ。
+	constexpr int MR_I = 4;
+#endif
+
+	typedef __m256  vf;
+	typedef __m256i vi;
+
+	inline vf   vf_zero()                      { return _mm256_setzero_ps(); }
+	inline vf   vf_load(const float* p)        { return _mm256_loadu_ps(p); }
+	inline void vf_store(float* p, vf v)       { _mm256_storeu_ps(p, v); }
+	inline vf   vf_set1(float x)               { return _mm256_set1_ps(x); }
+	inline vf   vf_add(vf a, vf b)             { return _mm256_add_ps(a, b); }
+	inline vf   vf_mul(vf a, vf b)             { return _mm256_mul_ps(a, b); }
+	inline vf   vf_max(vf a, vf b)             { return _mm256_max_ps(a, b); }
+#if defined(__FMA__) || (defined(_MSC_VER) && defined(__AVX2__))
+	// TARGET_CPU=AVX2のときは、Makefileでこのファイルだけ-mfmaを付けてコンパイルしている。
+	// (MSVCは/arch:AVX2でFMA命令も使える)
+	inline vf   vf_fmadd(vf a, vf b, vf c)     { return _mm256_fmadd_ps(a, b, c); }
+#else
+	inline vf   vf_fmadd(vf a, vf b, vf c)     { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+	inline vf   vf_and(vf a, const u32* m)     { return _mm256_and_ps(a, _mm256_loadu_ps((const float*)m)); }
+
+	inline vi   vi_zero()                      { return _mm256_setzero_si256(); }
+	inline vi   vi_load(const void* p)         { return _mm256_loadu_si256((const __m256i*)p); }
+	inline void vi_store(void* p, vi v)        { _mm256_storeu_si256((__m256i*)p, v); }
+	inline vi   vi_set1(s32 x)                 { return _mm256_set1_epi32(x); }
+	inline vi   vi_sub(vi a, vi b)             { return _mm256_sub_epi32(a, b); }
+	inline vf   vi_to_vf(vi a)                 { return _mm256_cvtepi32_ps(a); }
+
+	inline vi vi_dot(vi acc, vi u, vi s)
+	{
+#if defined(USE_VNNI)
+		return _mm256_dpbusd_epi32(acc, u, s);
+#else
+		return _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_maddubs_epi16(u, s), _mm256_set1_epi16(1)));
+#endif
+	}
+
+#else
+
+	// SIMDなし。(NEON等は未対応なのでこれになる)
+	constexpr int W    = 1;
+	constexpr int NR   = 8;
+	constexpr int MR_F = 4;
+	constexpr int MR_I = 4;
+
+	typedef float vf;
+	typedef s32   vi; // int8の時は、u8/s8を4つ詰めたもの
+
+	inline vf   vf_zero()                      { return 0.0f; }
+	inline vf   vf_load(const float* p)        { return *p; }
+	inline void vf_store(float* p, vf v)       { *p = v; }
+	inline vf   vf_set1(float x)               { return x; }
+	inline vf   vf_add(vf a, vf b)             { return a + b; }
+	inline vf   vf_mul(vf a, vf b)             { return a * b; }
+	inline vf   vf_max(vf a, vf b)             { return std::max(a, b); }
+	inline vf   vf_fmadd(vf a, vf b, vf c)     { return a * b + c; }
+	inline vf   vf_and(vf a, const u32* m)     { return *m ? a : 0.0f; }
+
+	inline vi   vi_zero()                      { return 0; }
+	inline vi   vi_load(const void* p)         { s32 v; memcpy(&v, p, 4); return v; }
+	inline void vi_store(void* p, vi v)        { memcpy(p, &v, 4); }
+	inline vi   vi_set1(s32 x)                 { return x; }
+	inline vi   vi_sub(vi a, vi b)             { return a - b; }
+	inline vf   vi_to_vf(vi a)                 { return float(a); }
+
+	inline vi vi_dot(vi acc, vi u, vi s)
+	{
+		for (int i = 0; i < 4; ++i)
+			acc += s32(u8(u >> (i * 8))) * s32(s8(s >> (i * 8)));
+		return acc;
+	}
+
+#endif
+
+	constexpr int NV = NR / W; // タイルの1行に含まれるベクトルの数
+
+	// Kをこの単位で分割してpackする。(BのpanelがL1/L2に収まるように)
+	constexpr int KC_F = 256;
+	constexpr int KC_I = 1024;
+
+	// 1スレッドが一度に計算する局面数の上限
+	constexpr int MaxGroup = 8;
+
+	// 各tensorのバッファの前後に確保しておく余白。(im2colの時に範囲外を読むので)
+	constexpr int Margin = 64;
+
+	// 64byte alignされたバッファ
+	template <typename T>
+	struct AlignedBuffer
+	{
+		void resize(size_t n)
+		{
+			mem.reset(new u8[n * sizeof(T) + 64]());
+			ptr = (T*)(((uintptr_t)mem.get() + 63) & ~uintptr_t(63));
+		}
+		T* data() const { return ptr; }
+
+	private:
+		std::unique_ptr<u8[]> mem;
+		T* ptr = nullptr;
+	};
+
+	inline int round_up(int x, int a) { return (x + a - 1) / a * a; }
+
+	} // namespace
+
+	// ---------------------------------------------
+	//   Network
+	// ---------------------------------------------
+
+	// 推論時のtensor。spatialなら[C][n][81]、そうでなければ[n][C]の形でメモリに置く。(nはgroupの局面数)
+	struct NativeValue
+	{
+		bool spatial;
+		int c;
+
+		// 値が負にならないことがわかっているか。(int8の量子化で、u8の範囲を全部使うために)
+		bool nonneg;
+
+		// 割り当てられたバッファの番号と、最後に参照されるlayerの番号
+		int slot = -1;
+		int last_use = -1;
+
+		int size() const { return spatial ? c * int(SQ_NB) : c; }
+	};
+
+	enum class LayerType { Conv, Affine, Add, Mul, Act, Flatten, Gemm };
+	enum class Activation { None, Relu, Sigmoid };
+
+	struct NativeLayer
+	{
+		LayerType type;
+		int in0 = -1, in1 = -1, out = -1;
+		Activation act = Activation::None;
+
+		// Conv , Gemm
+		int cin = 0, cout = 0, ksize = 0, K = 0;
+
+		// Conv : packしたもの , Gemm : [cout][cin]
+		// (compileが終わるまでは、ConvはONNXのまま[cout][cin][k][k])
+		std::vector<float> w;
+
+		// Conv/Gemm : bias[cout] , Affine : out = in * scale + shift。spatialならchannelごと、そうでなければ要素ごと。
+		std::vector<float> bias, scale;
+
+		// int8の時のConvの重み。[Mp/MR_I][K/4][MR_I][4]にpackしたものと、出力channelごとのscale、重みの和。
+		std::vector<s8> qw;
+		std::vector<float> qscale;
+		std::vector<s32> qsum;
+	};
+
+	// worker threadごとの作業領域
+	struct NativeWorkspace
+	{
+		std::vector<AlignedBuffer<float>> slots;
+
+		// packしたB
+		AlignedBuffer<float> packed_b;
+		AlignedBuffer<u8> packed_q;
+
+		// Kを分割した時の途中経過
+		AlignedBuffer<float> acc;
+
+		// 量子化した入力と、そのscale(列ごと)
+		AlignedBuffer<u8> qin;
+		AlignedBuffer<float> col_scale;
+
+		// im2colのmask。[9][cols]で、盤外と列の範囲外なら0。groupの局面数nが変わったら作り直す。
+		int mask_n = -1;
+		AlignedBuffer<u32> mask;
+		AlignedBuffer<u8> qmask;
+	};
+
+	struct NativeNetwork
+	{
+		std::vector<NativeValue> values;
+		std::vector<NativeLayer> layers;
+		int input1 = -1, input2 = -1, output_policy = -1, output_value = -1;
+
+		bool int8 = false;
+
+		// バッファの数と、1局面あたりのバッファのサイズ(float何個分か)
+		int slots = 0;
+		int slot_size = 0;
+
+		int max_k = 0, max_cout = 0;
+
+		std::vector<std::unique_ptr<NativeWorkspace>> workspaces;
+
+		// ONNXのgraphから構築する。
+		Result build(const OnnxGraph& g);
+
+		// 重みのpackとバッファの割り当て
+		void compile();
+
+		// スレッドn個分の作業領域を確保する。
+		void alloc_workspaces(size_t n);
+
+		// 局面n個(≦MaxGroup)分の推論
+		void forward_group(NativeWorkspace& ws, int n, const NN_Input1* x1, const NN_Input2* x2, NN_Output_Policy* y1, NN_Output_Value* y2) const;
+
+	private:
+		float* buffer(const NativeWorkspace& ws, int v) const { return ws.slots[values[v].slot].data() + Margin; }
+
+		void conv_f32(const NativeLayer& l, NativeWorkspace& ws, const float* in, float* out, int n) const;
+		void conv_i8 (const NativeLayer& l, NativeWorkspace& ws, const float* in, float* out, int n) const;
+		void update_mask(NativeWorkspace& ws, int n) const;
+	};
+
+	namespace {
+
+	// (dy,dx)だけずらした升へのoffset。o = (dy + 1) * 3 + (dx + 1)
+	constexpr int Delta[9] = { -10, -9, -8, -1, 0, 1, 8, 9, 10 };
+
+	void apply_act(float* p, size_t n, Activation act)
+	{
+		if (act == Activation::Relu)
+			for (size_t i = 0; i < n; ++i)
+				p[i] = std::max(p[i], 0.0f);
+		else if (act == Activation::Sigmoid)
+			for (size_t i = 0; i < n; ++i)
+				// -Ofastだとexp()がinfになった時にNaNになることがあるので範囲を制限しておく。
+				p[i] = 1.0f / (1.0f + std::exp(-std::clamp(p[i], -80.0f, 80.0f)));
+	}
+
+	// 1行分(NR列)を書き出す。
+	inline void store_row(vf x[NV], Activation act, float* out, int col0, int cols)
+	{
+		if (act == Activation::Relu)
+			for (int v = 0; v < NV; ++v)
+				x[v] = vf_max(x[v], vf_zero());
+
+		if (col0 + NR <= cols)
+			for (int v = 0; v < NV; ++v)
+				vf_store(out + col0 + v * W, x[v]);
+		else
+		{
+			float tmp[NR];
+			for (int v = 0; v < NV; ++v)
+				vf_store(tmp + v * W, x[v]);
+			memcpy(out + col0, tmp, sizeof(float) * (cols - col0));
+		}
+
+		if (act == Activation::Sigmoid)
+			apply_act(out + col0, std::min(NR, cols - col0), act);
+	}
+
+	// C[MR][NR] += A[kc][MR] * B[kc][NR]
+	template <int MR>
+	inline void kernel_f32(int kc, const float* A, const float* B, vf c[MR][NV])
+	{
+		for (int k = 0; k < kc; ++k)
+		{
+			vf b[NV];
+			for (int v = 0; v < NV; ++v)
+				b[v] = vf_load(B + k * NR + v * W);
+			for (int r = 0; r < MR; ++r)
+			{
+				const vf a = vf_set1(A[k * MR + r]);
+				for (int v = 0; v < NV; ++v)
+					c[r][v] = vf_fmadd(a, b[v], c[r][v]);
+			}
+		}
+	}
+
+	// C[MR][NR] += A[kc4][MR][4] * B[kc4][NR][4]
+	template <int MR>
+	inline void kernel_i8(int kc4, const s8* A, const u8* B, vi c[MR][NV])
+	{
+		for (int k = 0; k < kc4; ++k)
+		{
+			vi b[NV];
+			for (int v = 0; v < NV; ++v)
+				b[v] = vi_load(B + (k * NR + v * W) * 4);
+			for (int r = 0; r < MR; ++r)
+			{
+				s32 a4;
+				memcpy(&a4, A + (k * MR + r) * 4, 4);
+				const vi a = vi_set1(a4);
+				for (int v = 0; v < NV; ++v)
+					c[r][v] = vi_dot(c[r][v], b[v], a);
+			}
+		}
+	}
+
+	// u8のim2colで、4行分(k..k+3)のNR列を[NR][4]の順に並べ替えて書き出す。
+	// src[t]がnullptrの行は、offで埋める。
+	inline void pack_q4(const u8* const src[4], const u8* const mask[4], u8 off, int col, u8* dst)
+	{
+#if defined(USE_AVX2)
+		const __m128i offv = _mm_set1_epi8((char)off);
+		for (int c = 0; c < NR; c += 16)
+		{
+			__m128i r[4];
+			for (int t = 0; t < 4; ++t)
+			{
+				if (src[t])
+				{
+					const __m128i x = _mm_loadu_si128((const __m128i*)(src[t] + col + c));
+					const __m128i m = _mm_loadu_si128((const __m128i*)(mask[t] + col + c));
+					r[t] = _mm_or_si128(_mm_and_si128(m, x), _mm_andnot_si128(m, offv));
+				}
+				else
+					r[t] = offv;
+			}
+			const __m128i a01lo = _mm_unpacklo_epi8(r[0], r[1]), a01hi = _mm_unpackhi_epi8(r[0], r[1]);
+			const __m128i a23lo = _mm_unpacklo_epi8(r[2], r[3]), a23hi = _mm_unpackhi_epi8(r[2], r[3]);
+			_mm_storeu_si128((__m128i*)(dst + c * 4 +  0), _mm_unpacklo_epi16(a01lo, a23lo));
+			_mm_storeu_si128((__m128i*)(dst + c * 4 + 16), _mm_unpackhi_epi16(a01lo, a23lo));
+			_mm_storeu_si128((__m128i*)(dst + c * 4 + 32), _mm_unpacklo_epi16(a01hi, a23hi));
+			_mm_storeu_si128((__m128i*)(dst + c * 4 + 48), _mm_unpackhi_epi16(a01hi, a23hi));
+		}
+#else
+		for (int c = 0; c < NR; ++c)
+			for (int t = 0; t < 4; ++t)
+				dst[c * 4 + t] = (src[t] && mask[t][col + c]) ? src[t][col + c] : off;
+#endif
+	}
+
+	} // namespace
+
+	// im2colのmaskを作る。
+	void NativeNetwork::update_mask(NativeWorkspace& ws, int n) const
+	{
+		if (ws.mask_n == n)
+			return;
+		ws.mask_n = n;
+
+		const int cols = n * int(SQ_NB), cp = round_up(cols, NR);
+		for (int o = 0; o < 9; ++o)
+		{
+			const int dy = o / 3 - 1, dx = o % 3 - 1;
+			for (int col = 0; col < cp; ++col)
+			{
+				const int sq = col % SQ_NB, y = sq / 9 + dy, x = sq % 9 + dx;
+				const bool ok = col < cols && 0 <= y && y < 9 && 0 <= x && x < 9;
+				ws.mask .data()[o * cp + col] = ok ? 0xffffffffu : 0;
+				ws.qmask.data()[o * cp + col] = ok ? 0xff : 0;
+			}
+		}
+	}
+
+	// fp32のConv。in : [cin][n*81] , out : [cout][n*81]
+	void NativeNetwork::conv_f32(const NativeLayer& l, NativeWorkspace& ws, const float* in, float* out, int n) const
+	{
+		const int cols = n * int(SQ_NB), cp = round_up(cols, NR), strips = cp / NR;
+		const int K = l.K, Mp = round_up(l.cout, MR_F);
+		float* acc = ws.acc.data();
+
+		for (int k0 = 0; k0 < K; k0 += KC_F)
+		{
+			const int kc = std::min(KC_F, K - k0);
+			const bool first = k0 == 0, last = k0 + kc == K;
+
+			// im2col : [strip][kc][NR]
+			for (int k = k0; k < k0 + kc; ++k)
+			{
+				const int ci = l.ksize == 3 ? k / 9 : k, o = l.ksize == 3 ? k % 9 : 4;
+				const float* src = in + size_t(ci) * cols + Delta[o];
+				const u32* mask = ws.mask.data() + o * cp;
+				float* dst = ws.packed_b.data() + size_t(k - k0) * NR;
+				for (int s = 0; s < strips; ++s, src += NR, mask += NR, dst += size_t(kc) * NR)
+					for (int v = 0; v < NV; ++v)
+						vf_store(dst + v * W, vf_and(vf_load(src + v * W), mask + v * W));
+			}
+
+			for (int s = 0; s < strips; ++s)
+			{
+				const float* B = ws.packed_b.data() + size_t(s) * kc * NR;
+				for (int m0 = 0; m0 < Mp; m0 += MR_F)
+				{
+					const float* A = l.w.data() + size_t(m0) * K + size_t(k0) * MR_F;
+					float* C = acc + size_t(m0) * cp + s * NR;
+
+					vf c[MR_F][NV];
+					for (int r = 0; r < MR_F; ++r)
+						for (int v = 0; v < NV; ++v)
+							c[r][v] = first ? vf_zero() : vf_load(C + r * cp + v * W);
+
+					kernel_f32<MR_F>(kc, A, B, c);
+
+					if (!last)
+					{
+						for (int r = 0; r < MR_F; ++r)
+							for (int v = 0; v < NV; ++v)
+								vf_store(C + r * cp + v * W, c[r][v]);
+						continue;
+					}
+
+					for (int r = 0; r < MR_F && m0 + r < l.cout; ++r)
+					{
+						const vf b = vf_set1(l.bias[m0 + r]);
+						vf x[NV];
+						for (int v = 0; v < NV; ++v)
+							x[v] = vf_add(c[r][v], b);
+						store_row(x, l.act, out + size_t(m0 + r) * cols, s * NR, cols);
+					}
+				}
+			}
+		}
+	}
+
+	// int8のConv。入力を局面ごとに量子化して、u8×s8の積和で計算する。
+	void NativeNetwork::conv_i8(const NativeLayer& l, NativeWorkspace& ws, const float* in, float* out, int n) const
+	{
+		const int cols = n * int(SQ_NB), cp = round_up(cols, NR), strips = cp / NR;
+		const int Kp = round_up(l.K, 4), Mp = round_up(l.cout, MR_I);
+		s32* acc = (s32*)ws.acc.data();
+
+		// 入力が非負なら0～255(maddubsの時は0～127)を使う。負がありうるならoffsetを足してu8にする。
+#if defined(USE_VNNI) || !(defined(USE_AVX2) || defined(USE_AVX512))
+		const bool wide = true;
+#else
+		// maddubsは、i16に飽和するので、u8側を7bitにしておく。
+		const bool wide = false;
+#endif
+		const bool nonneg = values[l.in0].nonneg;
+		const int off  = nonneg ? 0 : (wide ? 128 : 64);
+		const int qmax = nonneg ? (wide ? 255 : 127) : (wide ? 127 : 63);
+
+		// 量子化
+		u8* q = ws.qin.data() + Margin;
+		float* col_scale = ws.col_scale.data();
+		float inv[MaxGroup];
+		for (int s = 0; s < n; ++s)
+		{
+			float mx = 0;
+			for (int c = 0; c < l.cin; ++c)
+			{
+				const float* p = in + size_t(c) * cols + s * int(SQ_NB);
+				for (int i = 0; i < SQ_NB; ++i)
+					mx = std::max(mx, std::abs(p[i]));
+			}
+			const float scale = mx > 0 ? mx / qmax : 1.0f;
+			inv[s] = 1.0f / scale;
+			for (int i = 0; i < SQ_NB; ++i)
+				col_scale[s * int(SQ_NB) + i] = scale;
+		}
+		for (int col = cols; col < cp; ++col)
+			col_scale[col] = 0;
+
+		for (int c = 0; c < l.cin; ++c)
+			for (int s = 0; s < n; ++s)
+			{
+				const float* p = in + size_t(c) * cols + s * int(SQ_NB);
+				u8* d = q + size_t(c) * cols + s * int(SQ_NB);
+				const float iv = inv[s];
+				for (int i = 0; i < SQ_NB; ++i)
+					d[i] = u8(std::clamp(off + int(std::floor(p[i] * iv + 0.5f)), 0, 255));
+			}
+
+		for (int k0 = 0; k0 < Kp; k0 += KC_I)
+		{
+			const int kc = std::min(KC_I, Kp - k0);
+			const bool first = k0 == 0, last = k0 + kc == Kp;
+
+			// im2col : [strip][kc/4][NR][4]
+			for (int k = k0; k < k0 + kc; k += 4)
+			{
+				const u8* src[4];
+				const u8* mask[4];
+				for (int t = 0; t < 4; ++t)
+				{
+					const int kk = k + t;
+					if (kk >= l.K) { src[t] = mask[t] = nullptr; continue; }
+					const int ci = l.ksize == 3 ? kk / 9 : kk, o = l.ksize == 3 ? kk % 9 : 4;
+					src[t]  = q + size_t(ci) * cols + Delta[o];
+					mask[t] = ws.qmask.data() + o * cp;
+				}
+				u8* dst = ws.packed_q.data() + size_t(k - k0) * NR;
+				for (int s = 0; s < strips; ++s)
+					pack_q4(src, mask, u8(off), s * NR, dst + size_t(s) * kc * NR);
+			}
+
+			for (int s = 0; s < strips; ++s)
+			{
+				const u8* B = ws.packed_q.data() + size_t(s) * kc * NR;
+				for (int m0 = 0; m0 < Mp; m0 += MR_I)
+				{
+					const s8* A = l.qw.data() + size_t(m0) * Kp + size_t(k0) * MR_I;
+					s32* C = acc + size_t(m0) * cp + s * NR;
+
+					vi c[MR_I][NV];
+					for (int r = 0; r < MR_I; ++r)
+						for (int v = 0; v < NV; ++v)
+							c[r][v] = first ? vi_zero() : vi_load(C + r * cp + v * W);
+
+					kernel_i8<MR_I>(kc / 4, A, B, c);
+
+					if (!last)
+					{
+						for (int r = 0; r < MR_I; ++r)
+							for (int v = 0; v < NV; ++v)
+								vi_store(C + r * cp + v * W, c[r][v]);
+						continue;
+					}
+
+					for (int r = 0; r < MR_I && m0 + r < l.cout; ++r)
+					{
+						const int m = m0 + r;
+						const vi corr = vi_set1(off * l.qsum[m]);
+						const vf ws_ = vf_set1(l.qscale[m]), b = vf_set1(l.bias[m]);
+						vf x[NV];
+						for (int v = 0; v < NV; ++v)
+						{
+							const vf sc = vf_mul(ws_, vf_load(col_scale + s * NR + v * W));
+							x[v] = vf_fmadd(vi_to_vf(vi_sub(c[r][v], corr)), sc, b);
+						}
+						store_row(x, l.act, out + size_t(m) * cols, s * NR, cols);
+					}
+				}
+			}
+		}
+	}
+
+	void NativeNetwork::forward_group(NativeWorkspace& ws, int n, const NN_Input1* x1, const NN_Input2* x2, NN_Output_Policy* y1, NN_Output_Value* y2) const
+	{
+		const int cols = n * int(SQ_NB);
+
+		// 入力を[C][n][81]に並べ替える。
+		auto load_input = [&](int v, const float* x, int stride)
+		{
+			float* dst = buffer(ws, v);
+			for (int s = 0; s < n; ++s)
+				for (int c = 0; c < values[v].c; ++c)
+					memcpy(dst + size_t(c) * cols + s * int(SQ_NB), x + size_t(s) * stride + c * int(SQ_NB), sizeof(float) * int(SQ_NB));
+		};
+		load_input(input1, (const float*)x1, sizeof(NN_Input1) / sizeof(float));
+		load_input(input2, (const float*)x2, sizeof(NN_Input2) / sizeof(float));
+
+		update_mask(ws, n);
+
+		for (auto& l : layers)
+		{
+			const NativeValue& vo = values[l.out];
+			float* out = buffer(ws, l.out);
+			const float* a = buffer(ws, l.in0);
+			const size_t size = size_t(vo.size()) * n;
+
+			switch (l.type)
+			{
+			case LayerType::Conv:
+				if (int8)
+					conv_i8(l, ws, a, out, n);
+				else
+					conv_f32(l, ws, a, out, n);
+				break;
+
+			case LayerType::Affine:
+				if (vo.spatial)
+					for (int c = 0; c < vo.c; ++c)
+						for (int i = 0; i < cols; ++i)
+							out[c * cols + i] = a[c * cols + i] * l.scale[c] + l.bias[c];
+				else
+					for (int s = 0; s < n; ++s)
+						for (int i = 0; i < vo.c; ++i)
+							out[s * vo.c + i] = a[s * vo.c + i] * l.scale[i] + l.bias[i];
+				apply_act(out, size, l.act);
+				break;
+
+			case LayerType::Add:
+			case LayerType::Mul: {
+				const float* b = buffer(ws, l.in1);
+				if (l.type == LayerType::Add)
+					for (size_t i = 0; i < size; ++i)
+						out[i] = a[i] + b[i];
+				else
+					for (size_t i = 0; i < size; ++i)
+						out[i] = a[i] * b[i];
+				apply_act(out, size, l.act);
+				break;
+			}
+
+			case LayerType::Act:
+				memcpy(out, a, sizeof(float) * size);
+				apply_act(out, size, l.act);
+				break;
+
+			case LayerType::Flatten: {
+				// [C][n][81] → [n][C*81]
+				const int c_in = values[l.in0].c;
+				for (int s = 0; s < n; ++s)
+					for (int c = 0; c < c_in; ++c)
+						memcpy(out + size_t(s) * vo.c + c * int(SQ_NB), a + size_t(c) * cols + s * int(SQ_NB), sizeof(float) * int(SQ_NB));
+				break;
+			}
+
+			case LayerType::Gemm:
+				// [n][K] × [cout][K]^T
+				for (int s = 0; s < n; ++s)
+				{
+					const float* x = a + size_t(s) * l.K;
+					for (int j = 0; j < l.cout; ++j)
+					{
+						const float* w = l.w.data() + size_t(j) * l.K;
+						vf sum = vf_zero();
+						int k = 0;
+						for (; k + W <= l.K; k += W)
+							sum = vf_fmadd(vf_load(x + k), vf_load(w + k), sum);
+						float tmp[W];
+						vf_store(tmp, sum);
+						float r = l.bias[j];
+						for (int i = 0; i < W; ++i)
+							r += tmp[i];
+						for (; k < l.K; ++k)
+							r += x[k] * w[k];
+						out[s * l.cout + j] = r;
+					}
+				}
+				apply_act(out, size, l.act);
+				break;
+			}
+		}
+
+		// 出力
+		const float* policy = buffer(ws, output_policy);
+		const int policy_size = values[output_policy].size();
+		for (int s = 0; s < n; ++s)
+		{
+			if (values[output_policy].spatial)
+				for (int c = 0; c < values[output_policy].c; ++c)
+					memcpy((float*)y1[s] + c * int(SQ_NB), policy + size_t(c) * cols + s * int(SQ_NB), sizeof(float) * int(SQ_NB));
+			else
+				memcpy((float*)y1[s], policy + size_t(s) * policy_size, sizeof(float) * policy_size);
+
+			y2[s] = buffer(ws, output_value)[s];
+		}
+	}
+
+	// ONNXのgraphからlayerを構築する。
+	Result NativeNetwork::build(const OnnxGraph& g)
+	{
+		// tensor名 → value
+		std::unordered_map<std::string, int> value_of;
+		// value → それを出力するlayer
+		std::vector<int> producer;
+		// tensor名 → 何回参照されているか
+		std::unordered_map<std::string, int> use_count;
+		// Constantで定義された定数
+		std::unordered_map<std::string, OnnxTensor> constants;
+
+		for (auto& node : g.nodes)
+			for (auto& name : node.inputs)
+				use_count[name]++;
+		for (auto& name : g.outputs)
+			use_count[name]++;
+
+		auto new_value = [&](bool spatial, int c, bool nonneg)
+		{
+			values.push_back(NativeValue{ spatial, c, nonneg });
+			producer.push_back(-1);
+			return int(values.size() - 1);
+		};
+
+		auto constant = [&](const std::string& name) -> const OnnxTensor*
+		{
+			auto it = g.initializers.find(name);
+			if (it != g.initializers.end())
+				return &it->second;
+			auto it2 = constants.find(name);
+			return it2 != constants.end() ? &it2->second : nullptr;
+		};
+
+		auto value = [&](const std::string& name)
+		{
+			auto it = value_of.find(name);
+			return it == value_of.end() ? -1 : it->second;
+		};
+
+		auto add_layer = [&](NativeLayer&& l)
+		{
+			layers.push_back(std::move(l));
+			producer[layers.back().out] = int(layers.size() - 1);
+			return &layers.back();
+		};
+
+		// nameを出力したlayerに後続の演算を融合できるなら、そのlayerを返す。
+		auto fusable = [&](const std::string& name) -> NativeLayer*
+		{
+			const int v = value(name);
+			if (v < 0 || use_count[name] != 1 || producer[v] < 0)
+				return nullptr;
+			NativeLayer& l = layers[producer[v]];
+			return l.act == Activation::None ? &l : nullptr;
+		};
+
+		// 定数をchannelごと(spatial)、要素ごと(flat)に展開する。
+		auto broadcast = [&](const OnnxTensor& t, const NativeValue& v, std::vector<float>& out)
+		{
+			const size_t n = t.data.size();
+			if (n == 1)
+				out.assign(v.c, t.data[0]);
+			else if (n == size_t(v.c))
+				out = t.data;
+			else
+				return false;
+			return true;
+		};
+
+		// 入力
+		auto find_input = [&](const std::string& name, size_t index) -> int
+		{
+			for (size_t i = 0; i < g.inputs.size(); ++i)
+				if (g.inputs[i] == name)
+					return int(i);
+			return index < g.inputs.size() ? int(index) : -1;
+		};
+		const int i1 = find_input("input1", 0), i2 = find_input("input2", 1);
+		if (i1 < 0 || i2 < 0 || i1 == i2)
+		{
+			sync_cout << "Error! : NNNative : the model must have two inputs." << sync_endl;
+			return ResultCode::SomeError;
+		}
+		auto input_channels = [&](int i, int def)
+		{
+			auto& d = g.input_dims[i];
+			return d.size() == 4 && d[1] > 0 ? int(d[1]) : def;
+		};
+		input1 = new_value(true, input_channels(i1, int(COLOR_NB) * int(MAX_FEATURES1_NUM)), true);
+		input2 = new_value(true, input_channels(i2, int(MAX_FEATURES2_NUM)), true);
+		if (values[input1].c != int(COLOR_NB) * int(MAX_FEATURES1_NUM) || values[input2].c != int(MAX_FEATURES2_NUM))
+		{
+			sync_cout << "Error! : NNNative : input channels mismatch." << sync_endl;
+			return ResultCode::SomeError;
+		}
+		value_of[g.inputs[i1]] = input1;
+		value_of[g.inputs[i2]] = input2;
+
+		for (auto& node : g.nodes)
+		{
+			const auto& op = node.op_type;
+			auto error = [&](const std::string& message)
+			{
+				sync_cout << "Error! : NNNative : " << op << " : " << message << sync_endl;
+				return Result(ResultCode::NotImplementedError);
+			};
+			if (node.outputs.empty())
+				continue;
+			const std::string& out_name = node.outputs[0];
+			const int x = node.inputs.empty() ? -1 : value(node.inputs[0]);
+
+			if (op == "Constant")
+			{
+				auto a = node.attribute("value");
+				if (!a)
+					return error("no value");
+				constants[out_name] = a->t;
+			}
+			else if (op == "Identity" || op == "Dropout")
+			{
+				if (x < 0) return error("unknown input " + node.inputs[0]);
+				value_of[out_name] = x;
+			}
+			else if (op == "Conv")
+			{
+				const OnnxTensor* w = node.inputs.size() > 1 ? constant(node.inputs[1]) : nullptr;
+				const OnnxTensor* b = node.inputs.size() > 2 ? constant(node.inputs[2]) : nullptr;
+				if (x < 0 || !values[x].spatial || !w || w->dims.size() != 4)
+					return error("unsupported input");
+
+				const int k = int(w->dims[2]);
+				auto all = [](const std::vector<s64>& v, s64 a) { return std::all_of(v.begin(), v.end(), [a](s64 e) { return e == a; }); };
+				if (w->dims[1] != values[x].c || w->dims[3] != k || !(k == 1 || k == 3)
+					|| !all(node.get_ints("pads"), k / 2) || !all(node.get_ints("strides"), 1)
+					|| !all(node.get_ints("dilations"), 1) || node.get_int("group", 1) != 1)
+					return error("only 1x1 or 3x3 convolutions with stride 1 and same padding are supported");
+
+				NativeLayer l;
+				l.type  = LayerType::Conv;
+				l.in0   = x;
+				l.cin   = values[x].c;
+				l.cout  = int(w->dims[0]);
+				l.ksize = k;
+				l.K     = l.cin * k * k;
+				l.w     = w->data;
+				l.bias  = b ? b->data : std::vector<float>(l.cout, 0.0f);
+				l.out   = new_value(true, l.cout, false);
+				value_of[out_name] = add_layer(std::move(l))->out;
+			}
+			else if (op == "BatchNormalization")
+			{
+				if (x < 0 || node.inputs.size() < 5)
+					return error("unsupported input");
+				const OnnxTensor* t[4];
+				for (int i = 0; i < 4; ++i)
+					if (!(t[i] = constant(node.inputs[i + 1])) || t[i]->data.size() != size_t(values[x].c))
+						return error("unsupported parameters");
+
+				// y = (x - mean) / sqrt(var + eps) * gamma + beta = x * s + t
+				const float eps = node.get_float("epsilon", 1e-5f);
+				std::vector<float> s(values[x].c), sh(values[x].c);
+				for (int c = 0; c < values[x].c; ++c)
+				{
+					s[c]  = t[0]->data[c] / std::sqrt(t[3]->data[c] + eps);
+					sh[c] = t[1]->data[c] - t[2]->data[c] * s[c];
+				}
+
+				NativeLayer* p = fusable(node.inputs[0]);
+				if (p && p->type == LayerType::Conv)
+				{
+					// 直前のConvの重みに畳み込む。
+					const size_t per = size_t(p->K);
+					for (int c = 0; c < p->cout; ++c)
+					{
+						for (size_t i = 0; i < per; ++i)
+							p->w[c * per + i] *= s[c];
+						p->bias[c] = p->bias[c] * s[c] + sh[c];
+					}
+					value_of[out_name] = x;
+				}
+				else if (p && p->type == LayerType::Affine)
+				{
+					for (int c = 0; c < values[x].c; ++c)
+					{
+						p->scale[c] *= s[c];
+						p->bias[c]   = p->bias[c] * s[c] + sh[c];
+					}
+					value_of[out_name] = x;
+				}
+				else
+				{
+					NativeLayer l;
+					l.type  = LayerType::Affine;
+					l.in0   = x;
+					l.scale = s;
+					l.bias  = sh;
+					l.out   = new_value(values[x].spatial, values[x].c, false);
+					value_of[out_name] = add_layer(std::move(l))->out;
+				}
+			}
+			else if (op == "Relu" || op == "Sigmoid")
+			{
+				if (x < 0) return error("unknown input " + node.inputs[0]);
+				const Activation act = op == "Relu" ? Activation::Relu : Activation::Sigmoid;
+				NativeLayer* p = fusable(node.inputs[0]);
+				if (p && p->type != LayerType::Flatten && p->type != LayerType::Act)
+				{
+					p->act = act;
+					values[x].nonneg = true;
+					value_of[out_name] = x;
+				}
+				else
+				{
+					NativeLayer l;
+					l.type = LayerType::Act;
+					l.act  = act;
+					l.in0  = x;
+					l.out  = new_value(values[x].spatial, values[x].c, true);
+					value_of[out_name] = add_layer(std::move(l))->out;
+				}
+			}
+			else if (op == "Add" || op == "Mul" || op == "Sum")
+			{
+				if (node.inputs.size() != 2)
+					return error("only two inputs are supported");
+				const bool add = op != "Mul";
+				int a = value(node.inputs[0]), b = value(node.inputs[1]);
+				if (a >= 0 && b >= 0)
+				{
+					if (values[a].spatial != values[b].spatial || values[a].c != values[b].c)
+						return error("broadcasting between tensors is not supported");
+					NativeLayer l;
+					l.type = add ? LayerType::Add : LayerType::Mul;
+					l.in0  = a;
+					l.in1  = b;
+					l.out  = new_value(values[a].spatial, values[a].c, values[a].nonneg && values[b].nonneg);
+					value_of[out_name] = add_layer(std::move(l))->out;
+					continue;
+				}
+
+				// 片方が定数
+				const bool swap = a < 0;
+				const std::string& xname = node.inputs[swap ? 1 : 0];
+				const OnnxTensor* t = constant(node.inputs[swap ? 0 : 1]);
+				a = swap ? b : a;
+				std::vector<float> k;
+				if (a < 0 || !t || !broadcast(*t, values[a], k))
+					return error("unsupported input");
+
+				NativeLayer* p = fusable(xname);
+				if (p && (p->type == LayerType::Conv || p->type == LayerType::Gemm) && add)
+				{
+					for (int c = 0; c < p->cout; ++c)
+						p->bias[c] += k[c];
+					value_of[out_name] = a;
+				}
+				else if (p && p->type == LayerType::Affine)
+				{
+					for (int c = 0; c < values[a].c; ++c)
+						if (add)
+							p->bias[c] += k[c];
+						else
+							p->scale[c] *= k[c], p->bias[c] *= k[c];
+					value_of[out_name] = a;
+				}
+				else
+				{
+					NativeLayer l;
+					l.type  = LayerType::Affine;
+					l.in0   = a;
+					l.scale = add ? std::vector<float>(values[a].c, 1.0f) : k;
+					l.bias  = add ? k : std::vector<float>(values[a].c, 0.0f);
+					l.out   = new_value(values[a].spatial, values[a].c, false);
+					value_of[out_name] = add_layer(std::move(l))->out;
+				}
+				// 負の値を掛けたり足したりするかも知れないので非負とは限らない。
+				values[value_of[out_name]].nonneg = false;
+			}
+			else if (op == "Flatten" || op == "Reshape")
+			{
+				if (x < 0) return error("unknown input " + node.inputs[0]);
+				if (op == "Flatten" && node.get_int("axis", 1) != 1)
+					return error("axis must be 1");
+				if (op == "Reshape")
+				{
+					const OnnxTensor* shape = node.inputs.size() > 1 ? constant(node.inputs[1]) : nullptr;
+					if (!shape || shape->ints.size() != 2 || !(shape->ints[1] == -1 || shape->ints[1] == values[x].size()))
+						return error("only reshaping to [batch, features] is supported");
+				}
+
+				if (!values[x].spatial)
+				{
+					value_of[out_name] = x;
+					continue;
+				}
+				NativeLayer l;
+				l.type = LayerType::Flatten;
+				l.in0  = x;
+				l.out  = new_value(false, values[x].size(), values[x].nonneg);
+				value_of[out_name] = add_layer(std::move(l))->out;
+			}
+			else if (op == "Gemm" || op == "MatMul")
+			{
+				const OnnxTensor* w = node.inputs.size() > 1 ? constant(node.inputs[1]) : nullptr;
+				const OnnxTensor* c = node.inputs.size() > 2 ? constant(node.inputs[2]) : nullptr;
+				if (x < 0 || !w || w->dims.size() != 2 || node.get_int("transA", 0) != 0)
+					return error("unsupported input");
+
+				int in = x;
+				if (values[x].spatial)
+				{
+					NativeLayer l;
+					l.type = LayerType::Flatten;
+					l.in0  = x;
+					l.out  = new_value(false, values[x].size(), values[x].nonneg);
+					in = add_layer(std::move(l))->out;
+				}
+
+				const bool trans_b = node.get_int("transB", 0) != 0;
+				const int K = values[in].c;
+				const int N = int(trans_b ? w->dims[0] : w->dims[1]);
+				if ((trans_b ? w->dims[1] : w->dims[0]) != K)
+					return error("shape mismatch");
+
+				const float alpha = node.get_float("alpha", 1.0f), beta = node.get_float("beta", 1.0f);
+				NativeLayer l;
+				l.type = LayerType::Gemm;
+				l.in0  = in;
+				l.cin  = l.K = K;
+				l.cout = N;
+				l.w.resize(size_t(N) * K);
+				for (int j = 0; j < N; ++j)
+					for (int k = 0; k < K; ++k)
+						l.w[size_t(j) * K + k] = alpha * (trans_b ? w->data[size_t(j) * K + k] : w->data[size_t(k) * N + j]);
+				l.bias.assign(N, 0.0f);
+				if (c)
+				{
+					if (c->data.size() != 1 && c->data.size() != size_t(N))
+						return error("unsupported bias");
+					for (int j = 0; j < N; ++j)
+						l.bias[j] = beta * c->data[c->data.size() == 1 ? 0 : j];
+				}
+				l.out = new_value(false, N, false);
+				value_of[out_name] = add_layer(std::move(l))->out;
+			}
+			else
+				return error("unsupported operator");
+		}
+
+		// 出力
+		auto find_output = [&](const std::string& name, size_t index) -> int
+		{
+			for (auto& o : g.outputs)
+				if (o == name)
+					return value(o);
+			return index < g.outputs.size() ? value(g.outputs[index]) : -1;
+		};
+		output_policy = find_output("output_policy", 0);
+		output_value  = find_output("output_value" , 1);
+		if (output_policy < 0 || output_value < 0
+			|| values[output_policy].size() != int(MAX_MOVE_LABEL_NUM * int(SQ_NB)) || values[output_value].size() != 1)
+		{
+			sync_cout << "Error! : NNNative : unexpected outputs." << sync_endl;
+			return ResultCode::SomeError;
+		}
+
+		return ResultCode::Ok;
+	}
+
+	void NativeNetwork::compile()
+	{
+		// 重みのpack
+		for (auto& l : layers)
+		{
+			if (l.type != LayerType::Conv)
+				continue;
+
+			max_k    = std::max(max_k, l.K);
+			max_cout = std::max(max_cout, l.cout);
+
+			if (!int8)
+			{
+				// [Mp/MR][K][MR]
+				const int Mp = round_up(l.cout, MR_F);
+				std::vector<float> w(size_t(Mp) * l.K, 0.0f);
+				for (int m = 0; m < l.cout; ++m)
+					for (int k = 0; k < l.K; ++k)
+						w[size_t(m / MR_F) * l.K * MR_F + size_t(k) * MR_F + m % MR_F] = l.w[size_t(m) * l.K + k];
+				l.w = std::move(w);
+			}
+			else
+			{
+				// 出力channelごとにscaleを決めてs8にする。[Mp/MR][Kp/4][MR][4]
+				const int Mp = round_up(l.cout, MR_I), Kp = round_up(l.K, 4);
+				l.qw.assign(size_t(Mp) * Kp, 0);
+				l.qscale.assign(l.cout, 1.0f);
+				l.qsum.assign(l.cout, 0);
+				for (int m = 0; m < l.cout; ++m)
+				{
+					const float* w = l.w.data() + size_t(m) * l.K;
+					float mx = 0;
+					for (int k = 0; k < l.K; ++k)
+						mx = std::max(mx, std::abs(w[k]));
+					const float scale = mx > 0 ? mx / 127.0f : 1.0f;
+					l.qscale[m] = scale;
+					for (int k = 0; k < l.K; ++k)
+					{
+						const s8 q = s8(std::clamp(int(std::lround(w[k] / scale)), -127, 127));
+						l.qw[size_t(m / MR_I) * Kp * MR_I + size_t(k / 4) * MR_I * 4 + (m % MR_I) * 4 + k % 4] = q;
+						l.qsum[m] += q;
+					}
+				}
+				l.w.clear();
+				l.w.shrink_to_fit();
+			}
+		}
+
+		// バッファの割り当て。最後に参照されたあとのバッファは使い回す。
+		for (int i = 0; i < int(layers.size()); ++i)
+		{
+			values[layers[i].in0].last_use = i;
+			if (layers[i].in1 >= 0)
+				values[layers[i].in1].last_use = i;
+		}
+		values[output_policy].last_use = values[output_value].last_use = INT_MAX;
+
+		std::vector<int> free_slots;
+		auto alloc = [&](int v)
+		{
+			slot_size = std::max(slot_size, values[v].size());
+			if (free_slots.empty())
+				values[v].slot = slots++;
+			else
+			{
+				values[v].slot = free_slots.back();
+				free_slots.pop_back();
+			}
+		};
+		auto release = [&](int v, int i)
+		{
+			if (v >= 0 && values[v].last_use <= i && values[v].slot >= 0
+				&& std::find(free_slots.begin(), free_slots.end(), values[v].slot) == free_slots.end())
+				free_slots.push_back(values[v].slot);
+		};
+		alloc(input1);
+		alloc(input2);
+		for (int i = 0; i < int(layers.size()); ++i)
+		{
+			alloc(layers[i].out);
+			release(layers[i].in0, i);
+			release(layers[i].in1, i);
+			release(layers[i].out, i);
+		}
+	}
+
+	void NativeNetwork::alloc_workspaces(size_t n)
+	{
+		const int cp = round_up(MaxGroup * int(SQ_NB), NR);
+		const size_t buf = size_t(Margin) * 2 + size_t(slot_size) * MaxGroup;
+
+		workspaces.clear();
+		for (size_t i = 0; i < n; ++i)
+		{
+			auto ws = std::make_unique<NativeWorkspace>();
+			ws->slots.resize(slots);
+			for (auto& s : ws->slots)
+				s.resize(buf);
+			ws->acc.resize(size_t(round_up(std::max(max_cout, 1), std::max(MR_F, MR_I))) * cp);
+			ws->mask.resize(9 * cp);
+			ws->qmask.resize(9 * cp);
+			if (int8)
+			{
+				ws->packed_q.resize(size_t(KC_I) * cp);
+				ws->qin.resize(buf);
+				ws->col_scale.resize(cp);
+			}
+			else
+				ws->packed_b.resize(size_t(KC_F) * cp);
+			workspaces.push_back(std::move(ws));
+		}
+	}
+
+	// ---------------------------------------------
+	//   NativeWorkers
+	// ---------------------------------------------
+
+	void NativeWorkers::resize(size_t n)
+	{
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			exit = true;
+		}
+		cv_start.notify_all();
+		for (auto& th : threads)
+			th.join();
+		threads.clear();
+		exit = false;
+
+		for (size_t i = 1; i < n; ++i)
+			threads.emplace_back([this, i, g = generation] { idle_loop(i, g); });
+	}
+
+	void NativeWorkers::run(const std::function<void(size_t)>& f)
+	{
+		if (threads.empty())
+		{
+			f(0);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lk(mutex);
+			job = &f;
+			running = threads.size();
+			++generation;
+		}
+		cv_start.notify_all();
+
+		f(0);
+
+		std::unique_lock<std::mutex> lk(mutex);
+		cv_done.wait(lk, [&] { return running == 0; });
+		job = nullptr;
+	}
+
+	void NativeWorkers::idle_loop(size_t thread_id, u64 seen)
+	{
+		std::unique_lock<std::mutex> lk(mutex);
+		while (true)
+		{
+			cv_start.wait(lk, [&] { return exit || generation != seen; });
+			if (exit)
+				return;
+			seen = generation;
+
+			auto f = job;
+			lk.unlock();
+			(*f)(thread_id);
+			lk.lock();
+
+			if (--running == 0)
+				cv_done.notify_one();
+		}
+	}
+
+	// ---------------------------------------------
+	//   NNNative
+	// ---------------------------------------------
+
+	std::string NNNative::isa()
+	{
+#if defined(USE_AVX512)
+		std::string s = "AVX-512";
+#elif defined(USE_AVX2)
+		std::string s = "AVX2";
+#else
+		std::string s = "generic";
+#endif
+#if defined(USE_VNNI)
+		s += " VNNI";
+#endif
+		return s;
+	}
+
+	// モデルファイルの読み込み。
+	Result NNNative::load(const std::string& model_filename, int gpu_id, int batch_size)
+	{
+		OnnxGraph graph;
+		auto result = parse_onnx(model_filename, graph);
+		if (result.is_not_ok())
+			return result;
+
+		net = std::make_unique<NativeNetwork>();
+		net->int8 = (bool)Options["NN_Int8"];
+		result = net->build(graph);
+		if (result.is_not_ok())
+			return result;
+		net->compile();
+
+		// NN_Threadsは、全UctSearcherGroup(UCT_Threads1～のうち0でないもの)の合計。
+		// グループごとにNNNativeを持って同時に推論するので、グループの数で割っておかないとCPUのコア数を超えてしまう。
+		int search_groups = 0;
+		for (int i = 1; i <= max_gpu; ++i)
+		{
+			const std::string name = "UCT_Threads" + std::to_string(i);
+			if (Options.count(name) && (int)Options[name] > 0)
+				++search_groups;
+		}
+		const size_t threads = std::max((int)Options["NN_Threads"] / std::max(search_groups, 1), 1);
+		workers.resize(threads);
+		net->alloc_workspaces(threads);
+
+		sync_cout << "info string NNNative : " << net->layers.size() << " layers"
+			<< ", " << (net->int8 ? "int8" : "fp32")
+			<< ", " << isa()
+			<< ", threads = " << threads << sync_endl;
+
+		return ResultCode::Ok;
+	}
+
+	// NNによる推論
+	void NNNative::forward(const int batch_size, PType* p1, PType* p2, NN_Input1* x1, NN_Input2* x2, NN_Output_Policy* y1, NN_Output_Value* y2)
+	{
+		// batchを、1スレッドあたり局面group(≦MaxGroup)ずつに分けて、各スレッドが空いたら次のgroupを取りに行く。
+		const int threads = int(workers.size());
+		const int group   = std::clamp((batch_size + threads - 1) / threads, 1, MaxGroup);
+		const int groups  = (batch_size + group - 1) / group;
+
+		std::atomic<int> next(0);
+		auto job = [&](size_t thread_id)
+		{
+			NativeWorkspace& ws = *net->workspaces[thread_id];
+			for (int i; (i = next++) < groups; )
+			{
+				const int b0 = i * group, n = std::min(group, batch_size - b0);
+				net->forward_group(ws, n, x1 + b0, x2 + b0, y1 + b0, y2 + b0);
+			}
+		};
+
+		if (groups == 1)
+			job(0);
+		else
+			workers.run(job);
+	}
+
+	NNNative::NNNative() {}
+	NNNative::~NNNative() {}
+
+} // namespace Eval::dlshogi
+
+#endif // defined(YANEURAOU_ENGINE_DEEP) && defined(NATIVE_NN)
@@ -0,0 +1,96 @@
+﻿#ifndef __NN_NATIVE_H_INCLUDED__
+#define __NN_NATIVE_H_INCLUDED__
+#include "../../config.h"
+
+#if defined(YANEURAOU_ENGINE_DEEP) && defined(NATIVE_NN)
+
+// 外部ライブラリに依存しない、CPUでの推論。
+// ONNX Runtime等がない環境(CPUしかないLinuxの解析用サーバーなど)でふかうら王を動かすためのもの。
+//
+// dlshogiのモデルファイル(.onnx)を自前で読み込んで、畳み込み(Conv)は、im2col + SIMDで書いたGEMMで計算する。
+// 対応しているONNXのオペレーターは、dlshogiのResNetで使われているものだけ。
+//   Conv(1x1,3x3) , BatchNormalization , Relu , Sigmoid , Add , Mul , Flatten , Reshape , Gemm , MatMul
+//
+// エンジンオプション
+//   NN_Threads : 推論に用いるスレッド数。batchを数局面ずつに分けて、各スレッドで並列に計算する。
+//                UCT_Threads2～も使うときは、その全グループの合計。(グループの数で割って、各グループのNNNativeに割り当てる)
+//   NN_Int8    : trueならConvの重みと入力をint8に量子化して計算する。(AVX2/AVX-512、VNNIがあればVNNI命令を使う)
+//                Gemm(全結合層)は、int8モードでもfp32で計算する。
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+#include "nn.h"
+#include "nn_types.h"
+
+namespace Eval::dlshogi
+{
+	// モデルをcompileしたもの。中身はnn_native.cppで定義する。
+	struct NativeNetwork;
+
+	// NNNative用のworker thread。
+	// run()で渡した関数を、呼び出し元のスレッドも含めて全スレッドで実行して、全部終わるまで待つ。
+	class NativeWorkers
+	{
+	public:
+		// 呼び出し元のスレッドを含めてn個のスレッドで実行するようにする。
+		void resize(size_t n);
+
+		// スレッド数(呼び出し元のスレッドを含む)
+		size_t size() const { return threads.size() + 1; }
+
+		// f(thread_id)を全スレッドで実行する。呼び出し元のスレッドのthread_idは0。
+		void run(const std::function<void(size_t)>& f);
+
+		~NativeWorkers() { resize(1); }
+
+	private:
+		// seen : 生成時のgeneration
+		void idle_loop(size_t thread_id, u64 seen);
+
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable cv_start, cv_done;
+		const std::function<void(size_t)>* job = nullptr;
+
+		// run()が呼び出されるごとにインクリメントされる。
+		u64 generation = 0;
+
+		// 実行中のworker thread数
+		size_t running = 0;
+
+		bool exit = false;
+	};
+
+	// 外部ライブラリを用いないCPU推論用
+	class NNNative : public NN
+	{
+	public:
+		// モデルファイルの読み込み。
+		virtual Tools::Result load(const std::string& model_path, int gpu_id, int batch_size);
+
+		// NNによる推論
+		virtual void forward(const int batch_size, PType* p1, PType* p2, NN_Input1* x1, NN_Input2* x2, NN_Output_Policy* y1, NN_Output_Value* y2);
+
+		// 使用可能なデバイス数を取得する。
+		static int get_device_count() { return 1; }
+
+		// 推論に使っているSIMD命令などを表す文字列。"info string"での表示用。
+		static std::string isa();
+
+		// NativeNetworkは不完全型なので、コンストラクタとデストラクタはnn_native.cppで定義する。
+		NNNative();
+		virtual ~NNNative();
+
+	private:
+		std::unique_ptr<NativeNetwork> net;
+		NativeWorkers workers;
+	};
+
+} // namespace Eval::dlshogi
+
+#endif // defined(YANEURAOU_ENGINE_DEEP) && defined(NATIVE_NN)
+#endif // ndef __NN_NATIVE_H_INCLUDED__
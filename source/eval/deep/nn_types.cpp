@@ -614,6 +614,7 @@ namespace Eval::dlshogi
 			if (model_paths[i] != "")
 			{
 				string path = Path::Combine(eval_dir, model_paths[i].c_str());
+#if !defined(MOCK_NN)
 				if (std::find(checked_paths.begin(), checked_paths.end(), path) == checked_paths.end())
 				{
 					// 未チェックのやつなので調べる。
@@ -626,6 +627,9 @@ namespace Eval::dlshogi
 					// 記憶しておく。
 					checked_paths.push_back(path);
 				}
+#else
+				// MOCK_NNではモデルファイルを読み込まないので、存在しなくとも良い。
+#endif
 				ModelPaths.push_back(path);
 			}
 			else {
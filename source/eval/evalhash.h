@@ -1,28 +1,38 @@
 ﻿#ifndef EVALHASH_H_INCLUDED
 #define EVALHASH_H_INCLUDED
 
+#include <memory>
+#include <type_traits>
 #include "../types.h"
 #include "../misc.h"
 
 // シンプルなHashTableの実装。Sizeは2のべき乗。
 // 評価値のcacheに用いる。
+// Tがstd::atomicを含むなどでmemsetしてはならない型であれば、確保・クリアのときに値初期化で構築する。
 template <typename T>
 struct HashTable
 {
 	// 配列のresize。単位は[MB]
+	// 0なら確保しない。このときoperator[]はnullptrを返す。
 	void resize(size_t mbSize)
 	{
 		size_t newClusterCount = mbSize * 1024 * 1024 / sizeof(T);
-		newClusterCount = (size_t)1 << MSB64(newClusterCount); // msbだけ取り、2**nであることを保証する
+		if (newClusterCount)
+			newClusterCount = (size_t)1 << MSB64(newClusterCount); // msbだけ取り、2**nであることを保証する
 
 		if (newClusterCount != size)
 		{
 			release();
 			size = newClusterCount;
+			if (!size)
+				return;
 
 			// ゼロクリアしておかないと、benchの結果が不安定になる。
 			// 気持ち悪いのでゼロクリアしておく。
-			entries_ = (T*)largeMemory.alloc(size * sizeof(T),alignof(T),true);
+			entries_ = (T*)largeMemory.alloc(size * sizeof(T), alignof(T), std::is_trivially_copyable<T>::value);
+			if (!std::is_trivially_copyable<T>::value)
+				std::uninitialized_value_construct_n(entries_, size);
+			mask = size - 1;
 		}
 	}
 
@@ -33,16 +43,28 @@ struct HashTable
 			largeMemory.free();
 			entries_ = nullptr;
 		}
+		size = mask = 0;
 	}
 
 	~HashTable() { release(); }
 
-	T* operator[] (const Key k) { return entries_ + (static_cast<size_t>(k) & (size - 1)); }
-	void clear() { Tools::memclear("eHash", entries_, size * sizeof(T)); }
+	T* operator[] (const Key k) { return entries_ + (static_cast<size_t>(k) & mask); }
+
+	void clear()
+	{
+		if (!entries_)
+			return;
+
+		if (std::is_trivially_copyable<T>::value)
+			Tools::memclear("eHash", entries_, size * sizeof(T));
+		else
+			std::uninitialized_value_construct_n(entries_, size);
+	}
 
 private:
 
 	size_t size = 0;
+	size_t mask = 0;
 	T* entries_ = nullptr;
 	LargeMemory largeMemory;
 };
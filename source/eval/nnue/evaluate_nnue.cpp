@@ -5,11 +5,13 @@
 #if defined(EVAL_NNUE)
 
 #include <fstream>
+#include <iomanip>
 
 #include "../../evaluate.h"
 #include "../../position.h"
 #include "../../misc.h"
 #include "../../usi.h"
+#include "../../thread.h"
 
 #if defined(USE_EVAL_HASH)
 #include "../evalhash.h"
@@ -17,68 +19,26 @@
 
 #include "evaluate_nnue.h"
 
+#if defined(USE_CPU_DISPATCH)
+#include "../../cpu_features.h"
+
+#if defined(EVAL_LEARN)
+// 学習部はFeatureTransformerなどを直接扱うので、命令セットごとの計算部分の切り替えに対応していない。
+#error "EVAL_LEARN is not supported with TARGET_CPU = DISPATCH"
+#endif
+#endif
+
 namespace Eval {
 
     namespace NNUE {
 
 		int FV_SCALE = 16; // 水匠5では24がベストらしいのでエンジンオプション"FV_SCALE"で変更可能にした。
 
-        // 入力特徴量変換器
-        AlignedPtr<FeatureTransformer> feature_transformer;
-
-        // 評価関数
-        AlignedPtr<Network> network;
-
         // 評価関数ファイル名
         const char* const kFileName = "nn.bin";
 
-        // 評価関数の構造を表す文字列を取得する
-        std::string GetArchitectureString() {
-            return "Features=" + FeatureTransformer::GetStructureString() +
-                ",Network=" + Network::GetStructureString();
-        }
-
-        namespace {
-
-            namespace Detail {
-
-                // 評価関数パラメータを初期化する
-                template <typename T>
-                void Initialize(AlignedPtr<T>& pointer) {
-
-                    // →　メモリはLarge Pageから確保することで高速化する。
-                    void* ptr = LargeMemory::static_alloc(sizeof(T) , alignof(T), true);
-                    pointer.reset(reinterpret_cast<T*>(ptr));
-
-                    //sync_cout << "nnue.alloc(" << sizeof(T) << "," << alignof(T) << ")" << sync_endl;
-                }
-
-                // 評価関数パラメータを読み込む
-                template <typename T>
-                bool ReadParameters(std::istream& stream, const AlignedPtr<T>& pointer) {
-                    std::uint32_t header;
-                    stream.read(reinterpret_cast<char*>(&header), sizeof(header));
-                    if (!stream || header != T::GetHashValue()) return false;
-                    return pointer->ReadParameters(stream);
-                }
-
-                // 評価関数パラメータを書き込む
-                template <typename T>
-                bool WriteParameters(std::ostream& stream, const AlignedPtr<T>& pointer) {
-                    constexpr std::uint32_t header = T::GetHashValue();
-                    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
-                    return pointer->WriteParameters(stream);
-                }
-
-            }  // namespace Detail
-
-            // 評価関数パラメータを初期化する
-            void Initialize() {
-                Detail::Initialize(feature_transformer);
-                Detail::Initialize(network);
-            }
-
-        }  // namespace
+        // FeatureTransformerのパラメーターの世代。AccumulatorCacheの破棄に用いる。
+        std::atomic<std::uint32_t> parameters_generation;
 
         // ヘッダを読み込む
         bool ReadHeader(std::istream& stream,
@@ -104,119 +64,95 @@ namespace Eval {
             return !stream.fail();
         }
 
-        // 評価関数パラメータを読み込む
-        bool ReadParameters(std::istream& stream) {
-            std::uint32_t hash_value;
-            std::string architecture;
-            if (!ReadHeader(stream, &hash_value, &architecture)) return false;
-            if (hash_value != kHashValue) return false;
-            if (!Detail::ReadParameters(stream, feature_transformer)) return false;
-            if (!Detail::ReadParameters(stream, network)) return false;
-            return stream && stream.peek() == std::ios::traits_type::eof();
-        }
+#if defined(USE_CPU_DISPATCH)
 
-        // 評価関数パラメータを書き込む
-        bool WriteParameters(std::ostream& stream) {
-            if (!WriteHeader(stream, kHashValue, GetArchitectureString())) return false;
-            if (!Detail::WriteParameters(stream, feature_transformer)) return false;
-            if (!Detail::WriteParameters(stream, network)) return false;
-            return !stream.fail();
-        }
+        // 使用中の命令セットの計算部分
+        static const Kernels* kernels = &sse42::kKernels;
 
-        // 差分計算ができるなら進める
-        static void UpdateAccumulatorIfPossible(const Position& pos) {
-            feature_transformer->UpdateAccumulatorIfPossible(pos);
-        }
+        // CpuFeatures::kernel()の命令セットの計算部分に切り替える。
+        // 評価関数パラメータは命令セットごとに別に持つので、切り替えたら読み込み直す必要がある。
+        static void SelectKernel() {
+            static const Kernels* const table[CpuFeatures::KERNEL_NB] = {
+                &sse42::kKernels, &avx2::kKernels, &avx512vnni::kKernels };
 
-        // 評価値を計算する
-        static Value ComputeScore(const Position& pos, bool refresh = false) {
-            auto& accumulator = pos.state()->accumulator;
-            if (!refresh && accumulator.computed_score) {
-                return accumulator.score;
+            const Kernels* k = table[CpuFeatures::kernel()];
+            if (k != kernels) {
+                kernels->release();
+                kernels = k;
             }
+        }
 
-            alignas(kCacheLineSize) TransformedFeatureType
-                transformed_features[FeatureTransformer::kBufferSize];
-            feature_transformer->Transform(pos, transformed_features, refresh);
-            alignas(kCacheLineSize) char buffer[Network::kBufferSize];
-            const auto output = network->Propagate(transformed_features, buffer);
-
-            // VALUE_MAX_EVALより大きな値が返ってくるとaspiration searchがfail highして
-            // 探索が終わらなくなるのでVALUE_MAX_EVAL以下であることを保証すべき。
-
-            // この現象が起きても、対局時に秒固定などだとそこで探索が打ち切られるので、
-            // 1つ前のiterationのときの最善手がbestmoveとして指されるので見かけ上、
-            // 問題ない。このVALUE_MAX_EVALが返ってくるような状況は、ほぼ詰みの局面であり、
-            // そのような詰みの局面が出現するのは終盤で形勢に大差がついていることが多いので
-            // 勝敗にはあまり影響しない。
-
-            // しかし、教師生成時などdepth固定で探索するときに探索から戻ってこなくなるので
-            // そのスレッドの計算時間を無駄にする。またdepth固定対局でtime-outするようになる。
-
-            auto score = static_cast<Value>(output[0] / FV_SCALE);
+        // 以下、使用中の命令セットの計算部分を呼び出す。
 
-            // 1) ここ、下手にclipすると学習時には影響があるような気もするが…。
-            // 2) accumulator.scoreは、差分計算の時に用いないので書き換えて問題ない。
-            score = Math::clamp(score, -VALUE_MAX_EVAL, VALUE_MAX_EVAL);
+        void Initialize() { kernels->initialize(); }
+        bool ReadParameters(std::istream& stream) { return kernels->read_parameters(stream); }
+        bool WriteParameters(std::ostream& stream) { return kernels->write_parameters(stream); }
+        std::string GetArchitectureString() { return kernels->get_architecture_string(); }
+        std::uint64_t GetParametersHash() { return kernels->get_parameters_hash(); }
+        void UpdateAccumulatorIfPossible(const Position& pos) { kernels->update_accumulator_if_possible(pos); }
+        Value ComputeScore(const Position& pos, bool refresh) { return kernels->compute_score(pos, refresh); }
 
-            accumulator.score = score;
-            accumulator.computed_score = true;
-            return accumulator.score;
-        }
+#endif
 
     }  // namespace NNUE
 
 #if defined(USE_EVAL_HASH)
 
-// HashTableに評価値を保存するために利用するクラス
-    struct alignas(16) ScoreKeyValue {
-#if defined(USE_SSE2)
-        ScoreKeyValue() = default;
-        ScoreKeyValue(const ScoreKeyValue & other) {
-            static_assert(sizeof(ScoreKeyValue) == sizeof(__m128i),
-                "sizeof(ScoreKeyValue) should be equal to sizeof(__m128i)");
-            _mm_store_si128(&as_m128i, other.as_m128i);
-        }
-        ScoreKeyValue& operator=(const ScoreKeyValue & other) {
-            _mm_store_si128(&as_m128i, other.as_m128i);
-            return *this;
+    // evaluate()の結果を保存しておくHashTable(俗にいうehash)のCluster。
+    // "EvalHash"が0ならHashTableは確保されず、evaluate()では用いない。
+    // 1 entryはu64 1つで、上位48bitにkeyの上位48bit、下位16bitに評価値(s16)を格納する。
+    // keyと評価値を1語にpackしてあるので、std::atomic<u64>のrelaxedなload/storeだけで
+    // lock-freeに読み書きでき、torn readが起きない。
+    // 1 cache lineに8 entry入り、probe()ではこの8 entryを調べる。(8-way set associative)
+    struct alignas(64) EvalHashCluster {
+        static constexpr int kEntries = 8;
+        std::atomic<std::uint64_t> entries[kEntries];
+
+        static constexpr std::uint64_t kKeyMask = ~std::uint64_t(0xffff);
+
+        // keyに対応する評価値があればscoreに格納してtrueを返す。
+        bool probe(const Key key, Value& score) const {
+            const std::uint64_t tag = std::uint64_t(key) & kKeyMask;
+            for (const auto& e : entries) {
+                const std::uint64_t data = e.load(std::memory_order_relaxed);
+                if (data != 0 && (data & kKeyMask) == tag) {
+                    score = Value(std::int16_t(data & 0xffff));
+                    return true;
+                }
+            }
+            return false;
         }
-#endif
 
-        // evaluate hashでatomicに操作できる必要があるのでそのための操作子
-        void encode() {
-#if defined(USE_SSE2)
-            // ScoreKeyValue は atomic にコピーされるので key が合っていればデータも合っている。
-#else
-            key ^= score;
-#endif
+        // keyに対する評価値を保存する。
+        // 同じkeyのentryか空きentryがあればそこに、なければkeyから決まるentryを置き換える。
+        void store(const Key key, const Value score) {
+            const std::uint64_t tag = std::uint64_t(key) & kKeyMask;
+            const std::uint64_t data = tag | std::uint16_t(std::int16_t(score));
+            int victim = int((std::uint64_t(key) >> 32) & (kEntries - 1));
+            for (int i = 0; i < kEntries; ++i) {
+                const std::uint64_t d = entries[i].load(std::memory_order_relaxed);
+                if (d == 0 || (d & kKeyMask) == tag) {
+                    victim = i;
+                    break;
+                }
+            }
+            entries[victim].store(data, std::memory_order_relaxed);
         }
-        // decode()はencode()の逆変換だが、xorなので逆変換も同じ変換。
-        void decode() { encode(); }
-
-        union {
-            struct {
-                std::uint64_t key;
-                std::uint64_t score;
-            };
-#if defined(USE_SSE2)
-            __m128i as_m128i;
-#endif
-        };
     };
+    static_assert(sizeof(EvalHashCluster) == 64, "sizeof(EvalHashCluster) should be 64");
+    static_assert(VALUE_MAX_EVAL <= INT16_MAX, "the score of EvalHash must fit in 16 bits");
 
-    // evaluateしたものを保存しておくHashTable(俗にいうehash)
-
-    struct EvaluateHashTable : HashTable<ScoreKeyValue> {};
+    struct EvaluateHashTable : HashTable<EvalHashCluster> {};
 
     EvaluateHashTable g_evalTable;
     void EvalHash_Resize(size_t mbSize) { g_evalTable.resize(mbSize); }
     void EvalHash_Clear() { g_evalTable.clear(); };
 
     // prefetchする関数も用意しておく。
+    // Clusterは64byteでalignされているので、そのアドレスをそのままprefetchすれば良い。
+    // (確保されていなければnullptrのprefetchになるが、それは何も起きない)
     void prefetch_evalhash(const Key key) {
-        constexpr auto mask = ~((u64)0x1f);
-        prefetch((void*)((u64)g_evalTable[key] & mask));
+        prefetch((void*)g_evalTable[key]);
     }
 #endif
 
@@ -224,6 +160,10 @@ namespace Eval {
     // benchコマンドなどでOptionsを保存して復元するのでこのときEvalDirが変更されたことになって、
     // 評価関数の再読込の必要があるというフラグを立てるため、この関数は2度呼び出されることがある。
     void load_eval() {
+#if defined(USE_CPU_DISPATCH)
+        NNUE::SelectKernel();
+        sync_cout << "info string NNUE kernel = " << CpuFeatures::kernel_name(CpuFeatures::kernel()) << sync_endl;
+#endif
         NNUE::Initialize();
 
 #if defined(EVAL_LEARN)
@@ -308,21 +248,33 @@ namespace Eval {
 #if defined(USE_EVAL_HASH)
         // evaluate hash tableにはあるかも。
         const Key key = pos.state()->key();
-        ScoreKeyValue entry = *g_evalTable[key];
-        entry.decode();
-        if (entry.key == key) {
+        EvalHashCluster* const cluster = g_evalTable[key];
+        Thread* const th = pos.this_thread();
+        if (th && cluster)
+            ++th->evalhash_probes;
+
+        Value hash_score;
+        if (cluster && cluster->probe(key, hash_score)) {
             // あった！
-            return Value(entry.score);
+            if (th)
+                ++th->evalhash_hits;
+
+            // hitしてもaccumulatorの差分計算は可能な限り進めておく。
+            // そうしておかないと、この局面の子局面で差分計算ができず全計算になってしまう。
+            // (affine層の計算は不要なので、それを省略できた分だけ得をする)
+            NNUE::UpdateAccumulatorIfPossible(pos);
+            auto& accumulator = pos.state()->accumulator;
+            accumulator.score = hash_score;
+            accumulator.computed_score = true;
+            return hash_score;
         }
 #endif
 
         Value score = NNUE::ComputeScore(pos);
 #if defined(USE_EVAL_HASH)
         // せっかく計算したのでevaluate hash tableに保存しておく。
-        entry.key = key;
-        entry.score = score;
-        entry.encode();
-        *g_evalTable[key] = entry;
+        if (cluster)
+            cluster->store(key, score);
 #endif
 
         return score;
@@ -333,9 +285,42 @@ namespace Eval {
         NNUE::UpdateAccumulatorIfPossible(pos);
     }
 
+#if defined(USE_EVAL_HASH)
+    // EvalHashのスレッドごとの照会回数とhit率を出力する。
+    void print_evalhash_stat(std::ostream& os) {
+        std::uint64_t probes = 0, hits = 0;
+        for (Thread* th : Threads)
+        {
+            probes += th->evalhash_probes;
+            hits   += th->evalhash_hits;
+        }
+        os << "EvalHash probes        : " << probes << std::endl
+           << "EvalHash hits          : " << hits
+           << " (" << std::fixed << std::setprecision(2) << (probes ? 100.0 * hits / probes : 0.0) << "%)"
+           << std::defaultfloat << std::endl;
+        if (Threads.size() > 1)
+            for (Thread* th : Threads)
+                os << "  thread " << th->thread_id() << " : " << th->evalhash_hits << " / " << th->evalhash_probes << std::endl;
+    }
+#endif
+
     // 現在の局面の評価値の内訳を表示する
+    // NNUEでは評価値の内訳はないので、探索スレッドごとのaccumulatorの計算方法の統計を表示する。
     void print_eval_stat(Position& /*pos*/) {
-        std::cout << "--- EVAL STAT: not implemented" << std::endl;
+        std::uint64_t refreshes = 0, cache_diffs = 0, multi_ply_updates = 0;
+        for (Thread* th : Threads)
+        {
+            refreshes         += th->nnue_cache.refreshes;
+            cache_diffs       += th->nnue_cache.cache_diffs;
+            multi_ply_updates += th->nnue_cache.multi_ply_updates;
+        }
+        std::cout << "--- EVAL STAT" << std::endl
+                  << "refreshes (full)       : " << refreshes << std::endl
+                  << "refreshes (cache diff) : " << cache_diffs << std::endl
+                  << "multi-ply updates      : " << multi_ply_updates << std::endl;
+#if defined(USE_EVAL_HASH)
+        print_evalhash_stat(std::cout);
+#endif
     }
 
 }  // namespace Eval
@@ -48,6 +48,20 @@ namespace Eval::NNUE {
 	template <typename T>
 	using AlignedPtr = std::unique_ptr<T, LargeMemoryDeleter<T>>;
 
+	// ヘッダを読み込む
+	bool ReadHeader(std::istream& stream,
+	    std::uint32_t* hash_value, std::string* architecture);
+
+	// ヘッダを書き込む
+	bool WriteHeader(std::ostream& stream,
+	    std::uint32_t hash_value, const std::string& architecture);
+
+	// 以下は、NNUEの計算部分。(evaluate_nnue_kernel.cpp)
+	// TARGET_CPU = DISPATCHのときは命令セットごとにコンパイルされて、それぞれの名前空間に入る。
+	// そのときは、evaluate_nnue.cppで定義する同名の関数が、使用中の命令セットのものを呼び出す。
+
+	NNUE_KERNEL_NAMESPACE_BEGIN
+
 	// 入力特徴量変換器
 	extern AlignedPtr<FeatureTransformer> feature_transformer;
 
@@ -60,13 +74,9 @@ namespace Eval::NNUE {
 	// 評価関数の構造を表す文字列を取得する
 	std::string GetArchitectureString();
 
-	// ヘッダを読み込む
-	bool ReadHeader(std::istream& stream,
-	    std::uint32_t* hash_value, std::string* architecture);
-
-	// ヘッダを書き込む
-	bool WriteHeader(std::ostream& stream,
-	    std::uint32_t hash_value, const std::string& architecture);
+	// 評価関数パラメーターのハッシュ値を取得する
+	// (置換表をファイルに保存するときに、同じ評価関数であるかの確認に用いる)
+	std::uint64_t GetParametersHash();
 
 	// 評価関数パラメータを読み込む
 	bool ReadParameters(std::istream& stream);
@@ -74,6 +84,36 @@ namespace Eval::NNUE {
 	// 評価関数パラメータを書き込む
 	bool WriteParameters(std::ostream& stream);
 
+	// 評価関数パラメータのメモリを確保する
+	void Initialize();
+
+	// 差分計算ができるなら進める
+	void UpdateAccumulatorIfPossible(const Position& pos);
+
+	// 評価値を計算する
+	Value ComputeScore(const Position& pos, bool refresh = false);
+
+	NNUE_KERNEL_NAMESPACE_END
+
+#if defined(USE_CPU_DISPATCH)
+	// 命令セットごとにコンパイルしたNNUEの計算部分の関数テーブル。
+	// evaluate_nnue.cppがCpuFeatures::kernel()に応じて選ぶ。
+	struct Kernels {
+		void          (*initialize)();
+		void          (*release)();                  // 評価関数パラメータのメモリを解放する
+		bool          (*read_parameters)(std::istream& stream);
+		bool          (*write_parameters)(std::ostream& stream);
+		std::string   (*get_architecture_string)();
+		std::uint64_t (*get_parameters_hash)();
+		void          (*update_accumulator_if_possible)(const Position& pos);
+		Value         (*compute_score)(const Position& pos, bool refresh);
+	};
+
+	namespace sse42      { extern const Kernels kKernels; }
+	namespace avx2       { extern const Kernels kKernels; }
+	namespace avx512vnni { extern const Kernels kKernels; }
+#endif
+
 }  // namespace Eval::NNUE
 
 #endif  // defined(EVAL_NNUE)
@@ -0,0 +1,173 @@
+﻿// NNUE評価関数の計算部分
+// TARGET_CPU = DISPATCHのときは、命令セットごとにコンパイルされる。(Makefile)
+
+#include "../../config.h"
+
+#if defined(EVAL_NNUE)
+
+#include "../../position.h"
+#include "../../misc.h"
+#include "../../thread.h"
+
+#include "evaluate_nnue.h"
+
+namespace Eval::NNUE {
+
+    NNUE_KERNEL_NAMESPACE_BEGIN
+
+        // 入力特徴量変換器
+        AlignedPtr<FeatureTransformer> feature_transformer;
+
+        // 評価関数
+        AlignedPtr<Network> network;
+
+        // 評価関数の構造を表す文字列を取得する
+        std::string GetArchitectureString() {
+            return "Features=" + FeatureTransformer::GetStructureString() +
+                ",Network=" + Network::GetStructureString();
+        }
+
+        // 評価関数パラメーターのハッシュ値を取得する
+        // パラメーターはゼロクリアしたメモリに確保しているので、paddingも含めてそのままハッシュする。
+        // (どちらのclassもcache lineでalignされているので、サイズは8の倍数である)
+        std::uint64_t GetParametersHash() {
+            std::uint64_t hash = 14695981039346656037ULL; // FNV-1aを8byte単位にしたもの
+            auto add = [&](const void* ptr, std::size_t size) {
+                auto p = reinterpret_cast<const std::uint64_t*>(ptr);
+                for (std::size_t i = 0; i < size / sizeof(std::uint64_t); ++i)
+                    hash = (hash ^ p[i]) * 1099511628211ULL;
+            };
+            if (feature_transformer) add(feature_transformer.get(), sizeof(FeatureTransformer));
+            if (network)             add(network.get(), sizeof(Network));
+            return hash;
+        }
+
+        namespace {
+
+            namespace Detail {
+
+                // 評価関数パラメータを初期化する
+                template <typename T>
+                void Initialize(AlignedPtr<T>& pointer) {
+
+                    // →　メモリはLarge Pageから確保することで高速化する。
+                    void* ptr = LargeMemory::static_alloc(sizeof(T) , alignof(T), true);
+                    pointer.reset(reinterpret_cast<T*>(ptr));
+
+                    //sync_cout << "nnue.alloc(" << sizeof(T) << "," << alignof(T) << ")" << sync_endl;
+                }
+
+                // 評価関数パラメータを読み込む
+                template <typename T>
+                bool ReadParameters(std::istream& stream, const AlignedPtr<T>& pointer) {
+                    std::uint32_t header;
+                    stream.read(reinterpret_cast<char*>(&header), sizeof(header));
+                    if (!stream || header != T::GetHashValue()) return false;
+                    return pointer->ReadParameters(stream);
+                }
+
+                // 評価関数パラメータを書き込む
+                template <typename T>
+                bool WriteParameters(std::ostream& stream, const AlignedPtr<T>& pointer) {
+                    constexpr std::uint32_t header = T::GetHashValue();
+                    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                    return pointer->WriteParameters(stream);
+                }
+
+            }  // namespace Detail
+
+        }  // namespace
+
+        // 評価関数パラメータのメモリを確保する
+        void Initialize() {
+            Detail::Initialize(feature_transformer);
+            Detail::Initialize(network);
+            parameters_generation.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // 評価関数パラメータを読み込む
+        bool ReadParameters(std::istream& stream) {
+            std::uint32_t hash_value;
+            std::string architecture;
+            if (!ReadHeader(stream, &hash_value, &architecture)) return false;
+            if (hash_value != kHashValue) return false;
+            if (!Detail::ReadParameters(stream, feature_transformer)) return false;
+            if (!Detail::ReadParameters(stream, network)) return false;
+            return stream && stream.peek() == std::ios::traits_type::eof();
+        }
+
+        // 評価関数パラメータを書き込む
+        bool WriteParameters(std::ostream& stream) {
+            if (!WriteHeader(stream, kHashValue, GetArchitectureString())) return false;
+            if (!Detail::WriteParameters(stream, feature_transformer)) return false;
+            if (!Detail::WriteParameters(stream, network)) return false;
+            return !stream.fail();
+        }
+
+        // 差分計算ができるなら進める
+        void UpdateAccumulatorIfPossible(const Position& pos) {
+            AccumulatorCache* cache = pos.this_thread() ? &pos.this_thread()->nnue_cache : nullptr;
+            feature_transformer->UpdateAccumulatorIfPossible(pos, cache);
+        }
+
+        // 評価値を計算する
+        Value ComputeScore(const Position& pos, bool refresh) {
+            auto& accumulator = pos.state()->accumulator;
+            if (!refresh && accumulator.computed_score) {
+                return accumulator.score;
+            }
+
+            alignas(kCacheLineSize) TransformedFeatureType
+                transformed_features[FeatureTransformer::kBufferSize];
+            // Position::set()から呼び出されたとき(refresh == true)は、まだthisThreadが設定されていないので
+            // スレッドごとのキャッシュは用いない。
+            AccumulatorCache* cache = (!refresh && pos.this_thread()) ? &pos.this_thread()->nnue_cache : nullptr;
+            feature_transformer->Transform(pos, transformed_features, refresh, cache);
+            alignas(kCacheLineSize) char buffer[Network::kBufferSize];
+            const auto output = network->Propagate(transformed_features, buffer);
+
+            // VALUE_MAX_EVALより大きな値が返ってくるとaspiration searchがfail highして
+            // 探索が終わらなくなるのでVALUE_MAX_EVAL以下であることを保証すべき。
+
+            // この現象が起きても、対局時に秒固定などだとそこで探索が打ち切られるので、
+            // 1つ前のiterationのときの最善手がbestmoveとして指されるので見かけ上、
+            // 問題ない。このVALUE_MAX_EVALが返ってくるような状況は、ほぼ詰みの局面であり、
+            // そのような詰みの局面が出現するのは終盤で形勢に大差がついていることが多いので
+            // 勝敗にはあまり影響しない。
+
+            // しかし、教師生成時などdepth固定で探索するときに探索から戻ってこなくなるので
+            // そのスレッドの計算時間を無駄にする。またdepth固定対局でtime-outするようになる。
+
+            auto score = static_cast<Value>(output[0] / FV_SCALE);
+
+            // 1) ここ、下手にclipすると学習時には影響があるような気もするが…。
+            // 2) accumulator.scoreは、差分計算の時に用いないので書き換えて問題ない。
+            score = Math::clamp(score, -VALUE_MAX_EVAL, VALUE_MAX_EVAL);
+
+            accumulator.score = score;
+            accumulator.computed_score = true;
+            return accumulator.score;
+        }
+
+#if defined(USE_CPU_DISPATCH)
+
+        // 評価関数パラメータのメモリを解放する
+        // (使用する命令セットを切り替えたときに、前の命令セットのものを解放する)
+        static void Release() {
+            feature_transformer.reset();
+            network.reset();
+        }
+
+        const Kernels kKernels = {
+            Initialize, Release, ReadParameters, WriteParameters,
+            GetArchitectureString, GetParametersHash,
+            UpdateAccumulatorIfPossible, ComputeScore,
+        };
+
+#endif
+
+    NNUE_KERNEL_NAMESPACE_END
+
+}  // namespace Eval::NNUE
+
+#endif  // defined(EVAL_NNUE)
@@ -83,42 +83,48 @@ class FeatureSetBase {
   static void AppendChangedIndices(
       const PositionType& pos, TriggerEvent trigger,
       IndexListType removed[2], IndexListType added[2], bool reset[2]) {
-    const auto& dp = pos.state()->dirtyPiece;
+    AppendChangedIndices(pos, pos.state()->dirtyPiece, trigger, removed, added, reset);
+  }
+
+  // 特徴量のうち、dpによって値が変化したインデックスのリストを取得する
+  // dpとして一手前以外の局面のDirtyPieceを渡すのは、kSupportsMultiPlyUpdateがtrueのときのみ許される。
+  template <typename PositionType, typename IndexListType>
+  static void AppendChangedIndices(
+      const PositionType& pos, const DirtyPiece& dp, TriggerEvent trigger,
+      IndexListType removed[2], IndexListType added[2], bool reset[2]) {
     if (dp.dirty_num == 0) return;
 
     for (const auto perspective : COLOR) {
-      reset[perspective] = false;
-      switch (trigger) {
-        case TriggerEvent::kNone:
-          break;
-        case TriggerEvent::kFriendKingMoved:
-          reset[perspective] =
-              dp.pieceNo[0] == PIECE_NUMBER_KING + perspective;
-          break;
-        case TriggerEvent::kEnemyKingMoved:
-          reset[perspective] =
-              dp.pieceNo[0] == PIECE_NUMBER_KING + ~perspective;
-          break;
-        case TriggerEvent::kAnyKingMoved:
-          reset[perspective] = dp.pieceNo[0] >= PIECE_NUMBER_KING;
-          break;
-        case TriggerEvent::kAnyPieceMoved:
-          reset[perspective] = true;
-          break;
-        default:
-          ASSERT_LV5(false);
-          break;
-      }
+      reset[perspective] = RequiresRefresh(dp, trigger, perspective);
       if (reset[perspective]) {
         Derived::CollectActiveIndices(
             pos, trigger, perspective, &added[perspective]);
       } else {
         Derived::CollectChangedIndices(
-            pos, trigger, perspective,
+            pos, dp, trigger, perspective,
             &removed[perspective], &added[perspective]);
       }
     }
   }
+
+  // dpの変化によって、triggerに対応する特徴量の全計算が必要になるか
+  static bool RequiresRefresh(const DirtyPiece& dp, TriggerEvent trigger, Color perspective) {
+    switch (trigger) {
+      case TriggerEvent::kNone:
+        return false;
+      case TriggerEvent::kFriendKingMoved:
+        return dp.pieceNo[0] == PIECE_NUMBER_KING + perspective;
+      case TriggerEvent::kEnemyKingMoved:
+        return dp.pieceNo[0] == PIECE_NUMBER_KING + ~perspective;
+      case TriggerEvent::kAnyKingMoved:
+        return dp.pieceNo[0] >= PIECE_NUMBER_KING;
+      case TriggerEvent::kAnyPieceMoved:
+        return true;
+      default:
+        ASSERT_LV5(false);
+        return false;
+    }
+  }
 };
 
 // Class template that represents the feature set
@@ -146,6 +152,9 @@ class FeatureSet<FirstFeatureType, RemainingFeatureTypes...> :
   using SortedTriggerSet = typename InsertToSet<TriggerEvent,
       typename Tail::SortedTriggerSet, Head::kRefreshTrigger>::Result;
   static constexpr auto kRefreshTriggers = SortedTriggerSet::kValues;
+  // 2手以上前の局面のDirtyPieceを用いて差分計算できるか
+  static constexpr bool kSupportsMultiPlyUpdate =
+      Head::kSupportsMultiPlyUpdate && Tail::kSupportsMultiPlyUpdate;
 
   // 特徴量名を取得する
   static std::string GetName() {
@@ -171,13 +180,13 @@ class FeatureSet<FirstFeatureType, RemainingFeatureTypes...> :
   // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
   template <typename IndexListType>
   static void CollectChangedIndices(
-      const Position& pos, const TriggerEvent trigger, const Color perspective,
+      const Position& pos, const DirtyPiece& dp, const TriggerEvent trigger, const Color perspective,
       IndexListType* const removed, IndexListType* const added) {
-    Tail::CollectChangedIndices(pos, trigger, perspective, removed, added);
+    Tail::CollectChangedIndices(pos, dp, trigger, perspective, removed, added);
     if (Head::kRefreshTrigger == trigger) {
       const auto start_removed = removed->size();
       const auto start_added = added->size();
-      Head::AppendChangedIndices(pos, perspective, removed, added);
+      Head::AppendChangedIndices(pos, dp, perspective, removed, added);
       for (auto i = start_removed; i < removed->size(); ++i) {
         (*removed)[i] += Tail::kDimensions;
       }
@@ -215,6 +224,8 @@ class FeatureSet<FeatureType> : public FeatureSetBase<FeatureSet<FeatureType>> {
   using SortedTriggerSet =
       CompileTimeList<TriggerEvent, FeatureType::kRefreshTrigger>;
   static constexpr auto kRefreshTriggers = SortedTriggerSet::kValues;
+  // 2手以上前の局面のDirtyPieceを用いて差分計算できるか
+  static constexpr bool kSupportsMultiPlyUpdate = FeatureType::kSupportsMultiPlyUpdate;
 
   // 特徴量名を取得する
   static std::string GetName() {
@@ -233,10 +244,10 @@ class FeatureSet<FeatureType> : public FeatureSetBase<FeatureSet<FeatureType>> {
 
   // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
   static void CollectChangedIndices(
-      const Position& pos, const TriggerEvent trigger, const Color perspective,
+      const Position& pos, const DirtyPiece& dp, const TriggerEvent trigger, const Color perspective,
       IndexList* const removed, IndexList* const added) {
     if (FeatureType::kRefreshTrigger == trigger) {
-      FeatureType::AppendChangedIndices(pos, perspective, removed, added);
+      FeatureType::AppendChangedIndices(pos, dp, perspective, removed, added);
     }
   }
 
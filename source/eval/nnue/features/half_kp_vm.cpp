@@ -63,12 +63,11 @@ namespace Eval {
 			// 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
 			template <Side AssociatedKing>
 			void HalfKP_vm<AssociatedKing>::AppendChangedIndices(
-				const Position& pos, Color perspective,
+				const Position& pos, const DirtyPiece& dp, Color perspective,
 				IndexList* removed, IndexList* added) {
 				BonaPiece* pieces;
 				Square sq_target_k;
 				GetPieces(pos, perspective, &pieces, &sq_target_k);
-				const auto& dp = pos.state()->dirtyPiece;
 				for (int i = 0; i < dp.dirty_num; ++i) {
 					if (dp.pieceNo[i] >= PIECE_NUMBER_KING) continue;
 					const auto old_p = static_cast<BonaPiece>(
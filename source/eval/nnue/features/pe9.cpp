@@ -86,11 +86,10 @@ void PE9::AppendActiveIndices(
 
 // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
 void PE9::AppendChangedIndices(
-    const Position& pos, Color perspective,
+    const Position& pos, const DirtyPiece& dp, Color perspective,
     IndexList* removed, IndexList* added) {
   BonaPiece* pieces;
   GetPieces(pos, perspective, &pieces);
-  const auto& dp = pos.state()->dirtyPiece;
 
   for (int i = 0; i < dp.dirty_num; ++i) {
     if (dp.pieceNo[i] >= PIECE_NUMBER_KING) continue;
@@ -31,13 +31,16 @@ class PE9 {
 
   // 差分計算の代わりに全計算を行うタイミング
   static constexpr TriggerEvent kRefreshTrigger = TriggerEvent::kNone;
+  // 2手以上前の局面のDirtyPieceを用いて差分計算できるか
+  // (利き数が現局面のものなので不可)
+  static constexpr bool kSupportsMultiPlyUpdate = false;
 
   // 特徴量のうち、値が1であるインデックスのリストを取得する
   static void AppendActiveIndices(const Position& pos, Color perspective,
                                   IndexList* active);
 
   // 特徴量のうち、一手前から値が変化したインデックスのリストを取得する
-  static void AppendChangedIndices(const Position& pos, Color perspective,
+  static void AppendChangedIndices(const Position& pos, const DirtyPiece& dp, Color perspective,
                                    IndexList* removed, IndexList* added);
 
   // BonaPieceと利き数から特徴量のインデックスを求める
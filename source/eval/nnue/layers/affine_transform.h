@@ -11,6 +11,7 @@
 #include "../nnue_common.h"
 
 namespace Eval::NNUE::Layers {
+NNUE_KERNEL_NAMESPACE_BEGIN
 
 // Affine transformation layer
 // アフィン変換層
@@ -82,7 +83,7 @@ class AffineTransform {
 	const OutputType* Propagate(const TransformedFeatureType* transformed_features, char* buffer) const {
 		const auto input = previous_layer_.Propagate(transformed_features, buffer + kSelfBufferSize);
 
-#if defined(USE_WASM_SIMD)
+#if defined(NNUE_USE_WASM_SIMD)
 		{
 			// Simplify variable names (y = Ax + b)
 			constexpr int n = kInputDimensions;
@@ -97,7 +98,7 @@ class AffineTransform {
 		}
 #endif
 
-#if defined(USE_AVX512)
+#if defined(NNUE_USE_AVX512)
 
 		[[maybe_unused]] const __m512i kOnes512 = _mm512_set1_epi16(1);
 
@@ -195,7 +196,7 @@ class AffineTransform {
 		};
 
 		[[maybe_unused]] auto m512_add_dpbusd_epi32 = [=](__m512i& acc, __m512i a, __m512i b) {
-#if defined(USE_VNNI)
+#if defined(NNUE_USE_VNNI)
 			acc = _mm512_dpbusd_epi32(acc, a, b);
 #else
 			__m512i product0 = _mm512_maddubs_epi16(a, b);
@@ -206,7 +207,7 @@ class AffineTransform {
 
 		[[maybe_unused]] auto m512_add_dpbusd_epi32x2 = [=](__m512i& acc, __m512i a0, __m512i b0, __m512i a1,
 		                                                    __m512i b1) {
-#if defined(USE_VNNI)
+#if defined(NNUE_USE_VNNI)
 			acc = _mm512_dpbusd_epi32(acc, a0, b0);
 			acc = _mm512_dpbusd_epi32(acc, a1, b1);
 #else
@@ -219,7 +220,7 @@ class AffineTransform {
 		};
 
 #endif
-#if defined(USE_AVX2)
+#if defined(NNUE_USE_AVX2)
 
 		[[maybe_unused]] const __m256i kOnes256 = _mm256_set1_epi16(1);
 
@@ -244,7 +245,7 @@ class AffineTransform {
 		};
 
 		[[maybe_unused]] auto m256_add_dpbusd_epi32 = [=](__m256i& acc, __m256i a, __m256i b) {
-#if defined(USE_VNNI)
+#if defined(NNUE_USE_VNNI)
 			acc = _mm256_dpbusd_epi32(acc, a, b);
 #else
 			__m256i product0 = _mm256_maddubs_epi16(a, b);
@@ -255,7 +256,7 @@ class AffineTransform {
 
 		[[maybe_unused]] auto m256_add_dpbusd_epi32x2 = [=](__m256i& acc, __m256i a0, __m256i b0, __m256i a1,
 		                                                    __m256i b1) {
-#if defined(USE_VNNI)
+#if defined(NNUE_USE_VNNI)
 			acc = _mm256_dpbusd_epi32(acc, a0, b0);
 			acc = _mm256_dpbusd_epi32(acc, a1, b1);
 #else
@@ -269,7 +270,7 @@ class AffineTransform {
 
 #endif
 
-#if defined(USE_SSSE3)
+#if defined(NNUE_USE_SSSE3)
 
 		[[maybe_unused]] const __m128i kOnes128 = _mm_set1_epi16(1);
 
@@ -306,7 +307,7 @@ class AffineTransform {
 
 #endif
 
-#if defined(USE_AVX512)
+#if defined(NNUE_USE_AVX512)
 
 		constexpr IndexType kNumChunks512 = kPaddedInputDimensions / (kSimdWidth * 2);
 		constexpr IndexType kNumChunks256 = kPaddedInputDimensions / kSimdWidth;
@@ -473,7 +474,7 @@ class AffineTransform {
 			ASSERT_LV5(false);
 		}
 
-#elif defined(USE_AVX2)
+#elif defined(NNUE_USE_AVX2)
 
 		constexpr IndexType kNumChunks = kPaddedInputDimensions / kSimdWidth;
 
@@ -543,7 +544,7 @@ class AffineTransform {
 			ASSERT_LV5(false);
 		}
 
-#elif defined(USE_SSSE3)
+#elif defined(NNUE_USE_SSSE3)
 
 		constexpr IndexType kNumChunks = kPaddedInputDimensions / kSimdWidth;
 
@@ -619,21 +620,21 @@ class AffineTransform {
 
 		auto output = reinterpret_cast<OutputType*>(buffer);
 
-#if defined(USE_SSE2)
+#if defined(NNUE_USE_SSE2)
 		constexpr IndexType kNumChunks = kPaddedInputDimensions / kSimdWidth;
-#ifndef USE_SSSE3
+#ifndef NNUE_USE_SSSE3
 		const __m128i kZeros = _mm_setzero_si128();
 #else
 		const __m128i kOnes = _mm_set1_epi16(1);
 #endif
 		const auto input_vector = reinterpret_cast<const __m128i*>(input);
 
-#elif defined(USE_MMX)
+#elif defined(NNUE_USE_MMX)
 		constexpr IndexType kNumChunks   = kPaddedInputDimensions / kSimdWidth;
 		const __m64         kZeros       = _mm_setzero_si64();
 		const auto          input_vector = reinterpret_cast<const __m64*>(input);
 
-#elif defined(USE_NEON)
+#elif defined(NNUE_USE_NEON)
 		constexpr IndexType kNumChunks   = kPaddedInputDimensions / kSimdWidth;
 		const auto          input_vector = reinterpret_cast<const int8x8_t*>(input);
 #endif
@@ -641,7 +642,7 @@ class AffineTransform {
 		for (IndexType i = 0; i < kOutputDimensions; ++i) {
 			const IndexType offset = i * kPaddedInputDimensions;
 
-#if defined(USE_SSE2)
+#if defined(NNUE_USE_SSE2)
 			__m128i    sum_lo = _mm_cvtsi32_si128(biases_[i]);
 			__m128i    sum_hi = kZeros;
 			const auto row    = reinterpret_cast<const __m128i*>(&weights_[offset]);
@@ -664,7 +665,7 @@ class AffineTransform {
 			sum                   = _mm_add_epi32(sum, sum_second_32);
 			output[i]             = _mm_cvtsi128_si32(sum);
 
-#elif defined(USE_MMX)
+#elif defined(NNUE_USE_MMX)
 			__m64      sum_lo = _mm_cvtsi32_si64(biases_[i]);
 			__m64      sum_hi = kZeros;
 			const auto row    = reinterpret_cast<const __m64*>(&weights_[offset]);
@@ -684,7 +685,7 @@ class AffineTransform {
 			sum       = _mm_add_pi32(sum, _mm_unpackhi_pi32(sum, sum));
 			output[i] = _mm_cvtsi64_si32(sum);
 
-#elif defined(USE_NEON)
+#elif defined(NNUE_USE_NEON)
 			int32x4_t  sum = {biases_[i]};
 			const auto row = reinterpret_cast<const int8x8_t*>(&weights_[offset]);
 			for (IndexType j = 0; j < kNumChunks; ++j) {
@@ -703,7 +704,7 @@ class AffineTransform {
 			output[i] = sum;
 #endif
 		}
-#if defined(USE_MMX)
+#if defined(NNUE_USE_MMX)
 		_mm_empty();
 #endif
 
@@ -732,6 +733,7 @@ class AffineTransform {
 	};
 };
 
+NNUE_KERNEL_NAMESPACE_END
 }  // namespace Eval::NNUE::Layers
 
 #endif  // defined(EVAL_NNUE)
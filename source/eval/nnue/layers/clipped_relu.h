@@ -11,6 +11,7 @@
 #include "../nnue_common.h"
 
 namespace Eval::NNUE::Layers {
+NNUE_KERNEL_NAMESPACE_BEGIN
 
 // Clipped ReLU
 template <typename PreviousLayer>
@@ -72,7 +73,7 @@ class ClippedReLU {
         transformed_features, buffer + kSelfBufferSize);
     const auto output = reinterpret_cast<OutputType*>(buffer);
 
-  #if defined(USE_AVX2)
+  #if defined(NNUE_USE_AVX2)
     constexpr IndexType kNumChunks = kInputDimensions / kSimdWidth;
     const __m256i kZero = _mm256_setzero_si256();
     const __m256i kOffsets = _mm256_set_epi32(7, 3, 6, 2, 5, 1, 4, 0);
@@ -91,10 +92,10 @@ class ClippedReLU {
     constexpr IndexType kStart = kNumChunks * kSimdWidth;
 	// 端数分の処理が必要なので、↓以下でそれを行う。
 
-  #elif defined(USE_SSE2)
+  #elif defined(NNUE_USE_SSE2)
     constexpr IndexType kNumChunks = kInputDimensions / kSimdWidth;
 
-  #ifdef USE_SSE41
+  #ifdef NNUE_USE_SSE41
     const __m128i kZero = _mm_setzero_si128();
   #else
     const __m128i k0x80s = _mm_set1_epi8(-128);
@@ -110,7 +111,7 @@ class ClippedReLU {
             _mm_load_si128(&in[i * 4 + 3])), kWeightScaleBits);
         const __m128i packedbytes = _mm_packs_epi16(words0, words1);
         _mm_store_si128(&out[i],
-  #if defined(USE_SSE41)
+  #if defined(NNUE_USE_SSE41)
             _mm_max_epi8(packedbytes, kZero)
   #else // SSE4非対応だがSSE3は使える環境
             _mm_subs_epi8(_mm_adds_epi8(packedbytes, k0x80s), k0x80s)
@@ -119,7 +120,7 @@ class ClippedReLU {
     }
     constexpr IndexType kStart = kNumChunks * kSimdWidth;
 
-  #elif defined(USE_MMX)
+  #elif defined(NNUE_USE_MMX)
       constexpr IndexType kNumChunks = kInputDimensions / kSimdWidth;
       const __m64 k0x80s = _mm_set1_pi8(-128);
       const auto in = reinterpret_cast<const __m64*>(input);
@@ -137,7 +138,7 @@ class ClippedReLU {
       _mm_empty();
       constexpr IndexType kStart = kNumChunks * kSimdWidth;
 
-  #elif defined(USE_NEON)
+  #elif defined(NNUE_USE_NEON)
     constexpr IndexType kNumChunks = kInputDimensions / (kSimdWidth / 2);
     const int8x8_t kZero = {0};
     const auto in = reinterpret_cast<const int32x4_t*>(input);
@@ -169,6 +170,7 @@ class ClippedReLU {
    PreviousLayer previous_layer_;
 };
 
+NNUE_KERNEL_NAMESPACE_END
 }  // namespace Eval::NNUE::Layers
 
 #endif  // defined(EVAL_NNUE)
@@ -11,6 +11,7 @@
 #include "../nnue_common.h"
 
 namespace Eval::NNUE::Layers {
+NNUE_KERNEL_NAMESPACE_BEGIN
 
 // Input layer
 // 入力層
@@ -70,6 +71,7 @@ class InputSlice {
  private:
 };
 
+NNUE_KERNEL_NAMESPACE_END
 }  // namespace Eval::NNUE::Layers
 
 #endif  // defined(EVAL_NNUE)
@@ -7,6 +7,8 @@
 
 #if defined(EVAL_NNUE)
 
+#include <atomic>
+
 #include "nnue_architecture.h"
 
 namespace Eval {
@@ -15,7 +17,7 @@ namespace NNUE {
 
 // 入力特徴量をアフィン変換した結果を保持するクラス
 // 最終的な出力である評価値も一緒に持たせておく
-struct alignas(32) Accumulator {
+struct alignas(kCacheLineSize) Accumulator {
   std::int16_t
       accumulation[2][kRefreshTriggers.size()][kTransformedFeatureDimensions];
   Value score = VALUE_ZERO;
@@ -23,6 +25,63 @@ struct alignas(32) Accumulator {
   bool computed_score = false;
 };
 
+// FeatureTransformerのパラメーターが書き換わるごとにインクリメントされるカウンター。
+// AccumulatorCacheは、これが自分の記録している値と異なれば中身を破棄する。
+extern std::atomic<std::uint32_t> parameters_generation;
+
+// 玉が移動したときの全計算(refresh)を、玉の升ごとに前回の計算結果との差分計算で
+// 済ませるためのキャッシュ。(Stockfishで"Finny table"と呼ばれているもの)
+// 探索スレッドごとに1つ持つ。(Thread::nnue_cache)
+struct AccumulatorCache {
+
+  struct alignas(64) Entry {
+    // 前回このentryでrefreshしたときのaccumulation
+    std::int16_t accumulation[kTransformedFeatureDimensions];
+    // そのときの値が1であった特徴量のインデックス(昇順)
+    IndexType active[RawFeatures::kMaxActiveDimensions];
+    std::uint32_t num_active = 0;
+    // このentryが有効であるか
+    bool valid = false;
+  };
+
+  // [refreshの契機となった玉の升][perspective][kRefreshTriggersのindex]
+  // 玉のいない局面ではking_square()がSQ_NBを返すのでSQ_NB_PLUS1だけ確保しておく。
+  Entry entries[SQ_NB_PLUS1][COLOR_NB][kRefreshTriggers.size()];
+
+  // このキャッシュを作ったときのparameters_generation
+  std::uint32_t generation = 0;
+
+  // 統計情報 : キャッシュを使えずに全計算した回数、キャッシュとの差分計算で済ませた回数
+  std::uint64_t refreshes = 0;
+  std::uint64_t cache_diffs = 0;
+
+  // 統計情報 : 直前の局面が未計算であったが、2手以上前の計算済みの局面からの差分計算で済ませた回数
+  // (このキャッシュとは関係ないが、スレッドごとの統計情報としてここに置いておく)
+  std::uint64_t multi_ply_updates = 0;
+
+  // キャッシュの中身を破棄する。統計情報もクリアする。
+  void clear() {
+    invalidate();
+    refreshes = cache_diffs = multi_ply_updates = 0;
+  }
+
+  // 評価関数のパラメーターが変更されていたらキャッシュの中身を破棄する。
+  void check_generation() {
+    if (generation != parameters_generation.load(std::memory_order_relaxed))
+      invalidate();
+  }
+
+private:
+  // キャッシュの中身を破棄する。
+  void invalidate() {
+    for (auto& e1 : entries)
+      for (auto& e2 : e1)
+        for (auto& e : e2)
+          e.valid = false;
+    generation = parameters_generation.load(std::memory_order_relaxed);
+  }
+};
+
 }  // namespace NNUE
 
 }  // namespace Eval
@@ -14,6 +14,79 @@
 #include "./wasm_simd.h"
 #endif
 
+// NNUEの計算で用いるSIMD命令
+// 通常はTARGET_CPUで指定した命令(USE_AVX2など)と同じ。
+// TARGET_CPU = DISPATCHでは、NNUEの計算部分(evaluate_nnue_kernel.cpp)を命令セットごとにコンパイルするので、
+// その翻訳単位でだけ、DISPATCH_KERNEL_XXXで指定された命令を用いる。
+// ※　USE_AVX2などはEvalListのalignなど、Positionのメモリ配置を変えてしまうので、翻訳単位ごとに変えるわけにはいかない。
+
+#if defined(DISPATCH_KERNEL_AVX512VNNI)
+	#define NNUE_USE_AVX512
+	#define NNUE_USE_VNNI
+#elif defined(DISPATCH_KERNEL_AVX2)
+	#define NNUE_USE_AVX2
+#elif defined(DISPATCH_KERNEL_SSE42)
+	#define NNUE_USE_SSE41
+#else
+	#if defined(USE_AVX512)
+	#define NNUE_USE_AVX512
+	#endif
+	#if defined(USE_VNNI)
+	#define NNUE_USE_VNNI
+	#endif
+	#if defined(USE_AVX2)
+	#define NNUE_USE_AVX2
+	#endif
+	#if defined(USE_SSE41)
+	#define NNUE_USE_SSE41
+	#endif
+	#if defined(USE_SSSE3)
+	#define NNUE_USE_SSSE3
+	#endif
+	#if defined(USE_SSE2)
+	#define NNUE_USE_SSE2
+	#endif
+	#if defined(USE_MMX)
+	#define NNUE_USE_MMX
+	#endif
+	#if defined(USE_NEON)
+	#define NNUE_USE_NEON
+	#endif
+	#if defined(USE_WASM_SIMD)
+	#define NNUE_USE_WASM_SIMD
+	#endif
+#endif
+
+#if defined(NNUE_USE_AVX512)
+#define NNUE_USE_AVX2
+#endif
+#if defined(NNUE_USE_AVX2)
+#define NNUE_USE_SSE41
+#include <immintrin.h>
+#endif
+#if defined(NNUE_USE_SSE41)
+#define NNUE_USE_SSSE3
+#endif
+#if defined(NNUE_USE_SSSE3)
+#define NNUE_USE_SSE2
+#endif
+
+// 命令セットごとにコンパイルする翻訳単位では、NNUEの計算部分のクラスを命令セットごとの名前空間に入れて、
+// 同名のクラスや関数のシンボルが翻訳単位の間で衝突しないようにする。
+#if defined(DISPATCH_KERNEL_AVX512VNNI)
+#define NNUE_KERNEL_NAMESPACE_BEGIN inline namespace avx512vnni {
+#define NNUE_KERNEL_NAMESPACE_END   }
+#elif defined(DISPATCH_KERNEL_AVX2)
+#define NNUE_KERNEL_NAMESPACE_BEGIN inline namespace avx2 {
+#define NNUE_KERNEL_NAMESPACE_END   }
+#elif defined(DISPATCH_KERNEL_SSE42)
+#define NNUE_KERNEL_NAMESPACE_BEGIN inline namespace sse42 {
+#define NNUE_KERNEL_NAMESPACE_END   }
+#else
+#define NNUE_KERNEL_NAMESPACE_BEGIN
+#define NNUE_KERNEL_NAMESPACE_END
+#endif
+
 // HACK: Use _mm256_loadu_si256() instead of _mm256_load_si256. Otherwise a binary
 //       compiled with older g++ crashes because the output memory is not aligned
 //       even though alignas is specified.
@@ -22,7 +95,7 @@
 //       古いg++でコンパイルされた実行ファイルはクラッシュする。なぜなら、
 //       alignasが指定されているのにalignされていないコードを生成しやがるからだ。
 
-#if defined(USE_AVX2)
+#if defined(NNUE_USE_AVX2)
 #if defined(__GNUC__ ) && (__GNUC__ < 9) && defined(_WIN32) && !defined(__clang__)
 #define _mm256_loadA_si256  _mm256_loadu_si256
 #define _mm256_storeA_si256 _mm256_storeu_si256
@@ -32,7 +105,7 @@
 #endif
 #endif
 
-#if defined(USE_AVX512)
+#if defined(NNUE_USE_AVX512)
 #if defined(__GNUC__ ) && (__GNUC__ < 9) && defined(_WIN32) && !defined(__clang__)
 #define _mm512_loadA_si512   _mm512_loadu_si512
 #define _mm512_storeA_si512  _mm512_storeu_si512
@@ -62,16 +135,16 @@ namespace Eval::NNUE {
 
   // SIMD width (in bytes)
   // SIMD幅（バイト単位）
-  #if defined(USE_AVX2)
+  #if defined(NNUE_USE_AVX2)
   constexpr std::size_t kSimdWidth = 32;
-  #elif defined(USE_SSE2)
+  #elif defined(NNUE_USE_SSE2)
   constexpr std::size_t kSimdWidth = 16;
-  #elif defined(USE_MMX)
+  #elif defined(NNUE_USE_MMX)
   constexpr std::size_t kSimdWidth = 8;
 
-  #elif defined(USE_NEON)
+  #elif defined(NNUE_USE_NEON)
   constexpr std::size_t kSimdWidth = 16;
-  #elif defined(USE_WASM_SIMD)
+  #elif defined(NNUE_USE_WASM_SIMD)
   constexpr std::size_t kSimdWidth = 16;
   #endif
   constexpr std::size_t kMaxSimdWidth = 32;
@@ -10,11 +10,14 @@
 
 #include "nnue_common.h"
 #include "nnue_architecture.h"
+#include "../../perf_counter.h"
 #include "features/index_list.h"
 
+#include <algorithm> // std::sort()
 #include <cstring>  // std::memset()
 
 namespace Eval::NNUE {
+NNUE_KERNEL_NAMESPACE_BEGIN
 
 // If vector instructions are enabled, we update and refresh the
 // accumulator tile by tile such that each tile fits in the CPU's
@@ -23,7 +26,7 @@ namespace Eval::NNUE {
 // 各タイルがCPUのベクトルレジスタに収まるように、更新してリフレッシュする。
 #define VECTOR
 
-#if defined(USE_AVX512)
+#if defined(NNUE_USE_AVX512)
 typedef __m512i vec_t;
 #define vec_load(a) _mm512_load_si512(a)
 #define vec_store(a, b) _mm512_store_si512(a, b)
@@ -32,7 +35,7 @@ typedef __m512i vec_t;
 #define vec_zero _mm512_setzero_si512()
 static constexpr IndexType kNumRegs = 8;  // only 8 are needed
 
-#elif defined(USE_AVX2)
+#elif defined(NNUE_USE_AVX2)
 typedef __m256i vec_t;
 #define vec_load(a) _mm256_load_si256(a)
 #define vec_store(a, b) _mm256_store_si256(a, b)
@@ -41,7 +44,18 @@ typedef __m256i vec_t;
 #define vec_zero _mm256_setzero_si256()
 static constexpr IndexType kNumRegs = 16;
 
-#elif defined(USE_SSE2)
+#elif defined(NNUE_USE_WASM_SIMD)
+// WASMではUSE_SSE2も定義されている(SSEの命令はemscriptenがWASM SIMDに変換する)が、
+// こちらを優先して直接WASM SIMDの命令を用いる。
+typedef v128_t vec_t;
+#define vec_load(a) wasm_v128_load(a)
+#define vec_store(a, b) wasm_v128_store(a, b)
+#define vec_add_16(a, b) wasm_i16x8_add(a, b)
+#define vec_sub_16(a, b) wasm_i16x8_sub(a, b)
+#define vec_zero wasm_i16x8_splat(0)
+static constexpr IndexType kNumRegs = 16;
+
+#elif defined(NNUE_USE_SSE2)
 typedef __m128i vec_t;
 #define vec_load(a) (*(a))
 #define vec_store(a, b) *(a) = (b)
@@ -50,7 +64,7 @@ typedef __m128i vec_t;
 #define vec_zero _mm_setzero_si128()
 static constexpr IndexType kNumRegs = Is64Bit ? 16 : 8;
 
-#elif defined(USE_MMX)
+#elif defined(NNUE_USE_MMX)
 typedef __m64 vec_t;
 #define vec_load(a) (*(a))
 #define vec_store(a, b) *(a) = (b)
@@ -59,14 +73,13 @@ typedef __m64 vec_t;
 #define vec_zero _mm_setzero_si64()
 static constexpr IndexType kNumRegs = 8;
 
-#elif defined(USE_NEON)
+#elif defined(NNUE_USE_NEON)
 typedef int16x8_t vec_t;
 #define vec_load(a) (*(a))
 #define vec_store(a, b) *(a) = (b)
 #define vec_add_16(a, b) vaddq_s16(a, b)
 #define vec_sub_16(a, b) vsubq_s16(a, b)
-#define vec_zero \
-	{ 0 }
+#define vec_zero vdupq_n_s16(0)
 static constexpr IndexType kNumRegs = 16;
 
 #else
@@ -131,7 +144,8 @@ class FeatureTransformer {
 
 	// Proceed with the difference calculation if possible
 	// 可能なら差分計算を進める
-	bool UpdateAccumulatorIfPossible(const Position& pos) const {
+	// cache : 統計情報を記録するスレッドごとのキャッシュ。nullptrなら記録しない。
+	bool UpdateAccumulatorIfPossible(const Position& pos, AccumulatorCache* cache = nullptr) const {
 		const auto now = pos.state();
 		if (now->accumulator.computed_accumulation) {
 			return true;
@@ -141,49 +155,60 @@ class FeatureTransformer {
 			update_accumulator(pos);
 			return true;
 		}
+		// 直前の局面が未計算であっても、計算済みの局面まで遡れるなら、そこからの差分を積み上げる。
+		if constexpr (RawFeatures::kSupportsMultiPlyUpdate) {
+			if (update_accumulator_multi_ply(pos)) {
+				PERF_COUNT(NNUE_MULTI_PLY_UPDATE);
+				if (cache) {
+					++cache->multi_ply_updates;
+				}
+				return true;
+			}
+		}
 		return false;
 	}
 
 	// Convert input features
 	// 入力特徴量を変換する
-	void Transform(const Position& pos, OutputType* output, bool refresh) const {
-		if (refresh || !UpdateAccumulatorIfPossible(pos)) {
-			refresh_accumulator(pos);
+	// cache : 全計算が必要になったときに用いるスレッドごとのキャッシュ。nullptrなら用いない。
+	void Transform(const Position& pos, OutputType* output, bool refresh, AccumulatorCache* cache = nullptr) const {
+		if (refresh || !UpdateAccumulatorIfPossible(pos, cache)) {
+			refresh_accumulator(pos, cache);
 		}
 		const auto& accumulation = pos.state()->accumulator.accumulation;
 
-#if defined(USE_AVX512)
+#if defined(NNUE_USE_AVX512)
 		constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth * 2);
 		static_assert(kHalfDimensions % (kSimdWidth * 2) == 0);
 		const __m512i kControl = _mm512_setr_epi64(0, 2, 4, 6, 1, 3, 5, 7);
 		const __m512i kZero    = _mm512_setzero_si512();
 
-#elif defined(USE_AVX2)
+#elif defined(NNUE_USE_AVX2)
 		constexpr IndexType kNumChunks = kHalfDimensions / kSimdWidth;
 		constexpr int       kControl   = 0b11011000;
 		const __m256i       kZero      = _mm256_setzero_si256();
 
-#elif defined(USE_SSE2)
+#elif defined(NNUE_USE_SSE2)
 		constexpr IndexType kNumChunks = kHalfDimensions / kSimdWidth;
-#if defined(USE_SSE41)
+#if defined(NNUE_USE_SSE41)
 		const __m128i kZero = _mm_setzero_si128();
 #else  // SSE41非対応だがSSE2は使える環境
 		const __m128i k0x80s = _mm_set1_epi8(-128);
 #endif
 
-#elif defined(USE_MMX)
+#elif defined(NNUE_USE_MMX)
 		// USE_MMX を config.h では現状、有効化することがないので dead code
 		constexpr IndexType kNumChunks = kHalfDimensions / kSimdWidth;
 		const __m64         k0x80s     = _mm_set1_pi8(-128);
 
-#elif defined(USE_NEON)
+#elif defined(NNUE_USE_NEON)
 		constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth / 2);
 		const int8x8_t      kZero      = {0};
 #endif
 		const Color perspectives[2] = {pos.side_to_move(), ~pos.side_to_move()};
 		for (IndexType p = 0; p < 2; ++p) {
 			const IndexType offset = kHalfDimensions * p;
-#if defined(USE_AVX512)
+#if defined(NNUE_USE_AVX512)
 			auto out = reinterpret_cast<__m512i*>(&output[offset]);
 			for (IndexType j = 0; j < kNumChunks; ++j) {
 				__m512i sum0 =
@@ -194,7 +219,7 @@ class FeatureTransformer {
 				                                kControl, _mm512_max_epi8(_mm512_packs_epi16(sum0, sum1), kZero)));
 			}
 
-#elif defined(USE_AVX2)
+#elif defined(NNUE_USE_AVX2)
 			auto out = reinterpret_cast<__m256i*>(&output[offset]);
 			for (IndexType j = 0; j < kNumChunks; ++j) {
 				__m256i sum0 =
@@ -211,7 +236,7 @@ class FeatureTransformer {
 				                                _mm256_max_epi8(_mm256_packs_epi16(sum0, sum1), kZero), kControl));
 			}
 
-#elif defined(USE_SSE2)
+#elif defined(NNUE_USE_SSE2)
 			auto out = reinterpret_cast<__m128i*>(&output[offset]);
 			for (IndexType j = 0; j < kNumChunks; ++j) {
 				__m128i sum0 =
@@ -227,7 +252,7 @@ class FeatureTransformer {
 
 				const __m128i packedbytes = _mm_packs_epi16(sum0, sum1);
 				_mm_store_si128(&out[j],
-#if defined(USE_SSE41)
+#if defined(NNUE_USE_SSE41)
 				                _mm_max_epi8(packedbytes, kZero)
 #else  // SSE41非対応だがSSE2は使える環境
 				                _mm_subs_epi8(_mm_adds_epi8(packedbytes, k0x80s), k0x80s)
@@ -235,7 +260,7 @@ class FeatureTransformer {
 				);
 			}
 
-#elif defined(USE_MMX)
+#elif defined(NNUE_USE_MMX)
 			// USE_MMX を config.h では現状、有効化することがないので dead code
 			auto out = reinterpret_cast<__m64*>(&output[offset]);
 			for (IndexType j = 0; j < kNumChunks; ++j) {
@@ -245,7 +270,7 @@ class FeatureTransformer {
 				out[j]                  = _mm_subs_pi8(_mm_adds_pi8(packedbytes, k0x80s), k0x80s);
 			}
 
-#elif defined(USE_NEON)
+#elif defined(NNUE_USE_NEON)
 			const auto out = reinterpret_cast<int8x8_t*>(&output[offset]);
 			for (IndexType j = 0; j < kNumChunks; ++j) {
 				int16x8_t sum = reinterpret_cast<const int16x8_t*>(accumulation[perspectives[p]][0])[j];
@@ -264,7 +289,7 @@ class FeatureTransformer {
 			}
 #endif
 		}
-#if defined(USE_MMX)
+#if defined(NNUE_USE_MMX)
 		// USE_MMX を config.h では現状、有効化することがないので dead code
 		_mm_empty();
 #endif
@@ -273,41 +298,30 @@ class FeatureTransformer {
    private:
 	// Calculate cumulative value without using difference calculation
 	// 差分計算を用いずに累積値を計算する
-	void refresh_accumulator(const Position& pos) const {
+	void refresh_accumulator(const Position& pos, AccumulatorCache* cache) const {
+		PERF_COUNT(NNUE_REFRESH);
+		PERF_TIMER(NNUE_REFRESH_TIME);
 		auto& accumulator = pos.state()->accumulator;
+		if (cache) {
+			cache->check_generation();
+		}
 		for (IndexType i = 0; i < kRefreshTriggers.size(); ++i) {
 			Features::IndexList active_indices[2];
 			RawFeatures::AppendActiveIndices(pos, kRefreshTriggers[i], active_indices);
 			for (Color perspective : {BLACK, WHITE}) {
-#if defined(VECTOR)
-				if (i == 0) {
-					std::memcpy(accumulator.accumulation[perspective][i], biases_, kHalfDimensions * sizeof(BiasType));
-				} else {
-					std::memset(accumulator.accumulation[perspective][i], 0, kHalfDimensions * sizeof(BiasType));
-				}
-				for (const auto index : active_indices[perspective]) {
-					const IndexType offset = kHalfDimensions * index;
-					auto accumulation      = reinterpret_cast<vec_t*>(&accumulator.accumulation[perspective][i][0]);
-					auto column            = reinterpret_cast<const vec_t*>(&weights_[offset]);
-					constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth / 2);
-					for (IndexType j = 0; j < kNumChunks; ++j) {
-						accumulation[j] = vec_add_16(accumulation[j], column[j]);
-					}
-				}
-#else
-				if (i == 0) {
-					std::memcpy(accumulator.accumulation[perspective][i], biases_, kHalfDimensions * sizeof(BiasType));
-				} else {
-					std::memset(accumulator.accumulation[perspective][i], 0, kHalfDimensions * sizeof(BiasType));
-				}
-				for (const auto index : active_indices[perspective]) {
-					const IndexType offset = kHalfDimensions * index;
-
-					for (IndexType j = 0; j < kHalfDimensions; ++j) {
-						accumulator.accumulation[perspective][i][j] += weights_[offset + j];
-					}
+				if (cache) {
+					// 相手玉の移動でrefreshされる特徴量は相手玉の升、それ以外は自玉の升でentryを引く。
+					const Square ksq = (kRefreshTriggers[i] == Features::TriggerEvent::kEnemyKingMoved)
+					                       ? pos.king_square(~perspective)
+					                       : pos.king_square(perspective);
+					auto& entry = cache->entries[ksq][perspective][i];
+					refresh_cache_entry(entry, active_indices[perspective], i, *cache);
+					std::memcpy(accumulator.accumulation[perspective][i], entry.accumulation,
+					            kHalfDimensions * sizeof(BiasType));
+					continue;
 				}
-#endif
+				update_accumulation(accumulator.accumulation[perspective][i], i == 0 ? biases_ : nullptr,
+				                    Features::IndexList(), active_indices[perspective]);
 			}
 		}
 
@@ -316,63 +330,67 @@ class FeatureTransformer {
 		accumulator.computed_score = false;
 	}
 
+	// Refresh the accumulator cache entry by diffing against its previous active features
+	// キャッシュのentryを、前回の値が1であった特徴量との差分によって現局面のものに更新する。
+	// 差分のほうが多いときは全計算する。
+	void refresh_cache_entry(AccumulatorCache::Entry& entry, Features::IndexList& active, IndexType i,
+	                         AccumulatorCache& cache) const {
+		std::sort(active.begin(), active.end());
+
+		Features::IndexList removed, added;
+		bool                full = !entry.valid;
+		if (!full) {
+			// ソート済みの2つのリストをmergeして、増えたものと減ったものを求める。
+			std::size_t a = 0, b = 0;
+			while (a < entry.num_active && b < active.size()) {
+				if (entry.active[a] == active[b]) {
+					++a, ++b;
+				} else if (entry.active[a] < active[b]) {
+					removed.push_back(entry.active[a++]);
+				} else {
+					added.push_back(active[b++]);
+				}
+			}
+			while (a < entry.num_active) removed.push_back(entry.active[a++]);
+			while (b < active.size()) added.push_back(active[b++]);
+
+			full = removed.size() + added.size() >= active.size();
+		}
+
+		if (full) {
+			removed.resize(0);
+			added.resize(0);
+			for (const auto index : active) added.push_back(index);
+			++cache.refreshes;
+		} else {
+			++cache.cache_diffs;
+		}
+
+		update_accumulation(entry.accumulation, full ? (i == 0 ? biases_ : nullptr) : entry.accumulation, removed,
+		                    added);
+
+		std::copy(active.begin(), active.end(), entry.active);
+		entry.num_active = static_cast<std::uint32_t>(active.size());
+		entry.valid      = true;
+	}
+
 	// Calculate cumulative value using difference calculation
 	// 差分計算を用いて累積値を計算する
 	void update_accumulator(const Position& pos) const {
-		const auto prev_accumulator = pos.state()->previous->accumulator;
-		auto&      accumulator      = pos.state()->accumulator;
+		PERF_COUNT(NNUE_UPDATE);
+		const auto& prev_accumulator = pos.state()->previous->accumulator;
+		auto&       accumulator      = pos.state()->accumulator;
 		for (IndexType i = 0; i < kRefreshTriggers.size(); ++i) {
 			Features::IndexList removed_indices[2], added_indices[2];
 			bool                reset[2];
 			RawFeatures::AppendChangedIndices(pos, kRefreshTriggers[i], removed_indices, added_indices, reset);
 			for (Color perspective : {BLACK, WHITE}) {
-#if defined(VECTOR)
-				constexpr IndexType kNumChunks = kHalfDimensions / (kSimdWidth / 2);
-				auto accumulation              = reinterpret_cast<vec_t*>(&accumulator.accumulation[perspective][i][0]);
-#endif
-				if (reset[perspective]) {
-					if (i == 0) {
-						std::memcpy(accumulator.accumulation[perspective][i], biases_,
-						            kHalfDimensions * sizeof(BiasType));
-					} else {
-						std::memset(accumulator.accumulation[perspective][i], 0, kHalfDimensions * sizeof(BiasType));
-					}
-				} else {
-					// Difference calculation for the feature amount changed from 1 to 0
-					// 1から0に変化した特徴量に関する差分計算
-					std::memcpy(accumulator.accumulation[perspective][i], prev_accumulator.accumulation[perspective][i],
-					            kHalfDimensions * sizeof(BiasType));
-					for (const auto index : removed_indices[perspective]) {
-						const IndexType offset = kHalfDimensions * index;
-#if defined(VECTOR)
-						auto column = reinterpret_cast<const vec_t*>(&weights_[offset]);
-						for (IndexType j = 0; j < kNumChunks; ++j) {
-							accumulation[j] = vec_sub_16(accumulation[j], column[j]);
-						}
-#else
-						for (IndexType j = 0; j < kHalfDimensions; ++j) {
-							accumulator.accumulation[perspective][i][j] -= weights_[offset + j];
-						}
-#endif
-					}
-				}
-				{
-					// Difference calculation for features that changed from 0 to 1
-					// 0から1に変化した特徴量に関する差分計算
-					for (const auto index : added_indices[perspective]) {
-						const IndexType offset = kHalfDimensions * index;
-#if defined(VECTOR)
-						auto column = reinterpret_cast<const vec_t*>(&weights_[offset]);
-						for (IndexType j = 0; j < kNumChunks; ++j) {
-							accumulation[j] = vec_add_16(accumulation[j], column[j]);
-						}
-#else
-						for (IndexType j = 0; j < kHalfDimensions; ++j) {
-							accumulator.accumulation[perspective][i][j] += weights_[offset + j];
-						}
-#endif
-					}
-				}
+				// 全計算(reset)ならbiasか0から、そうでなければ一手前の累積値から、
+				// 1から0に変化した特徴量を引き、0から1に変化した特徴量を足す。
+				const BiasType* src = reset[perspective] ? (i == 0 ? biases_ : nullptr)
+				                                         : prev_accumulator.accumulation[perspective][i];
+				update_accumulation(accumulator.accumulation[perspective][i], src, removed_indices[perspective],
+				                    added_indices[perspective]);
 			}
 		}
 
@@ -381,11 +399,112 @@ class FeatureTransformer {
 		accumulator.computed_score = false;
 	}
 
+	// Calculate cumulative value by going back to the nearest computed accumulator
+	// accumulatorが計算済みである局面まで遡り、そこからの差分を積み上げて累積値を計算する。
+	// 途中で全計算が必要になる変化がある場合や、差分計算の手間が全計算を上回る場合はfalseを返す。
+	bool update_accumulator_multi_ply(const Position& pos) const {
+		// 差分計算で変化する特徴量の数の見積もり。これが全計算のときの特徴量の数を上回るなら諦める。
+		IndexType cost = 0;
+		const StateInfo* st = pos.state();
+		for (;;) {
+			// null moveで生じた局面(pliesFromNull == 0)は、一手前のaccumulatorとdirtyPieceをコピーしているだけなので
+			// 差分はない。
+			if (st->pliesFromNull != 0) {
+				const auto& dp = st->dirtyPiece;
+				for (IndexType i = 0; i < kRefreshTriggers.size(); ++i)
+					for (Color perspective : {BLACK, WHITE})
+						if (RawFeatures::RequiresRefresh(dp, kRefreshTriggers[i], perspective))
+							return false;
+				cost += dp.dirty_num * 2;
+				if (cost >= RawFeatures::kMaxActiveDimensions)
+					return false;
+			}
+			st = st->previous;
+			if (st == nullptr)
+				return false;
+			if (st->accumulator.computed_accumulation)
+				break;
+		}
+
+		// 差分の加減算は順序によらないので、現局面から遡る順に各局面の差分を集めて、まとめて適用する。
+		// 上のcostの制限により、集めた特徴量の数はIndexListに収まる。
+		auto& accumulator = pos.state()->accumulator;
+		for (IndexType i = 0; i < kRefreshTriggers.size(); ++i) {
+			Features::IndexList removed_indices[2], added_indices[2];
+			for (const StateInfo* s = pos.state(); s != st; s = s->previous) {
+				if (s->pliesFromNull == 0)
+					continue;
+				bool reset[2] = {false, false};
+				RawFeatures::AppendChangedIndices(pos, s->dirtyPiece, kRefreshTriggers[i], removed_indices,
+				                                  added_indices, reset);
+			}
+			for (Color perspective : {BLACK, WHITE}) {
+				update_accumulation(accumulator.accumulation[perspective][i], st->accumulator.accumulation[perspective][i],
+				                    removed_indices[perspective], added_indices[perspective]);
+			}
+		}
+
+		accumulator.computed_accumulation = true;
+		accumulator.computed_score        = false;
+		return true;
+	}
+
 	// parameter type
 	// パラメータの型
 	using BiasType   = std::int16_t;
 	using WeightType = std::int16_t;
 
+	// Apply removed and added features to the accumulation tile by tile
+	// dst = src - Σ(removedの重み) + Σ(addedの重み) を計算する。srcがnullptrなら0とみなす。dst == srcでも良い。
+	// ベクトル命令が使える場合は、ベクトルレジスタに収まるタイルごとに、すべての特徴量の加減算を
+	// レジスタ上で済ませてから一度だけ書き戻す。(一手の差分は2～4個程度の特徴量なので、メモリへの読み書きが減る)
+	void update_accumulation(BiasType* dst, const BiasType* src, const Features::IndexList& removed,
+	                         const Features::IndexList& added) const {
+#if defined(VECTOR)
+		for (IndexType j = 0; j < kHalfDimensions / kTileHeight; ++j) {
+			vec_t acc[kNumRegs];
+			if (src) {
+				auto src_tile = reinterpret_cast<const vec_t*>(&src[j * kTileHeight]);
+				for (IndexType k = 0; k < kNumRegs; ++k) acc[k] = vec_load(&src_tile[k]);
+			} else {
+				for (IndexType k = 0; k < kNumRegs; ++k) acc[k] = vec_zero;
+			}
+
+			for (const auto index : removed) {
+				const IndexType offset = kHalfDimensions * index + j * kTileHeight;
+				auto column            = reinterpret_cast<const vec_t*>(&weights_[offset]);
+				for (IndexType k = 0; k < kNumRegs; ++k) acc[k] = vec_sub_16(acc[k], vec_load(&column[k]));
+			}
+			for (const auto index : added) {
+				const IndexType offset = kHalfDimensions * index + j * kTileHeight;
+				auto column            = reinterpret_cast<const vec_t*>(&weights_[offset]);
+				for (IndexType k = 0; k < kNumRegs; ++k) acc[k] = vec_add_16(acc[k], vec_load(&column[k]));
+			}
+
+			auto dst_tile = reinterpret_cast<vec_t*>(&dst[j * kTileHeight]);
+			for (IndexType k = 0; k < kNumRegs; ++k) vec_store(&dst_tile[k], acc[k]);
+		}
+#else
+		if (src == nullptr) {
+			std::memset(dst, 0, kHalfDimensions * sizeof(BiasType));
+		} else if (src != dst) {
+			std::memcpy(dst, src, kHalfDimensions * sizeof(BiasType));
+		}
+		for (const auto index : removed) {
+			const IndexType offset = kHalfDimensions * index;
+			for (IndexType j = 0; j < kHalfDimensions; ++j) {
+				dst[j] -= weights_[offset + j];
+			}
+		}
+		for (const auto index : added) {
+			const IndexType offset = kHalfDimensions * index;
+			for (IndexType j = 0; j < kHalfDimensions; ++j) {
+				dst[j] += weights_[offset + j];
+			}
+		}
+#endif
+	}
+
 	// Make the learning class a friend
 	// 学習用クラスをfriendにする
 	friend class Trainer<FeatureTransformer>;
@@ -396,6 +515,7 @@ class FeatureTransformer {
 	alignas(kCacheLineSize) WeightType weights_[kHalfDimensions * kInputDimensions];
 };  // class FeatureTransformer
 
+NNUE_KERNEL_NAMESPACE_END
 }  // namespace Eval::NNUE
 
 #endif  // defined(EVAL_NNUE)
@@ -264,6 +264,8 @@ class Trainer<FeatureTransformer> {
 
   // 重みの飽和とパラメータの整数化
   void QuantizeParameters() {
+    // パラメーターが変わるのでスレッドごとのAccumulatorCacheを無効化する。
+    parameters_generation.fetch_add(1, std::memory_order_relaxed);
     for (IndexType i = 0; i < kHalfDimensions; ++i) {
       target_layer_->biases_[i] =
           Round<typename LayerType::BiasType>(biases_[i] * kBiasScale);
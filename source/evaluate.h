@@ -382,6 +382,11 @@ namespace Eval {
 
 	// EvalHashのクリア
 	extern void EvalHash_Clear();
+
+#if defined(EVAL_NNUE)
+	// EvalHashの照会回数とhit率を出力する。
+	extern void print_evalhash_stat(std::ostream& os);
+#endif
 #endif
 
 }
@@ -0,0 +1,117 @@
+﻿#include "move_sort.h"
+
+#if defined(USE_CPU_DISPATCH)
+#include "../cpu_features.h"
+#endif
+
+#if defined(USE_SUPER_SORT) && defined(USE_AVX2)
+// partial_insertion_sort()のSuperSortを用いた実装。extra/super_sort.cpp
+// beginは32byteでalignされている必要がある。
+extern void partial_super_sort(ExtMove* start, ExtMove* end, int limit);
+#endif
+
+namespace MoveSort
+{
+	// -----------------------
+	//   partial insertion sort
+	// -----------------------
+
+	// partial_insertion_sort()は指し手を与えられたlimitまで降順でソートする。
+	// limitよりも小さい値の指し手の順序については、不定。
+	// 将棋だと指し手の数が多い(ことがある)ので、数が多いときは途中で打ち切ったほうがいいかも。
+	// 現状、全体時間の6.5～7.5%程度をこの関数で消費している。
+	// (長い時間思考させるとこの割合が増えてくる)
+	void partial_insertion_sort(ExtMove* begin, ExtMove* end, int limit) {
+		partial_insertion_sort_inline(begin, end, limit);
+	}
+
+	const char* simd_isa()
+	{
+#if defined(USE_AVX512)
+		return "AVX-512";
+#elif defined(USE_CPU_DISPATCH)
+		return CpuFeatures::best_kernel() >= CpuFeatures::KERNEL_AVX512VNNI ? "AVX-512" : "none";
+#else
+		return "none";
+#endif
+	}
+
+	// -----------------------
+	//   実装の切り替え
+	// -----------------------
+
+	namespace {
+
+		struct Algorithm
+		{
+			std::string name;
+			PartialSortFunc func;
+		};
+
+		const std::vector<Algorithm>& algorithms()
+		{
+			static const std::vector<Algorithm> list = [] {
+				std::vector<Algorithm> v = {
+					{ "Insertion", partial_insertion_sort },
+#if defined(USE_AVX512)
+					{ "SIMD"     , partial_simd_sort      },
+#endif
+#if defined(USE_SUPER_SORT) && defined(USE_AVX2)
+					{ "SuperSort", partial_super_sort     },
+#endif
+				};
+#if defined(USE_CPU_DISPATCH)
+				// AVX-512に対応したCPUでのみ選べるようにする。
+				if (CpuFeatures::best_kernel() >= CpuFeatures::KERNEL_AVX512VNNI)
+					v.push_back({ "SIMD", partial_simd_sort });
+#endif
+				return v;
+			}();
+			return list;
+		}
+	}
+
+#if defined(USE_SUPER_SORT) && defined(USE_AVX2)
+	PartialSortFunc partial_sort = partial_super_sort;
+#else
+	PartialSortFunc partial_sort = partial_insertion_sort;
+#endif
+
+	const std::vector<std::string>& algorithm_names()
+	{
+		static const std::vector<std::string> names = [] {
+			std::vector<std::string> v;
+			for (auto& a : algorithms())
+				v.push_back(a.name);
+			return v;
+		}();
+		return names;
+	}
+
+	std::string default_algorithm()
+	{
+#if defined(USE_SUPER_SORT) && defined(USE_AVX2)
+		return "SuperSort";
+#else
+		return "Insertion";
+#endif
+	}
+
+	PartialSortFunc get_algorithm(const std::string& name)
+	{
+		for (auto& a : algorithms())
+			if (a.name == name)
+				return a.func;
+		return nullptr;
+	}
+
+	bool set_algorithm(const std::string& name)
+	{
+		auto f = get_algorithm(name);
+		if (f == nullptr)
+			return false;
+
+		partial_sort = f;
+		return true;
+	}
+}
@@ -0,0 +1,86 @@
+﻿#ifndef MOVE_SORT_H_INCLUDED
+#define MOVE_SORT_H_INCLUDED
+
+#include "../types.h"
+#include <string>
+#include <vector>
+
+// --------------------
+//  指し手の部分ソート
+// --------------------
+
+// MovePickerで駒を捕獲しない指し手をオーダリングするときの部分ソートの実装をまとめたもの。
+// どの実装を用いるかは、エンジンオプションの"MoveSort"で実行時に切り替えられる。
+//
+// いずれの実装も、[begin,end)のうち value >= limit である指し手を先頭に集めて降順に並べる。
+// limitより小さい値の指し手の並び順は実装ごとに異なるので、実装を切り替えるとbenchコマンドの探索ノード数は変わる。
+//
+// 各実装の速度は、"bench movesort"で実際の探索で現れた指し手の並びを用いて比較できる。
+
+namespace MoveSort
+{
+	// 部分ソートを行う関数の型
+	typedef void (*PartialSortFunc)(ExtMove* begin, ExtMove* end, int limit);
+
+	// 挿入ソートによる実装。Stockfishと同じもの。
+	// beginの指し手は、limitより小さくともソート済みの区間に含まれる。
+	void partial_insertion_sort(ExtMove* begin, ExtMove* end, int limit);
+
+	// partial_insertion_sort()の本体。sort()からinline展開して呼び出すためにheaderに置いてある。
+	inline void partial_insertion_sort_inline(ExtMove* begin, ExtMove* end, int limit)
+	{
+		for (ExtMove *sortedEnd = begin, *p = begin + 1; p < end; ++p)
+			if (p->value >= limit)
+			{
+				ExtMove tmp = *p, *q;
+				*p = *++sortedEnd;
+				for (q = sortedEnd; q != begin && *(q - 1) < tmp; --q)
+					*q = *(q - 1);
+				*q = tmp;
+			}
+	}
+
+#if defined(USE_AVX512) || defined(USE_CPU_DISPATCH)
+	// value >= limitである指し手をSIMD命令で分岐なしに先頭に集めて、その区間だけをソートする実装。
+	// 集めた指し手が多いときは、SIMD命令によるbitonic sortを用いる。
+	// 先頭はvalueの降順(valueが等しければmoveの降順)、limitより小さい指し手は元の順序のまま後ろに並ぶ。
+	// TARGET_CPUがAVX-512のときのみ。(AVX2だとint64の比較・min/max・compressがなく、挿入ソートより遅かったので用意していない)
+	// TARGET_CPU = DISPATCHのときは、AVX-512に対応したCPUでのみ選べる。(extra/move_sort_simd.cpp)
+	//
+	// NEON・WASM SIMDの実装も用意していない。
+	// いずれも128bit幅で1命令で比較できる指し手は2つだけで、compress命令もないので、
+	// 4つずつ処理できるAVX2の実装(挿入ソートの0.61～1.03倍の速度)より速くなる見込みがないため。
+	void partial_simd_sort(ExtMove* begin, ExtMove* end, int limit);
+#endif
+
+	// 部分ソートの実装。set_algorithm()で切り替える。
+	extern PartialSortFunc partial_sort;
+
+	// MovePickerが呼び出す部分ソート。
+	// partial_sortが既定のpartial_insertion_sort()のときは、関数ポインタを経由せずにinline展開した挿入ソートを呼び出す。
+	// (この分岐は探索中ずっと同じ方向に行くので、ほぼ予測が外れない)
+	inline void sort(ExtMove* begin, ExtMove* end, int limit)
+	{
+		if (partial_sort == partial_insertion_sort)
+			partial_insertion_sort_inline(begin, end, limit);
+		else
+			partial_sort(begin, end, limit);
+	}
+
+	// このビルドで利用できる実装の名前の一覧。"Insertion"と、USE_AVX512(DISPATCHならAVX-512対応のCPU)のときは"SIMD"、USE_SUPER_SORTのときは"SuperSort"。
+	const std::vector<std::string>& algorithm_names();
+
+	// 既定の実装の名前。USE_SUPER_SORTが定義されていれば"SuperSort"、さもなくば"Insertion"。
+	std::string default_algorithm();
+
+	// 名前に対応する実装を返す。該当するものがなければnullptr。
+	PartialSortFunc get_algorithm(const std::string& name);
+
+	// partial_sortを、名前で指定した実装に切り替える。該当するものがなければ何もせずにfalseを返す。
+	bool set_algorithm(const std::string& name);
+
+	// partial_simd_sort()の実装に用いている命令セットの名前。AVX-512のときは"AVX-512"、なければ"none"。
+	const char* simd_isa();
+}
+
+#endif // MOVE_SORT_H_INCLUDED
@@ -0,0 +1,198 @@
+﻿// partial_simd_sort()の実装。
+// TARGET_CPU = DISPATCHのときは、AVX512VNNI用にコンパイルしたものが使われる。(Makefile)
+
+#include "move_sort.h"
+
+#if defined(USE_AVX512) || defined(DISPATCH_KERNEL_AVX512VNNI)
+
+#include <cstring>
+#include <cstdint>
+#include <immintrin.h>
+#include "bitop.h"
+
+namespace MoveSort
+{
+	// -----------------------
+	//   partial SIMD sort
+	// -----------------------
+
+	// ExtMoveは下位32bitがmove、上位32bitがvalueなので、little endianならint64_tとみなして比較できる。
+	//   value >= limit ⇔ int64 >= (limit << 32)
+	// また、int64_tとして降順に並べれば、valueの降順(valueが等しければmoveの降順)になる。
+	// x86はlittle endianなので、ExtMoveの配列をそのままint64_tの配列として扱う。
+
+	namespace {
+
+		// [p,end)のうち、value >= limitの指し手をwに、それ以外をtに元の順序のまま書き出す。(分岐なし)
+		inline void partition_scalar(const ExtMove* p, const ExtMove* end, int limit, ExtMove*& w, ExtMove*& t)
+		{
+			for (; p < end; ++p)
+			{
+				const ExtMove m = *p;
+				const int sel = m.value >= limit;
+				*w = m; w += sel;
+				*t = m; t += 1 - sel;
+			}
+		}
+
+
+		// [begin,end)を、value >= limitの指し手と、それ以外に安定に分割する。
+		// 前者はselに、後者はrestに書き出す。前者の個数を返す。
+		// sel,restには、それぞれend - begin + 8要素書き込める必要がある。(SIMDのstoreで余分に書き込むため)
+		size_t partition(const ExtMove* begin, const ExtMove* end, int limit, ExtMove* sel, ExtMove* rest)
+		{
+			const ExtMove* p = begin;
+			ExtMove* w = sel;
+			ExtMove* t = rest;
+
+			// 8要素ずつ比較して、maskで前に詰めて書き出す。
+			// ※ _mm512_mask_compressstoreu_epi64()はZen4で遅いので、compressしてから普通にstoreする。
+			const __m512i limit64 = _mm512_set1_epi64(static_cast<int64_t>(limit) << 32);
+			for (; p + 8 <= end; p += 8)
+			{
+				const __m512i v = _mm512_loadu_si512(p);
+				const __mmask8 m = _mm512_cmpge_epi64_mask(v, limit64);
+				const int n = POPCNT32(m);
+				_mm512_storeu_si512(w, _mm512_maskz_compress_epi64(m, v));
+				_mm512_storeu_si512(t, _mm512_maskz_compress_epi64(__mmask8(~m), v));
+				w += n;
+				t += 8 - n;
+			}
+
+			// 端数
+			partition_scalar(p, end, limit, w, t);
+
+			return size_t(w - sel);
+		}
+
+		// [begin,end)をvalueの降順(valueが等しければmoveの降順)に挿入ソートする。
+		inline void insertion_sort(ExtMove* begin, ExtMove* end)
+		{
+			auto key = [](const ExtMove& m) { return (static_cast<int64_t>(m.value) << 32) | u32(m.move); };
+
+			for (ExtMove* p = begin + 1; p < end; ++p)
+			{
+				ExtMove tmp = *p, *q;
+				const int64_t k = key(tmp);
+				for (q = p; q != begin && key(*(q - 1)) < k; --q)
+					*q = *(q - 1);
+				*q = tmp;
+			}
+		}
+
+		// ソートする要素数がこれ以下なら挿入ソートのほうが速い。
+		constexpr size_t BitonicSortThreshold = 16;
+
+		// bitonic sortで用いるSIMD命令をまとめたもの。
+		//   V        : int64_tをW個持つレジスタ
+		//   Mask     : 要素ごとにmaxとminのどちらを選ぶか
+		//   partner  : 要素iに要素(i ^ j)を持ってくる。(j < W)
+		//   min_max  : 要素ごとのminとmax
+		//   blend    : maskの立っている要素はmx、さもなくばmnを選ぶ。
+		//   make_mask: bitsの下位W bitからMaskを作る。
+
+		struct Simd
+		{
+			typedef __m512i V;
+			typedef __mmask8 Mask;
+			static constexpr size_t W = 8;
+
+			static V load(const int64_t* p) { return _mm512_load_si512(p); }
+			static void store(int64_t* p, V v) { _mm512_store_si512(p, v); }
+			static void min_max(V x, V y, V& mn, V& mx) { mn = _mm512_min_epi64(x, y); mx = _mm512_max_epi64(x, y); }
+			static V partner(V v, size_t j) {
+				return j == 1 ? _mm512_permutex_epi64(v, _MM_SHUFFLE(2, 3, 0, 1))
+					 : j == 2 ? _mm512_permutex_epi64(v, _MM_SHUFFLE(1, 0, 3, 2))
+					 :          _mm512_shuffle_i64x2(v, v, _MM_SHUFFLE(1, 0, 3, 2));
+			}
+			static Mask make_mask(int bits) { return Mask(bits); }
+			static V blend(Mask m, V mn, V mx) { return _mm512_mask_blend_epi64(m, mn, mx); }
+		};
+
+		// a[0..n)を降順にbitonic sortする。nは2の累乗でW以上。aはW * 8 byteでalignされていること。
+		// 比較の順序がデータによらないので分岐予測のミスがなく、SIMD命令でW個ずつ比較交換できる。
+		void bitonic_sort(int64_t* a, size_t n)
+		{
+			typedef Simd S;
+			constexpr size_t W = S::W;
+
+			for (size_t k = 2; k <= n; k <<= 1)
+				for (size_t j = k >> 1; j > 0; j >>= 1)
+				{
+					if (j >= W)
+					{
+						// 比較する相手は別のレジスタ。iのk bit目が0の区間は降順、1の区間は昇順にする。
+						for (size_t i = 0; i < n; i += W)
+						{
+							if (i & j)
+								continue;
+
+							typename S::V mn, mx;
+							S::min_max(S::load(a + i), S::load(a + i + j), mn, mx);
+							S::store(a + i    , (i & k) ? mn : mx);
+							S::store(a + i + j, (i & k) ? mx : mn);
+						}
+					}
+					else
+					{
+						// 比較する相手は同じレジスタ内。要素lがmaxを取るのは、
+						// (l & j) == 0 (ペアの前側) と、((i + l) & k) == 0 (降順の区間) が一致するとき。
+						// k >= Wなら区間の向きはレジスタごとに(i & k)で決まり、k < Wならレジスタ内の位置lで決まる。(このとき i & k == 0)
+						int bits[2] = { 0, 0 };
+						for (size_t l = 0; l < W; ++l)
+							for (int hi = 0; hi < 2; ++hi)
+							{
+								const bool desc = k < W ? (l & k) == 0 : hi == 0;
+								bits[hi] |= int(((l & j) == 0) == desc) << l;
+							}
+						const typename S::Mask mask0 = S::make_mask(bits[0]);
+						const typename S::Mask mask1 = S::make_mask(bits[1]);
+
+						for (size_t i = 0; i < n; i += W)
+						{
+							const typename S::V v = S::load(a + i);
+							typename S::V mn, mx;
+							S::min_max(v, S::partner(v, j), mn, mx);
+							S::store(a + i, S::blend((i & k) ? mask1 : mask0, mn, mx));
+						}
+					}
+				}
+		}
+	}
+
+	void partial_simd_sort(ExtMove* begin, ExtMove* end, int limit)
+	{
+		// value >= limitの指し手と、それ以外の指し手の書き出し先。
+		// selは、bitonic sortのために要素数を2の累乗に切り上げられるだけの大きさを確保しておく。
+		alignas(64) ExtMove sel[1024];
+		ExtMove rest[MAX_MOVES + 8];
+		static_assert(MAX_MOVES + 8 <= 1024, "");
+
+		const size_t n = size_t(end - begin);
+		const size_t k = partition(begin, end, limit, sel, rest);
+
+		// 1つも選ばれなければ、元の並びのまま。
+		if (k == 0)
+			return;
+
+		// depthが深いときはほぼすべての指し手が選ばれるので、挿入ソートだとO(n^2)になり、分岐予測も外れまくる。
+		// 数が多いときは、要素数を2の累乗まで最小値で埋めてbitonic sortする。
+		if (k > BitonicSortThreshold)
+		{
+			size_t n2 = BitonicSortThreshold;
+			while (n2 < k)
+				n2 <<= 1;
+			int64_t* keys = (int64_t*)sel;
+			for (size_t i = k; i < n2; ++i)
+				keys[i] = INT64_MIN;
+			bitonic_sort(keys, n2);
+		}
+		else
+			insertion_sort(sel, sel + k);
+
+		std::memcpy(begin    , sel , k       * sizeof(ExtMove));
+		std::memcpy(begin + k, rest, (n - k) * sizeof(ExtMove));
+	}
+}
+
+#endif // defined(USE_AVX512) || defined(DISPATCH_KERNEL_AVX512VNNI)
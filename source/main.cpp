@@ -28,6 +28,8 @@ int main(int argc, char* argv[])
 	// 起動時に説明書きを出力。
 	print_file("startup_info.txt");
 
+	// ※　ビルド時に指定した拡張命令にCPUが対応しているかは、main()よりも前にcpu_features.cppで判定している。
+
 	// --- 全体的な初期化
 
 	CommandLine::init(argc,argv);
@@ -6,6 +6,7 @@
 #if defined(USE_MATE_1PLY) && defined(LONG_EFFECT_LIBRARY)
 
 #include "../position.h"
+#include "../perf_counter.h"
 #include "../extra/long_effect.h"
 
 using namespace Effect8; // Effect24のほうは必要に応じて書く。
@@ -537,7 +538,10 @@ NextCandidate:;
 	// 現局面で1手詰めであるかを判定する。1手詰めであればその指し手を返す。
 	Move mate_1ply(const Position& pos)
 	{
-		return pos.side_to_move() == BLACK ? Mate::mate_1ply_imp<BLACK>(pos) : Mate::mate_1ply_imp<WHITE>(pos);
+		const Move m = pos.side_to_move() == BLACK ? Mate::mate_1ply_imp<BLACK>(pos) : Mate::mate_1ply_imp<WHITE>(pos);
+		PERF_COUNT(MATE_1PLY);
+		PERF_COUNT_IF(m != MOVE_NONE, MATE_1PLY_FOUND);
+		return m;
 	}
 
 } // namespace Mate
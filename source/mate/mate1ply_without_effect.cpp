@@ -6,6 +6,7 @@
 // やねうら王2014からの移植。
 
 #include "../position.h"
+#include "../perf_counter.h"
 
 //#include <iostream>
 //using std::cout;
@@ -2139,7 +2140,10 @@ namespace Mate {
 	// 現局面で1手詰めであるかを判定する。1手詰めであればその指し手を返す。
 	Move mate_1ply(const Position& pos)
 	{
-		return pos.side_to_move() == BLACK ? Mate::mate_1ply_imp<BLACK>(pos) : Mate::mate_1ply_imp<WHITE>(pos);
+		const Move m = pos.side_to_move() == BLACK ? Mate::mate_1ply_imp<BLACK>(pos) : Mate::mate_1ply_imp<WHITE>(pos);
+		PERF_COUNT(MATE_1PLY);
+		PERF_COUNT_IF(m != MOVE_NONE, MATE_1PLY_FOUND);
+		return m;
 	}
 
 } // namespace Mate
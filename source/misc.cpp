@@ -35,6 +35,7 @@ extern "C" {
 #include <iomanip>
 //#include <iostream>
 #include <sstream>
+#include <unordered_map>
 //#include <vector>
 //#include <cstdlib>
 
@@ -43,12 +44,27 @@ extern "C" {
 #include <sys/mman.h> // madvise()
 #endif
 
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <fcntl.h>    // open()
+#include <sys/stat.h> // fstat()
+#include <sys/mman.h> // mmap()
+#include <unistd.h>   // close()
+#endif
+
+#if defined(__linux__) && !defined(__ANDROID__) && !defined(__EMSCRIPTEN__)
+#define NUMA_LINUX
+#include <sched.h>       // sched_setaffinity(),sched_getcpu()
+#include <unistd.h>      // syscall()
+#include <sys/syscall.h> // SYS_mbind,SYS_get_mempolicy
+#endif
+
 #if defined(__APPLE__) || defined(__ANDROID__) || defined(__OpenBSD__) || (defined(__GLIBCXX__) && !defined(_GLIBCXX_HAVE_ALIGNED_ALLOC) && !defined(_WIN32)) || defined(__e2k__)
 #define POSIXALIGNEDALLOC
 #include <stdlib.h>
 #endif
 
 #include "misc.h"
+#include "cpu_features.h"
 #include "thread.h"
 
 // === やねうら王独自追加
@@ -276,6 +292,16 @@ const std::string compiler_info() {
 	compiler += "(undefined macro)";
 #endif
 
+	// ビルド時に指定された拡張命令と、実行中のCPUが対応している拡張命令
+	compiler += "\nTarget CPU  : " TARGET_CPU;
+	compiler += "\nCPU detected: " + CpuFeatures::detected();
+#if defined(USE_CPU_DISPATCH)
+	compiler += std::string("\nKernel      : ") + CpuFeatures::kernel_name(CpuFeatures::kernel());
+#endif
+	const std::string best = CpuFeatures::best_target();
+	if (!best.empty())
+		compiler += "\nBest TARGET_CPU for this CPU: " + best;
+
 	compiler += "\n";
 
 	return compiler;
@@ -367,6 +393,37 @@ void prefetch(void* addr) {
 namespace {
 	// LargeMemoryを使っているかどうかがわかるように初回だけその旨を出力する。
 	bool largeMemoryAllocFirstCall = true;
+
+	// aligned_large_pages_alloc()で確保したメモリのサイズと、どのようなページで確保されたか。
+	// MAP_HUGETLBで確保したメモリはmunmap()でサイズを指定して開放しなければならないので、それも兼ねている。
+	struct LargePageAllocation {
+		size_t size;
+		const char* kind;
+		bool mmapped;
+	};
+
+	// 確保したメモリの一覧とそのmutex。
+	// グローバルなオブジェクト(置換表など)のデストラクタからも開放されるので、
+	// それより先に破棄されないように、newしたものを開放せずに使う。
+	struct LargePageAllocations {
+		std::unordered_map<void*, LargePageAllocation> map;
+		std::mutex mutex;
+	};
+
+	LargePageAllocations& large_page_allocations()
+	{
+		static LargePageAllocations* allocations = new LargePageAllocations();
+		return *allocations;
+	}
+
+	void register_large_pages(void* mem, size_t size, const char* kind, bool mmapped = false)
+	{
+		if (!mem)
+			return;
+		auto& allocations = large_page_allocations();
+		std::lock_guard<std::mutex> lk(allocations.mutex);
+		allocations.map[mem] = { size, kind, mmapped };
+	}
 }
 
 /// std_aligned_alloc() is our wrapper for systems where the c++17 implementation
@@ -498,10 +555,16 @@ void* aligned_large_pages_alloc(size_t allocSize) {
 		largeMemoryAllocFirstCall = false;
 	}
 
+	if (ptr)
+		register_large_pages(ptr, allocSize, "Windows Large Pages");
+
 	// fall back to regular, page aligned, allocation if necessary
 	// 4KB単位であることは保証されているはず..
 	if (!ptr)
+	{
 		ptr = VirtualAlloc(NULL, allocSize, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		register_large_pages(ptr, allocSize, "normal pages");
+	}
 
 	// VirtualAlloc()はpage size(4KB)でalignされていること自体は保証されているはず。
 
@@ -514,8 +577,58 @@ void* aligned_large_pages_alloc(size_t allocSize) {
 // LargePage非対応の環境であれば、std::aligned_alloc()を用いて確保しておく。
 // 最低でも4KBでalignされたメモリが返るので、引数でalignを指定できるようにする必要はない。
 
+#if defined(__linux__) && defined(MAP_HUGETLB)
+
+// ※ やねうら王独自拡張
+// hugetlbfsにhuge pageが予約されていれば(/proc/sys/vm/nr_hugepages など)、MAP_HUGETLBで明示的にhuge pageを確保する。
+// madvise(MADV_HUGEPAGE)はTransparent Huge Pageのヒントに過ぎず、実際にhuge pageになるかはカーネル次第であるが、
+// こちらは確保できればhuge pageであることが保証される。1GBのpageは確保サイズが1GB以上のときだけ試す。
+// ただし、1GB単位に切り上げると確保サイズの1/16より多く無駄になるとき(1.5GBなど)は、2MBのpageにする。
+static void* aligned_large_pages_alloc_hugetlb(size_t allocSize) {
+
+	// LargePageはエンジンオプションにより無効化されているなら何もせずに返る。
+	if (Options.count("LargePageEnable") && !Options["LargePageEnable"])
+		return nullptr;
+
+	struct { size_t page_size; int flags; const char* kind; } pages[] = {
+#if defined(MAP_HUGE_1GB)
+		{ size_t(1) << 30, MAP_HUGE_1GB, "1GB huge pages (MAP_HUGETLB)" },
+#endif
+#if defined(MAP_HUGE_2MB)
+		{ size_t(2) << 20, MAP_HUGE_2MB, "2MB huge pages (MAP_HUGETLB)" },
+#else
+		{ size_t(2) << 20, 0           , "2MB huge pages (MAP_HUGETLB)" },
+#endif
+	};
+
+	for (auto& p : pages)
+	{
+		if (allocSize < p.page_size)
+			continue;
+
+		size_t size = ((allocSize + p.page_size - 1) / p.page_size) * p.page_size;
+		if (p.page_size > (size_t(2) << 20) && size - allocSize > allocSize / 16)
+			continue;
+
+		void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | p.flags, -1, 0);
+		if (mem != MAP_FAILED)
+		{
+			register_large_pages(mem, size, p.kind, true);
+			return mem;
+		}
+	}
+	return nullptr;
+}
+
+#endif
+
 void* aligned_large_pages_alloc(size_t allocSize) {
 
+#if defined(__linux__) && defined(MAP_HUGETLB)
+	if (void* mem = aligned_large_pages_alloc_hugetlb(allocSize))
+		return mem;
+#endif
+
 #if defined(__linux__)
 	constexpr size_t alignment = 2 * 1024 * 1024; // assumed 2MB page size
 #else
@@ -526,7 +639,11 @@ void* aligned_large_pages_alloc(size_t allocSize) {
 	size_t size = ((allocSize + alignment - 1) / alignment) * alignment;
 	void* mem = std_aligned_alloc(alignment, size);
 #if defined(MADV_HUGEPAGE)
-	madvise(mem, size, MADV_HUGEPAGE);
+	if (mem)
+		madvise(mem, size, MADV_HUGEPAGE);
+	register_large_pages(mem, size, "transparent huge pages (madvise)");
+#else
+	register_large_pages(mem, size, "normal pages");
 #endif
 
 	return mem;
@@ -540,6 +657,12 @@ void* aligned_large_pages_alloc(size_t allocSize) {
 
 void aligned_large_pages_free(void* mem) {
 
+	{
+		auto& allocations = large_page_allocations();
+		std::lock_guard<std::mutex> lk(allocations.mutex);
+		allocations.map.erase(mem);
+	}
+
 	if (mem && !VirtualFree(mem, 0, MEM_RELEASE))
 	{
 		DWORD err = GetLastError();
@@ -553,6 +676,27 @@ void aligned_large_pages_free(void* mem) {
 #else
 
 void aligned_large_pages_free(void* mem) {
+
+	LargePageAllocation allocation = {};
+	{
+		auto& allocations = large_page_allocations();
+		std::lock_guard<std::mutex> lk(allocations.mutex);
+		auto it = allocations.map.find(mem);
+		if (it != allocations.map.end())
+		{
+			allocation = it->second;
+			allocations.map.erase(it);
+		}
+	}
+
+#if defined(__linux__) && defined(MAP_HUGETLB)
+	if (allocation.mmapped)
+	{
+		munmap(mem, allocation.size);
+		return;
+	}
+#endif
+
 	std_aligned_free(mem);
 }
 
@@ -570,7 +714,7 @@ void aligned_large_pages_free(void* mem) {
 void* LargeMemory::alloc(size_t size, size_t align , bool zero_clear)
 {
 	free();
-	return static_alloc(size, align, zero_clear);
+	return ptr = static_alloc(size, align, zero_clear);
 }
 
 // alloc()で確保したメモリを開放する。
@@ -620,6 +764,15 @@ void LargeMemory::static_free(void* mem)
 	aligned_large_pages_free(mem);
 }
 
+// static_alloc()で確保したメモリmemが、どのようなページで確保されたか。
+std::string LargeMemory::static_page_kind(void* mem)
+{
+	auto& allocations = large_page_allocations();
+	std::lock_guard<std::mutex> lk(allocations.mutex);
+	auto it = allocations.map.find(mem);
+	return it == allocations.map.end() ? "not allocated" : it->second.kind;
+}
+
 
 
 // --------------------
@@ -630,7 +783,8 @@ namespace WinProcGroup {
 
 #if !defined ( _WIN32 )
 
-	void bindThisThread(size_t) {}
+	// Linuxでは、NUMA nodeが複数あるときに、そのnodeのCPU群にスレッドを割り当てる。
+	void bindThisThread(size_t idx) { Numa::bind_this_thread(idx); }
 
 #else
 
@@ -774,6 +928,230 @@ namespace WinProcGroup {
 
 } // namespace WinProcGroup
 
+// --------------------
+//     NUMA
+// --------------------
+
+namespace Numa {
+
+	// 呼び出したスレッドがbind_this_thread()で割り当てられたnode。(割り当てられていなければ-1)
+	thread_local int this_thread_node = -1;
+
+#if defined(NUMA_LINUX)
+
+	// <numaif.h>(libnuma)に依存しないように、mbind(),get_mempolicy()はsyscall()で直接呼び出す。
+	// 以下はそのための定数。(値はlinux/mempolicy.hと同じ)
+	constexpr int MPOL_DEFAULT_    = 0;
+	constexpr int MPOL_BIND_       = 2;
+	constexpr int MPOL_INTERLEAVE_ = 3;
+	constexpr unsigned MPOL_MF_MOVE_ = 1 << 1;
+	constexpr unsigned long MPOL_F_NODE_ = 1 << 0;
+	constexpr unsigned long MPOL_F_ADDR_ = 1 << 1;
+
+	// NUMAのtopology。最初に必要になった時に/sys/devices/system/node/から読み込む。
+	struct Topology
+	{
+		// nodeの番号(OSの付けたnode id)。連番とは限らない。
+		std::vector<int> ids;
+
+		// 各nodeに属するCPUの番号
+		std::vector<std::vector<int>> cpus;
+
+		// CPU番号 → nodeのindex(idsの何番目か)
+		std::vector<int> node_of_cpu;
+
+		// bind_this_thread()でスレッドを割り当てていく順番に並べたnodeのindex。
+		std::vector<int> groups;
+
+		Topology()
+		{
+			// "0-3,8-11"のような形式のCPUの一覧をparseする。
+			auto parse_list = [](const std::string& list) {
+				std::vector<int> v;
+				std::istringstream ss(list);
+				std::string range;
+				while (std::getline(ss, range, ','))
+				{
+					if (range.empty() || !isdigit((unsigned char)range[0]))
+						continue;
+					auto dash  = range.find('-');
+					int  first = std::stoi(range.substr(0, dash));
+					int  last  = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+					for (int i = first; i <= last; ++i)
+						v.push_back(i);
+				}
+				return v;
+			};
+
+			std::string online;
+			std::ifstream("/sys/devices/system/node/online") >> online;
+
+			for (int id : parse_list(online))
+			{
+				std::string cpulist;
+				std::ifstream("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist") >> cpulist;
+				auto list = parse_list(cpulist);
+
+				// CPUのないnode(メモリだけのnode)は、スレッドの割り当て先にもTTの配置先にもしない。
+				if (list.empty())
+					continue;
+
+				for (int cpu : list)
+				{
+					if ((size_t)cpu >= node_of_cpu.size())
+						node_of_cpu.resize(cpu + 1, -1);
+					node_of_cpu[cpu] = (int)ids.size();
+				}
+				ids.push_back(id);
+				cpus.push_back(list);
+			}
+
+			// 取得できなかったときは、NUMAではない環境とみなす。
+			if (ids.empty())
+				ids.push_back(0), cpus.push_back({});
+
+			// WinProcGroup::best_node()と同じく、1つ目のnodeの論理コアを使い切ってから次のnodeを使う。
+			for (size_t n = 0; n < cpus.size(); ++n)
+				for (size_t i = 0; i < cpus[n].size(); ++i)
+					groups.push_back((int)n);
+		}
+	};
+
+	const Topology& topology_()
+	{
+		static Topology t;
+		return t;
+	}
+
+	size_t node_count() { return topology_().ids.size(); }
+
+	size_t node_of_thread(size_t idx)
+	{
+		auto& groups = topology_().groups;
+		return groups.empty() ? 0 : groups[idx % groups.size()];
+	}
+
+	void bind_this_thread(size_t idx)
+	{
+		auto& t = topology_();
+		if (t.ids.size() <= 1)
+			return;
+
+		size_t node = node_of_thread(idx);
+
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		for (int cpu : t.cpus[node])
+			if (cpu < CPU_SETSIZE)
+				CPU_SET(cpu, &mask);
+
+		if (sched_setaffinity(0, sizeof(mask), &mask) == 0)
+			this_thread_node = (int)node;
+	}
+
+	int current_node()
+	{
+		int cpu = sched_getcpu();
+		auto& node_of_cpu = topology_().node_of_cpu;
+		return (cpu >= 0 && (size_t)cpu < node_of_cpu.size()) ? node_of_cpu[cpu] : -1;
+	}
+
+	int node_of_address(const void* addr)
+	{
+		int id = -1;
+		if (syscall(SYS_get_mempolicy, &id, nullptr, 0, const_cast<void*>(addr), MPOL_F_NODE_ | MPOL_F_ADDR_) != 0)
+			return -1;
+
+		auto& ids = topology_().ids;
+		for (size_t n = 0; n < ids.size(); ++n)
+			if (ids[n] == id)
+				return (int)n;
+		return -1;
+	}
+
+	// [addr, addr + size)の配置policyを設定する。nodesは配置先のnodeのindex。
+	// 配置済みのページもpolicyに従うように移動させる。
+	static bool set_policy(void* addr, size_t size, int mode, const std::vector<size_t>& nodes)
+	{
+		// mbind()の範囲はpage境界でなければならない。
+		const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+		uintptr_t begin = ((uintptr_t)addr + page - 1) / page * page;
+		uintptr_t end   = ((uintptr_t)addr + size) / page * page;
+		if (begin >= end)
+			return true;
+
+		auto& ids = topology_().ids;
+		constexpr size_t bits = sizeof(unsigned long) * 8;
+		int max_id = *std::max_element(ids.begin(), ids.end());
+		std::vector<unsigned long> mask(max_id / bits + 1);
+		for (auto n : nodes)
+			mask[ids[n] / bits] |= 1UL << (ids[n] % bits);
+
+		return syscall(SYS_mbind, (void*)begin, end - begin, mode,
+			mode == MPOL_DEFAULT_ ? nullptr : mask.data(), mode == MPOL_DEFAULT_ ? 0 : mask.size() * bits + 1,
+			MPOL_MF_MOVE_) == 0;
+	}
+
+	bool interleave(void* addr, size_t size)
+	{
+		std::vector<size_t> nodes;
+		for (size_t n = 0; n < node_count(); ++n)
+			nodes.push_back(n);
+		return set_policy(addr, size, MPOL_INTERLEAVE_, nodes);
+	}
+
+	bool bind(void* addr, size_t size, size_t node) { return set_policy(addr, size, MPOL_BIND_, { node }); }
+
+	bool reset(void* addr, size_t size) { return set_policy(addr, size, MPOL_DEFAULT_, {}); }
+
+	std::string topology()
+	{
+		auto& t = topology_();
+		std::ostringstream ss;
+		for (size_t n = 0; n < t.ids.size(); ++n)
+		{
+			ss << (n ? " , " : "") << "node" << t.ids[n] << " : cpus ";
+			// 連続するCPU番号は"0-15"のようにまとめる。
+			auto& cpus = t.cpus[n];
+			for (size_t i = 0; i < cpus.size(); )
+			{
+				size_t j = i;
+				while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+					++j;
+				ss << (i ? "," : "") << cpus[i];
+				if (j > i)
+					ss << "-" << cpus[j];
+				i = j + 1;
+			}
+		}
+		return ss.str();
+	}
+
+#else
+
+	// NUMAに対応していない環境では、node数1として振る舞う。
+
+	size_t node_count() { return 1; }
+	size_t node_of_thread(size_t) { return 0; }
+	void bind_this_thread(size_t) {}
+	int current_node() { return -1; }
+	int node_of_address(const void*) { return -1; }
+	bool interleave(void*, size_t) { return false; }
+	bool bind(void*, size_t, size_t) { return false; }
+	bool reset(void*, size_t) { return false; }
+	std::string topology() { return "node0"; }
+
+#endif
+
+	int thread_node()
+	{
+		if (this_thread_node < 0)
+			this_thread_node = std::max(current_node(), 0);
+		return this_thread_node;
+	}
+
+} // namespace Numa
+
 
 // --------------------
 //  Timer
@@ -1076,10 +1454,11 @@ namespace SystemIO
 		if (fp == nullptr)
 			return Tools::Result(Tools::ResultCode::FileOpenError);
 
-		fseek(fp, 0, SEEK_END);
-		size_t endPos = (size_t)ftell(fp);
-		fseek(fp, 0, SEEK_SET);
-		size_t beginPos = (size_t)ftell(fp);
+		// 置換表のファイルなど、2GBを超えるファイルもあるのでftell64()を用いる。
+		fseek64(fp, 0, SEEK_END);
+		size_t endPos = ftell64(fp);
+		fseek64(fp, 0, SEEK_SET);
+		size_t beginPos = ftell64(fp);
 		size_t file_size = endPos - beginPos;
 
 		// ファイルサイズがわかったのでcallback_funcを呼び出してこの分のバッファを確保してもらい、
@@ -1090,7 +1469,10 @@ namespace SystemIO
 		// nullptrを返すことになっている。このとき、読み込みを中断し、エラーリターンする。
 		// 原因は不明だが、メモリ割り当ての失敗なのでMemoryAllocationErrorを返しておく。
 		if (ptr == nullptr)
+		{
+			fclose(fp);
 			return Tools::Result(Tools::ResultCode::MemoryAllocationError);
+		}
 
 		// 細切れに読み込む
 
@@ -1101,8 +1483,11 @@ namespace SystemIO
 			size_t read_size = (pos + block_size < file_size) ? block_size : (file_size - pos);
 
 			if (fread((u8*)ptr + pos, 1, read_size, fp) != read_size)
+			{
 				// 指定サイズだけ読み込めていないということは、読み込み上のエラーである。
+				fclose(fp);
 				return Tools::Result(Tools::ResultCode::FileReadError);
+			}
 
 			//cout << ".";
 		}
@@ -1112,9 +1497,9 @@ namespace SystemIO
 	}
 
 
-	Tools::Result WriteMemoryToFile(const std::string& filename, void* ptr, size_t size)
+	Tools::Result WriteMemoryToFile(const std::string& filename, void* ptr, size_t size, bool append)
 	{
-		fstream fs(filename, ios::out | ios::binary);
+		fstream fs(filename, ios::out | ios::binary | (append ? ios::app : ios::trunc));
 		if (fs.fail())
 			return Tools::Result(Tools::ResultCode::FileOpenError);
 
@@ -1136,6 +1521,65 @@ namespace SystemIO
 		return Tools::Result::Ok();
 	}
 
+	// --- MappedFile
+
+	Tools::Result MappedFile::Open(const std::string& filename)
+	{
+		Close();
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			return Tools::Result(Tools::ResultCode::FileOpenError);
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			// MAP_PRIVATEなので、書き換えてもファイルには反映されない。(copy on write)
+			void* p = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				ptr = p;
+				data_size = (size_t)st.st_size;
+				mmapped = true;
+			}
+		}
+		// mmap()したあとはfdを閉じて良い。
+		close(fd);
+
+		if (mmapped)
+			return Tools::Result::Ok();
+#endif
+
+		// mmapできなかったので丸読みする。
+		void* p = nullptr;
+		size_t file_size = 0;
+		auto result = ReadFileToMemory(filename, [&](size_t size) {
+			file_size = size;
+			return p = size ? memory.alloc(size) : nullptr;
+		});
+		if (result.is_ok())
+		{
+			ptr = p;
+			data_size = file_size;
+		}
+		else
+			memory.free();
+		return result;
+	}
+
+	void MappedFile::Close()
+	{
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+		if (mmapped)
+			munmap(ptr, data_size);
+#endif
+		memory.free();
+		ptr = nullptr;
+		data_size = 0;
+		mmapped = false;
+	}
+
 	// 通常のftell/fseekは2GBまでしか対応していないので特別なバージョンが必要である。
 	// 64bit環境でないと対応していない。まあいいや…。
 
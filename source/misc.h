@@ -71,6 +71,13 @@ struct LargeMemory
 	// alloc()が呼び出されてメモリが確保されている状態か？
 	bool alloced() const { return ptr != nullptr; }
 
+	// alloc()で確保したメモリが、どのようなページで確保されたか。("info string"で出力する用)
+	// 例) "1GB huge pages (MAP_HUGETLB)" , "Windows Large Pages" , "transparent huge pages (madvise)"
+	std::string page_kind() const { return static_page_kind(ptr); }
+
+	// static_alloc()で確保したメモリmemの、page_kind()と同じもの。
+	static std::string static_page_kind(void* mem);
+
 	// alloc()のstatic関数版。この関数で確保したメモリはstatic_free()で開放する。
 	static void* static_alloc(size_t size, size_t align = 256, bool zero_clear = false);
 
@@ -273,6 +280,51 @@ namespace WinProcGroup {
 	void bindThisThread(size_t idx);
 }
 
+// --------------------
+//     NUMA
+// --------------------
+
+// Linux環境でのNUMA nodeの取得とメモリ配置。
+// libnumaには依存せず、/sys/devices/system/node/とsyscallを直接用いる。
+// Linux以外の環境では、node数が1であるかのように振る舞い、メモリ配置などは何もしない。
+// 以下、nodeはOSのnode idではなく、0から始まるnodeのindexである。
+
+namespace Numa {
+	// CPUを持つNUMA nodeの数。(1以上)
+	size_t node_count();
+
+	// スレッド番号idxのスレッドを割り当てるnode。1つ目のnodeの論理コアを使い切ってから次のnodeを使う。
+	size_t node_of_thread(size_t idx);
+
+	// 呼び出したスレッドを、node_of_thread(idx)のnodeのCPU群に割り当てる。
+	// nodeが1つしかないときは何もしない。Linuxでは、WinProcGroup::bindThisThread()から呼び出される。
+	void bind_this_thread(size_t idx);
+
+	// 呼び出したスレッドのnode。bind_this_thread()で割り当てたnode、
+	// 割り当てていなければ初回の呼び出し時に実行されていたnodeを返す。
+	int thread_node();
+
+	// 呼び出したスレッドが現在実行されているnode。取得できなければ-1。
+	int current_node();
+
+	// addrのページが配置されているnode。(まだ配置されていないなどで)取得できなければ-1。
+	// syscallを伴うので、探索中に呼び出すときはサンプリングすること。
+	int node_of_address(const void* addr);
+
+	// [addr, addr + size)のメモリを全nodeにinterleaveして配置する。
+	// 配置済みのページも移動させる。以下の関数も同様。
+	bool interleave(void* addr, size_t size);
+
+	// [addr, addr + size)のメモリをnodeに配置する。
+	bool bind(void* addr, size_t size, size_t node);
+
+	// [addr, addr + size)のメモリの配置方法を既定(first-touch)に戻す。
+	bool reset(void* addr, size_t size);
+
+	// "node0 : cpus 0-15,32-47 , node1 : cpus 16-31,48-63"のような各nodeのCPUの一覧。
+	std::string topology();
+}
+
 // -----------------------
 //  探索のときに使う時間管理用
 // -----------------------
@@ -540,7 +592,42 @@ namespace SystemIO
 	// nullptrを返せば良い。このとき、read_file_to_memory()は、読み込みを中断し、エラーリターンする。
 
 	extern Tools::Result ReadFileToMemory(const std::string& filename, std::function<void* (size_t)> callback_func);
-	extern Tools::Result WriteMemoryToFile(const std::string& filename, void* ptr, size_t size);
+
+	// appendがtrueなら、ファイルの末尾に追記する。(ヘッダーと本体を別々に書き出したいとき用)
+	extern Tools::Result WriteMemoryToFile(const std::string& filename, void* ptr, size_t size, bool append = false);
+
+	// ファイルをメモリにmapする。
+	// POSIX環境ではmmap(MAP_PRIVATE)するので、ページは最初にアクセスされたときに読み込まれる。(巨大なファイルでも一瞬で開ける)
+	// mapしたメモリは書き換えられるが、書き換えた内容はファイルには反映されない。
+	// mmapできない環境では、LargeMemoryに確保してReadFileToMemory()で丸読みする。
+	struct MappedFile
+	{
+		// ファイルをmapする。すでにmapしているファイルはCloseされる。
+		Tools::Result Open(const std::string& filename);
+
+		// mapしたファイルを開放する。デストラクタからも呼び出される。
+		void Close();
+
+		// mapしたメモリの先頭とサイズ。
+		void* data() const { return ptr; }
+		size_t size() const { return data_size; }
+
+		// ファイルをmapしている状態か？
+		bool is_open() const { return ptr != nullptr; }
+
+		// mmapしているのか(falseならReadFileToMemory()で読み込んでいる)
+		bool is_mmapped() const { return mmapped; }
+
+		~MappedFile() { Close(); }
+
+	private:
+		void* ptr = nullptr;
+		size_t data_size = 0;
+		bool mmapped = false;
+
+		// mmapできなかったときに読み込む先
+		LargeMemory memory;
+	};
 
 	// 通常のftell/fseekは2GBまでしか対応していないので特別なバージョンが必要である。
 
@@ -182,10 +182,11 @@ template <PieceType Pt, Color Us, bool All> struct make_move_target {
 };
 
 // 指し手生成のうち、一般化されたもの。香・桂・銀はこの指し手生成を用いる。
+// movers : 移動させて良い駒のある升。合法手の直接生成のときに、pinされている駒を除外するのに用いる。
 template <MOVE_GEN_TYPE GenType, PieceType Pt, Color Us, bool All> struct GeneratePieceMoves {
-	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target) {
+	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target, const Bitboard& movers = Bitboard(1)) {
 		// 盤上の駒pc(香・桂・銀)に対して
-		auto pieces = pos.pieces(Us, Pt);
+		auto pieces = pos.pieces(Us, Pt) & movers;
 		const auto occ = pos.pieces();
 
 		while (pieces)
@@ -209,10 +210,10 @@ template <MOVE_GEN_TYPE GenType, PieceType Pt, Color Us, bool All> struct Genera
 
 // 歩の移動による指し手生成
 template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<GenType, PAWN, Us, All> {
-	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target)
+	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target, const Bitboard& movers = Bitboard(1))
 	{
 		// 盤上の自駒の歩に対して
-		auto pieces = pos.pieces(Us, PAWN);
+		auto pieces = pos.pieces(Us, PAWN) & movers;
 
 		// 歩の利き
 		auto target2 = pawnBbEffect<Us>(pieces) & target;
@@ -251,10 +252,10 @@ template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<G
 
 // 角・飛による移動による指し手生成。これらの駒は成れるなら絶対に成る
 template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<GenType, GPM_BR, Us, All> {
-	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target)
+	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target, const Bitboard& movers = Bitboard(1))
 	{
 		// 角と飛に対して(馬と龍は除く)
-		auto pieces = pos.pieces(Us,BISHOP,ROOK);
+		auto pieces = pos.pieces(Us,BISHOP,ROOK) & movers;
 		auto occ = pos.pieces();
 
 		while (pieces)
@@ -272,10 +273,10 @@ template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<G
 
 // 成れない駒による移動による指し手。(金相当の駒・馬・龍・王)
 template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<GenType, GPM_GHDK, Us, All> {
-	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target)
+	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target, const Bitboard& movers = Bitboard(1))
 	{
 		// 金相当の駒・馬・龍・玉に対して
-		auto pieces = pos.pieces(Us,GOLDS,HDK);
+		auto pieces = pos.pieces(Us,GOLDS,HDK) & movers;
 		auto occ = pos.pieces();
 
 		while (pieces)
@@ -292,10 +293,10 @@ template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<G
 
 // 玉を除く成れない駒による移動による指し手。(金相当の駒・馬・龍)
 template <MOVE_GEN_TYPE GenType, Color Us, bool All> struct GeneratePieceMoves<GenType, GPM_GHD, Us, All> {
-	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target)
+	FORCE_INLINE ExtMove* operator()(const Position&pos, ExtMove*mlist, const Bitboard& target, const Bitboard& movers = Bitboard(1))
 	{
 		// 金相当の駒・馬・龍に対して
-		auto pieces = pos.pieces(Us,GOLDS,HORSE,DRAGON);
+		auto pieces = pos.pieces(Us,GOLDS,HORSE,DRAGON) & movers;
 		auto occ = pos.pieces();
 
 		while (pieces)
@@ -607,6 +608,253 @@ ExtMove* generate_general(const Position& pos, ExtMove* mlist, Square recapSq =
 	return mlist;
 }
 
+// -----------------------------------------------------
+//      合法手の直接生成
+// -----------------------------------------------------
+
+// LEGAL , LEGAL_ALL用の指し手生成。
+// 擬似合法手を生成してから1手ずつlegal()で自殺手を取り除くのではなく、
+//  1) 玉の移動は、移動先に敵の利きがない升のみ
+//  2) pinされている駒の移動は、玉とその駒を結ぶ直線上のみ
+//  3) 王手がかかっているなら、両王手なら玉の移動のみ、さもなくば王手している駒を取る手と合駒のみ
+// を最初から生成する。打ち歩詰めと二歩はGenerateDropMovesのほうで除外されている。
+template<Color Us, bool All>
+ExtMove* generate_legal(const Position& pos, ExtMove* mlist)
+{
+	ExtMove* mlist_org = mlist;
+	constexpr Color Them = ~Us;
+
+	const Square ksq = pos.king_square(Us);
+	const Bitboard occ = pos.pieces();
+
+	// pinされている自駒
+	const Bitboard pinned = pos.blockers_for_king(Us) & pos.pieces(Us);
+
+	// 玉以外で移動させて良い駒
+	const Bitboard movers = pinned.andnot(pos.pieces(Us)) ^ ksq;
+
+	// 駒の移動先と駒打ちの升
+	Bitboard target, dropTarget;
+
+	// 1) 玉の移動。玉はないものとして移動先の利きを調べる。
+	// 生成順は従来のEVASIONS/NON_EVASIONSに合わせておく。(王手がかかっていれば玉の移動が先)
+	auto generate_king_moves = [&]() {
+		Bitboard kingTarget = pos.pieces(Us).andnot(kingEffect(ksq));
+		while (kingTarget)
+		{
+			const Square to = kingTarget.pop();
+			if (!pos.effected_to(Them, to, ksq))
+				mlist++->move = make_move(ksq, to, Us, KING);
+		}
+	};
+
+	if (pos.in_check())
+	{
+		generate_king_moves();
+
+		// 3) 両王手なら玉の移動しかない。
+		const Bitboard checkers = pos.checkers();
+		if (checkers.more_than_one())
+			return mlist;
+
+		// 王手している駒を取るか、王手している駒と玉の間に移動するか打つか。
+		// pinされている駒は玉との直線上から外れられないので、これらの升には移動できない。
+		const Square checksq = checkers.pop_c();
+		dropTarget = between_bb(checksq, ksq);
+		target     = dropTarget | checksq;
+	}
+	else
+	{
+		target     = ~pos.pieces(Us);
+		dropTarget = pos.empties();
+
+		// 2) pinされている駒の移動。(pinされている駒はほとんどの局面で存在しないので、まとめてここで処理する)
+		Bitboard pinned2 = pinned;
+		while (pinned2)
+		{
+			const Square from = pinned2.pop();
+			const Piece pc = pos.piece_on(from);
+			const Bitboard target2 = effects_from(pc, from, occ) & target & line_bb(ksq, from);
+
+			switch (type_of(pc))
+			{
+			case PAWN  : mlist = make_move_target<PAWN  , Us, All>()(pos, from, target2, mlist); break;
+			case LANCE : mlist = make_move_target<LANCE , Us, All>()(pos, from, target2, mlist); break;
+			case KNIGHT: break; // 桂は玉との直線上には移動できない。
+			case SILVER: mlist = make_move_target<SILVER, Us, All>()(pos, from, target2, mlist); break;
+			case BISHOP: case ROOK:
+				         mlist = make_move_target<GPM_BR, Us, All>()(pos, from, target2, mlist); break;
+			default    : mlist = make_move_target<GPM_GHDK, Us, All>()(pos, from, target2, mlist); break;
+			}
+		}
+	}
+
+	// pinされていない駒の移動と駒打ち。これらは自殺手にならない。
+	mlist = GeneratePieceMoves<NON_EVASIONS, PAWN   , Us, All>()(pos, mlist, target, movers);
+	mlist = GeneratePieceMoves<NON_EVASIONS, LANCE  , Us, All>()(pos, mlist, target, movers);
+	mlist = GeneratePieceMoves<NON_EVASIONS, KNIGHT , Us, All>()(pos, mlist, target, movers);
+	mlist = GeneratePieceMoves<NON_EVASIONS, SILVER , Us, All>()(pos, mlist, target, movers);
+	mlist = GeneratePieceMoves<NON_EVASIONS, GPM_BR , Us, All>()(pos, mlist, target, movers);
+	mlist = GeneratePieceMoves<NON_EVASIONS, GPM_GHD, Us, All>()(pos, mlist, target, movers);
+	if (!pos.in_check())
+		generate_king_moves();
+	mlist = GenerateDropMoves<Us>()(pos, mlist, dropTarget);
+
+	ASSERT_LV5(pseudo_legal_check(pos, mlist_org, mlist));
+
+	return mlist;
+}
+
+// fromにあるPtの駒をtargetの升に移動させる指し手の数。make_move_target()と同じ条件で成・不成を数える。
+template <PieceType Pt, Color Us, bool All>
+FORCE_INLINE int count_move_target(Square from, const Bitboard& target)
+{
+	// 不成で移動できる升(先手なら2段目以降/3段目以降)
+	const Bitboard rank2_9 = Us == BLACK ? BB_Table::ForwardRanksBB[WHITE][RANK_1] : BB_Table::ForwardRanksBB[BLACK][RANK_9];
+	const Bitboard rank3_9 = Us == BLACK ? BB_Table::ForwardRanksBB[WHITE][RANK_2] : BB_Table::ForwardRanksBB[BLACK][RANK_8];
+
+	switch (Pt)
+	{
+	case PAWN:
+	{
+		if (!target)
+			return 0;
+		const Square to = from + (Us == BLACK ? SQ_U : SQ_D);
+		return canPromote(Us, to) ? 1 + ((All && rank_of(to) != (Us == BLACK ? RANK_1 : RANK_9)) ? 1 : 0) : 1;
+	}
+
+	case LANCE:
+		return (target & enemy_field(Us)).pop_count() + (target & (All ? rank2_9 : rank3_9)).pop_count();
+
+	case KNIGHT:
+		return (target & enemy_field(Us)).pop_count() + (target & rank3_9).pop_count();
+
+	case SILVER:
+		return (enemy_field(Us) & from) ? target.pop_count() * 2 : target.pop_count() + (target & enemy_field(Us)).pop_count();
+
+	case GPM_BR:
+		// 成れるなら成る。Allのときだけ不成も数える。
+		return canPromote(Us, from) ? target.pop_count() * (All ? 2 : 1)
+			: target.pop_count() + (All ? (target & enemy_field(Us)).pop_count() : 0);
+
+	case GPM_GHDK:
+		return target.pop_count();
+
+	default: UNREACHABLE; return 0;
+	}
+}
+
+// generate_legal()で生成される指し手の数を、ExtMoveに書き出さずに数える。
+// perftの末端や、詰みかどうかの判定など、指し手の数だけが欲しいときに用いる。
+template<Color Us, bool All>
+int count_legal(const Position& pos)
+{
+	constexpr Color Them = ~Us;
+
+	const Square ksq = pos.king_square(Us);
+	const Bitboard occ = pos.pieces();
+	const Bitboard pinned = pos.blockers_for_king(Us) & pos.pieces(Us);
+	const Bitboard movers = pinned.andnot(pos.pieces(Us)) ^ ksq;
+	Bitboard target, dropTarget;
+	int count = 0;
+
+	// 玉の移動
+	Bitboard kingTarget = pos.pieces(Us).andnot(kingEffect(ksq));
+	while (kingTarget)
+		if (!pos.effected_to(Them, kingTarget.pop(), ksq))
+			++count;
+
+	if (pos.in_check())
+	{
+		const Bitboard checkers = pos.checkers();
+		if (checkers.more_than_one())
+			return count;
+
+		const Square checksq = checkers.pop_c();
+		dropTarget = between_bb(checksq, ksq);
+		target     = dropTarget | checksq;
+	}
+	else
+	{
+		target     = ~pos.pieces(Us);
+		dropTarget = pos.empties();
+
+		// pinされている駒の移動
+		Bitboard pinned2 = pinned;
+		while (pinned2)
+		{
+			const Square from = pinned2.pop();
+			const Piece pc = pos.piece_on(from);
+			const Bitboard target2 = effects_from(pc, from, occ) & target & line_bb(ksq, from);
+
+			switch (type_of(pc))
+			{
+			case PAWN  : count += count_move_target<PAWN  , Us, All>(from, target2); break;
+			case LANCE : count += count_move_target<LANCE , Us, All>(from, target2); break;
+			case KNIGHT: break;
+			case SILVER: count += count_move_target<SILVER, Us, All>(from, target2); break;
+			case BISHOP: case ROOK:
+				         count += count_move_target<GPM_BR, Us, All>(from, target2); break;
+			default    : count += count_move_target<GPM_GHDK, Us, All>(from, target2); break;
+			}
+		}
+	}
+
+	// 歩の移動。成れるなら成る。Allのときは1段目以外への不成も数える。
+	const Bitboard pawnTarget = pawnBbEffect<Us>(pos.pieces(Us, PAWN) & movers) & target;
+	count += pawnTarget.pop_count();
+	if (All)
+		count += (pawnTarget & enemy_field(Us) & (Us == BLACK ? BB_Table::ForwardRanksBB[WHITE][RANK_1] : BB_Table::ForwardRanksBB[BLACK][RANK_9])).pop_count();
+
+	// 香・桂・銀
+	Bitboard pieces = pos.pieces(Us, LANCE) & movers;
+	while (pieces) { const Square from = pieces.pop(); count += count_move_target<LANCE , Us, All>(from, lanceEffect(Us, from, occ) & target); }
+	pieces = pos.pieces(Us, KNIGHT) & movers;
+	while (pieces) { const Square from = pieces.pop(); count += count_move_target<KNIGHT, Us, All>(from, knightEffect(Us, from) & target); }
+	pieces = pos.pieces(Us, SILVER) & movers;
+	while (pieces) { const Square from = pieces.pop(); count += count_move_target<SILVER, Us, All>(from, silverEffect(Us, from) & target); }
+
+	// 角・飛
+	pieces = pos.pieces(Us, BISHOP, ROOK) & movers;
+	while (pieces) { const Square from = pieces.pop(); count += count_move_target<GPM_BR, Us, All>(from, effects_from(pos.piece_on(from), from, occ) & target); }
+
+	// 金相当の駒・馬・龍
+	pieces = pos.pieces(Us, GOLDS, HORSE, DRAGON) & movers;
+	while (pieces) { const Square from = pieces.pop(); count += (effects_from(pos.piece_on(from), from, occ) & target).pop_count(); }
+
+	// --- 駒打ち(GenerateDropMoves()と同じ条件)
+	const Hand hand = pos.hand_of(Us);
+	if (hand == 0)
+		return count;
+
+	if (hand_exists(hand, PAWN))
+	{
+		Bitboard target2 = dropTarget & pawn_drop_mask<Us>(pos.pieces<Us>(PAWN));
+
+		// 打ち歩詰めになる升は除外する。
+		Bitboard pe = pawnEffect<Them>(pos.king_square<Them>());
+		if (pe & target2)
+		{
+			Square to = pe.pop_c();
+			if (!pos.legal_drop(to))
+				target2 ^= pe;
+		}
+		count += target2.pop_count();
+	}
+
+	// 香・桂以外の手駒の種類数
+	const int others = (hand_exists(hand, SILVER) ? 1 : 0) + (hand_exists(hand, GOLD) ? 1 : 0)
+		             + (hand_exists(hand, BISHOP) ? 1 : 0) + (hand_exists(hand, ROOK) ? 1 : 0);
+	if (others)
+		count += dropTarget.pop_count() * others;
+	if (hand_exists(hand, LANCE))
+		count += (dropTarget & (Us == BLACK ? BB_Table::ForwardRanksBB[WHITE][RANK_1] : BB_Table::ForwardRanksBB[BLACK][RANK_9])).pop_count();
+	if (hand_exists(hand, KNIGHT))
+		count += (dropTarget & (Us == BLACK ? BB_Table::ForwardRanksBB[WHITE][RANK_2] : BB_Table::ForwardRanksBB[BLACK][RANK_8])).pop_count();
+
+	return count;
+}
+
 // -----------------------------------------------------
 //      王手生成関係
 // -----------------------------------------------------
@@ -914,20 +1162,9 @@ ExtMove* generateMoves(const Position& pos, ExtMove* mlist, Square recapSq)
 
 	if (GenType == LEGAL || GenType == LEGAL_ALL)
 	{
-
-		// 合法性な指し手のみを生成する。
-		// 自殺手や打ち歩詰めが含まれているのでそれを取り除く。かなり重い。ゆえにLEGALは特殊な状況でしか使うべきではない。
-		auto last = pos.in_check() ? generateEvasionMoves<All>(pos, mlist) : generateMoves<NON_EVASIONS, All>(pos, mlist);
-
-		// 合法ではない指し手を末尾の指し手と入れ替え
-		while (mlist != last)
-		{
-			if (!pos.legal(*mlist))
-				mlist->move = (--last)->move;
-			else
-				++mlist;
-		}
-		return last;
+		// 合法な指し手のみを生成する。
+		// 自殺手はpinされている駒と玉の移動に対してのみ生成時に取り除く。(generate_legal()の説明を参照のこと)
+		return pos.side_to_move() == BLACK ? generate_legal<BLACK, All>(pos, mlist) : generate_legal<WHITE, All>(pos, mlist);
 	}
 
 	// 王手生成
@@ -972,6 +1209,15 @@ ExtMove* generateMoves(const Position& pos, ExtMove* mlist)
 	return generateMoves<GenType>(pos, mlist, SQ_NB);
 }
 
+// 指し手の数だけを数える。
+template<MOVE_GEN_TYPE GenType>
+size_t countMoves(const Position& pos)
+{
+	static_assert(GenType == LEGAL || GenType == LEGAL_ALL, "countMoves() supports LEGAL , LEGAL_ALL only.");
+	constexpr bool All = GenType == LEGAL_ALL;
+	return (size_t)(pos.side_to_move() == BLACK ? count_legal<BLACK, All>(pos) : count_legal<WHITE, All>(pos));
+}
+
 
 // テンプレートの実体化。これを書いておかないとリンクエラーになる。
 // .h(ヘッダー)ではなく.cppのほうに書くことでコンパイル時間を節約できる。
@@ -999,3 +1245,6 @@ template ExtMove* generateMoves<QUIET_CHECKS_ALL      >(const Position& pos, Ext
 
 template ExtMove* generateMoves<RECAPTURES            >(const Position& pos, ExtMove* mlist, Square recapSq);
 template ExtMove* generateMoves<RECAPTURES_ALL        >(const Position& pos, ExtMove* mlist, Square recapSq);
+
+template size_t countMoves<LEGAL    >(const Position& pos);
+template size_t countMoves<LEGAL_ALL>(const Position& pos);
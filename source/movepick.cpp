@@ -2,20 +2,13 @@
 #if defined(USE_MOVE_PICKER)
 
 #include "thread.h"
+#include "perf_counter.h"
 
 // パラメーターの自動調整フレームワークからパラメーターの値を読み込む
 #include "engine/yaneuraou-engine/yaneuraou-param-common.h"
 
-#if defined(USE_SUPER_SORT) && defined(USE_AVX2)
-// partial_insertion_sort()のSuperSortを用いた実装
-extern void partial_super_sort(ExtMove* start, ExtMove* end, int limit);
-
-/*
-  - 少し高速化されるらしい。
-  - 安定ソートではないので並び順が以前のとは異なるから、benchコマンドの探索ノード数は変わる。
-  - CPU targetによって実装が変わるのでCPUによってbenchコマンドの探索ノード数は変わる。
-*/
-#endif
+// 駒を捕獲しない指し手の部分ソート。実装はエンジンオプションの"MoveSort"で切り替えられる。
+#include "extra/move_sort.h"
 
 namespace {
 
@@ -82,28 +75,6 @@ enum Stages: int {
 	QCHECK_						// 王手となる指し手(- 歩を成る指し手)を返すフェーズ
 };
 
-// -----------------------
-//   partial insertion sort
-// -----------------------
-
-// partial_insertion_sort()は指し手を与えられたlimitまで降順でソートする。
-// limitよりも小さい値の指し手の順序については、不定。
-// 将棋だと指し手の数が多い(ことがある)ので、数が多いときは途中で打ち切ったほうがいいかも。
-// 現状、全体時間の6.5～7.5%程度をこの関数で消費している。
-// (長い時間思考させるとこの割合が増えてくる)
-void partial_insertion_sort(ExtMove* begin, ExtMove* end, int limit) {
-
-	for (ExtMove *sortedEnd = begin, *p = begin + 1; p < end; ++p)
-		if (p->value >= limit)
-		{
-			ExtMove tmp = *p, *q;
-			*p = *++sortedEnd;
-			for (q = sortedEnd; q != begin && *(q - 1) < tmp; --q)
-				*q = *(q - 1);
-			*q = tmp;
-		}
-}
-
 } // end of namespace
 
 // 指し手オーダリング器
@@ -286,6 +257,7 @@ top:
 	case EVASION_TT:
 	case QSEARCH_TT:
 	case PROBCUT_TT:
+		PERF_COUNT(MP_TT_MOVE);
 		++stage;
 		return ttMove;
 
@@ -298,6 +270,8 @@ top:
 		//endMoves = Search::Limits.generate_all_legal_moves ? generateMoves<CAPTURES_PRO_PLUS_ALL>(pos, cur) : generateMoves<CAPTURES_PRO_PLUS>(pos, cur);
 		// → Probcutとかでしか使わないから、CAPTURES_PRO_PLUS_ALLは廃止する。
 		endMoves = generateMoves<CAPTURES_PRO_PLUS>(pos, cur);
+		PERF_COUNT(MP_CAPTURE_GEN);
+		PERF_COUNT_N(MP_CAPTURE_MOVES, endMoves - cur);
 
 		// 駒を捕獲する指し手に対してオーダリングのためのスコアをつける
 		score<CAPTURES>();
@@ -360,6 +334,8 @@ top:
 
 			//endMoves = Search::Limits.generate_all_legal_moves ? generateMoves<NON_CAPTURES_PRO_MINUS_ALL>(pos, cur) : generateMoves<NON_CAPTURES_PRO_MINUS>(pos, cur);
 			endMoves = generateMoves<NON_CAPTURES_PRO_MINUS>(pos, cur);
+			PERF_COUNT(MP_QUIET_GEN);
+			PERF_COUNT_N(MP_QUIET_MOVES, endMoves - cur);
 
 			// 駒を捕獲しない指し手に対してオーダリングのためのスコアをつける
 			score<QUIETS>();
@@ -367,24 +343,14 @@ top:
 			// 指し手を部分的にソートする。depthに線形に依存する閾値で。
 			// (depthが低いときに真面目に全要素ソートするのは無駄だから)
 
-#if defined(USE_SUPER_SORT) && defined(USE_AVX2)
-
-			// AVX2なので自動的にlittle endianと仮定できるのでint64_tとみなしてソートして良い。
-			// このとき、sortの高速化として、SuperSortが使える。
-			// cur == movesの先頭だし、MAX_MOVESの分だけbufferは確保されているので32の倍数になるように
-			// 後方のpaddingをしてAVX2を使ったsortをして良い。このとき、他にbuffer不要。
-			
-			partial_super_sort(cur, endMoves , -3000 * depth);
-
-			// ↑を有効にするとinsertion_sortと結果が異なるのでbenchコマンドの探索node数が変わって困ることがあるので注意。
-
-#else
+			// MoveSort::sort()は既定ではpartial_insertion_sort()をinline展開したもの。
+			// "SuperSort"を使うときは、curが32byteでalignされていて、MAX_MOVESの分だけ後方にbufferがあることが前提。
+			// 挿入ソート以外に切り替えると並び順が変わるので、benchコマンドの探索node数が変わることに注意。
 
 			// TODO : このへん係数調整したほうが良いのでは…。
 			// →　sort時間がもったいないのでdepthが浅いときはscoreの悪い指し手を無視するようにしているだけで
-			//   sortできるなら全部したほうが良い。上のSuperSortを使う実装の場合、全部sortしている。
-			partial_insertion_sort(cur, endMoves, -3000 * depth);
-#endif
+			//   sortできるなら全部したほうが良い。SuperSortを使う実装の場合、全部sortしている。
+			MoveSort::sort(cur, endMoves, -3000 * depth);
 		}
 
 		++stage;
@@ -418,6 +384,8 @@ top:
 		cur = moves;
 
 		endMoves = Search::Limits.generate_all_legal_moves ? generateMoves<EVASIONS_ALL>(pos, cur) : generateMoves<EVASIONS>(pos, cur);
+		PERF_COUNT(MP_EVASION_GEN);
+		PERF_COUNT_N(MP_EVASION_MOVES, endMoves - cur);
 
 		// 王手を回避する指し手に対してオーダリングのためのスコアをつける
 		score<EVASIONS>();
@@ -458,6 +426,8 @@ top:
 		cur = moves;
 
 		endMoves = Search::Limits.generate_all_legal_moves ? generateMoves<QUIET_CHECKS_ALL>(pos, cur) : generateMoves<QUIET_CHECKS>(pos, cur);
+		PERF_COUNT(MP_QCHECK_GEN);
+		PERF_COUNT_N(MP_QCHECK_MOVES, endMoves - cur);
 
 		++stage;
 		[[fallthrough]];
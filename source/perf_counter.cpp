@@ -0,0 +1,156 @@
+﻿#include "perf_counter.h"
+
+#include <iomanip>
+#include <mutex>
+#include <vector>
+#include "misc.h"
+
+namespace PerfCounter
+{
+	namespace {
+
+		// 表示の仕方
+		enum Kind { Count, Time };
+
+		struct CounterInfo
+		{
+			// 表示名
+			const char* name;
+			Kind kind;
+
+			// Countなら、この値に対する割合(%)を併記するカウンター。Timeなら、1回あたりの時間を求めるための回数のカウンター。
+			// 該当するものがなければID_NB。
+			Id base;
+		};
+
+		// Idの順に並べること。
+		const CounterInfo counter_info[ID_NB] = {
+			{ "tt probe"                  , Count, ID_NB          },
+			{ "tt hit"                    , Count, TT_PROBE       },
+			{ "tt store"                  , Count, ID_NB          },
+			{ "tt replace"                , Count, TT_PROBE       },
+			{ "tt collision"              , Count, TT_PROBE       },
+			{ "tt torn read"              , Count, TT_PROBE       },
+			{ "nnue update"               , Count, ID_NB          },
+			{ "nnue multi-ply update"     , Count, ID_NB          },
+			{ "nnue refresh"              , Count, ID_NB          },
+			{ "nnue refresh time"         , Time , NNUE_REFRESH   },
+			{ "movepicker tt move"        , Count, ID_NB          },
+			{ "movepicker capture gen"    , Count, ID_NB          },
+			{ "movepicker capture moves"  , Count, ID_NB          },
+			{ "movepicker quiet gen"      , Count, ID_NB          },
+			{ "movepicker quiet moves"    , Count, ID_NB          },
+			{ "movepicker evasion gen"    , Count, ID_NB          },
+			{ "movepicker evasion moves"  , Count, ID_NB          },
+			{ "movepicker qcheck gen"     , Count, ID_NB          },
+			{ "movepicker qcheck moves"   , Count, ID_NB          },
+			{ "mate_1ply"                 , Count, ID_NB          },
+			{ "mate_1ply found"           , Count, MATE_1PLY      },
+			{ "search nodes"              , Count, ID_NB          },
+			{ "qsearch nodes"             , Count, ID_NB          },
+			{ "book probe"                , Count, ID_NB          },
+			{ "book hit"                  , Count, BOOK_PROBE     },
+			{ "book probe time"           , Time , BOOK_PROBE     },
+		};
+
+#if defined(USE_PERF_COUNTERS)
+		// スレッドごとの集計場所。終了したスレッドのSlotはfree_slotsに返却されて再利用される。
+		// 同時に生きているスレッドがこれを超えるときは集計場所を共有する。(多少数え漏れても構わない)
+		constexpr size_t SLOT_NB = 1024;
+		Slot slots[SLOT_NB];
+		std::atomic<size_t> slot_count;
+		std::mutex slot_mutex;
+		std::vector<Slot*> free_slots;
+
+		// values[]の値を表示する。
+		void print_values(const char* title, const u64* values)
+		{
+			sync_cout << "info string stats : " << title << sync_endl;
+			for (int i = 0; i < ID_NB; ++i)
+			{
+				const auto& info = counter_info[i];
+				std::ostringstream ss;
+				ss << "info string   " << std::left << std::setw(26) << info.name << " : " << std::right << std::setw(14);
+
+				if (info.kind == Time)
+				{
+					ss << values[i] / 1000 << " us";
+					if (info.base != ID_NB && values[info.base])
+						ss << " (" << values[i] / values[info.base] << " ns/call)";
+				}
+				else
+				{
+					ss << values[i];
+					if (info.base != ID_NB && values[info.base])
+						ss << " (" << std::fixed << std::setprecision(2) << 100.0 * values[i] / values[info.base] << "%)";
+				}
+				sync_cout << ss.str() << sync_endl;
+			}
+		}
+#endif
+	}
+
+#if defined(USE_PERF_COUNTERS)
+	Slot* acquire_slot(bool& shared)
+	{
+		{
+			std::lock_guard<std::mutex> lk(slot_mutex);
+			if (!free_slots.empty())
+			{
+				Slot* s = free_slots.back();
+				free_slots.pop_back();
+				shared = false;
+				return s;
+			}
+		}
+
+		const size_t n = slot_count.fetch_add(1);
+		shared = n >= SLOT_NB;
+		return &slots[n % SLOT_NB];
+	}
+
+	void release_slot(Slot* s)
+	{
+		std::lock_guard<std::mutex> lk(slot_mutex);
+		free_slots.push_back(s);
+	}
+#endif
+
+	void print(std::istringstream& is)
+	{
+		std::string token;
+		is >> token;
+
+#if defined(USE_PERF_COUNTERS)
+		const size_t used = std::min(slot_count.load(), SLOT_NB);
+
+		if (token == "clear")
+		{
+			for (size_t s = 0; s < used; ++s)
+				for (auto& v : slots[s].values)
+					v.store(0, std::memory_order_relaxed);
+			sync_cout << "info string stats : cleared." << sync_endl;
+			return;
+		}
+
+		u64 total[ID_NB] = {};
+		for (size_t s = 0; s < used; ++s)
+			for (int i = 0; i < ID_NB; ++i)
+				total[i] += slots[s].values[i].load(std::memory_order_relaxed);
+
+		if (token == "threads")
+			for (size_t s = 0; s < used; ++s)
+			{
+				u64 values[ID_NB];
+				for (int i = 0; i < ID_NB; ++i)
+					values[i] = slots[s].values[i].load(std::memory_order_relaxed);
+				print_values(("thread slot " + std::to_string(s)).c_str(), values);
+			}
+
+		print_values(("total of " + std::to_string(used) + " threads").c_str(), total);
+#else
+		(void)counter_info;
+		sync_cout << "info string stats : performance counters are disabled. define USE_PERF_COUNTERS to enable them." << sync_endl;
+#endif
+	}
+}
@@ -0,0 +1,133 @@
+﻿#ifndef PERF_COUNTER_H_INCLUDED
+#define PERF_COUNTER_H_INCLUDED
+
+#include "types.h"
+#include <sstream>
+
+#if defined(USE_PERF_COUNTERS)
+#include <atomic>
+#include <chrono>
+#endif
+
+// --------------------
+//  探索のホットパスの計測用カウンター
+// --------------------
+
+// 置換表・NNUE・MovePicker・1手詰め・静止探索・定跡などが、何回呼び出されたか/どれだけ時間を使ったかを
+// スレッドごとに集計して、"stats"コマンドで全スレッド合算の値を表示する。
+// 対局中にどこでノードが使われているかを、profilerをattachせずに調べるためのもの。
+//
+// USE_PERF_COUNTERSが定義されていないときは、PERF_COUNT()などのマクロは空になり、コストは一切かからない。
+// 定義されているときでも、スレッドごとのカウンターへの(atomicではない)加算なので、オーバーヘッドは小さい。
+//
+// 使い方)
+//   PERF_COUNT(TT_PROBE);                   // TT_PROBEのカウンターを1加算
+//   PERF_COUNT_N(MP_QUIET_MOVES, n);        // nを加算
+//   PERF_COUNT_IF(found, TT_HIT);           // foundのときだけ1加算
+//   PERF_TIMER(NNUE_REFRESH_TIME);          // スコープを抜けるまでの時間[ns]を加算
+
+namespace PerfCounter
+{
+	// カウンターの種類。名前などはperf_counter.cppのCounterInfoを参照のこと。
+	enum Id : int
+	{
+		// 置換表
+		// 置換 : 空きentryがなく、他の局面のentryを潰すことになった回数
+		// 衝突・torn read : USE_TT_LOCKLESSのとき、16bitのkeyであれば偽のhitとなっていたentryの数と、
+		//                   他のスレッドの書き込みと混ざっていることを検出したentryの数
+		TT_PROBE, TT_HIT, TT_STORE, TT_REPLACE, TT_COLLISION, TT_TORN_READ,
+
+		// NNUE : 差分計算 , 2手以上前からの差分計算 , 全計算(refresh)とその時間
+		NNUE_UPDATE, NNUE_MULTI_PLY_UPDATE, NNUE_REFRESH, NNUE_REFRESH_TIME,
+
+		// MovePicker : 置換表の指し手を返した回数と、各stageでの指し手生成の回数・生成した指し手の数
+		MP_TT_MOVE,
+		MP_CAPTURE_GEN, MP_CAPTURE_MOVES,
+		MP_QUIET_GEN  , MP_QUIET_MOVES,
+		MP_EVASION_GEN, MP_EVASION_MOVES,
+		MP_QCHECK_GEN , MP_QCHECK_MOVES,
+
+		// 1手詰め判定の呼び出し回数と、詰みを見つけた回数
+		MATE_1PLY, MATE_1PLY_FOUND,
+
+		// 通常探索と静止探索のノード数
+		SEARCH_NODES, QSEARCH_NODES,
+
+		// 定跡のprobe回数、hitした回数、probeにかかった時間
+		BOOK_PROBE, BOOK_HIT, BOOK_PROBE_TIME,
+
+		ID_NB
+	};
+
+#if defined(USE_PERF_COUNTERS)
+
+	// スレッドごとのカウンター。他のスレッドとcache lineを共有しないように64byteにalignする。
+	struct alignas(64) Slot
+	{
+		std::atomic<u64> values[ID_NB];
+	};
+
+	// 空いているSlotを確保する。(スレッドごとに最初の1回だけ呼び出される)
+	// 空きがないときは、他のスレッドと共有するSlotを返してsharedをtrueにする。
+	Slot* acquire_slot(bool& shared);
+
+	// スレッドの終了時にSlotを返却する。集計した値はそのまま残り、次に確保したスレッドがそこに加算していく。
+	void release_slot(Slot* s);
+
+	// スレッドが確保しているSlot。スレッドの終了時にdestructorで返却する。
+	struct SlotOwner
+	{
+		SlotOwner() : s(acquire_slot(shared)) {}
+		~SlotOwner() { if (!shared) release_slot(s); }
+
+		bool shared = false;
+		Slot* s;
+	};
+
+	// 呼び出したスレッドのSlot
+	inline Slot& slot()
+	{
+		thread_local SlotOwner owner;
+		return *owner.s;
+	}
+
+	// 同じスレッドからしか加算しないのでatomicな加算は必要ない。(読み出しは"stats"コマンドのスレッドから)
+	inline void add(Id id, u64 n)
+	{
+		auto& v = slot().values[id];
+		v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	// コンストラクタからデストラクタまでの時間[ns]をidのカウンターに加算する。
+	struct ScopedTimer
+	{
+		ScopedTimer(Id id_) : id(id_), start(std::chrono::steady_clock::now()) {}
+		~ScopedTimer() { add(id, (u64)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()); }
+
+	private:
+		Id id;
+		std::chrono::steady_clock::time_point start;
+	};
+
+#endif
+
+	// "stats"コマンドの本体。
+	//   stats         : 全スレッド合算の値を表示する
+	//   stats threads : スレッドごとの値も表示する
+	//   stats clear   : カウンターをすべて0にする
+	void print(std::istringstream& is);
+}
+
+#if defined(USE_PERF_COUNTERS)
+#define PERF_COUNT(ID)          PerfCounter::add(PerfCounter::ID, 1)
+#define PERF_COUNT_N(ID, N)     PerfCounter::add(PerfCounter::ID, (u64)(N))
+#define PERF_COUNT_IF(COND, ID) do { if (COND) PerfCounter::add(PerfCounter::ID, 1); } while (false)
+#define PERF_TIMER(ID)          PerfCounter::ScopedTimer perf_timer_##ID(PerfCounter::ID)
+#else
+#define PERF_COUNT(ID)
+#define PERF_COUNT_N(ID, N)
+#define PERF_COUNT_IF(COND, ID)
+#define PERF_TIMER(ID)
+#endif
+
+#endif // #ifndef PERF_COUNTER_H_INCLUDED
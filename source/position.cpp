@@ -663,7 +663,7 @@ bool Position::gives_check(Move m) const
 bool Position::is_mated() const
 {
 	// 不成で詰めろを回避できるパターンはないのでLEGAL_ALLである必要はない。
-	return MoveList<LEGAL>(*this).size() == 0;
+	return countMoves<LEGAL>(*this) == 0;
 }
 
 // ----------------------------------
@@ -1152,7 +1152,7 @@ void Position::do_move_impl(Move m, StateInfo& new_st, bool givesCheck)
 		// なるべく早い段階でのTTに対するprefetch
 		// 駒打ちのときはこの時点でTT entryのアドレスが確定できる
 		const Key key = k + h;
-		prefetch(TT.first_entry(key));
+		prefetch(TT.first_entry(key, thisThread ? thisThread->numa_node : 0));
 #if defined(USE_EVAL_HASH)
 		Eval::prefetch_evalhash(key);
 #endif
@@ -1317,7 +1317,7 @@ void Position::do_move_impl(Move m, StateInfo& new_st, bool givesCheck)
 
 		// 駒打ちでないときはprefetchはこの時点まで延期される。
 		const Key key = k + h;
-		prefetch(TT.first_entry(key));
+		prefetch(TT.first_entry(key, thisThread ? thisThread->numa_node : 0));
 #if defined(USE_EVAL_HASH)
 		Eval::prefetch_evalhash(key);
 #endif
@@ -1647,7 +1647,7 @@ void Position::do_null_move(StateInfo& newSt) {
 	// CPUによっては有効なので一応やっておく。
 
 	const Key key = st->key();
-	prefetch(TT.first_entry(key));
+	prefetch(TT.first_entry(key, thisThread ? thisThread->numa_node : 0));
 
 	// これは、さっきアクセスしたところのはずなので意味がない。
 	//  Eval::prefetch_evalhash(key);
@@ -2299,7 +2299,7 @@ namespace {
 		for (const auto& m : ml)
 		{
 			pos.do_move(m, st);
-			cnt = leaf ? MoveList<LEGAL_ALL>(pos).size() : perft(pos, depth - 1);
+			cnt = leaf ? countMoves<LEGAL_ALL>(pos) : perft(pos, depth - 1);
 			nodes += cnt;
 			pos.undo_move(m);
 		}
@@ -106,6 +106,7 @@ namespace Search {
 
 			silent = bench = consideration_mode = outout_fail_lh_pv = false;
 			pv_interval = 0;
+			smp_diversification = 0;
 			generate_all_legal_moves = true;
 		}
 
@@ -191,6 +192,12 @@ namespace Search {
 		// PVの出力間隔(探索のときにMainThread::search()内で初期化する)
 		TimePoint pv_interval;
 
+		// Lazy SMPでのhelper threadの探索深さの分散方法(探索のときにMainThread::search()内で初期化する)
+		// エンジンオプションのSMP_Diversificationの値。
+		// 0 : 分散させない。すべてのスレッドが反復深化の深さを1ずつ増やしていく。
+		// 1 : Stockfish9のskip blockに従って、helper threadごとに一部の深さを飛ばす。
+		int smp_diversification;
+
 		// 合法手を生成する時に全合法手を生成するのか(歩の不成など)
 		// エンジンオプションのGenerateAllLegalMovesの値がこのフラグに反映される。
 		// 
@@ -1,14 +1,21 @@
 ﻿#include "../types.h"
 
 #include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include "../tt.h"
 #include "../search.h"
 #include "../thread.h"
 #include "../usi.h"
+#include "../extra/move_sort.h"
 
 #if defined(YANEURAOU_ENGINE_DEEP)
 // dlshogiではnodeのカウントの仕方が異なるので、nodes_searched()を別途用意する。
 #include "../engine/dlshogi-engine/dlshogi_min.h"
+#include "../eval/deep/nn.h"
 #endif
 
 using namespace std;
@@ -38,6 +45,810 @@ const vector<string> BenchSfen =
 	"sfen l6nl/5+P1gk/2np1S3/p1p4Pp/3P2Sp1/1PPb2P1P/P5GS1/R8/LN4bKL w RGgsn5p 1",
 };
 
+#if !defined(YANEURAOU_ENGINE_DEEP)
+// "bench smp"のとき。
+// スレッド数を1,2,4,...,threadsと増やしながら、各局面を固定深さでruns回ずつ探索して、
+// その深さに到達するまでの時間(time-to-depth)と、best moveの安定性を出力する。
+//   same as 1T : 1スレッドのときと同じbest moveになった割合
+//   stable     : 同じスレッド数でのruns回の探索で、すべて同じbest moveになった局面の割合
+// Lazy SMPは非決定的なので、runsを2以上にしないとstableは意味をなさない。
+static void bench_smp(const vector<string>& fens, Search::LimitsType limits, size_t max_threads, int runs)
+{
+	// 各局面の1スレッドでのbest move
+	vector<Move> best_moves_1t(fens.size(), MOVE_NONE);
+	TimePoint time_1t = 0;
+
+	// 結果の表。最後にまとめて出力する。
+	std::ostringstream table;
+	table << "threads , time-to-depth(ms) , speedup , nodes , nps , same as 1T(%) , stable(%)" << endl;
+
+	// bestmoveの出力を抑制する。
+	limits.silent = true;
+
+	for (size_t threads = 1; threads <= max_threads; threads = threads < max_threads ? std::min(threads * 2, max_threads) : threads + 1)
+	{
+		Options["Threads"] = std::to_string(threads);
+
+		// スレッドの生成等
+		is_ready();
+
+		TimePoint total_time = 0;
+		int64_t total_nodes = 0;
+		int same_as_1t = 0, stable = 0;
+
+		Position pos;
+		for (size_t i = 0; i < fens.size(); ++i)
+		{
+			Move first_move = MOVE_NONE;
+			bool all_same = true;
+
+			for (int r = 0; r < runs; ++r)
+			{
+				StateListPtr states(new StateList(1));
+				istringstream is(fens[i]);
+				position_cmd(pos, is, states);
+
+				// 毎回、置換表とhistoryをクリアしてから探索する。
+				Search::clear();
+				Time.reset();
+
+				Timer time;
+				time.reset();
+
+				Threads.start_thinking(pos, states, limits);
+				Threads.main()->wait_for_search_finished();
+
+				total_time  += time.elapsed();
+				total_nodes += Threads.nodes_searched();
+
+				// 固定深さのときはmain threadの指し手がbest moveとなる。
+				Move best = Threads.main()->rootMoves[0].pv[0];
+				if (r == 0)
+					first_move = best;
+				else if (best != first_move)
+					all_same = false;
+
+				if (threads == 1 && r == 0)
+					best_moves_1t[i] = best;
+
+				same_as_1t += best == best_moves_1t[i];
+			}
+			stable += all_same;
+		}
+
+		if (threads == 1)
+			time_1t = total_time;
+
+		table << threads
+			<< " , " << total_time / runs
+			<< " , " << std::fixed << std::setprecision(2) << double(time_1t) / std::max(total_time, TimePoint(1))
+			<< " , " << total_nodes / runs
+			<< " , " << 1000 * total_nodes / std::max(total_time, TimePoint(1))
+			<< " , " << std::setprecision(1) << 100.0 * same_as_1t / (fens.size() * runs)
+			<< " , " << 100.0 * stable / fens.size()
+			<< endl;
+	}
+
+	sync_cout << "\n==========================="
+		<< "\nSMP scaling : depth " << limits.depth << " , " << fens.size() << " positions x " << runs << " runs , "
+		<< "SMP_Diversification = " << std::string(Options["SMP_Diversification"])
+		<< "\n" << table.str() << sync_endl;
+}
+#endif
+
+// ----------------------------------
+//  "bench sweep" , "bench compare"
+// ----------------------------------
+
+// "bench sweep"の1行分の結果。(スレッド数 , hash , 局面)の組ごとにruns回の探索を集計したもの。
+// "bench compare"で結果ファイルを読み戻すときにも用いる。
+struct BenchRecord
+{
+	size_t threads = 0, hash = 0, position = 0;
+	int runs = 0;
+
+	// time-to-depth(固定深さの時)または探索時間[ms]の平均と標準偏差
+	double time_ms = 0, time_ms_sd = 0;
+
+	// 探索ノード数の平均 , npsの平均と標準偏差
+	double nodes = 0, nps = 0, nps_sd = 0;
+
+	// main threadの完了した反復深化の深さの平均
+	double depth = 0;
+
+	// 探索終了時の置換表の使用率(1000分率)の平均
+	double hashfull = 0;
+
+	// EvalHashのhit率(%)。USE_EVAL_HASHでないときは0。
+	double evalhash_hit_rate = 0;
+};
+
+// CSVの列名。BenchRecordのメンバの順。
+static const vector<string> BenchRecordColumns = {
+	"threads", "hash", "position", "runs", "time_ms", "time_ms_sd", "nodes", "nps", "nps_sd", "depth", "hashfull", "evalhash_hit_rate"
+};
+
+// threads , hash , position , runsの4列は整数。
+static const size_t BenchRecordIntegerColumns = 4;
+
+// BenchRecordのi番目の列の値を返す/設定する。
+static double bench_record_get(const BenchRecord& r, size_t i)
+{
+	const double v[] = { double(r.threads), double(r.hash), double(r.position), double(r.runs),
+		r.time_ms, r.time_ms_sd, r.nodes, r.nps, r.nps_sd, r.depth, r.hashfull, r.evalhash_hit_rate };
+	return v[i];
+}
+
+// BenchRecordのi番目の列の値を文字列化する。
+static string bench_record_format(const BenchRecord& r, size_t i)
+{
+	std::ostringstream ss;
+	if (i < BenchRecordIntegerColumns)
+		ss << uint64_t(bench_record_get(r, i));
+	else
+		ss << std::fixed << std::setprecision(2) << bench_record_get(r, i);
+	return ss.str();
+}
+
+static void bench_record_set(BenchRecord& r, size_t i, double v)
+{
+	switch (i)
+	{
+	case 0 : r.threads           = size_t(v); break;
+	case 1 : r.hash              = size_t(v); break;
+	case 2 : r.position          = size_t(v); break;
+	case 3 : r.runs              = int(v)   ; break;
+	case 4 : r.time_ms           = v; break;
+	case 5 : r.time_ms_sd        = v; break;
+	case 6 : r.nodes             = v; break;
+	case 7 : r.nps               = v; break;
+	case 8 : r.nps_sd            = v; break;
+	case 9 : r.depth             = v; break;
+	case 10: r.hashfull          = v; break;
+	case 11: r.evalhash_hit_rate = v; break;
+	}
+}
+
+// 標本平均と(不偏)標準偏差
+static void mean_sd(const vector<double>& v, double& mean, double& sd)
+{
+	mean = sd = 0;
+	if (v.empty())
+		return;
+	for (auto x : v)
+		mean += x;
+	mean /= v.size();
+	if (v.size() < 2)
+		return;
+	for (auto x : v)
+		sd += (x - mean) * (x - mean);
+	sd = std::sqrt(sd / (v.size() - 1));
+}
+
+// 結果をCSVかJSONで書き出す。filenameが空なら標準出力に出力する。
+static void write_bench_records(const vector<BenchRecord>& records, const string& filename, bool json,
+	const string& limit_type, const string& limit, int runs)
+{
+	std::ostringstream ss;
+	if (json)
+	{
+		// "bench compare"で読み戻せるように、resultsの要素は1行に1つ書く。
+		ss << "{" << endl
+		   << "  \"engine\" : \"" << ENGINE_NAME << " " << ENGINE_VERSION << "\"," << endl
+		   << "  \"limit_type\" : \"" << limit_type << "\"," << endl
+		   << "  \"limit\" : " << limit << "," << endl
+		   << "  \"runs\" : " << runs << "," << endl
+		   << "  \"results\" : [" << endl;
+		for (size_t i = 0; i < records.size(); ++i)
+		{
+			ss << "    {";
+			for (size_t c = 0; c < BenchRecordColumns.size(); ++c)
+				ss << (c ? ", " : "") << "\"" << BenchRecordColumns[c] << "\":" << bench_record_format(records[i], c);
+			ss << "}" << (i + 1 < records.size() ? "," : "") << endl;
+		}
+		ss << "  ]" << endl << "}" << endl;
+	}
+	else
+	{
+		for (size_t c = 0; c < BenchRecordColumns.size(); ++c)
+			ss << (c ? "," : "") << BenchRecordColumns[c];
+		ss << endl;
+		for (auto& r : records)
+		{
+			for (size_t c = 0; c < BenchRecordColumns.size(); ++c)
+				ss << (c ? "," : "") << bench_record_format(r, c);
+			ss << endl;
+		}
+	}
+
+	if (filename.empty())
+	{
+		sync_cout << ss.str() << sync_endl;
+		return;
+	}
+
+	SystemIO::TextWriter writer;
+	if (writer.Open(filename).is_ok() && writer.Write(ss.str()).is_ok() && writer.Close().is_ok())
+		sync_cout << "info string bench results are written to " << filename << sync_endl;
+	else
+		sync_cout << "info string Error! : can't write " << filename << sync_endl;
+}
+
+// write_bench_records()で書き出したファイルを読み込む。CSVとJSONのどちらでも良い。
+static Tools::Result read_bench_records(const string& filename, vector<BenchRecord>& records)
+{
+	vector<string> lines;
+	auto result = SystemIO::ReadAllLines(filename, lines, true);
+	if (result.is_not_ok())
+		return result;
+
+	// CSVのときの、各列のBenchRecordColumnsでのindex
+	vector<int> column_index;
+
+	for (auto& line : lines)
+	{
+		if (line.find("\"threads\"") != string::npos)
+		{
+			// JSON : {"threads":1, "hash":64, ...}
+			BenchRecord r;
+			for (size_t c = 0; c < BenchRecordColumns.size(); ++c)
+			{
+				auto pos = line.find("\"" + BenchRecordColumns[c] + "\":");
+				if (pos != string::npos)
+					bench_record_set(r, c, atof(line.c_str() + pos + BenchRecordColumns[c].size() + 3));
+			}
+			records.push_back(r);
+		}
+		else if (StringExtension::StartsWith(line, "threads,"))
+		{
+			// CSVのheader
+			column_index.clear();
+			for (auto& name : StringExtension::Split(line, ","))
+			{
+				auto it = std::find(BenchRecordColumns.begin(), BenchRecordColumns.end(), name);
+				column_index.push_back(it == BenchRecordColumns.end() ? -1 : int(it - BenchRecordColumns.begin()));
+			}
+		}
+		else if (!column_index.empty())
+		{
+			BenchRecord r;
+			auto values = StringExtension::Split(line, ",");
+			for (size_t c = 0; c < values.size() && c < column_index.size(); ++c)
+				if (column_index[c] >= 0)
+					bench_record_set(r, column_index[c], atof(values[c].c_str()));
+			records.push_back(r);
+		}
+	}
+
+	return records.empty() ? Tools::Result(Tools::ResultCode::FileReadError) : Tools::Result::Ok();
+}
+
+// 正則化された不完全ベータ関数 I_x(a,b)の連分数展開部分。(Lentz法)
+static double incomplete_beta_cf(double a, double b, double x)
+{
+	const double tiny = 1e-300;
+	double c = 1, d = 1 - (a + b) * x / (a + 1);
+	d = 1 / (std::abs(d) < tiny ? tiny : d);
+	double h = d;
+	for (int m = 1; m <= 300; ++m)
+	{
+		for (int k = 0; k < 2; ++k)
+		{
+			const double num = k == 0
+				?  m * (b - m) * x / ((a + 2 * m - 1) * (a + 2 * m))
+				: -(a + m) * (a + b + m) * x / ((a + 2 * m) * (a + 2 * m + 1));
+			d = 1 + num * d; d = 1 / (std::abs(d) < tiny ? tiny : d);
+			c = 1 + num / c; c =      std::abs(c) < tiny ? tiny : c;
+			h *= d * c;
+		}
+		if (std::abs(d * c - 1) < 1e-12)
+			break;
+	}
+	return h;
+}
+
+static double incomplete_beta(double a, double b, double x)
+{
+	if (x <= 0) return 0;
+	if (x >= 1) return 1;
+	const double bt = std::exp(std::lgamma(a + b) - std::lgamma(a) - std::lgamma(b) + a * std::log(x) + b * std::log(1 - x));
+	return x < (a + 1) / (a + b + 2)
+		?     bt * incomplete_beta_cf(a, b, x) / a
+		: 1 - bt * incomplete_beta_cf(b, a, 1 - x) / b;
+}
+
+// 平均・標準偏差・標本数からWelchのt検定を行い、両側p値を返す。
+// 標本数が2未満で分散がわからないときは1.0(有意差なし)を返す。
+static double welch_t_test(double m1, double s1, int n1, double m2, double s2, int n2)
+{
+	if (n1 < 2 || n2 < 2)
+		return 1.0;
+
+	const double v1 = s1 * s1 / n1, v2 = s2 * s2 / n2;
+	if (v1 + v2 == 0)
+		return m1 == m2 ? 1.0 : 0.0;
+
+	const double t  = (m2 - m1) / std::sqrt(v1 + v2);
+	const double df = (v1 + v2) * (v1 + v2) / (v1 * v1 / (n1 - 1) + v2 * v2 / (n2 - 1));
+	return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+// "bench compare base.csv new.csv [alpha 0.05]"
+// 2つの"bench sweep"の結果ファイルを(スレッド数 , hash , 局面)ごとに突き合わせて、
+// npsが有意に下がったか、探索時間(time-to-depth)が有意に伸びたものをREGRESSIONとして報告する。
+static void bench_compare(const string& base_file, const string& target_file, double alpha)
+{
+	vector<BenchRecord> base, target;
+	for (auto& f : { std::make_pair(&base_file, &base), std::make_pair(&target_file, &target) })
+	{
+		auto result = read_bench_records(*f.first, *f.second);
+		if (result.is_not_ok())
+		{
+			sync_cout << "info string Error! : can't read bench results from " << *f.first << " , " << result.to_string() << sync_endl;
+			return;
+		}
+	}
+
+	std::ostringstream table;
+	table << std::fixed
+		<< "threads , hash , position , base nps , new nps , change(%) , p(nps) , base time(ms) , new time(ms) , p(time) , verdict" << endl;
+
+	int regressions = 0, improvements = 0, compared = 0;
+	for (auto& b : base)
+	{
+		auto it = std::find_if(target.begin(), target.end(), [&](const BenchRecord& t) {
+			return t.threads == b.threads && t.hash == b.hash && t.position == b.position; });
+		if (it == target.end())
+			continue;
+		auto& t = *it;
+		++compared;
+
+		const double p_nps  = welch_t_test(b.nps    , b.nps_sd    , b.runs, t.nps    , t.nps_sd    , t.runs);
+		const double p_time = welch_t_test(b.time_ms, b.time_ms_sd, b.runs, t.time_ms, t.time_ms_sd, t.runs);
+
+		const bool worse  = (p_nps < alpha && t.nps < b.nps) || (p_time < alpha && t.time_ms > b.time_ms);
+		const bool better = (p_nps < alpha && t.nps > b.nps) || (p_time < alpha && t.time_ms < b.time_ms);
+		regressions  += worse;
+		improvements += better && !worse;
+
+		table << b.threads << " , " << b.hash << " , " << b.position
+			<< " , " << std::setprecision(0) << b.nps << " , " << t.nps
+			<< " , " << std::setprecision(2) << (b.nps ? 100.0 * (t.nps - b.nps) / b.nps : 0.0)
+			<< " , " << std::setprecision(4) << p_nps
+			<< " , " << std::setprecision(0) << b.time_ms << " , " << t.time_ms
+			<< " , " << std::setprecision(4) << p_time
+			<< " , " << (worse ? "REGRESSION" : better ? "improved" : "-") << endl;
+	}
+
+	sync_cout << "\n==========================="
+		<< "\nbench compare : " << base_file << " -> " << target_file << " , alpha = " << alpha
+		<< "\n" << table.str()
+		<< "compared = " << compared << " , regressions = " << regressions << " , improvements = " << improvements
+		<< "\n===========================" << sync_endl;
+}
+
+#if !defined(YANEURAOU_ENGINE_DEEP)
+// "bench sweep"のとき。
+// スレッド数とhashサイズのすべての組み合わせについて、各局面をruns回ずつ探索して、
+// nps , time-to-depth , 置換表の使用率 , EvalHashのhit率と、そのruns回でのばらつきをCSV/JSONで出力する。
+// 例) bench sweep threads 1,2,4 hash 256,1024 limit 14 runs 5 output result.json
+static void bench_sweep(const vector<string>& fens, Search::LimitsType limits,
+	const vector<string>& threads_list, const vector<string>& hash_list, int runs,
+	const string& limit_type, const string& limit, const string& output, bool json)
+{
+	vector<BenchRecord> records;
+
+	// bestmoveの出力を抑制する。
+	limits.silent = true;
+
+	for (auto& hash : hash_list)
+		for (auto& threads : threads_list)
+		{
+			Options["USI_Hash"] = hash;
+			Options["Threads"]  = threads;
+
+			// 置換表の確保、スレッドの生成等
+			is_ready();
+
+			double total_nodes = 0, total_time = 0;
+
+			Position pos;
+			for (size_t i = 0; i < fens.size(); ++i)
+			{
+				vector<double> times, nodes, nps, depths, hashfulls, evalhash_rates;
+
+				for (int r = 0; r < runs; ++r)
+				{
+					StateListPtr states(new StateList(1));
+					istringstream is(fens[i]);
+					position_cmd(pos, is, states);
+
+					// 毎回、置換表とhistoryをクリアしてから探索する。(EvalHashの統計もここでクリアされる)
+					Search::clear();
+					Time.reset();
+
+					Timer time;
+					time.reset();
+
+					Threads.start_thinking(pos, states, limits);
+					Threads.main()->wait_for_search_finished();
+
+					const double elapsed = double(std::max(time.elapsed(), TimePoint(1)));
+					const double n = double(Threads.nodes_searched());
+
+					times    .push_back(elapsed);
+					nodes    .push_back(n);
+					nps      .push_back(1000 * n / elapsed);
+					depths   .push_back(Threads.main()->completedDepth);
+					hashfulls.push_back(TT.hashfull());
+
+					u64 probes = 0, hits = 0;
+#if defined(EVAL_NNUE) && defined(USE_EVAL_HASH)
+					for (Thread* th : Threads)
+					{
+						probes += th->evalhash_probes;
+						hits   += th->evalhash_hits;
+					}
+#endif
+					evalhash_rates.push_back(probes ? 100.0 * hits / probes : 0.0);
+
+					total_nodes += n;
+					total_time  += elapsed;
+				}
+
+				BenchRecord rec;
+				double dummy;
+				rec.threads  = (size_t)stoull(threads);
+				rec.hash     = (size_t)stoull(hash);
+				rec.position = i + 1;
+				rec.runs     = runs;
+				mean_sd(times         , rec.time_ms , rec.time_ms_sd);
+				mean_sd(nodes         , rec.nodes   , dummy);
+				mean_sd(nps           , rec.nps     , rec.nps_sd);
+				mean_sd(depths        , rec.depth   , dummy);
+				mean_sd(hashfulls     , rec.hashfull, dummy);
+				mean_sd(evalhash_rates, rec.evalhash_hit_rate, dummy);
+				records.push_back(rec);
+			}
+
+			sync_cout << "info string bench sweep : threads = " << threads << " , hash = " << hash
+				<< " , nps = " << uint64_t(1000 * total_nodes / std::max(total_time, 1.0))
+				<< " , time(ms) = " << uint64_t(total_time / runs) << sync_endl;
+		}
+
+	write_bench_records(records, output, json, limit_type, limit, runs);
+}
+
+#if defined(USE_MOVE_PICKER)
+// "bench movesort"のとき。
+// 各局面を固定深さで探索して、MovePickerが部分ソートに渡した指し手の並びとlimitを記録し、
+// それを"MoveSort"の各実装でruns回ずつソートする時間を計測する。結果が正しく並んでいるかも検証する。
+// そのあと、実装ごとに同じ局面を探索したときのnpsも出力する。
+// 局面集に実戦の棋譜から取り出した局面を与えれば(file指定)、実戦で現れる指し手の並びで比較できる。
+// 例) bench movesort limit 12 file games.sfen runs 20
+
+// 記録した1回分の部分ソートの入力
+struct MoveSortSample
+{
+	vector<ExtMove> moves;
+	int limit;
+};
+
+static vector<MoveSortSample> movesort_samples;
+static std::mutex movesort_samples_mutex;
+
+// 記録する部分ソートの入力の上限
+static const size_t MoveSortMaxSamples = 200000;
+
+// 記録中に実際に並び替えに用いる実装
+static MoveSort::PartialSortFunc movesort_captured;
+
+// MoveSort::partial_sortを差し替えて、入力を記録する。
+static void movesort_capture(ExtMove* begin, ExtMove* end, int limit)
+{
+	{
+		std::lock_guard<std::mutex> lk(movesort_samples_mutex);
+		if (movesort_samples.size() < MoveSortMaxSamples)
+			movesort_samples.push_back(MoveSortSample{ vector<ExtMove>(begin, end), limit });
+	}
+	movesort_captured(begin, end, limit);
+}
+
+// 部分ソートの結果が正しいか。
+// value >= limitの指し手が先頭に降順で並んでいて、かつ、指し手の集合が変わっていないこと。
+static bool movesort_verify(const MoveSortSample& s, const ExtMove* result)
+{
+	const size_t n = s.moves.size();
+	const size_t k = (size_t)std::count_if(s.moves.begin(), s.moves.end(), [&](const ExtMove& m) { return m.value >= s.limit; });
+
+	for (size_t i = 0; i < k; ++i)
+		if (result[i].value < s.limit || (i > 0 && result[i - 1].value < result[i].value))
+			return false;
+
+	auto key = [](const ExtMove& m) { return (u64(u32(m.value)) << 32) | u32(m.move); };
+	vector<u64> a, b;
+	for (size_t i = 0; i < n; ++i)
+	{
+		a.push_back(key(s.moves[i]));
+		b.push_back(key(result[i]));
+	}
+	std::sort(a.begin(), a.end());
+	std::sort(b.begin(), b.end());
+	return a == b;
+}
+
+static void bench_movesort(const vector<string>& fens, Search::LimitsType limits, int runs)
+{
+	// bestmoveの出力を抑制する。
+	limits.silent = true;
+
+	// スレッドの生成等
+	is_ready();
+
+	const auto old_sort = MoveSort::partial_sort;
+	const auto& names = MoveSort::algorithm_names();
+
+	// 探索して、部分ソートの入力を記録する。
+	movesort_samples.clear();
+	movesort_captured = old_sort;
+	MoveSort::partial_sort = movesort_capture;
+
+	Position pos;
+	for (size_t i = 0; i < fens.size(); ++i)
+	{
+		StateListPtr states(new StateList(1));
+		istringstream is(fens[i]);
+		position_cmd(pos, is, states);
+
+		Search::clear();
+		Time.reset();
+		Threads.start_thinking(pos, states, limits);
+		Threads.main()->wait_for_search_finished();
+	}
+	MoveSort::partial_sort = old_sort;
+
+	if (movesort_samples.empty())
+	{
+		sync_cout << "info string bench movesort : no samples." << sync_endl;
+		return;
+	}
+
+	u64 total_moves = 0, total_selected = 0;
+	for (auto& s : movesort_samples)
+	{
+		total_moves += s.moves.size();
+		total_selected += std::count_if(s.moves.begin(), s.moves.end(), [&](const ExtMove& m) { return m.value >= s.limit; });
+	}
+
+	// ソートする作業領域。SuperSortは32byteでalignされていて後方にpaddingがあることを前提とする。
+	alignas(64) ExtMove buf[MAX_MOVES + 64];
+
+	// 作業領域へのコピーも含めて計測して、コピーだけの時間を差し引く。
+	// funcがnullptrならコピーのみ。
+	u64 checksum = 0;
+	auto measure = [&](MoveSort::PartialSortFunc func) {
+		auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < runs; ++r)
+			for (auto& s : movesort_samples)
+			{
+				std::memcpy(buf, s.moves.data(), s.moves.size() * sizeof(ExtMove));
+				if (func)
+					func(buf, buf + s.moves.size(), s.limit);
+				checksum += u32(buf[0].move);
+			}
+		auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		return double(ns) / (double(runs) * movesort_samples.size());
+	};
+	const double copy_ns = measure(nullptr);
+
+	std::ostringstream table;
+	table << "algorithm , ns/list , speedup , errors , nodes , nps" << endl;
+
+	double base_ns = 0;
+	for (auto& name : names)
+	{
+		const auto func = MoveSort::get_algorithm(name);
+
+		// 検証
+		size_t errors = 0;
+		for (auto& s : movesort_samples)
+		{
+			std::memcpy(buf, s.moves.data(), s.moves.size() * sizeof(ExtMove));
+			func(buf, buf + s.moves.size(), s.limit);
+			errors += !movesort_verify(s, buf);
+		}
+
+		const double ns = std::max(measure(func) - copy_ns, 0.001);
+		if (name == names[0])
+			base_ns = ns;
+
+		// この実装で探索したときのnps
+		MoveSort::partial_sort = func;
+		TimePoint total_time = 0;
+		int64_t total_nodes = 0;
+		for (size_t i = 0; i < fens.size(); ++i)
+		{
+			StateListPtr states(new StateList(1));
+			istringstream is(fens[i]);
+			position_cmd(pos, is, states);
+
+			Search::clear();
+			Time.reset();
+
+			Timer time;
+			time.reset();
+
+			Threads.start_thinking(pos, states, limits);
+			Threads.main()->wait_for_search_finished();
+
+			total_time  += time.elapsed();
+			total_nodes += Threads.nodes_searched();
+		}
+		MoveSort::partial_sort = old_sort;
+
+		table << name
+			<< " , " << std::fixed << std::setprecision(1) << ns
+			<< " , " << std::setprecision(2) << base_ns / ns
+			<< " , " << errors
+			<< " , " << total_nodes
+			<< " , " << 1000 * total_nodes / std::max(total_time, TimePoint(1))
+			<< endl;
+	}
+
+	sync_cout << "\n==========================="
+		<< "\nMoveSort : depth " << limits.depth << " , " << fens.size() << " positions , SIMD = " << MoveSort::simd_isa()
+		<< "\nsamples : " << movesort_samples.size()
+		<< " lists , " << std::fixed << std::setprecision(1) << double(total_moves) / movesort_samples.size() << " moves/list"
+		<< " , " << double(total_selected) / movesort_samples.size() << " sorted/list , x " << runs << " runs"
+		<< "\ncopy only : " << copy_ns << " ns/list (subtracted)"
+		<< "\n" << table.str() << "(checksum " << (checksum & 0xff) << ")" << sync_endl;
+
+	movesort_samples.clear();
+	movesort_samples.shrink_to_fit();
+}
+#endif
+#endif
+
+#if defined(YANEURAOU_ENGINE_DEEP)
+// "bench nn"のとき。
+// DNN_Model1のモデルを読み込んで、batch sizeを変えながら推論(NN::forward())だけをruns回ずつ繰り返し、
+// 1秒あたりに推論できた局面数を出力する。ONNX Runtime版と自前のCPU推論(NATIVE_NN)など、backendごとの速度の比較用。
+// 局面は、sfenの局面を順番に繰り返してbatchを埋める。
+// 例) bench nn batch 1,8,32,128 runs 20
+static void bench_nn(const vector<string>& fens, const vector<string>& batch_list, int runs)
+{
+	using namespace Eval::dlshogi;
+
+	// ModelPathsの設定
+	is_ready();
+
+	vector<int> batches;
+	for (auto& s : batch_list)
+		batches.push_back(std::max(stoi(s), 1));
+	const int max_batch = *std::max_element(batches.begin(), batches.end());
+
+	if (ModelPaths.empty() || ModelPaths[0].empty())
+	{
+		sync_cout << "info string bench nn : DNN_Model1 is empty." << sync_endl;
+		return;
+	}
+	auto nn = NN::build_nn(ModelPaths[0], 0, max_batch);
+	if (!nn)
+		return;
+
+	PType* p1 = (PType*)nn->alloc(((size_t)max_batch * ((int)COLOR_NB * (int)MAX_FEATURES1_NUM * (int)SQ_NB) + 7) >> 3);
+	PType* p2 = (PType*)nn->alloc(((size_t)max_batch * ((int)MAX_FEATURES2_NUM) + 7) >> 3);
+	NN_Input1*        x1 = (NN_Input1*       )nn->alloc(sizeof(NN_Input1       ) * max_batch);
+	NN_Input2*        x2 = (NN_Input2*       )nn->alloc(sizeof(NN_Input2       ) * max_batch);
+	NN_Output_Policy* y1 = (NN_Output_Policy*)nn->alloc(sizeof(NN_Output_Policy) * max_batch);
+	NN_Output_Value*  y2 = (NN_Output_Value* )nn->alloc(sizeof(NN_Output_Value ) * max_batch);
+
+	Position pos;
+	for (int i = 0; i < max_batch; ++i)
+	{
+		StateListPtr states(new StateList(1));
+		istringstream iss(fens[i % fens.size()]);
+		position_cmd(pos, iss, states);
+		make_input_features(pos, i, p1, p2);
+	}
+
+	sync_cout << "bench nn : " << ModelPaths[0] << " , x " << runs << " runs" << endl
+		<< "     batch     ms/batch   positions/s   value[0]" << sync_endl;
+
+	for (int batch : batches)
+	{
+#if !defined(UNPACK_NVRTC)
+		extract_input_features(batch, p1, p2, x1, x2);
+#endif
+		// 1回目はメモリ確保などが入るかも知れないので計測しない。
+		nn->forward(batch, p1, p2, x1, x2, y1, y2);
+
+		const auto start = std::chrono::steady_clock::now();
+		for (int r = 0; r < runs; ++r)
+			nn->forward(batch, p1, p2, x1, x2, y1, y2);
+		const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		sync_cout << std::setw(10) << batch
+			<< std::fixed << std::setprecision(3) << std::setw(13) << sec * 1000 / runs
+			<< std::setprecision(0) << std::setw(14) << batch * runs / std::max(sec, 1e-9)
+			<< std::setprecision(4) << std::setw(11) << to_float(y2[0]) << sync_endl;
+	}
+
+	nn->free(p1);
+	nn->free(p2);
+	nn->free(x1);
+	nn->free(x2);
+	nn->free(y1);
+	nn->free(y2);
+}
+
+// "bench mcts"のとき。
+// ふかうら王の探索部(UCT探索)の速度を、探索スレッド数(UCT_Threads1)を変えながら計測する。
+// スレッド数ごとに全局面を探索して、以下を出力する。
+//   playouts/s : 1秒あたりのプレイアウト数(nodes visited)
+//   fill       : NNに渡したbatchの充填率(局面数 / DNN_Batch_Size1)
+//   discard    : 他のスレッドが評価中などの理由で破棄したプレイアウトの割合
+//   cache      : leaf nodeでNNCacheにあった割合(NN_CacheSizeが0なら0%)
+//   trans      : 合流した局面の探索結果を使って、NNを呼び出さずに終えたプレイアウトの割合(UCT_Transpositionがtrueの時)
+//   lock       : nodeのmutexの獲得待ち時間(全スレッドの合計)
+//   gpu wait   : 同じGPUを使う他のスレッドのforward()の終了待ち時間(全スレッドの合計)
+//   nn         : forward()の時間(全スレッドの合計)
+//   gc         : GCスレッドがノードの開放にかかった時間と、NodeArenaのコンパクションにかかった時間
+// MOCK_NN版(YANEURAOU_ENGINE_DEEP_MOCK)なら、GPUもモデルファイルもなしに探索部だけを計測できる。
+// 例) bench mcts threads 1,2,4,8 limit 20000
+static void bench_mcts(const vector<string>& fens, Search::LimitsType limits, const vector<string>& threads_list)
+{
+	// PVなどを出力すると表が見づらいので。
+	limits.silent = true;
+
+	sync_cout << "bench mcts : " << fens.size() << " positions , limit nodes " << limits.nodes << endl
+		<< "   threads   playouts/s    fill  discard   cache   trans    lock[ms]  gpu wait[ms]      nn[ms]      gc[ms]" << sync_endl;
+
+	for (auto& threads : threads_list)
+	{
+		Options["UCT_Threads1"] = threads;
+		is_ready();
+
+		// is_ready()でのダミーの推論の分などを除外する。
+		dlshogi::clear_search_stats();
+
+		u64 nodes_visited = 0;
+		Timer time;
+		time.reset();
+
+		Position pos;
+		for (auto& fen : fens)
+		{
+			StateListPtr states(new StateList(1));
+			istringstream is(fen);
+			position_cmd(pos, is, states);
+
+			Time.reset();
+			Threads.start_thinking(pos, states, limits);
+			Threads.main()->wait_for_search_finished();
+
+			nodes_visited += dlshogi::nodes_visited();
+		}
+
+		const auto elapsed = time.elapsed() + 1; // 0除算の回避のため
+		const auto s = dlshogi::get_search_stats();
+		const auto to_ms = [](u64 ns) { return double(ns) / 1000000; };
+
+		sync_cout << std::setw(10) << threads
+			<< std::setw(13) << 1000 * nodes_visited / elapsed
+			<< std::fixed << std::setprecision(1)
+			<< std::setw(7) << 100.0 * s.batch_positions / std::max(s.batch_capacity, (u64)1) << "%"
+			<< std::setw(8) << 100.0 * s.discarded / std::max(s.playouts + s.discarded, (u64)1) << "%"
+			<< std::setw(7) << 100.0 * s.cache_hits / std::max(s.cache_probes, (u64)1) << "%"
+			<< std::setw(7) << 100.0 * s.transpositions / std::max(s.playouts, (u64)1) << "%"
+			<< std::setw(12) << to_ms(s.lock_wait_ns)
+			<< std::setw(14) << to_ms(s.gpu_wait_ns)
+			<< std::setw(12) << to_ms(s.forward_ns)
+			<< std::setw(12) << to_ms(s.gc_ns) << sync_endl;
+	}
+}
+#endif
+
 void bench_cmd(Position& current, istringstream& is)
 {
 	// Optionsを書き換えるのであとで復元する。
@@ -54,6 +865,34 @@ void bench_cmd(Position& current, istringstream& is)
 
 	string* positional_args[] = { &ttSize, &threads, &limit, &fenFile, &limitType };
 
+	// "smp"が指定されていれば、スレッド数を増やしながらtime-to-depthとbest moveの安定性を調べる。
+	// 例) bench smp hash 1024 threads 8 limit 14 runs 3
+	bool smp = false;
+	int runs = 2;
+
+	// "sweep"が指定されていれば、threadsとhashにカンマ区切りで複数の値を指定して、そのすべての組み合わせで計測する。
+	// 結果はoutputで指定したファイル(拡張子が.jsonならJSON、さもなくばCSV)に書き出す。
+	// 例) bench sweep threads 1,2,4 hash 256,1024 limit 14 runs 5 output result.csv
+	// "compare"が指定されていれば、2つのsweepの結果ファイルを比較して、有意に遅くなったものを報告する。
+	// 例) bench compare base.csv new.csv alpha 0.05
+	bool sweep = false, compare = false;
+
+	// "movesort"が指定されていれば、MovePickerの部分ソートの実装ごとの速度を比較する。
+	// 例) bench movesort limit 12 file games.sfen runs 20
+	bool movesort = false;
+
+	// "nn"が指定されていれば、ふかうら王のNNの推論速度をbatch sizeごとに計測する。
+	// 例) bench nn batch 1,8,32,128 runs 20
+	bool nn = false;
+
+	// "mcts"が指定されていれば、ふかうら王の探索部の速度を、探索スレッド数を変えながら計測する。
+	// ノード数固定で探索する。limitを指定するときは、mctsより後ろに書くこと。
+	// 例) bench mcts threads 1,2,4,8 limit 20000
+	bool mcts = false;
+	std::string batch = "1,8,32,128";
+	std::string output, format, compare_base, compare_target;
+	double alpha = 0.05;
+
 	// "benchmark hash 1024 threads 4 limit 3000 type nodes file sfen.txt"のようにも書きたい。
 
 	// 解析中の引数の位置
@@ -70,6 +909,28 @@ void bench_cmd(Position& current, istringstream& is)
 			is >> fenFile;
 		else if (token == "type")
 			is >> limitType;
+		else if (token == "smp")
+			smp = true, limitType = "depth";
+		else if (token == "runs")
+			is >> runs;
+		else if (token == "sweep")
+			sweep = true, limitType = "depth";
+		else if (token == "movesort")
+			movesort = true, limitType = "depth";
+		else if (token == "nn")
+			nn = true;
+		else if (token == "mcts")
+			mcts = true, limitType = "nodes", limit = "20000";
+		else if (token == "batch")
+			is >> batch;
+		else if (token == "output")
+			is >> output;
+		else if (token == "format")
+			is >> format;
+		else if (token == "compare")
+			compare = true, is >> compare_base >> compare_target;
+		else if (token == "alpha")
+			is >> alpha;
 		else
 		{
 			// 解釈できなかったものは、位置固定の引数と解釈する
@@ -78,6 +939,24 @@ void bench_cmd(Position& current, istringstream& is)
 		}
 	}
 
+	if (compare)
+	{
+		bench_compare(compare_base, compare_target, alpha);
+		return;
+	}
+
+	// "bench smp"はLazy SMPのエンジン(SMP_Diversificationがある)でしか計測できない。
+	// 黙って通常のbenchを行うと、計測したつもりで別のものを見ることになるのでエラーにする。
+#if !defined(YANEURAOU_ENGINE_DEEP)
+	if (smp && !Options.count("SMP_Diversification"))
+#else
+	if (smp)
+#endif
+	{
+		sync_cout << "info string Error! : bench smp is not supported by this engine (no SMP_Diversification option)." << sync_endl;
+		return;
+	}
+
 	if (ttSize == "d")
 	{
 		// デバッグ用の設定(毎回入力するのが面倒なので)
@@ -88,6 +967,12 @@ void bench_cmd(Position& current, istringstream& is)
 		limit = "6";
 	}
 
+	// sweepのときはカンマ区切りのリスト。先頭の値を代表として以下の設定に用いる。
+	const auto threads_list = StringExtension::Split(threads, ",");
+	const auto hash_list    = StringExtension::Split(ttSize , ",");
+	threads = threads_list[0];
+	ttSize  = hash_list[0];
+
 	// "Threads"があるとは仮定できない
 	if (Options.count("Threads"))
 		Options["Threads"] = threads;
@@ -134,6 +1019,64 @@ void bench_cmd(Position& current, istringstream& is)
 	else
 		SystemIO::ReadAllLines(fenFile, fens);
 
+#if defined(YANEURAOU_ENGINE_DEEP)
+	if (nn)
+	{
+		bench_nn(fens, StringExtension::Split(batch, ","), std::max(runs, 1));
+
+		for (auto& s : oldOptions)
+			Options[s.first] = std::string(s.second);
+		return;
+	}
+
+	if (mcts)
+	{
+		bench_mcts(fens, limits, threads_list);
+
+		for (auto& s : oldOptions)
+			Options[s.first] = std::string(s.second);
+
+		// bench_mcts()はUCT_Threads1を変えながらis_ready()を呼び出しているので、探索スレッドとUctSearcherの割り当て、
+		// batch sizeなどが最後に計測した条件のままになっている。また、Search::Limitsにはsilentなどのbench用の条件が残っている。
+		// 通常のbenchとは異なり、このあと"go"だけが来てもそれらを引きずらないように、復元したOptionsで探索部を初期化しなおしておく。
+		Search::Limits = Search::LimitsType();
+		is_ready();
+		return;
+	}
+#endif
+
+#if !defined(YANEURAOU_ENGINE_DEEP)
+	if (smp)
+	{
+		bench_smp(fens, limits, (size_t)stoi(threads), std::max(runs, 1));
+
+		for (auto& s : oldOptions)
+			Options[s.first] = std::string(s.second);
+		return;
+	}
+
+	if (sweep && Options.count("Threads") && Options.count("USI_Hash"))
+	{
+		const bool json = format.empty() ? StringExtension::EndsWith(output, ".json") : format == "json";
+		bench_sweep(fens, limits, threads_list, hash_list, std::max(runs, 1), limitType, limit, output, json);
+
+		for (auto& s : oldOptions)
+			Options[s.first] = std::string(s.second);
+		return;
+	}
+
+#if defined(USE_MOVE_PICKER)
+	if (movesort)
+	{
+		bench_movesort(fens, limits, std::max(runs, 1));
+
+		for (auto& s : oldOptions)
+			Options[s.first] = std::string(s.second);
+		return;
+	}
+#endif
+#endif
+
 	// 評価関数の読み込み等
 	is_ready();
 
@@ -210,6 +1153,30 @@ void bench_cmd(Position& current, istringstream& is)
 		<< "\nNodes searched/second(main thread) : " << 1000 * nodes_searched_main / elapsed;
 #endif
 
+#if defined(EVAL_NNUE)
+	// 玉移動などで必要になったaccumulatorの全計算のうち、
+	// AccumulatorCacheとの差分計算で済んだ回数。
+	// また、直前の局面が未計算のときに、2手以上前の局面からの差分計算で全計算を回避できた回数。
+	{
+		uint64_t refreshes = 0, cache_diffs = 0, multi_ply_updates = 0;
+		for (Thread* th : Threads)
+		{
+			refreshes         += th->nnue_cache.refreshes;
+			cache_diffs       += th->nnue_cache.cache_diffs;
+			multi_ply_updates += th->nnue_cache.multi_ply_updates;
+		}
+		cout
+		<< "\nNNUE refreshes (full)       : " << refreshes
+		<< "\nNNUE refreshes (cache diff) : " << cache_diffs
+		<< "\nNNUE multi-ply updates      : " << multi_ply_updates;
+	}
+#if defined(USE_EVAL_HASH)
+	// EvalHashのhit率。スレッド数を変えてbenchを回せば、スレッド数ごとに有効かどうかを確認できる。
+	cout << "\n";
+	Eval::print_evalhash_stat(cout);
+#endif
+#endif
+
 	cout << sync_endl;
 
 	// 終了したことを出力しないと他のスクリプトから呼び出した時に終了判定にこまる。
@@ -0,0 +1,232 @@
+﻿#include "../types.h"
+
+#include <sstream>
+#include <thread>
+#include <atomic>
+#include "../position.h"
+#include "../thread.h"
+#include "../usi.h"
+#include "../misc.h"
+
+using namespace std;
+
+// ----------------------------------
+//  USI拡張コマンド "perft"
+// ----------------------------------
+
+// 指し手生成の検証用。現在の局面から深さdepthまで全合法手で辿った時の末端の局面数を数える。
+// "go perft"(やねうら王の探索部のperft)と違い、
+//   ・rootから2手目までの指し手の組をスレッドで分担して数える。
+//   ・部分木の局面数を、局面のhash keyと残り深さをkeyにしてhash tableにcacheする。(合流する局面を数えなおさない)
+//   ・rootの指し手ごとの局面数(divide)と、nodes/secを出力する。
+//
+// 例)
+//   > position startpos
+//   > perft 6
+//   > perft depth 7 threads 8 hash 4096 divide 0
+//
+//   depth   : 深さ
+//   threads : 使うスレッド数。省略時はOptions["Threads"]の値。
+//   hash    : hash tableのサイズ[MB]。0ならhash tableを使わない。省略時は256。
+//   divide  : 0ならrootの指し手ごとの局面数を出力しない。省略時は1。
+
+namespace {
+
+	// perft用のhash table。
+	// 部分木の局面数を (局面のhash key ^ 残り深さのhash key) ごとに格納する。
+	// 複数スレッドからlockせずに読み書きするので、key ^ countを一緒に格納しておき、
+	// 取り出す時にcountと組み合わせて元のkeyに戻るかで、他のスレッドの書き込みと混ざっていないかを確認する。
+	struct PerftTable
+	{
+		struct Entry
+		{
+			std::atomic<u64> check; // key ^ count
+			std::atomic<u64> count;
+		};
+
+		// mb[MB]に収まる2のべき乗個のentryを確保する。mb == 0ならhash tableを使わない。
+		void resize(size_t mb)
+		{
+			memory.free();
+			entries = nullptr;
+			mask = 0;
+			if (mb == 0)
+				return;
+
+			size_t n = 1;
+			while (n * 2 * sizeof(Entry) <= mb * 1024 * 1024)
+				n *= 2;
+			entries = (Entry*)memory.alloc(n * sizeof(Entry), alignof(Entry), true);
+			mask = n - 1;
+		}
+
+		bool enabled() const { return entries != nullptr; }
+
+		bool probe(Key key, u64& count) const
+		{
+			const Entry& e = entries[key & mask];
+			u64 c = e.count.load(std::memory_order_relaxed);
+			if ((e.check.load(std::memory_order_relaxed) ^ c) != key)
+				return false;
+			count = c;
+			return true;
+		}
+
+		void store(Key key, u64 count)
+		{
+			Entry& e = entries[key & mask];
+			e.count.store(count, std::memory_order_relaxed);
+			e.check.store(key ^ count, std::memory_order_relaxed);
+		}
+
+	private:
+		LargeMemory memory;
+		Entry* entries = nullptr;
+		size_t mask = 0;
+	};
+
+	// 深さdepthまでの末端の局面数を返す。depth >= 1であること。
+	u64 perft(Position& pos, Depth depth, PerftTable& table)
+	{
+		// 末端の1手手前では、指し手の数を数えるだけで良い。(bulk counting)
+		if (depth <= 1)
+			return countMoves<LEGAL_ALL>(pos);
+
+		// 手順が違っても同じ局面で同じ残り深さなら局面数は同じ。
+		const bool use_table = table.enabled();
+		const Key key = pos.key() ^ Key(DepthHash(depth));
+		u64 nodes;
+		if (use_table && table.probe(key, nodes))
+			return nodes;
+
+		nodes = 0;
+		StateInfo st;
+		for (const auto& m : MoveList<LEGAL_ALL>(pos))
+		{
+			pos.do_move(m, st);
+			nodes += perft(pos, depth - 1, table);
+			pos.undo_move(m);
+		}
+
+		if (use_table)
+			table.store(key, nodes);
+
+		return nodes;
+	}
+
+	// スレッドに分配する単位。rootの指し手と、(depth >= 3なら)その次の指し手の組。
+	struct PerftWork
+	{
+		size_t root_index;
+		Move move1;
+		Move move2;
+	};
+}
+
+void perft_cmd(Position& pos, istringstream& is)
+{
+	Depth depth = 0;
+	size_t threads = Options["Threads"];
+	size_t hash_mb = 256;
+	int divide = 1;
+
+	string token;
+	while (is >> token)
+	{
+		if (token == "depth")        is >> depth;
+		else if (token == "threads") is >> threads;
+		else if (token == "hash")    is >> hash_mb;
+		else if (token == "divide")  is >> divide;
+		else depth = (Depth)StringExtension::to_int(token, 0); // "perft 6"のように深さだけ書いてある。
+	}
+
+	if (depth < 1 || depth >= MAX_PLY)
+	{
+		sync_cout << "Error! : perft depth must be in [1," << MAX_PLY - 1 << "]." << sync_endl;
+		return;
+	}
+	threads = std::max(threads, size_t(1));
+
+	// Position::set()で評価関数が必要。
+	is_ready();
+
+	PerftTable table;
+	table.resize(hash_mb);
+
+	sync_cout << "perft depth = " << depth << " , threads = " << threads << " , hash = " << hash_mb << "[MB]" << sync_endl;
+
+	// 分配する仕事を列挙する。rootの指し手だけだと、rootの合法手が少ない局面でスレッドが余るので2手目まで展開する。
+	const string sfen = pos.sfen();
+	const auto root_moves = MoveList<LEGAL_ALL>(pos);
+	vector<PerftWork> works;
+	for (size_t i = 0; i < root_moves.size(); ++i)
+	{
+		const Move m1 = root_moves.at(i);
+		if (depth >= 3)
+		{
+			StateInfo si;
+			pos.do_move(m1, si);
+			for (const auto& m2 : MoveList<LEGAL_ALL>(pos))
+				works.push_back(PerftWork{ i, m1, m2 });
+			pos.undo_move(m1);
+		}
+		else
+			works.push_back(PerftWork{ i, m1, MOVE_NONE });
+	}
+
+	vector<std::atomic<u64>> root_nodes(root_moves.size());
+	for (auto& n : root_nodes)
+		n = 0;
+
+	std::atomic<size_t> next_work{ 0 };
+
+	Timer time;
+	time.reset();
+
+	vector<std::thread> workers;
+	for (size_t t = 0; t < threads; ++t)
+		workers.emplace_back([&, t] {
+			// 各スレッドが自分の局面を持つ。(do_move()でnodesを数えるThreadもなるべく別々に)
+			Position p;
+			StateInfo si;
+			p.set(sfen, &si, Threads[t % Threads.size()]);
+
+			for (size_t w; (w = next_work++) < works.size(); )
+			{
+				auto& work = works[w];
+				StateInfo st1, st2;
+				u64 nodes;
+
+				if (depth == 1)
+					nodes = 1;
+				else {
+					p.do_move(work.move1, st1);
+					if (depth == 2)
+						nodes = perft(p, 1, table);
+					else {
+						p.do_move(work.move2, st2);
+						nodes = perft(p, depth - 2, table);
+						p.undo_move(work.move2);
+					}
+					p.undo_move(work.move1);
+				}
+				root_nodes[work.root_index] += nodes;
+			}
+		});
+	for (auto& th : workers)
+		th.join();
+
+	const TimePoint elapsed = time.elapsed() + 1;
+
+	u64 nodes = 0;
+	for (size_t i = 0; i < root_moves.size(); ++i)
+	{
+		nodes += root_nodes[i];
+		if (divide)
+			sync_cout << USI::move(root_moves.at(i)) << ": " << root_nodes[i] << sync_endl;
+	}
+
+	sync_cout << "\nNodes searched: " << nodes
+		<< "\nTime [ms]     : " << elapsed
+		<< "\nNodes/second  : " << nodes * 1000 / elapsed << "\n" << sync_endl;
+}
@@ -58,6 +58,13 @@ void Thread::clear()
 			continuationHistory[inCheck][c][SQ_ZERO][NO_PIECE]->fill(Search::CounterMovePruneThreshold - 1);
 		}
 #endif
+
+#if defined(EVAL_NNUE)
+	nnue_cache.clear();
+#if defined(USE_EVAL_HASH)
+	evalhash_probes = evalhash_hits = 0;
+#endif
+#endif
 }
 
 // 待機していたスレッドを起こして探索を開始させる
@@ -88,7 +95,9 @@ void Thread::idle_loop() {
 
 #if !defined(FORCE_BIND_THIS_THREAD)
 	// "Threads"というオプションがない時は、強制的にbindThisThread()しておいていいと思う。(使うスレッド数がここではわからないので..)
-	if (Options.count("Threads")==0 || Options["Threads"] > 8)
+	if (Options.count("Threads")==0 || Options["Threads"] > 8
+		// 置換表をNUMA nodeごとに分割して使うときは、スレッドのnodeを固定しておく必要がある。
+		|| (Options.count("TT_NumaPolicy") && std::string(Options["TT_NumaPolicy"]) == "NodeGrouped"))
 #endif
 		WinProcGroup::bindThisThread(idx);
 		// このifを有効にすると何故かNUMA環境のマルチスレッド時に弱くなることがある気がする。
@@ -96,6 +105,9 @@ void Thread::idle_loop() {
 		// 上の投稿者と条件が何か違うのだろうか…。
 		// 前のバージョンのソフトが、こちらのNUMAの割当を阻害している可能性が微レ存。
 
+	// 探索中に毎回Numa::thread_node()を呼び出さなくて済むように、ここで求めておく。
+	numa_node = (size_t)Numa::thread_node();
+
 	while (true)
 	{
 		std::unique_lock<std::mutex> lk(mutex);
@@ -280,35 +292,71 @@ Thread* ThreadPool::get_best_thread() const {
 	// 単にcompleteDepthが深いほうのスレッドを採用しても良さそうだが、スコアが良いほうの探索深さのほうが
 	// いい指し手を発見している可能性があって楽観合議のような効果があるようだ。
 
+	// 各スレッドの結果は、rootVotesに書き込まれている、最後に完了したiterationのものを用いる。
+	// 1度もiterationを完了していないスレッドは投票に参加しない。
+
 	Thread* bestThread = front();
+	RootVoteTable::Vote best = rootVotes.read(bestThread->thread_id());
 	std::map<Move, int64_t> votes;
 	Value minScore = VALUE_NONE;
 
 	// Find minimum score of all threads
 	for (Thread* th : *this)
-		minScore = std::min(minScore, th->rootMoves[0].score);
+	{
+		auto v = rootVotes.read(th->thread_id());
+		if (v.depth)
+			minScore = std::min(minScore, v.score);
+	}
 
 	// Vote according to score and depth, and select the best thread
 	for (Thread* th : *this)
 	{
-		votes[th->rootMoves[0].pv[0]] +=
-			(th->rootMoves[0].score - minScore + 14) * int(th->completedDepth);
+		auto v = rootVotes.read(th->thread_id());
+		if (!v.depth)
+			continue;
+
+		votes[v.move] += (v.score - minScore + 14) * int(v.depth);
+
+		if (!best.depth)
+			bestThread = th, best = v;
 
-		if (abs(bestThread->rootMoves[0].score) >= VALUE_TB_WIN_IN_MAX_PLY)
+		else if (abs(best.score) >= VALUE_TB_WIN_IN_MAX_PLY)
 		{
 			// Make sure we pick the shortest mate / TB conversion or stave off mate the longest
-			if (th->rootMoves[0].score > bestThread->rootMoves[0].score)
-				bestThread = th;
+			if (v.score > best.score)
+				bestThread = th, best = v;
 		}
-		else if (th->rootMoves[0].score >= VALUE_TB_WIN_IN_MAX_PLY
-			|| (th->rootMoves[0].score > VALUE_TB_LOSS_IN_MAX_PLY
-				&& votes[th->rootMoves[0].pv[0]] > votes[bestThread->rootMoves[0].pv[0]]))
-			bestThread = th;
+		else if (v.score >= VALUE_TB_WIN_IN_MAX_PLY
+			|| (v.score > VALUE_TB_LOSS_IN_MAX_PLY
+				&& votes[v.move] > votes[best.move]))
+			bestThread = th, best = v;
 	}
 
 	return bestThread;
 }
 
+// --- RootVoteTable
+
+void RootVoteTable::clear()
+{
+	for (auto& slot : slots)
+		slot.store(0, std::memory_order_relaxed);
+}
+
+void RootVoteTable::publish(size_t idx, Move move, Value score, Depth depth)
+{
+	if (idx >= MAX_THREADS)
+		return;
+
+	slots[idx].store(u64(u32(move)) | u64(u16(s16(score))) << 32 | u64(u16(depth)) << 48, std::memory_order_relaxed);
+}
+
+RootVoteTable::Vote RootVoteTable::read(size_t idx) const
+{
+	u64 data = idx < MAX_THREADS ? slots[idx].load(std::memory_order_relaxed) : 0;
+	return Vote{ Move(u32(data)), Value(s16(u16(data >> 32))), Depth(u16(data >> 48)) };
+}
+
 
 /// Start non-main threads
 // 探索を開始する(main thread以外)
@@ -79,6 +79,10 @@ public:
 	// 探索中であるかを返す。
 	bool is_searching() const { return searching; }
 
+	// このスレッドのNUMA node。idle_loop()の開始時に(bindThisThread()したあとで)設定される。
+	// TT_NumaPolicyが"NodeGrouped"のとき、置換表のどのグループを使うかをこれで決める。
+	size_t numa_node = 0;
+
 	// ------------------------------
 	//       探索に必要なもの
 	// ------------------------------
@@ -175,6 +179,17 @@ public:
 	TranspositionTable tt;
 #endif
 
+#if defined(EVAL_NNUE)
+	// NNUEの玉移動時のrefreshを差分計算で済ませるためのキャッシュ。
+	Eval::NNUE::AccumulatorCache nnue_cache;
+
+#if defined(USE_EVAL_HASH)
+	// EvalHashの照会回数とhitした回数。hit率の集計用。
+	u64 evalhash_probes = 0;
+	u64 evalhash_hits = 0;
+#endif
+#endif
+
 };
 
 
@@ -244,6 +259,36 @@ struct MainThread: public Thread
 };
 
 
+// Lazy SMPで、各スレッドが反復深化の1回分を終えるごとに、その結果(best move,評価値,深さ)を書き込むテーブル。
+// スレッドごとに書き込む場所が決まっているのでlockは不要で、ThreadPool::get_best_thread()は
+// 探索中のスレッドのrootMovesではなく、ここに書き込まれた最後に完了したiterationの結果で投票を行う。
+struct RootVoteTable
+{
+	// 投票に参加できる最大スレッド数。これを超えるスレッドidの投票は無視される。
+	static constexpr size_t MAX_THREADS = 1024;
+
+	struct Vote {
+		Move  move;
+		Value score;
+
+		// 投票したiterationの深さ。まだ投票していなければ0。
+		Depth depth;
+	};
+
+	// すべての投票を消す。探索開始時に呼び出す。
+	void clear();
+
+	// スレッドidxの投票を書き込む。(前回の投票は上書きされる)
+	void publish(size_t idx, Move move, Value score, Depth depth);
+
+	// スレッドidxの投票を読み出す。
+	Vote read(size_t idx) const;
+
+private:
+	// move(32bit) | score(16bit) << 32 | depth(16bit) << 48 をpackしたもの。
+	std::atomic<u64> slots[MAX_THREADS];
+};
+
 // 思考で用いるスレッドの集合体
 // 継承はあまり使いたくないが、for(auto* th:Threads) ... のようにして回せて便利なのでこうしてある。
 //
@@ -292,6 +337,9 @@ struct ThreadPool: public std::vector<Thread*>
 	// すべて終了していればtrueが返る。
 	bool search_finished() const;
 
+	// 各スレッドの反復深化の結果。get_best_thread()で用いる。
+	RootVoteTable rootVotes;
+
 private:
 
 	// 現局面までのStateInfoのlist
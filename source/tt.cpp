@@ -1,10 +1,19 @@
 ﻿#include <cstring>	// std::memset()
+#include <iomanip>	// std::setprecision()
 #include "misc.h"
 #include "thread.h"
 #include "tt.h"
+#include "usi.h"
+#include "perf_counter.h"
+#include "evaluate.h"
+#if defined(EVAL_NNUE)
+#include "eval/nnue/evaluate_nnue.h"
+#endif
 
 TranspositionTable TT; // 置換表をglobalに確保。
 
+#if !defined(USE_TT_LOCKLESS)
+
 // 置換表のエントリーに対して与えられたデータを保存する。上書き動作
 //   v    : 探索のスコア
 //   eval : 評価関数 or 静止探索の値
@@ -14,6 +23,8 @@ TranspositionTable TT; // 置換表をglobalに確保。
 // スレッドごとに異なるgenerationの値を指定したくてこのような作りになっている。
 void TTEntry::save(Key k, Value v, bool pv , Bound b, Depth d, Move m , Value ev)
 {
+	PERF_COUNT(TT_STORE);
+
 	// ASSERT_LV3((-VALUE_INFINITE < v && v < VALUE_INFINITE) || v == VALUE_NONE);
 
 	// 置換表にVALUE_INFINITE以上の値を書き込んでしまうのは本来はおかしいが、
@@ -70,6 +81,55 @@ void TTEntry::save(Key k, Value v, bool pv , Bound b, Depth d, Move m , Value ev
 	}
 }
 
+#else
+
+// 置換表のエントリーに対して与えられたデータを保存する。上書き動作(USE_TT_LOCKLESS版)
+// 上書きするかの判定は通常版と同じ。
+// 他のスレッドが同時に書き込むことがあるので、data64をローカルにコピーして更新してから、data64,key64の順に書き戻す。
+void TTEntry::save(Key k, Value v, bool pv , Bound b, Depth d, Move m , Value ev)
+{
+	PERF_COUNT(TT_STORE);
+
+	TTEntry e;
+	e.data64 = data64;
+	const bool same_key = (key64 ^ e.data64) == (u64)k;
+
+	if (m || !same_key)
+		e.move16 = (uint16_t)m;
+
+	if ( b == BOUND_EXACT
+		|| !same_key
+		|| d - DEPTH_OFFSET > e.depth8 - 4
+		)
+	{
+		ASSERT_LV3(d > DEPTH_OFFSET);
+		ASSERT_LV3(d < 256 + DEPTH_OFFSET);
+
+		e.depth8    = (uint8_t)(d - DEPTH_OFFSET);
+		e.genBound8 = (uint8_t)(TT.generation8 | uint8_t(pv) << 2 | b);
+		e.value16   = (int16_t)v;
+		e.eval16    = (int16_t)ev;
+	}
+
+	data64 = e.data64;
+	key64  = (u64)k ^ e.data64;
+}
+
+#endif
+
+namespace {
+
+	// 評価関数のハッシュ値。tt_save/tt_loadで、同じ評価関数の置換表であるかを照合するのに用いる。
+	u64 eval_hash()
+	{
+#if defined(EVAL_NNUE)
+		return Eval::NNUE::GetParametersHash();
+#else
+		return Eval::calc_check_sum();
+#endif
+	}
+}
+
 // 置換表のサイズを確保しなおす。
 void TranspositionTable::resize(size_t mbSize) {
 
@@ -94,6 +154,15 @@ void TranspositionTable::resize(size_t mbSize) {
 	// これを掛け算するから2の倍数である。
 	ASSERT_LV3((newClusterCount & 1) == 0);
 
+	// isreadyの前にload()した置換表は、ここで評価関数を照合する。一致しなければ捨てて確保しなおす。
+	if (tt_file && keep_loaded && loaded_eval_hash != eval_hash())
+	{
+		sync_cout << "info string Error! : tt_load : the evaluation function differs from the one used when the file was saved."
+			<< " The loaded table is discarded." << sync_endl;
+		keep_loaded = false;
+		clusterCount = 0;
+	}
+
 	// 同じサイズなら確保しなおす必要はない。
 
 	// Stockfishのコード、問答無用で確保しなおしてゼロクリアしているが、
@@ -102,7 +171,26 @@ void TranspositionTable::resize(size_t mbSize) {
 	if (newClusterCount == clusterCount)
 		return;
 
+	// load()した置換表を、(isreadyで)確保しなおして捨ててしまわないようにする。
+	if (tt_file && keep_loaded)
+	{
+		sync_cout << "info string USI_Hash is ignored until the next search. The table loaded by tt_load ("
+			<< clusterCount * sizeof(Cluster) / (1024 * 1024) << "[MB]) is used." << sync_endl;
+		return;
+	}
+
+	// backgroundでのゼロクリアが、これから開放するメモリにアクセスしているかも知れない。
+	stop_scrub();
+
+	// load()したファイルを置換表として使っていたなら、それは開放する。
+	tt_file.reset();
+
 	clusterCount = newClusterCount;
+	need_zero_clear = true;
+
+	// NUMA nodeへの配置はclear()でやりなおす。
+	numa_groups = 1;
+	numa_policy = NumaPolicy::None;
 
 	// tableはCacheLineSizeでalignされたメモリに配置したいので、CacheLineSize-1だけ余分に確保する。
 	// callocではなくmallocにしないと初回の探索でTTにアクセスするとき、特に巨大なTTだと
@@ -110,7 +198,13 @@ void TranspositionTable::resize(size_t mbSize) {
 	// cf. Explicitly zero TT upon resize. : https://github.com/official-stockfish/Stockfish/commit/2ba47416cbdd5db2c7c79257072cd8675b61721f
 
 	// Large Pageを確保する。ランダムメモリアクセスが5%程度速くなる。
-	table = static_cast<Cluster*>(tt_memory.alloc(clusterCount * sizeof(Cluster),32));
+	// Clusterがcache lineを跨がないように、Clusterのサイズでalignする。
+	table = static_cast<Cluster*>(tt_memory.alloc(clusterCount * sizeof(Cluster), sizeof(Cluster)));
+
+#if !defined(EVAL_LEARN)
+	// 実際にどのようなページで確保できたかを出力しておく。
+	sync_cout << "info string TT allocation : " << clusterCount * sizeof(Cluster) / (1024 * 1024) << "[MB] , " << tt_memory.page_kind() << sync_endl;
+#endif
 
 	// clear();
 
@@ -131,12 +225,56 @@ void TranspositionTable::clear()
 	return;
 #endif
 
+	// load()した置換表は、次に探索を開始するまではクリアしない。
+	if (tt_file && keep_loaded)
+		return;
+
 	auto size = clusterCount * sizeof(Cluster);
 
+#if !defined(USE_TT_LOCKLESS)
+	// 論理クリア。epochを進めるだけで済ませる。
+	const std::string mode = Options.count("TT_ClearMode") ? std::string(Options["TT_ClearMode"]) : std::string("Zero");
+	if (mode != "Zero" && !need_zero_clear && u16(epoch + 1) != 0)
+	{
+		stop_scrub();
+		++epoch;
+		stale_clusters = true;
+		scrub_finished = false;
+
+#if !defined(EVAL_LEARN) && !defined(__EMSCRIPTEN__)
+		// 探索と並行して、epochの古いClusterをゼロクリアしていく。
+		// 探索スレッドがprobe()で同じClusterを初期化して書き込んだ直後にそれを消してしまうことがあるが、
+		// 置換表のentryが1つ失われるだけなので問題ない。
+		if (mode == "EpochScrub")
+		{
+			scrub_stop = false;
+			scrub_thread = std::thread([this, table = table, count = clusterCount, e = epoch]() {
+				size_t i = 0;
+				for (; i < count && !scrub_stop.load(std::memory_order_relaxed); ++i)
+					if (table[i].epoch != e)
+					{
+						std::memset(table[i].entry, 0, sizeof(table[i].entry));
+						table[i].epoch = e;
+					}
+				scrub_finished = (i == count);
+			});
+		}
+#endif
+		return;
+	}
+#endif
+
+	stop_scrub();
+
 #if !defined(EVAL_LEARN) && !defined(__EMSCRIPTEN__)
 	// 進捗を表示しながら並列化してゼロクリア
 	// Stockfishのここにあったコードは、独自の置換表を実装した時にも使いたいため、tt.cppに移動させた。
+	// NUMA環境では、ページが実メモリに割り当てられるゼロクリアの前に配置先を設定しておく。
+	place_numa();
 	Tools::memclear("USI_Hash" , table, size);
+
+	if (numa_policy != NumaPolicy::None)
+		sync_cout << "info string TT NUMA : " << numa_info() << sync_endl;
 #else
 	// yaneuraou.wasm
 	// pthread_joinによってブラウザのメインスレッドがブロックされるため、単一スレッドでメモリをクリアする処理に変更
@@ -148,24 +286,339 @@ void TranspositionTable::clear()
 	// 例) th->tt.clear();
 	std::memset(table, 0, size);
 #endif
+
+	// ゼロクリアしたので、全Clusterのepochは0である。
+	epoch = 0;
+	need_zero_clear = false;
+	stale_clusters = false;
+}
+
+namespace {
+
+	// save()で書き出すファイルのヘッダー。
+	// 置換表本体がpage境界に来るように、ファイルの先頭のTT_FILE_HEADER_SIZE bytesをヘッダーとする。
+	struct TTFileHeader
+	{
+		char magic[8];
+		u32  version;
+
+		// Clusterの構成
+		u32  cluster_bytes;
+		u32  cluster_entries;
+		u32  lockless;
+
+		u32  hash_key_bits;
+		u32  padding;
+
+		u64  cluster_count;
+
+		// 評価関数のハッシュ値。評価関数が異なると、value,evalが別物になる。
+		u64  eval_hash;
+
+		u8   generation8;
+		u8   padding2;
+		u16  epoch;
+	};
+
+	constexpr char   TT_FILE_MAGIC[8]    = "YANE_TT";
+	constexpr u32    TT_FILE_VERSION     = 1;
+	constexpr size_t TT_FILE_HEADER_SIZE = 4096;
+}
+
+void TranspositionTable::save(const std::string& filename)
+{
+	if (!table)
+	{
+		sync_cout << "info string Error! : TT is not allocated. Send isready first." << sync_endl;
+		return;
+	}
+
+	Threads.main()->wait_for_search_finished();
+	stop_scrub();
+
+	std::vector<u8> buffer(TT_FILE_HEADER_SIZE);
+	TTFileHeader* header = reinterpret_cast<TTFileHeader*>(buffer.data());
+	std::memcpy(header->magic, TT_FILE_MAGIC, sizeof(header->magic));
+	header->version         = TT_FILE_VERSION;
+	header->cluster_bytes   = (u32)sizeof(Cluster);
+	header->cluster_entries = (u32)ClusterSize;
+#if defined(USE_TT_LOCKLESS)
+	header->lockless        = 1;
+#endif
+	header->hash_key_bits   = HASH_KEY_BITS;
+	header->cluster_count   = clusterCount;
+	header->eval_hash       = eval_hash();
+	header->generation8     = generation8;
+	header->epoch           = epoch;
+
+	TimePoint start = now();
+
+	auto result = SystemIO::WriteMemoryToFile(filename, buffer.data(), buffer.size());
+	if (result.is_ok())
+		result = SystemIO::WriteMemoryToFile(filename, table, clusterCount * sizeof(Cluster), true);
+
+	if (!result.is_ok())
+	{
+		sync_cout << "info string Error! : tt_save " << filename << " failed. " << result.to_string() << sync_endl;
+		return;
+	}
+
+	sync_cout << "info string tt_save : " << filename << " , " << clusterCount * sizeof(Cluster) / (1024 * 1024) << "[MB] , "
+		<< now() - start << "[ms]" << sync_endl;
 }
 
-TTEntry* TranspositionTable::probe(const Key key, bool& found) const
+void TranspositionTable::load(const std::string& filename)
+{
+#if defined(TANUKI_MATE_ENGINE) || defined(YANEURAOU_MATE_ENGINE)
+	// MateEngineではこの置換表は用いない。
+	return;
+#endif
+
+	if (Threads.size() == 0)
+		return;
+
+	Threads.main()->wait_for_search_finished();
+	stop_scrub();
+
+	TimePoint start = now();
+
+	auto file = std::make_unique<SystemIO::MappedFile>();
+	auto result = file->Open(filename);
+	if (!result.is_ok())
+	{
+		sync_cout << "info string Error! : tt_load " << filename << " failed. " << result.to_string() << sync_endl;
+		return;
+	}
+
+	auto error = [&](const std::string& mes) {
+		sync_cout << "info string Error! : tt_load " << filename << " : " << mes << sync_endl;
+	};
+
+	if (file->size() < TT_FILE_HEADER_SIZE)
+		return error("not a TT file.");
+
+	const TTFileHeader& header = *reinterpret_cast<const TTFileHeader*>(file->data());
+	if (std::memcmp(header.magic, TT_FILE_MAGIC, sizeof(header.magic)) != 0)
+		return error("not a TT file.");
+	if (header.version != TT_FILE_VERSION)
+		return error("version mismatch. file = " + std::to_string(header.version) + " , expected = " + std::to_string(TT_FILE_VERSION));
+
+#if defined(USE_TT_LOCKLESS)
+	const u32 lockless = 1;
+#else
+	const u32 lockless = 0;
+#endif
+	if (header.cluster_bytes != sizeof(Cluster) || header.cluster_entries != ClusterSize || header.lockless != lockless)
+		return error("cluster layout mismatch. file = " + std::to_string(header.cluster_bytes) + " bytes x "
+			+ std::to_string(header.cluster_entries) + (header.lockless ? " entries (lockless)" : " entries"));
+	if (header.hash_key_bits != HASH_KEY_BITS)
+		return error("HASH_KEY_BITS mismatch. file = " + std::to_string(header.hash_key_bits));
+	// 評価関数をまだ読み込んでいない(isreadyの前)なら、評価関数の照合はisreadyでのresize()で行う。
+	if (USI::load_eval_finished && header.eval_hash != eval_hash())
+		return error("the evaluation function differs from the one used when the file was saved.");
+	if (header.cluster_count == 0 || (header.cluster_count & 1) != 0
+		|| file->size() != TT_FILE_HEADER_SIZE + header.cluster_count * sizeof(Cluster))
+		return error("file size mismatch.");
+
+	// 問題ないので、mapしたファイルを置換表として用いる。
+	clusterCount = header.cluster_count;
+	generation8 = header.generation8;
+	epoch = header.epoch;
+
+	tt_file = std::move(file);
+	tt_memory.free();
+	table = reinterpret_cast<Cluster*>((u8*)tt_file->data() + TT_FILE_HEADER_SIZE);
+	need_zero_clear = false;
+	keep_loaded = true;
+	// 保存したときに論理クリアされる前のClusterが残っていたかも知れない。
+	stale_clusters = true;
+	loaded_eval_hash = header.eval_hash;
+	numa_groups = 1;
+	numa_policy = NumaPolicy::None;
+
+	sync_cout << "info string tt_load : " << filename << " , " << clusterCount * sizeof(Cluster) / (1024 * 1024) << "[MB] , "
+		<< (tt_file->is_mmapped() ? "mmap" : "read") << " , " << now() - start << "[ms]" << sync_endl;
+}
+
+void TranspositionTable::stop_scrub()
+{
+	if (scrub_thread.joinable())
+	{
+		scrub_stop = true;
+		scrub_thread.join();
+	}
+}
+
+namespace {
+
+	// NUMA環境でのremote accessの割合のサンプリング。
+	// 各スレッドのprobe()の4096回に1回、Clusterの配置されているnodeが実行中のnodeと異なるかを調べる。
+	std::atomic<u64> numa_samples, numa_remote_samples;
+
+	void sample_numa(const void* addr)
+	{
+		thread_local u32 counter = 0;
+		if ((++counter & 4095) != 0)
+			return;
+
+		int node = Numa::node_of_address(addr), current = Numa::current_node();
+		if (node < 0 || current < 0)
+			return;
+
+		numa_samples.fetch_add(1, std::memory_order_relaxed);
+		if (node != current)
+			numa_remote_samples.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void TranspositionTable::place_numa()
+{
+	// 前回の配置方法。resize()で確保しなおしたあとならNone。
+	const NumaPolicy last_policy = numa_policy;
+
+	numa_groups = 1;
+	numa_policy = NumaPolicy::None;
+	numa_samples = numa_remote_samples = 0;
+
+	const size_t nodes = Numa::node_count();
+	if (nodes <= 1)
+		return;
+
+	// 探索中にprobe()で文字列を比較しなくて済むように、ここでNumaPolicyに変換しておく。
+	const std::string policy = Options.count("TT_NumaPolicy") ? std::string(Options["TT_NumaPolicy"]) : std::string("FirstTouch");
+	const size_t size = clusterCount * sizeof(Cluster);
+
+	if (policy == "NodeGrouped" && clusterCount / nodes >= 2)
+	{
+		numa_policy = NumaPolicy::NodeGrouped;
+		numa_group_clusters = (clusterCount / nodes) & ~size_t(1);
+		numa_groups = nodes;
+		for (size_t n = 0; n < nodes; ++n)
+			Numa::bind(&table[n * numa_group_clusters], numa_group_clusters * sizeof(Cluster), n);
+	}
+	else if (policy == "Interleave")
+	{
+		numa_policy = NumaPolicy::Interleave;
+		Numa::interleave(table, size);
+	}
+	else
+	{
+		// OSの既定の動作のまま。前回Interleave等で配置していたときだけ、既定の配置方法に戻す。
+		numa_policy = NumaPolicy::FirstTouch;
+		if (last_policy == NumaPolicy::Interleave || last_policy == NumaPolicy::NodeGrouped)
+			Numa::reset(table, size);
+	}
+}
+
+std::string TranspositionTable::numa_info() const
+{
+	std::ostringstream ss;
+	const char* policy_name[] = { "none", "FirstTouch", "Interleave", "NodeGrouped" };
+	ss << "policy = " << policy_name[(int)numa_policy]
+	   << " , nodes = " << Numa::node_count() << " (" << Numa::topology() << ")";
+
+	for (size_t n = 0; n < numa_groups && numa_groups > 1; ++n)
+		ss << " , node" << n << " : clusters [" << n * numa_group_clusters << "," << (n + 1) * numa_group_clusters << ")";
+
+	return ss.str();
+}
+
+void TTWriter::write(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev)
+{
+#if !defined(USE_TT_LOCKLESS)
+	// 論理クリアされる前のClusterなら、ここでゼロクリアして今のepochのClusterにする。
+	if (reset_cluster)
+	{
+		auto* cluster = reinterpret_cast<TranspositionTable::Cluster*>(entry);
+		std::memset(cluster->entry, 0, sizeof(cluster->entry));
+		cluster->epoch = reset_epoch;
+		reset_cluster = false;
+	}
+#endif
+	entry->save(k, v, pv, b, d, m, ev);
+}
+
+namespace {
+	// probe()で見つからなかったときに返すTTData。
+	const TTData TT_DATA_NONE = { Move16(), VALUE_NONE, VALUE_NONE, DEPTH_NONE, BOUND_NONE, false };
+}
+
+TTWriter TranspositionTable::probe(const Key key, const size_t node, bool& found, TTData& data) const
 {
 	ASSERT_LV3(clusterCount != 0);
 
+	TTWriter writer;
+	data = TT_DATA_NONE;
+
 #if defined(USE_GLOBAL_OPTIONS)
 	if (!GlobalOptions.use_hash_probe)
 	{
 		// 置換表にhitさせないモードであるなら、見つからなかったことにして
 		// つねに確保しているメモリの先頭要素を返せば良い。(ここに書き込まれたところで問題ない)
-		return found = false, first_entry(0);
+		writer.entry = first_entry(0, 0);
+		return found = false, writer;
 	}
 #endif
 
 	// 最初のTT_ENTRYのアドレス(このアドレスからTT_ENTRYがClusterSize分だけ連なっている)
 	// keyの下位bitをいくつか使って、このアドレスを求めるので、自ずと下位bitはいくらかは一致していることになる。
-	TTEntry* const tte = first_entry(key);
+	TTEntry* const tte = first_entry(key, node);
+
+	PERF_COUNT(TT_PROBE);
+
+	if (numa_policy != NumaPolicy::None)
+		sample_numa(tte);
+
+#if !defined(USE_TT_LOCKLESS)
+	// 論理クリアされる前のClusterは空である。probe()では書き換えずに、
+	// 返したTTWriterで書き込むときにゼロクリアする。
+	if (stale_clusters && reinterpret_cast<const Cluster*>(tte)->epoch != epoch)
+	{
+		writer.entry = tte;
+		writer.reset_cluster = true;
+		writer.reset_epoch = epoch;
+		return found = false, writer;
+	}
+#endif
+
+#if defined(USE_TT_LOCKLESS)
+	for (int i = 0; i < ClusterSize; ++i)
+	{
+		// key64とdata64は他のスレッドに書き換えられうるので、一度だけ読み出して検証し、
+		// 以降はこのコピーからしか読まない。
+		TTEntry e;
+		e.data64 = tte[i].data64;
+		const Key stored_key = Key(tte[i].key64 ^ e.data64);
+
+		if (!e.depth8)
+		{
+			writer.entry = &tte[i];
+			return found = false, writer;
+		}
+
+		if (stored_key == key)
+		{
+			// generationをrefreshする。data64を書き換えるのでkey64も書き直す。
+			e.genBound8 = uint8_t(generation8 | (e.genBound8 & (GENERATION_DELTA - 1)));
+			tte[i].data64 = e.data64;
+			tte[i].key64  = (u64)key ^ e.data64;
+
+			PERF_COUNT(TT_HIT);
+			data = e.read();
+			writer.entry = &tte[i];
+			return found = true, writer;
+		}
+
+#if defined(USE_PERF_COUNTERS)
+		// このClusterに格納されるはずのない局面のkeyであれば、key64とdata64が混ざっている。(torn write)
+		if (first_entry(stored_key, node) != tte)
+			PERF_COUNT(TT_TORN_READ);
+		// 通常版の16bitのkeyなら偽のhitとなっていた。
+		else if ((u16)(stored_key >> 1) == (u16)(key >> 1))
+			PERF_COUNT(TT_COLLISION);
+#endif
+	}
+#else
 
 	// 下位16bit(bit0は除く)が合致するTT_ENTRYを探す
 	// 上位bitは、tteのアドレスの算出に用いているので、だいたい合ってる。
@@ -186,13 +639,22 @@ TTEntry* TranspositionTable::probe(const Key key, bool& found) const
 		// Stockfish12からはdepth8 == 0が空のTTEntryを意味するように変わった。
 		// key16は1/65536の確率で0になりうるので…。
 
-		if (tte[i].key16 == key16 || !tte[i].depth8)
+		// 他のスレッドが書き換えている途中かも知れないので、entryを一度だけコピーして、以降はこのコピーからしか読まない。
+		TTEntry e = tte[i];
+		if (e.key16 == key16 || !e.depth8)
 		{
-			tte[i].genBound8 = uint8_t(generation8 | (tte[i].genBound8 & (GENERATION_DELTA - 1))); // Refresh
+			tte[i].genBound8 = uint8_t(generation8 | (e.genBound8 & (GENERATION_DELTA - 1))); // Refresh
 
-			return found = (bool)tte[i].depth8, &tte[i];
+			PERF_COUNT_IF(e.depth8, TT_HIT);
+			if (e.depth8)
+				data = e.read();
+			writer.entry = &tte[i];
+			return found = (bool)e.depth8, writer;
 		}
 	}
+#endif
+
+	PERF_COUNT(TT_REPLACE);
 
 	// 空きエントリーも、探していたkeyが格納されているentryが見当たらなかった。
 	// クラスター内のどれか一つを潰す必要がある。
@@ -222,28 +684,52 @@ TTEntry* TranspositionTable::probe(const Key key, bool& found) const
 	//   b := genBound8は下位3bitにはBoundが入っているのでこれはゴミと考える。
 	// ( 256 + a - b + c) & 0xfc として c = 7としても結果に影響は及ぼさない、かつ、このゴミを無視した計算が出来る。
 
-	return found = false, replace;
+	writer.entry = replace;
+	return found = false, writer;
 }
 
 // read onlyであることが保証されているprobe()
-TTEntry* TranspositionTable::read_probe(const Key key, bool& found) const
+bool TranspositionTable::read_probe(const Key key, TTData& data) const
 {
 	ASSERT_LV3(clusterCount != 0);
 
+	data = TT_DATA_NONE;
+
 #if defined(USE_GLOBAL_OPTIONS)
 	if (!GlobalOptions.use_hash_probe)
-		return found = false, first_entry(0);
+		return false;
 #endif
 
-	TTEntry* const tte = first_entry(key);
+	// 探索中には呼び出されないので、nodeは都度求めれば良い。
+	const TTEntry* const tte = first_entry(key, (size_t)Numa::thread_node());
+
+#if defined(USE_TT_LOCKLESS)
+	for (int i = 0; i < ClusterSize; ++i)
+	{
+		TTEntry e;
+		e.data64 = tte[i].data64;
+		if (!e.depth8)
+			return false;
+		if ((tte[i].key64 ^ e.data64) == (u64)key)
+			return data = e.read(), true;
+	}
+#else
+	// 論理クリアされる前のClusterは空である。
+	if (reinterpret_cast<const Cluster*>(tte)->epoch != epoch)
+		return false;
+
 	const uint16_t key16 = (u16)(key >> 1);
 
 	for (int i = 0; i < ClusterSize; ++i)
 	{
-		if (tte[i].key16 == key16 || !tte[i].depth8)
-				return found = (bool)tte[i].depth8, &tte[i];
+		const TTEntry e = tte[i];
+		if (!e.depth8)
+			return false;
+		if (e.key16 == key16)
+			return data = e.read(), true;
 	}
-	return found = false, nullptr;
+#endif
+	return false;
 }
 
 int TranspositionTable::hashfull() const
@@ -256,13 +742,61 @@ int TranspositionTable::hashfull() const
 
 	int cnt = 0;
 	for (int i = 0; i < 1000 / ClusterSize; ++i)
+	{
+#if !defined(USE_TT_LOCKLESS)
+		// 論理クリアされる前のClusterは空である。
+		if (table[i].epoch != epoch)
+			continue;
+#endif
 		for (int j = 0; j < ClusterSize; ++j)
 			cnt += table[i].entry[j].depth8 && (table[i].entry[j].genBound8 & GENERATION_MASK) == generation8;
+	}
 
 	// return cnt;でも良いが、そうすると最大で999しか返らず、置換表使用率が100%という表示にならない。
 	return cnt * 1000 / (ClusterSize * (1000 / ClusterSize));
 }
 
+void TranspositionTable::print_stats(std::istringstream& is) const
+{
+	std::string token;
+	is >> token;
+
+	if (token == "clear")
+	{
+		numa_samples = numa_remote_samples = 0;
+		sync_cout << "info string tt_stats : cleared." << sync_endl;
+		return;
+	}
+
+	sync_cout << "info string tt_stats : layout = "
+#if defined(USE_TT_LOCKLESS)
+		<< "lockless"
+#else
+		<< "standard"
+#endif
+		<< " , cluster = " << sizeof(Cluster) << " bytes x " << clusterCount
+		<< " , entries/cluster = " << ClusterSize
+		<< " , key bits = "
+#if defined(USE_TT_LOCKLESS)
+		<< 64
+#else
+		<< 16
+#endif
+		<< " , hashfull = " << (clusterCount ? hashfull() : 0)
+#if !defined(USE_TT_LOCKLESS)
+		<< " , epoch = " << epoch
+#endif
+		<< " , memory = " << (tt_file ? std::string("file (tt_load)") : tt_memory.page_kind()) << sync_endl;
+
+	if (numa_policy != NumaPolicy::None)
+	{
+		const u64 samples = numa_samples, remote = numa_remote_samples;
+		sync_cout << "info string tt_stats : NUMA " << numa_info()
+			<< " , remote access = " << remote << " / " << samples << " samples ("
+			<< std::fixed << std::setprecision(2) << (samples ? 100.0 * remote / samples : 0.0) << "%)" << sync_endl;
+	}
+}
+
 #if defined(EVAL_LEARN)
 // スレッド数が変更になった時にThread.set()から呼び出される。
 // これに応じて、スレッドごとに保持しているTTを初期化する。
@@ -289,6 +823,7 @@ void TranspositionTable::init_tt_per_thread()
 		auto& tt = Threads[i]->tt;
 		tt.clusterCount = clusterCountPerThread;
 		tt.table = this->table + clusterCountPerThread * i;
+		tt.need_zero_clear = true;
 	}
 }
 #endif
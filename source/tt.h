@@ -1,6 +1,9 @@
 ﻿#ifndef TT_H_INCLUDED
 #define TT_H_INCLUDED
 
+#include <atomic>
+#include <thread>
+
 #include "types.h"
 #include "misc.h"
 
@@ -10,6 +13,40 @@
 //       置換表
 // --------------------
 
+/// 置換表のentryの内容のコピー。TranspositionTable::probe()が返す。
+/// 他のスレッドが同じentryに書き込んでも、probe()した時点の内容から変わらない。
+/// (USE_TT_LOCKLESSのときは、keyとの整合性を検証済みの内容である)
+/// 探索部はentryを直接読まずに、こちらから読むこと。
+struct TTData {
+	Move16 move;
+	Value  value;
+	Value  eval;
+	Depth  depth;
+	Bound  bound;
+	bool   is_pv;
+};
+
+struct TTEntry;
+
+/// probe()で見つけた置換表のentryへの書き込み用。TranspositionTable::probe()が返す。
+struct TTWriter {
+
+	// 置換表のentryに対して与えられたデータを保存する。引数の意味はTTEntry::save()と同じ。
+	void write(Key k, Value v, bool pv, Bound b, Depth d, Move m, Value ev);
+
+private:
+	friend struct TranspositionTable;
+	TTEntry* entry = nullptr;
+
+#if !defined(USE_TT_LOCKLESS)
+	// entryのClusterが論理クリアされる前のものなら、書き込む前にゼロクリアしてepochをreset_epochにする。
+	bool reset_cluster = false;
+	u16 reset_epoch = 0;
+#endif
+};
+
+#if !defined(USE_TT_LOCKLESS)
+
 /// 置換表エントリー
 /// 本エントリーは10bytesに収まるようになっている。3つのエントリーを並べたときに32bytesに収まるので
 /// CPUのcache lineに一発で載るというミラクル。
@@ -24,13 +61,6 @@
 /// eval value 16 bit : このnodeでのevaluate()の返し値
 struct TTEntry {
 
-	Move16 move() const { return Move16(move16); }
-	Value value() const { return (Value)value16; }
-	Value eval() const { return (Value)eval16; }
-	Depth depth() const { return (Depth)depth8 + DEPTH_OFFSET; }
-	bool is_pv() const { return (bool)(genBound8 & 0x4); }
-	Bound bound() const { return (Bound)(genBound8 & 0x3); }
-
 	// 置換表のエントリーに対して与えられたデータを保存する。上書き動作
 	//   v    : 探索のスコア
 	//   ev   : 評価関数 or 静止探索の値
@@ -42,6 +72,12 @@ struct TTEntry {
 private:
 	friend struct TranspositionTable;
 
+	// このentryの内容をTTDataにして返す。
+	TTData read() const {
+		return TTData{ Move16(move16), (Value)value16, (Value)eval16, (Depth)depth8 + DEPTH_OFFSET,
+			(Bound)(genBound8 & 0x3), (bool)(genBound8 & 0x4) };
+	}
+
 	// hash keyの下位bit16(bit0は除く)
 	// Stockfishの最新版[2020/11/03]では、key16はhash_keyの下位16bitに変更になったが(取り出しやすいため)
 	// やねうら王ではhash_keyのbit0を先後フラグとして用いるので、bit16..1を使う。
@@ -68,22 +104,87 @@ private:
 	uint8_t depth8;
 };
 
+#else
+
+/// 置換表エントリー(USE_TT_LOCKLESS版)
+/// 本エントリーは16bytesで、4つ並べると64bytes(CPUのcache line)になる。
+///
+/// key64      64 bit : hash key ^ data64 (lockless hashing)
+/// data64     64 bit : 以下をpackしたもの。それぞれの意味は通常版のTTEntryと同じ。
+///   move       16 bit
+///   value      16 bit
+///   eval value 16 bit
+///   generation  5 bit + pv node 1 bit + bound type 2 bit
+///   depth       8 bit
+///
+/// key64にはhash keyとdata64のxorを格納するので、key64 ^ data64がprobe()したhash keyと一致すればhitである。
+/// 他のスレッドの書き込みとkey64,data64が混ざった場合(torn write)はこれが一致しないので、誤ったデータを用いることがない。
+struct TTEntry {
+
+	// 置換表のエントリーに対して与えられたデータを保存する。上書き動作
+	// 引数の意味は通常版のTTEntry::save()と同じ。
+	void save(Key k, Value v, bool pv , Bound b, Depth d, Move m, Value ev);
+
+private:
+	friend struct TranspositionTable;
+
+	// このentryの内容をTTDataにして返す。
+	// data64は他のスレッドに書き換えられうるので、一度だけ読み出したコピーに対して呼び出すこと。
+	TTData read() const {
+		return TTData{ Move16(move16), (Value)value16, (Value)eval16, (Depth)depth8 + DEPTH_OFFSET,
+			(Bound)(genBound8 & 0x3), (bool)(genBound8 & 0x4) };
+	}
+
+	// hash keyとdata64のxor
+	uint64_t key64;
+
+	union {
+		uint64_t data64;
+		struct {
+			uint16_t move16;
+			int16_t  value16;
+			int16_t  eval16;
+			uint8_t  genBound8;
+			uint8_t  depth8;
+		};
+	};
+};
+
+static_assert(sizeof(TTEntry) == 16, "Unexpected TTEntry size");
+
+#endif
+
 // --- 置換表本体
 // TT_ENTRYをClusterSize個並べて、クラスターをつくる。
 // このクラスターのTT_ENTRYは同じhash keyに対する保存場所である。(保存場所が被ったときに後続のTT_ENTRYを使う)
 // このクラスターが、clusterCount個だけ確保されている。
 struct TranspositionTable {
 
+#if !defined(USE_TT_LOCKLESS)
 	// 1クラスターにおけるTTEntryの数
 	// TTEntry 10bytes×3つ + 2(padding) = 32bytes
 	static constexpr int ClusterSize = 3;
 
 	struct Cluster {
 		TTEntry entry[ClusterSize];
-		u8 padding[2]; // 全体を32byteぴったりにするためのpadding
+
+		// 論理クリアのためのepoch。(全体を32byteぴったりにするためのpaddingを流用している)
+		// TranspositionTable::epochと異なるClusterは、空であるとみなす。
+		u16 epoch;
 	};
 
 	static_assert(sizeof(Cluster) == 32, "Unexpected Cluster size");
+#else
+	// 1クラスターにおけるTTEntryの数
+	// TTEntry 16bytes×4つ = 64bytes
+	static constexpr int ClusterSize = 4;
+
+	struct alignas(64) Cluster {
+		TTEntry entry[ClusterSize];
+	};
+
+	static_assert(sizeof(Cluster) == 64, "Unexpected Cluster size");
+#endif
 
 	// --- Constants used to refresh the hash table periodically
 
@@ -108,30 +209,60 @@ public:
 	//~TranspositionTable() { aligned_ttmem_free(mem); }
 	// メモリの開放は、LargeMemoryクラスが勝手にやってくれるので、やねうら王では、
 	// このclassのデストラクタでメモリを明示的に開放しなくて良い。
+	// ただし、論理クリア後のbackgroundでのゼロクリアが終わっていなければ、それは止める必要がある。
+	~TranspositionTable() { stop_scrub(); }
 
 	// 新しい探索ごとにこの関数を呼び出す。(generationを加算する。)
 	// USE_GLOBAL_OPTIONSが有効のときは、このタイミングで、Options["Threads"]の値を
 	// キャプチャして、探索スレッドごとの置換表と世代カウンターを用意する。
-	void new_search() { generation8 += GENERATION_DELTA; } // 下位3bitはPV nodeかどうかのフラグとBoundに用いている。
+	// load()した置換表は、探索を開始したらisreadyで捨てても良い。
+	// 論理クリアのあと、backgroundでのゼロクリアが終わっていれば、もうepochの古いClusterはない。
+	void new_search() {
+		generation8 += GENERATION_DELTA; // 下位3bitはPV nodeかどうかのフラグとBoundに用いている。
+		keep_loaded = false;
+		if (scrub_finished)
+			stale_clusters = false;
+	}
 
 	// 置換表のなかから与えられたkeyに対応するentryを探す。
-	// 見つかったならfound == trueにしてそのTT_ENTRY*を返す。
-	// 見つからなかったらfound == falseで、このとき置換表に書き戻すときに使うと良いTT_ENTRY*を返す。
-	TTEntry* probe(const Key key, bool& found) const;
+	// 見つかったならfound == trueにして、そのentryの内容のコピーをdataに格納する。
+	// 見つからなかったらfound == falseで、dataは空(VALUE_NONE,BOUND_NONEなど)にする。
+	// いずれの場合も、置換表に書き戻すときに使うentryへのTTWriterを返す。
+	// node : 呼び出したスレッドのNUMA node(Thread::numa_node)。first_entry()を見よ。
+	TTWriter probe(const Key key, const size_t node, bool& found, TTData& data) const;
 
-	// probe()の、置換表を一切書き換えないことが保証されている版。
+	// probe()の、置換表を一切書き換えないことが保証されている版。見つかったならtrueを返して、dataにその内容を格納する。
 	// ConsiderationMode時のPVの出力時は置換表をprobe()したいが、hitしないときに空きTTEntryを作る挙動が嫌なので、
 	// こちらを用いる。(やねうら王独自拡張)
-	TTEntry* read_probe(const Key key, bool& found) const;
+	bool read_probe(const Key key, TTData& data) const;
 
 	// 置換表の使用率を1000分率で返す。(USIプロトコルで統計情報として出力するのに使う)
 	int hashfull() const;
 
+	// 置換表の構成と、NUMAのremote accessの割合を出力する。("tt_stats"コマンド)
+	// "tt_stats clear"ならremote accessの統計をクリアする。
+	// probe()のhit率などは、USE_PERF_COUNTERSを定義して"stats"コマンドで見る。
+	void print_stats(std::istringstream& is) const;
+
 	// 置換表のサイズを変更する。mbSize == 確保するメモリサイズ。MB単位。
 	void resize(size_t mbSize);
 
+	// 置換表をファイルに保存する。("tt_save"コマンド)
+	// ファイルの先頭には、Clusterの構成、HASH_KEY_BITS、評価関数のハッシュ値などを記録したヘッダーを書き出す。
+	void save(const std::string& filename);
+
+	// save()で保存したファイルをmapして、それを置換表として用いる。("tt_load"コマンド)
+	// ヘッダーの内容がこの実行ファイル・評価関数と合致しなければ読み込まない。
+	// 読み込んだ置換表は、次に探索を開始するまではisreadyでのresize(),clear()で捨てられない。
+	// (GUIはオプションの変更のあとにisreadyを送ってくるので、isreadyの前に読み込んでも良い)
+	void load(const std::string& filename);
+
 	// 置換表のエントリーの全クリア
 	// 並列化してクリアするので高速。
+	// USIオプションの"TT_ClearMode"が"Epoch","EpochScrub"のときは、置換表のepochを進めるだけのO(1)の論理クリアとなる。
+	// epochの異なるClusterは空とみなされ、最初にそのClusterに書き込むときにゼロクリアされる。
+	// "EpochScrub"なら、それに加えて、epochの古いClusterをbackgroundのスレッドでゼロクリアしていく。
+	// resize()直後とepochが一周したときは、通常のゼロクリアを行う。USE_TT_LOCKLESSのときは常にゼロクリアである。
 	// 備考)
 	// LEARN版のときは、
 	// 単一スレッドでメモリをクリアする。(他のスレッドは仕事をしているので..)
@@ -141,7 +272,8 @@ public:
 	void clear();
 
 	// keyを元にClusterのindexを求めて、その最初のTTEntry*を返す。
-	TTEntry* first_entry(const Key key) const {
+	// node : 呼び出したスレッドのNUMA node(Thread::numa_node)。TT_NumaPolicyが"NodeGrouped"のときだけ用いる。
+	TTEntry* first_entry(const Key key, const size_t node) const {
 		// Stockfishのコード
 		// mul_hi64は、64bit * 64bitの掛け算をして下位64bitを取得する関数。
 		//return &table[mul_hi64(key, clusterCount)].entry[0];
@@ -161,12 +293,22 @@ public:
 		// indexのbit0は、keyのbit0(先後フラグ)が反映されなければならない。
 		// →　次のindexの計算ではbit0を潰して計算するためにkeyを2で割ってからmul_hi64()している。
 
-		// (key/2) * clusterCount / 2^64 をするので、indexは 0 ～ (clusterCount/2)-1 の範囲となる。
-		uint64_t index = mul_hi64((u64)key >> 1, clusterCount);
-
-		// indexは0～(clusterCount/2)-1の範囲にあるのでこれを2倍すると、0～clusterCount-2の範囲。
-		// clusterCountは偶数で、ここにkeyのbit0がbit-orされるので0～clusterCount-1が得られる。
-		return &table[(index << 1) | ((u64)key & 1)].entry[0];
+		// TT_NumaPolicyが"NodeGrouped"のときは、呼び出したスレッドのNUMA nodeのグループのなかから選ぶ。
+		// numa_group_clustersも偶数である。
+		size_t base = 0, count = clusterCount;
+		if (numa_groups > 1)
+		{
+			ASSERT_LV3(node < numa_groups);
+			count = numa_group_clusters;
+			base  = node * count;
+		}
+
+		// (key/2) * count / 2^64 をするので、indexは 0 ～ (count/2)-1 の範囲となる。
+		uint64_t index = mul_hi64((u64)key >> 1, count);
+
+		// indexは0～(count/2)-1の範囲にあるのでこれを2倍すると、0～count-2の範囲。
+		// countは偶数で、ここにkeyのbit0がbit-orされるので0～count-1が得られる。
+		return &table[base + ((index << 1) | ((u64)key & 1))].entry[0];
 	}
 
 #if defined(EVAL_LEARN)
@@ -177,6 +319,7 @@ public:
 
 private:
 	friend struct TTEntry;
+	friend struct TTWriter;
 
 	// この置換表が保持しているクラスター数。
 	// Stockfishはresize()ごとに毎回新しく置換表を確保するが、やねうら王では
@@ -200,6 +343,57 @@ private:
 
 	// 置換表テーブルのメモリ確保用のhelpper
 	LargeMemory tt_memory;
+
+	// --- NUMA対応
+
+	// clear()の時に、USIオプションの"TT_NumaPolicy"に従って置換表のメモリをNUMA nodeに配置する。
+	// nodeが1つしかない環境では何もしない。
+	void place_numa();
+
+	// 置換表のNUMA nodeへの配置の説明。("info string"で出力する用)
+	std::string numa_info() const;
+
+	// "NodeGrouped"のとき、置換表をnodeの数に分割したグループの数と、1グループあたりのCluster数。
+	// 各スレッドは自分のnodeのグループだけを使う。それ以外のときは、numa_groups == 1。
+	size_t numa_groups = 1;
+	size_t numa_group_clusters = 0;
+
+	// 置換表のNUMA nodeへの配置方法。clear()の時に"TT_NumaPolicy"の値から決める。
+	// None以外なら、probe()でremote accessの割合をサンプリングする。
+	enum class NumaPolicy { None, FirstTouch, Interleave, NodeGrouped };
+	NumaPolicy numa_policy = NumaPolicy::None;
+
+	// load()でmapした置換表のファイル。mapしていれば、tableはこのなかを指している。
+	std::unique_ptr<SystemIO::MappedFile> tt_file;
+
+	// load()してから、まだ探索を開始していないか。
+	// このときは、resize(),clear()で置換表を捨てない。
+	bool keep_loaded = false;
+
+	// load()したファイルの評価関数のハッシュ値。isreadyの前にload()した時は、resize()で照合する。
+	u64 loaded_eval_hash = 0;
+
+	// --- 論理クリア
+
+	// 置換表のepoch。clear()で論理クリアするごとに1加算する。
+	// Cluster::epochがこれと異なるClusterは空とみなす。
+	u16 epoch = 0;
+
+	// tableが一度もゼロクリアされていないか。(resize()直後など)
+	// このときは論理クリアは出来ない。
+	bool need_zero_clear = true;
+
+	// epochの古いClusterが残っているかも知れないか。論理クリアかload()のあとでtrueになる。
+	// falseなら、probe()でCluster::epochを調べなくて良い。
+	bool stale_clusters = false;
+
+	// epochの古いClusterをゼロクリアするbackgroundのスレッドと、その停止フラグ、最後まで終わったかのフラグ。
+	std::thread scrub_thread;
+	std::atomic<bool> scrub_stop{ false };
+	std::atomic<bool> scrub_finished{ false };
+
+	// scrub_threadを停止させて、終了を待つ。
+	void stop_scrub();
 };
 
 // global object。探索部からこのinstanceを参照する。
@@ -110,7 +110,7 @@ namespace Search {
 	bool RootMove::extract_ponder_from_tt(Position& pos, Move ponder_candidate)
 	{
 		StateInfo st;
-		bool ttHit;
+		TTData ttData;
 
 		//    ASSERT_LV3(pv.size() == 1);
 
@@ -119,11 +119,10 @@ namespace Search {
 			return false;
 
 		pos.do_move(pv[0], st, pos.gives_check(pv[0]));
-		TTEntry* tte = TT.read_probe(pos.state()->key(), ttHit);
 		Move m;
-		if (ttHit)
+		if (TT.read_probe(pos.state()->key(), ttData))
 		{
-			m = pos.to_move(tte->move()); // SMP safeにするためlocal copy
+			m = pos.to_move(ttData.move);
 			if (MoveList<LEGAL_ALL>(pos).contains(m))
 				goto FOUND;
 		}
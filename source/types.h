@@ -925,6 +925,10 @@ struct CheckInfo;
 template <MOVE_GEN_TYPE gen_type> ExtMove* generateMoves(const Position& pos, ExtMove* mlist);
 template <MOVE_GEN_TYPE gen_type> ExtMove* generateMoves(const Position& pos, ExtMove* mlist,Square recapSq); // RECAPTURES,RECAPTURES_ALL専用
 
+// generateMoves()で生成される指し手の数だけを返す。指し手バッファには書き出さないので速い。
+// MoveList<LEGAL_ALL>(pos).size()の代わりに用いる。LEGAL,LEGAL_ALL専用。
+template <MOVE_GEN_TYPE gen_type> size_t countMoves(const Position& pos);
+
 // MoveGeneratorのwrapper。範囲forで回すときに便利。
 template<MOVE_GEN_TYPE GenType>
 struct MoveList {
@@ -4,6 +4,7 @@
 #include "search.h"
 #include "thread.h"
 #include "tt.h"
+#include "perf_counter.h"
 #include "testcmd/unit_test.h"
 
 #if defined(__EMSCRIPTEN__)
@@ -120,6 +121,10 @@ namespace Learner
 // "bench"コマンドは、"test"コマンド群とは別。常に呼び出せるようにしてある。
 extern void bench_cmd(Position& pos, istringstream& is);
 
+// "perft"コマンド。指し手生成の検証用。これも常に呼び出せるようにしてある。
+// testcmd/perft.cppで定義されている。
+extern void perft_cmd(Position& pos, istringstream& is);
+
 
 // "gameover"コマンドに対するハンドラ
 #if defined(USE_GAMEOVER_HANDLER)
@@ -258,14 +263,13 @@ namespace USI
 						// 次の手を置換表から拾う。
 						// ただし置換表を破壊されるとbenchコマンドの時にシングルスレッドなのに探索内容の同一性が保証されなくて
 						// 困るのでread_probe()を用いる。
-						bool found;
-						auto* tte = TT.read_probe(pos.state()->key(), found);
+						TTData ttData;
 
 						// 置換表になかった
-						if (!found)
+						if (!TT.read_probe(pos.state()->key(), ttData))
 							break;
 
-						m = pos.to_move(tte->move());
+						m = pos.to_move(ttData.move);
 
 						// 置換表にはpsudo_legalではない指し手が含まれるのでそれを弾く。
 						// 宣言勝ちでないならこれが合法手であるかのチェックが必要。
@@ -870,6 +874,9 @@ void usi_cmdexec(Position& pos, StateListPtr& states, string& cmd, queue<string>
 		// ベンチコマンド(これは常に使える)
 		else if (token == "bench") bench_cmd(pos, is);
 
+		// 指し手生成の検証用のperft(マルチスレッド、hash table付き)
+		else if (token == "perft") perft_cmd(pos, is);
+
 		// 現在の局面を表示する。(デバッグ用)
 		else if (token == "d") cout << pos << endl;
 
@@ -894,6 +901,14 @@ void usi_cmdexec(Position& pos, StateListPtr& states, string& cmd, queue<string>
 
 		// この実行ファイルをコンパイルしたコンパイラの情報を出力する。
 		else if (token == "compiler") sync_cout << compiler_info() << sync_endl;
+		else if (token == "tt_stats") TT.print_stats(is);
+
+		// 探索のホットパスの計測用カウンターを表示する。(USE_PERF_COUNTERSが定義されているときのみ有効)
+		else if (token == "stats") PerfCounter::print(is);
+
+		// 置換表をファイルに保存する/ファイルから読み込む。
+		else if (token == "tt_save") { string filename; is >> filename; TT.save(filename); }
+		else if (token == "tt_load") { string filename; is >> filename; TT.load(filename); }
 
 		// -- 以下、やねうら王独自拡張のカスタムコマンド
 
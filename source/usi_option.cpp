@@ -2,6 +2,8 @@
 #include "tt.h"
 #include "usi.h"
 #include "misc.h"
+#include "extra/move_sort.h"
+#include "cpu_features.h"
 
 using std::string;
 
@@ -70,10 +72,39 @@ namespace USI {
 		// 置換表のサイズ。[MB]で指定。
 		o["USI_Hash"] << Option(16, 1, MaxHashMB, [](const Option& o) { /* TT.resize(o); */ });
 
+#if defined(__linux__) && !defined(__ANDROID__) && !defined(__EMSCRIPTEN__)
+		// NUMA nodeが複数ある環境での置換表のメモリの配置方法。isreadyでの置換表のクリア時に反映される。
+		// FirstTouch  : ゼロクリアしたスレッドのnodeに配置する。(OSの既定の動作。デフォルト)
+		// Interleave  : ページ単位で全nodeに分散させる。
+		// NodeGrouped : 置換表をnodeの数に分割してそれぞれのnodeに配置し、各スレッドは自分のnodeの部分だけを使う。
+		//               remote accessはなくなるが、1スレッドから見た置換表のサイズは1/node数になる。
+		o["TT_NumaPolicy"] << Option(std::vector<std::string>{ "FirstTouch", "Interleave", "NodeGrouped" }, "FirstTouch");
+#endif
+
+		// 置換表のクリア(isready,usinewgameのたびに行われる)の方法。
+		// Zero       : 置換表全体をゼロクリアする。(デフォルト。従来の動作)
+		// Epoch      : 置換表のepochを進めるだけのO(1)の論理クリア。古いepochのClusterは空とみなされる。
+		// EpochScrub : Epochに加えて、古いepochのClusterをbackgroundのスレッドでゼロクリアしていく。
+		o["TT_ClearMode"] << Option(std::vector<std::string>{ "Zero", "Epoch", "EpochScrub" }, "Zero");
+
+#if defined(USE_MOVE_PICKER)
+		// MovePickerで駒を捕獲しない指し手を部分ソートするときの実装。
+		// Insertion : 挿入ソート(従来の実装)
+		// SIMD      : AVX-512でビルドしたときのみ。(TARGET_CPU = DISPATCHなら、AVX-512に対応したCPUのときのみ)SIMD命令で分割してからソートする。
+		// SuperSort : USE_SUPER_SORTでビルドしたときのみ。
+		// 挿入ソート以外では並び順が変わるので、benchコマンドの探索ノード数が変わる。"bench movesort"で速度を比較できる。
+		o["MoveSort"] << Option(MoveSort::algorithm_names(), MoveSort::default_algorithm(),
+			[](const Option& o) { MoveSort::set_algorithm(o); });
+#endif
+
 #if defined(USE_EVAL_HASH)
 		// 評価値用のcacheサイズ。[MB]で指定。
 
-#if defined(FOR_TOURNAMENT)
+#if defined(EVAL_NNUE)
+		// NNUEでは、hitしてもaccumulatorの差分計算は省略できず、nps向上が確認できていないので、デフォルトでは用いない。
+		// 0なら確保しない。
+		o["EvalHash"] << Option(0, 0, MaxHashMB, [](const Option& o) { Eval::EvalHash_Resize(o); });
+#elif defined(FOR_TOURNAMENT)
 		// トーナメント用は少し大きなサイズ
 		o["EvalHash"] << Option(1024, 1, MaxHashMB, [](const Option& o) { Eval::EvalHash_Resize(o); });
 #else
@@ -143,6 +174,21 @@ namespace USI {
 				load_eval_finished = false;
 			}
 		});
+
+#if defined(USE_CPU_DISPATCH) && defined(EVAL_NNUE)
+		// TARGET_CPU = DISPATCHのときに、NNUEの計算に用いる命令セット。
+		// Auto : 実行中のCPUで使える最上位のもの。(デフォルト)
+		// それ以外は、命令セットごとの速度の比較用。CPUが対応していないものを選んだときはAutoと同じになる。
+		// 評価関数パラメータは命令セットごとに持つので、変更したときは次のisreadyで評価関数を読み込み直す。
+		o["DispatchKernel"] << Option(std::vector<std::string>{ "Auto", "AVX512VNNI", "AVX2", "SSE42" }, "Auto", [](const Option& o) {
+			const auto old = CpuFeatures::kernel();
+			if (!CpuFeatures::select_kernel(o))
+				sync_cout << "info string Error! : this CPU does not support DispatchKernel = " << string(o)
+				          << " , use " << CpuFeatures::kernel_name(CpuFeatures::kernel()) << sync_endl;
+			if (CpuFeatures::kernel() != old)
+				load_eval_finished = false;
+		});
+#endif
 #if defined(__EMSCRIPTEN__) && defined(EVAL_NNUE)
 		// WASM NNUE
 		const char* default_eval_file = "nn.bin";